@@ -11,6 +11,21 @@
 
 namespace BeanInterface {
 
+/*! \brief Flags for calculating the binary hash of an object
+ * \param code_relocations required for updating relocations in machine code
+ * \return bean flags
+ */
+static inline uint32_t flags(bool code_relocations) {
+	uint32_t bean_flags = Bean::FLAG_NONE;
+	// Resolve internal relocations to improve patchable detection
+	bean_flags |= Bean::FLAG_RESOLVE_INTERNAL_RELOCATIONS;
+	if (code_relocations) {
+		bean_flags |= Bean::FLAG_RECONSTRUCT_RELOCATIONS;
+		bean_flags |= Bean::FLAG_HASH_ATTRIBUTES_FOR_ID;
+	}
+	return bean_flags;
+}
+
 struct Symbol {
 	const Bean::Symbol & _sym;
 
@@ -0,0 +1,129 @@
+// Luci - a dynamic linker/loader with DSU capabilities
+// Copyright 2021-2023 by Bernhard Heinloth <heinloth@cs.fau.de>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include "code_patch.hpp"
+
+#include <dlh/assert.hpp>
+#include <dlh/syscall.hpp>
+#include <dlh/page.hpp>
+#include <dlh/math.hpp>
+#include <dlh/log.hpp>
+
+#ifndef __NR_membarrier
+#define __NR_membarrier 324
+#endif
+
+namespace CodePatch {
+
+/*! \brief Commands for membarrier (see `linux/membarrier.h`) */
+enum MembarrierCommand : int {
+	MEMBARRIER_CMD_QUERY                                = 0,
+	MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE          = (1 << 5),
+	MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE = (1 << 6),
+};
+
+/*! \brief Size of cache line (head must not cross it) */
+static const size_t cacheline_size = 64;
+
+/*! \brief Registration state */
+static bool registered = false;
+
+/*! \brief Raw membarrier system call
+ *  \return non-negative value on success, negative error number otherwise
+ */
+static long membarrier(int cmd, unsigned flags = 0) {
+	long ret;
+	asm volatile ("syscall" : "=a"(ret) : "a"(__NR_membarrier), "D"(cmd), "S"(flags), "d"(0) : "rcx", "r11", "memory");
+	return ret;
+}
+
+/*! \brief Atomically store head
+ *  \param address target
+ *  \param data bytes to store
+ *  \param size number of bytes (1 or 2)
+ */
+static void store(uintptr_t address, const uint8_t * data, size_t size) {
+	if (size == 1) {
+		__atomic_store_n(reinterpret_cast<uint8_t *>(address), data[0], __ATOMIC_RELEASE);
+	} else {
+		assert(size == 2);
+		uint16_t value = static_cast<uint16_t>(data[0] | (data[1] << 8));
+		__atomic_store_n(reinterpret_cast<uint16_t *>(address), value, __ATOMIC_RELEASE);
+	}
+}
+
+bool setup() {
+	long supported = membarrier(MEMBARRIER_CMD_QUERY);
+	if (supported < 0) {
+		LOG_INFO << "Membarrier is not supported (error " << -supported << ")" << endl;
+		registered = false;
+	} else if ((supported & MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE) == 0) {
+		LOG_INFO << "Membarrier does not support core serialization" << endl;
+		registered = false;
+	} else if (long reg = membarrier(MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE); reg < 0) {
+		LOG_WARNING << "Registering for membarrier core serialization failed (error " << -reg << ")" << endl;
+		registered = false;
+	} else {
+		LOG_DEBUG << "Using membarrier for cross modifying code" << endl;
+		registered = true;
+	}
+	return registered;
+}
+
+bool available() {
+	return registered;
+}
+
+bool sync_core() {
+	if (!registered)
+		return false;
+	if (long ret = membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE); ret < 0) {
+		LOG_ERROR << "Membarrier core serialization failed (error " << -ret << ")" << endl;
+		return false;
+	}
+	return true;
+}
+
+bool write(uintptr_t address, const uint8_t * code, size_t size, const uint8_t * trap, size_t trap_size, int protection) {
+	assert(trap_size > 0 && trap_size <= 2 && size >= trap_size);
+	if (!registered) {
+		return false;
+	} else if (address / cacheline_size != (address + trap_size - 1) / cacheline_size) {
+		LOG_DEBUG << "Head of code at " << reinterpret_cast<void*>(address) << " crosses cache line -- cannot modify it atomically" << endl;
+		return false;
+	}
+
+	// Temporarily allow writing to the live code
+	uintptr_t page_start = address - (address % Page::SIZE);
+	size_t page_size = Math::align_up(address + size, Page::SIZE) - page_start;
+	if (auto mprotect = Syscall::mprotect(page_start, page_size, protection | PROT_WRITE); mprotect.failed()) {
+		LOG_WARNING << "Unable to make code at " << reinterpret_cast<void*>(page_start) << " (" << page_size << " Bytes) writable: " << mprotect.error_message() << endl;
+		return false;
+	}
+
+	// 1. Trap head, from now on every thread executing this address will be handled by the trap handler
+	store(address, trap, trap_size);
+	bool success = sync_core();
+
+	// 2. Write tail
+	auto ptr = reinterpret_cast<volatile uint8_t *>(address);
+	for (size_t i = trap_size; i < size; i++)
+		ptr[i] = code[i];
+	success &= sync_core();
+
+	// 3. Replace trap with new head
+	store(address, code, trap_size);
+	success &= sync_core();
+
+	// Restore protection
+	if (auto mprotect = Syscall::mprotect(page_start, page_size, protection); mprotect.failed()) {
+		LOG_ERROR << "Unable to restore protection of code at " << reinterpret_cast<void*>(page_start) << " (" << page_size << " Bytes): " << mprotect.error_message() << endl;
+		success = false;
+	}
+
+	LOG_DEBUG << "Modified " << size << " Bytes of live code at " << reinterpret_cast<void*>(address) << endl;
+	return success;
+}
+
+}  // namespace CodePatch
@@ -0,0 +1,45 @@
+// Luci - a dynamic linker/loader with DSU capabilities
+// Copyright 2021-2023 by Bernhard Heinloth <heinloth@cs.fau.de>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#pragma once
+
+#include <dlh/types.hpp>
+
+/*! \brief Cross modifying code (without stopping the process)
+ *  Similar to the kernels `text_poke_bp`, live code is modified in several steps,
+ *  using `membarrier` to force a core serializing instruction on all threads in between.
+ */
+namespace CodePatch {
+
+/*! \brief Setup: register process for core serialization via membarrier
+ *  \note has to be called again in a forked child
+ *  \return `true` if the required membarrier commands are available
+ */
+bool setup();
+
+/*! \brief Check if core serialization is available
+ *  \return `true` if setup was successful
+ */
+bool available();
+
+/*! \brief Ensure every thread of the process executes a core serializing instruction before returning to user space
+ *  \return `true` on success
+ */
+bool sync_core();
+
+/*! \brief Modify live code
+ *  First, the head is replaced by a trap, then the remaining bytes (tail) are written
+ *  and finally the head is replaced with the new instruction -- each step followed by a core synchronization.
+ *  Threads executing the site in the meantime have to be handled by the trap handler.
+ *  \param address start address of live code
+ *  \param code new instructions
+ *  \param size number of bytes of new instructions
+ *  \param trap trap instruction
+ *  \param trap_size size of the trap instruction (head, has to be written atomically, hence at most 2 bytes)
+ *  \param protection current protection of the code memory
+ *  \return `true` if the code was modified
+ */
+bool write(uintptr_t address, const uint8_t * code, size_t size, const uint8_t * trap, size_t trap_size, int protection);
+
+}  // namespace CodePatch
@@ -0,0 +1,102 @@
+// Luci - a dynamic linker/loader with DSU capabilities
+// Copyright 2021-2023 by Bernhard Heinloth <heinloth@cs.fau.de>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include "common_symbols.hpp"
+
+#include <dlh/syscall.hpp>
+#include <dlh/string.hpp>
+#include <dlh/math.hpp>
+#include <dlh/mem.hpp>
+#include <dlh/page.hpp>
+#include <dlh/log.hpp>
+
+CommonSymbols::~CommonSymbols() {
+	for (const auto & area : areas)
+		if (auto munmap = Syscall::munmap(area.first, area.second); munmap.failed())
+			LOG_WARNING << "Unmapping common symbols at " << reinterpret_cast<void*>(area.first) << " failed: " << munmap.error_message() << endl;
+	for (auto & sym : symbols)
+		Memory::free(const_cast<char *>(sym.name));
+}
+
+void CommonSymbols::declare(namespace_t ns, const char * name, size_t size, size_t alignment) {
+	auto i = index.find(Key{ns, StrPtr(name)});
+	if (i == index.end()) {
+		// Declaring object might be unloaded later on
+		const char * copy = String::duplicate(name);
+		index.insert(Key{ns, StrPtr(copy)}, symbols.size());
+		pending.push_back(symbols.size());
+		symbols.push_back(Symbol{copy, ns, size, Math::max(alignment, static_cast<size_t>(1))});
+	} else {
+		auto & sym = symbols[i->value];
+		// Symbol has already been allocated (and the memory is sufficient)?
+		bool allocated = sym.address != 0 && !sym.defined && sym.size <= sym.allocated && sym.address % sym.alignment == 0;
+		sym.size = Math::max(sym.size, size);
+		sym.alignment = Math::max(sym.alignment, alignment);
+		// Larger or stricter aligned declaration (e.g., by an update) has to be reallocated
+		if (allocated && (sym.size > sym.allocated || sym.address % sym.alignment != 0)) {
+			sym.pending = true;
+			pending.push_back(i->value);
+		}
+	}
+}
+
+bool CommonSymbols::define(namespace_t ns, const char * name, uintptr_t address, size_t size) {
+	auto i = index.find(Key{ns, StrPtr(name)});
+	if (i == index.end())
+		return false;
+	auto & sym = symbols[i->value];
+	if (!sym.pending || sym.defined)
+		return false;
+	sym.address = address;
+	sym.allocated = size;
+	sym.defined = true;
+	return true;
+}
+
+size_t CommonSymbols::layout() {
+	size_t size = 0;
+	for (auto i : pending) {
+		auto & sym = symbols[i];
+		if (!sym.defined) {
+			// Offset in area (temporary)
+			sym.address = Math::align_up(size, sym.alignment);
+			size = sym.address + sym.size;
+		}
+	}
+	return size;
+}
+
+bool CommonSymbols::allocate(uintptr_t start, size_t size) {
+	if (size > 0) {
+		size = Math::align_up(size, Page::SIZE);
+		if (auto mmap = Syscall::mmap(start, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED_NOREPLACE)) {
+			areas.emplace_back(start, size);
+		} else {
+			LOG_ERROR << "Mapping " << size << " bytes for common symbols at " << reinterpret_cast<void*>(start) << " failed: " << mmap.error_message() << endl;
+			return false;
+		}
+	}
+	for (auto i : pending) {
+		auto & sym = symbols[i];
+		if (!sym.defined) {
+			sym.address += start;
+			sym.allocated = sym.size;
+		}
+		sym.pending = false;
+	}
+	pending.clear();
+	return true;
+}
+
+uintptr_t CommonSymbols::end() const {
+	uintptr_t end = 0;
+	for (const auto & area : areas)
+		end = Math::max(end, area.first + area.second);
+	return end;
+}
+
+const CommonSymbols::Symbol * CommonSymbols::find(namespace_t ns, const char * name) const {
+	auto i = index.find(Key{ns, StrPtr(name)});
+	return i != index.end() ? &symbols[i->value] : nullptr;
+}
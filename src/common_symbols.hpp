@@ -0,0 +1,129 @@
+// Luci - a dynamic linker/loader with DSU capabilities
+// Copyright 2021-2023 by Bernhard Heinloth <heinloth@cs.fau.de>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#pragma once
+
+#include <dlh/types.hpp>
+#include <dlh/strptr.hpp>
+#include <dlh/container/hash.hpp>
+#include <dlh/container/pair.hpp>
+#include <dlh/container/vector.hpp>
+
+#include "comp/glibc/libdl/interface.hpp"
+
+/*! \brief Tentative definitions (`SHN_COMMON` symbols) of all relocatable objects
+ *  Declarations with the same name (per namespace) are merged using the maximum size and alignment.
+ *  Unless there is a real definition, they are allocated together in a single (BSS-like) mapping.
+ *  Names and mappings are owned by this class (and not by the declaring objects, which might be unloaded).
+ */
+class CommonSymbols {
+ public:
+	struct Symbol {
+		/*! \brief Symbol name (copy) */
+		const char * name;
+
+		/*! \brief Namespace */
+		namespace_t ns;
+
+		/*! \brief Maximum size of all declarations */
+		size_t size;
+
+		/*! \brief Maximum alignment of all declarations */
+		size_t alignment;
+
+		/*! \brief Assigned address (0 if not allocated yet) */
+		uintptr_t address = 0;
+
+		/*! \brief Available memory at assigned address */
+		size_t allocated = 0;
+
+		/*! \brief Address belongs to a (non-tentative) definition */
+		bool defined = false;
+
+		/*! \brief Symbol has to be (re)allocated (is in `pending`) */
+		bool pending = true;
+	};
+
+ private:
+	struct Key {
+		namespace_t ns;
+		StrPtr name;
+	};
+
+	struct KeyComparison {
+		static inline bool equal(const Key & a, const Key & b) {
+			return a.ns == b.ns && a.name == b.name;
+		}
+
+		static inline uint32_t hash(const Key & v) {
+			return static_cast<uint32_t>(v.ns) * 0x9e3779b1U ^ static_cast<uint32_t>(v.name.hash);
+		}
+	};
+
+	/*! \brief Symbols (index in `symbols`) by namespace & name */
+	HashMap<Key, size_t, KeyComparison> index;
+
+	/*! \brief All symbols */
+	Vector<Symbol> symbols;
+
+	/*! \brief Symbols (index in `symbols`) which have to be (re)allocated */
+	Vector<size_t> pending;
+
+	/*! \brief Mapped memory areas (start and size) */
+	Vector<Pair<uintptr_t, size_t>> areas;
+
+ public:
+	CommonSymbols() {}
+	CommonSymbols(const CommonSymbols&) = delete;
+	CommonSymbols& operator=(const CommonSymbols&) = delete;
+
+	/*! \brief Unmap memory areas */
+	~CommonSymbols();
+
+	/*! \brief Declare tentative definition
+	 * \param ns namespace
+	 * \param name symbol name (will be copied)
+	 * \param size size of symbol
+	 * \param alignment required alignment of symbol (value of common symbol)
+	 */
+	void declare(namespace_t ns, const char * name, size_t size, size_t alignment);
+
+	/*! \brief Check for symbols to be allocated */
+	bool has_pending() const {
+		return !pending.empty();
+	}
+
+	/*! \brief Assign a (non-tentative) definition to a pending symbol (first definition wins)
+	 * \param ns namespace
+	 * \param name symbol name
+	 * \param address address of the definition
+	 * \param size size of the definition
+	 * \return `true` if a pending symbol was defined
+	 */
+	bool define(namespace_t ns, const char * name, uintptr_t address, size_t size);
+
+	/*! \brief Calculate packed layout for all pending symbols without definition
+	 * \return required size of the memory area
+	 */
+	size_t layout();
+
+	/*! \brief Map the memory area from `layout` and assign addresses to all pending symbols
+	 * \param start start address of the memory area
+	 * \param size size of the memory area (`0` if no memory is required)
+	 * \return `false` if memory could not be mapped
+	 */
+	bool allocate(uintptr_t start, size_t size);
+
+	/*! \brief End of mapped memory areas
+	 * \return highest end address (or `0` if no area was mapped)
+	 */
+	uintptr_t end() const;
+
+	/*! \brief Get merged tentative definition
+	 * \param ns namespace
+	 * \param name symbol name
+	 * \return pointer to symbol or `nullptr` if not declared
+	 */
+	const Symbol * find(namespace_t ns, const char * name) const;
+};
@@ -22,21 +22,60 @@ namespace GDB {
 /* When debugger support is enabled, this will create a flat list containing all versions of the object in the debug structure.
  * Hence GDB is able to resolve symbols in each version - and set breakpoints to all symbols having the same name. */
 static List<GLIBC::DL::link_map, GLIBC::DL::link_map, &GLIBC::DL::link_map::l_next, &GLIBC::DL::link_map::l_prev> flat_link_map;
+
+/*! \brief Size of the procfs path buffer for versions with file descriptor (`/proc/<pid>/fd/<fd>`) */
+static const size_t procfs_name_size = 32;
+
+/*! \brief Unused procfs path buffers (of released versions) */
+static Vector<char *> procfs_name_cache;
+
+/*! \brief Versions available during refresh (kept to reuse its memory) */
+static HashSet<const void *> available_versions;
+
+/*! \brief Nesting level of modification batches */
+static unsigned batch_depth = 0;
+
+/*! \brief Get (reused) name buffer containing procfs path of file descriptor */
+static char * procfs_name(pid_t pid, int fd) {
+	char * name;
+	if (procfs_name_cache.empty()) {
+		name = Memory::alloc_array<char>(procfs_name_size);
+		assert(name != nullptr);
+	} else {
+		name = procfs_name_cache.back();
+		procfs_name_cache.pop_back();
+	}
+	BufferStream procfsfd(name, procfs_name_size);
+	procfsfd << "/proc/" << pid << "/fd/" << fd;
+	procfsfd.str();
+	return name;
+}
+
 void refresh(const Loader & loader) {
 	if (r_debug.base.r_brk != nullptr && loader.config.debugger) {
+		available_versions.clear();
+		for (const auto & o : loader.lookup)
+			for (Object * c = o.current; c != nullptr; c = c->file_previous)
+				available_versions.insert(c);
+
+		// Unlink released versions
+		for (auto i = flat_link_map.begin(); i != flat_link_map.end();)
+			if (available_versions.contains(i->l_versions)) {
+				++i;
+			} else {
+				if (i->l_name != nullptr && String::compare(i->l_name, "/proc/", 6) == 0)
+					procfs_name_cache.push_back(i->l_name);
+				i = flat_link_map.erase(i);
+			}
+
+		// Insert new versions (at their position in the lookup list)
 		auto i = flat_link_map.begin();
 		for (const auto & o : loader.lookup)
 			for (Object * c = o.current; c != nullptr; c = c->file_previous) {
 				if (i == flat_link_map.end() || i->l_versions != c) {
 					i = flat_link_map.insert(i, o.glibc_link_map);
 					i->l_addr = c->base;
-					if (c->data.fd < 0) {
-						i->l_name = const_cast<char*>(o.path.str);
-					} else {
-						StringStream<100> procfsfd;
-						procfsfd << "/proc/" << loader.pid << "/fd/" << c->data.fd;
-						i->l_name = String::duplicate(procfsfd.str());
-					}
+					i->l_name = c->data.fd < 0 ? const_cast<char*>(o.path.str) : procfs_name(loader.pid, c->data.fd);
 					i->l_versions = reinterpret_cast<void*>(c);  // Hack. This field is reserved for symbol versioning, but we use it for object comparison instead.
 				}
 				++i;
@@ -45,6 +84,21 @@ void refresh(const Loader & loader) {
 	}
 }
 
+bool begin(State state) {
+	if (batch_depth++ > 0)
+		return false;
+	notify(state);
+	return true;
+}
+
+void end(const Loader & loader) {
+	assert(batch_depth > 0);
+	if (--batch_depth == 0) {
+		refresh(loader);
+		notify(RT_CONSISTENT);
+	}
+}
+
 void notify(State state) {
 	r_debug.base.r_state = state;
 	if (r_debug.base.r_brk != nullptr)
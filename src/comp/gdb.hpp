@@ -54,6 +54,32 @@ struct RDebugExtended {
 void init(const Loader & loader);
 void refresh(const Loader & loader);
 void notify(State state = RT_CONSISTENT);
+
+/*! \brief Begin modification of the link map
+ * Only the outermost of nested modifications notifies the debugger
+ * \return `true` if debugger was notified
+ */
+bool begin(State state = RT_ADD);
+
+/*! \brief End modification of the link map
+ * The outermost one refreshes the link map and notifies the debugger about the consistent state
+ */
+void end(const Loader & loader);
+
+/*! \brief Scoped modification of the link map */
+class Batch {
+	const Loader & loader;
+
+ public:
+	explicit Batch(const Loader & loader, State state = RT_ADD) : loader(loader) {
+		begin(state);
+	}
+
+	~Batch() {
+		end(loader);
+	}
+};
+
 static inline void breakpoint() {
 	asm volatile("int3" ::: "memory");
 }
@@ -8,6 +8,7 @@
 #include <dlh/thread.hpp>
 
 #include "loader.hpp"
+#include "thread_registry.hpp"
 
 extern "C" __attribute__((__used__)) int __fork_syscall() {
 #ifndef NO_FPU
@@ -30,18 +31,46 @@ extern "C" __attribute__((__used__)) int __fork_syscall() {
 
 	HashMap<int, int> replace_fd;
 	if (loader->config.dynamic_update) {
+		// First forking process will analyse updates for the whole tree
+		if (loader->config.fork_coordinator)
+			loader->update_coordinator.setup();
+
+		// Shared memory files which are mapped only once (not shared between versions) can be privatized
+		HashMap<int, unsigned> fd_usage;
+		if (loader->config.fork_copy_on_write)
+			for (const ObjectIdentity & i : loader->lookup)
+				for (Object * o = i.current; o != nullptr; o = o->file_previous)
+					for (MemorySegment & m : o->memory_map)
+						if (m.target.fd != -1 && !m.target.snapshot) {
+							auto usage = fd_usage.find(m.target.fd);
+							if (usage == fd_usage.end())
+								fd_usage.insert(m.target.fd, 1);
+							else
+								usage->value++;
+						}
+
+		size_t privatized = 0;
 		for (const ObjectIdentity & i : loader->lookup)
 			for (Object * o = i.current; o != nullptr; o = o->file_previous)
 				for (MemorySegment & m : o->memory_map) {
 					const int old_fd = m.target.fd;
-					if (old_fd != -1 && !replace_fd.contains(old_fd)) {
+					// Relocation read-only segments are detached in the child
+					if (old_fd == -1 || m.target.snapshot || m.target.relro || replace_fd.contains(old_fd)) {
+						continue;
+					} else if (loader->config.fork_copy_on_write && !m.target.relro && fd_usage[old_fd] == 1 && m.privatize()) {
+						// Private mapping will be copied on write by the kernel, no need to replace it in the child
+						privatized++;
+					} else {
 						int new_fd = m.shmemdup();
 						assert(new_fd != -1);
 						replace_fd.insert(old_fd, new_fd);
 						LOG_DEBUG << "Fork created copy of shared memory at " << reinterpret_cast<void*>(m.target.address()) << " (fd " << old_fd << " -> " << new_fd << ")" << endl;
 					}
 				}
-		LOG_INFO << "Fork needs to replace " << replace_fd.size() << " shared memory files" << endl;
+		LOG_INFO << "Fork needs to replace " << replace_fd.size() << " shared memory files";
+		if (privatized > 0)
+			LOG_INFO_APPEND << " (privatized " << privatized << ")";
+		LOG_INFO_APPEND << endl;
 	}
 
 	pid_t child = 0;
@@ -54,7 +83,13 @@ extern "C" __attribute__((__used__)) int __fork_syscall() {
 				for (Object * o = i.current; o != nullptr; o = o->file_previous)
 					for (MemorySegment & m : o->memory_map) {
 						int old_fd = m.target.fd;
-						if (old_fd != -1) {
+						if (old_fd == -1 || m.target.snapshot) {
+							continue;
+						} else if (m.target.relro) {
+							// Version specific shared memory must not be shared with the parent
+							if (!m.detach())
+								LOG_ERROR << "Fork child detaching relocation read-only memory at " << reinterpret_cast<void*>(m.target.address()) << " failed" << endl;
+						} else {
 							int new_fd = replace_fd[old_fd];
 							LOG_DEBUG << "Fork child remapping shared memory at " << reinterpret_cast<void*>(m.target.address()) << " (fd " << old_fd << " -> " << new_fd << ")" << endl;
 							m.unmap();
@@ -68,8 +103,16 @@ extern "C" __attribute__((__used__)) int __fork_syscall() {
 			// Close (parent) shared memory file descriptor
 			for (auto & f : replace_fd)
 				Syscall::close(f.key);
+			// Pending status info will be written by the parent
+			loader->status_info.discard();
+			// Object identifiers in status info are per process, hence announce the objects again (with the childs PID)
+			for (const ObjectIdentity & i : loader->lookup)
+				i.status_id = 0;
 			// Set own Thread ID
 			Thread::self()->tid = child;
+			// and Process ID (for stopping on updates)
+			loader->pid = child;
+			ThreadRegistry::reset(Thread::self());
 			// Start handler threads
 			loader->start_handler_threads();
 		} else if (loader->config.dynamic_update) {
@@ -56,6 +56,9 @@ void init_tls(ObjectIdentity & object, const size_t size, const size_t align, co
 	object.glibc_link_map.l_tls_firstbyte_offset = offset;
 	object.glibc_link_map.l_tls_offset = offset;
 	object.glibc_link_map.l_tls_modid = modid;
+	// Static TLS in use
+	if (offset > 0 && static_cast<size_t>(offset) > rtld_global._dl_tls_static_used)
+		rtld_global._dl_tls_static_used = offset;
 }
 
 }  // namespace GLIBC
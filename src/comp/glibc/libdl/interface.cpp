@@ -6,6 +6,7 @@
 
 #include <dlh/log.hpp>
 #include <dlh/macro.hpp>
+#include <dlh/string.hpp>
 
 #include "comp/gdb.hpp"
 #include "object/base.hpp"
@@ -18,10 +19,22 @@ const void* RTLD_DEFAULT = 0;
 static const char * error_msg = nullptr;
 
 EXPORT int dlclose(void * handle) {
-	(void)handle;
-	error_msg = "Unloading is not supported (yet)";
-	LOG_WARNING << "dlclose failed: " << error_msg << endl;
-	return -1;
+	LOG_TRACE << "GLIBC dlclose(" << handle << ")" << endl;
+	Loader * loader = Loader::instance();
+	assert(loader != nullptr);
+
+	GuardedWriter _{loader->lookup_sync};
+	ObjectIdentity * o = reinterpret_cast<ObjectIdentity *>(handle);
+	if (!loader->is_loaded(o)) {
+		error_msg = "Invalid handle for dlclose!";
+		LOG_WARNING << error_msg << endl;
+		return -1;
+	} else if (!loader->dlclose(o)) {
+		error_msg = "Shared object is not open!";
+		LOG_WARNING << "dlclose failed: " << error_msg << endl;
+		return -1;
+	}
+	return 0;
 }
 
 EXPORT const char *dlerror() {
@@ -170,7 +183,7 @@ EXPORT int dlinfo(void * __restrict handle, int request, void * __restrict info)
 			*reinterpret_cast<size_t*>(info) = o->tls_module_id;
 			return 0;
 		case RTLD_DI_TLS_DATA:
-			*reinterpret_cast<uintptr_t*>(info) = o->tls_offset == 0 ? 0 : loader->tls.get_addr(Thread::self(), o->tls_module_id, false);
+			*reinterpret_cast<uintptr_t*>(info) = o->tls_module_id == 0 ? 0 : loader->tls.get_addr(Thread::self(), o->tls_module_id, o->tls_offset != 0);
 			return 0;
 		default:
 			error_msg = "Unknown request for dlinfo!";
@@ -218,38 +231,58 @@ static void *_dlvsym(void *__restrict handle, const char *__restrict symbol, con
 	Loader * loader = Loader::instance();
 	assert(loader != nullptr);
 
-	GuardedWriter _{loader->lookup_sync};
-	Optional<VersionedSymbol> r;
-	if (handle == RTLD_DEFAULT || handle == RTLD_NEXT) {
-		Object * o = loader->resolve_object(reinterpret_cast<uintptr_t>(caller));
-		assert(o != nullptr);
-		r = loader->resolve_symbol(symbol, version, o->file.ns, &(o->file), handle == RTLD_NEXT ? Loader::RESOLVE_AFTER_OBJECT : Loader::RESOLVE_DEFAULT);
+	// Modifications of the loaded objects require exclusive access
+	GuardedReader _{loader->lookup_sync};
+	const bool next = handle == RTLD_NEXT;
+	const ObjectIdentity * o;
+	if (handle == RTLD_DEFAULT || next) {
+		Object * c = loader->resolve_object(reinterpret_cast<uintptr_t>(caller));
+		assert(c != nullptr);
+		o = &(c->file);
 	} else {
-		const ObjectIdentity * o = reinterpret_cast<const ObjectIdentity *>(handle);
+		o = reinterpret_cast<const ObjectIdentity *>(handle);
 		if (!loader->is_loaded(o)) {
 			error_msg = "Invalid handle for dl[v]sym!";
 			LOG_WARNING << error_msg << endl;
 			return nullptr;
 		}
+	}
 
-		r = o->current->resolve_symbol(symbol, version);
+	// Check cache of handle (or caller)
+	const uint32_t gnu_hash = ELF_Def::gnuhash(symbol);
+	const unsigned long generation = __atomic_load_n(&loader->generation, __ATOMIC_ACQUIRE);
+	void * ptr = nullptr;
+	if (o->dlsym_cache.get(symbol, gnu_hash, version, next, generation, ptr)) {
+		LOG_TRACE << "Symbol " << symbol << " --> " << ptr << " (cached)" << endl;
+		return ptr;
 	}
 
+	Optional<VersionedSymbol> r;
+	if (handle == RTLD_DEFAULT || next)
+		r = loader->resolve_symbol(symbol, ELF_Def::hash(symbol), gnu_hash, VersionedSymbol::Version(version), o->ns, o, next ? Loader::RESOLVE_AFTER_OBJECT : Loader::RESOLVE_DEFAULT);
+	else
+		r = o->current->resolve_symbol(symbol, version);
+
 	if (r && r->valid()) {
 		const ObjectIdentity & identity = r->object().file;
 		// Assert the object is from the latest update
 		assert(identity.current == &(r->object()));
-		auto * ptr = r->pointer();
+		ptr = r->pointer();
 		// Use trampolines
 		if (ptr != nullptr && loader->config.dynamic_dlupdate && (r->type() == Elf::STT_FUNC || r->type() == Elf::STT_GNU_IFUNC)) {
 			auto * tptr = loader->symbol_trampoline.set(r.value());
 			LOG_TRACE <<  "Symbol " << symbol  << " using trampoline " << tptr << " --> " << ptr << endl;
 			assert(tptr != nullptr);
-			return tptr;
+			ptr = tptr;
 		} else {
 			LOG_TRACE << "Symbol " << symbol << " --> " << ptr << endl;
-			return ptr;
 		}
+		// Strings of the resolved object remain valid until the next change
+		if (version == nullptr)
+			o->dlsym_cache.set(r->name(), gnu_hash, nullptr, next, generation, ptr);
+		else if (r->version.name != nullptr && String::compare(r->version.name, version) == 0)
+			o->dlsym_cache.set(r->name(), gnu_hash, r->version.name, next, generation, ptr);
+		return ptr;
 	} else {
 		error_msg = "Symbol not found!";
 		LOG_WARNING << "dl[v]sym for " << symbol << " failed: " << error_msg << endl;
@@ -35,7 +35,7 @@ class Patch {
 		if (!valid())
 			return false;
 
-		uint8_t * addr = object.compose_pointer(reinterpret_cast<uint8_t *>(object.base + address));
+		uint8_t * addr = object.compose_pointer(reinterpret_cast<uint8_t *>(object.base + address), nullptr, size);
 
 		if (addr == nullptr) {
 			LOG_ERROR << "Unable to get compose buffer for " << reinterpret_cast<void*>(address) << " for patching " << name << " in " << object << endl;
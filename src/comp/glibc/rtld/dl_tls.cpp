@@ -10,6 +10,7 @@
 #include <dlh/thread.hpp>
 
 #include "loader.hpp"
+#include "thread_registry.hpp"
 
 EXPORT uintptr_t __tls_get_addr(struct tls_index *ti) {
 	if (ti == nullptr)
@@ -29,7 +30,7 @@ EXPORT void _dl_get_tls_static_info(size_t *size, size_t *align) {
 	Loader * loader = Loader::instance();
 	assert(loader != nullptr);
 
-	*size = loader->tls.initial_size + sizeof(Thread);
+	*size = loader->tls.static_size();
 	*align = loader->tls.initial_align;
 }
 
@@ -47,6 +48,9 @@ EXPORT Thread * _dl_allocate_tls_init(Thread *thread, bool init_tls) {
 	Loader * loader = Loader::instance();
 	assert(loader != nullptr);
 
+	// Thread is about to be started (register before setup, so no static TLS initialization gets lost)
+	ThreadRegistry::add(thread);
+
 	loader->tls.dtv_setup(thread);
 
 	return thread;
@@ -58,6 +62,7 @@ EXPORT Thread * _dl_allocate_tls(Thread * thread) {
 	assert(loader != nullptr);
 
 	thread = loader->tls.allocate(thread);
+	ThreadRegistry::add(thread);
 	loader->tls.dtv_setup(thread);
 	return thread;
 }
@@ -67,6 +72,7 @@ EXPORT void _dl_deallocate_tls(Thread * thread, bool free_thread_struct) {
 	Loader * loader = Loader::instance();
 	assert(loader != nullptr);
 
+	ThreadRegistry::remove(thread);
 	loader->tls.free(thread, free_thread_struct);
 }
 
@@ -76,8 +76,10 @@ static __attribute__((unused)) void _dl_rtld_unlock_recursive(void* arg) {
 
 #if GLIBC_VERSION < GLIBC_2_34 || !GLIBC_PTHREAD_IN_LIBC
 static __attribute__((unused)) void _dl_init_static_tls(GLIBC::DL::link_map * map) {
-	(void) map;
-	LOG_ERROR << "GLIBC _dl_init_static_tls not implemented" << endl;
+	LOG_TRACE << "GLIBC _dl_init_static_tls(" << reinterpret_cast<void*>(map) << ")" << endl;
+	Loader * loader = Loader::instance();
+	assert(loader != nullptr);
+	loader->tls.init_static();
 }
 #endif
 
@@ -305,8 +307,8 @@ void init_globals_tls(const TLS & tls, void * dtv) {
 	rtld_global._dl_tls_generation = tls.gen;
 	rtld_global._dl_initial_dtv = dtv;
 	rtld_global._dl_tls_static_nelem = tls.initial_count;
-	rtld_global._dl_tls_static_used = tls.initial_size;
-	auto static_size = Math::align_up(tls.initial_size + tls.surplus,  tls.initial_align) + sizeof(Thread);
+	rtld_global._dl_tls_static_used = tls.static_used;
+	auto static_size = tls.static_size();
 #if GLIBC_VERSION >= GLIBC_2_34
 	rtld_global_ro._dl_tls_static_size = static_size;
 	rtld_global_ro._dl_tls_static_align = tls.initial_align;
@@ -18,6 +18,11 @@ void * ptr_libc_start_main = nullptr;
 
 void _luci_exit(int value) {
 	LOG_INFO << "`main` finished with exit code " << value << endl;
+	// Write pending status info and profile
+	if (Loader * loader = Loader::instance()) {
+		loader->status_info.drain();
+		loader->profiler.summary("runtime");
+	}
 	Syscall::exit(value);
 }
 
@@ -23,8 +23,10 @@
 #include "comp/glibc/init.hpp"
 #include "comp/gdb.hpp"
 #include "object/base.hpp"
+#include "code_patch.hpp"
 #include "process.hpp"
 #include "redirect.hpp"
+#include "thread_registry.hpp"
 
 
 static Loader * _instance = nullptr;
@@ -45,6 +47,13 @@ Loader::Loader(uintptr_t luci_self, const char * sopath, struct Config config)
  : config(config), symbol_trampoline(symbol_trampoline_address_callback), pid(Syscall::getpid()), dependencies(lookup.end()) {
 	default_flags.bind_global = 1;
 
+	// Profiling of loader phases (has to be enabled before the first object is opened)
+	if (config.profile || config.profile_trace != nullptr)
+		profiler.setup(config.profile, config.profile_trace);
+
+	// Surplus of static TLS (has to be known before the first thread is allocated)
+	tls.surplus = TLS::surplus_reserved + config.tls_optional_static;
+
 	if (config.dynamic_update) {
 		default_flags.updatable = 1;
 	} else {
@@ -92,7 +101,7 @@ Loader::Loader(uintptr_t luci_self, const char * sopath, struct Config config)
 
 	// Configure redirection
 	if (config.dynamic_update)
-		Redirect::setup(config.trap_mode);
+		Redirect::setup(config.trap_mode, config.trap_promote_hits, config.trap_promote_delay);
 }
 
 
@@ -101,13 +110,7 @@ Loader::~Loader() {
 
 	debug_hash_socket.disconnect();
 
-	if (statusinfofd >= 0) {
-		if (auto close = Syscall::close(statusinfofd)) {
-			LOG_INFO << "Destroyed status info handle" << endl;
-		} else {
-			LOG_ERROR << "Closing status info handle failed: " << close.error_message() << endl;
-		}
-	}
+	status_info.close();
 
 	if (config.dynamic_update && filemodification_inotifyfd >= 0) {
 		if (auto close = Syscall::close(filemodification_inotifyfd)) {
@@ -125,7 +128,10 @@ Loader::~Loader() {
 		}
 	}
 
+	object_index.clear();
 	lookup.clear();
+
+	delete address_index;
 }
 
 
@@ -133,10 +139,19 @@ ObjectIdentity * Loader::library(const char * filename, ObjectIdentity::Flags fl
 	assert(filename != nullptr);
 	StrPtr path(filename);
 	auto name = path.find_last('/');
-	if (ns != NAMESPACE_NEW)
-		for (auto & i : lookup)
-			if (ns == i.ns && name == i.name)
-				return &i;
+	if (ns != NAMESPACE_NEW) {
+		if (auto i = object_index.by_name(ns, name))
+			return i;
+
+		// Full path of an object loaded using a different name (link)?
+		if (path != name) {
+			if (auto i = object_index.by_path(ns, path))
+				return i;
+			if (struct stat sb; !load && Syscall::stat(filename, &sb).success())
+				if (auto i = object_index.by_file(ns, sb.st_dev, sb.st_ino))
+					return i;
+		}
+	}
 
 	if (load) {
 		ObjectIdentity * lib;
@@ -174,7 +189,12 @@ ObjectIdentity * Loader::open(const char * filename, const char * directory, Obj
 
 ObjectIdentity * Loader::open(const char * filepath, ObjectIdentity::Flags flags, bool priority, namespace_t ns, uintptr_t addr, Elf::ehdr_type type, const char * altname) {  // NOLINT
 	// Does file contain a valid full path or do we have a memory address?
-	if (addr != 0 || File::exists(filepath)) {
+	bool exists = addr != 0;
+	if (!exists) {
+		Profiler::Scope profile{profiler, Profiler::PHASE_SEARCH, StrPtr(filepath).find_last('/').str};
+		exists = File::exists(filepath);
+	}
+	if (exists) {
 		if (ns == NAMESPACE_NEW)
 			ns = next_namespace++;
 
@@ -207,20 +227,46 @@ ObjectIdentity * Loader::open(const char * filepath, ObjectIdentity::Flags flags
 				return obj;
 			}
 		} else if (format == File::contents::FORMAT_ELF) {
-			GDB::notify(GDB::RT_ADD);
+			// File already loaded (using a different path)?
+			struct stat sb;
+			bool file_based = addr == 0 && Syscall::stat(filepath, &sb).success();
+			if (file_based)
+				if (auto existing = object_index.by_file(ns, sb.st_dev, sb.st_ino)) {
+					LOG_DEBUG << filepath << " is already loaded as " << *existing << endl;
+					return existing;
+				}
+
+			// Dependencies are loaded recursively, the debugger is notified only once (after loading all of them)
+			GDB::Batch debugger{*this};
 			auto i = lookup.emplace(priority ? dependencies : lookup.end(), *this, flags, filepath, ns, altname);
 			assert(i);
+			if (file_based) {
+				i->device = sb.st_dev;
+				i->inode = sb.st_ino;
+			}
+			// Index before loading, since (cyclic) dependencies are loaded recursively
+			object_index.add(*i);
 
 			if (!priority && dependencies == lookup.end())
 				dependencies = i;
-			Object * o = i->load(addr, type);
-			GDB::refresh(*this);
-			GDB::notify(GDB::RT_CONSISTENT);
+			// Use file data from prefetch (if available)
+			Object::Data data;
+			bool prefetched = addr == 0 && prefetch != nullptr && prefetch->take(filepath, ns, data);
+			Object * o = i->load(addr, type, prefetched ? &data : nullptr);
 			if (o != nullptr) {
+				// Only objects loaded during runtime can be unloaded
+				i->unloadable = process_started;
+				load_adds++;
+				// Add remaining keys (shared object name)
+				object_index.add(*i);
 				return i.operator->();
 			} else {
 				LOG_ERROR << "Unable to open " << filepath << endl;
-				lookup.pop_back();
+				object_index.remove(*i);
+				bool first_dependency = dependencies == i;
+				auto next = lookup.erase(i);
+				if (first_dependency)
+					dependencies = next;
 			}
 		} else {
 			LOG_ERROR << filepath << " has unsupported format: " << File::contents::format_description(format) << endl;
@@ -237,7 +283,9 @@ ObjectIdentity * Loader::dlopen(const char * file, ObjectIdentity::Flags flags,
 		o->flags.bind_now = flags.bind_now;  // TODO: if change to true, resolve all relocations
 		o->flags.bind_global = flags.bind_global;
 		o->flags.bind_deep = flags.bind_deep;
-		o->flags.persistent = flags.persistent;
+		// Once set, objects remain persistent
+		if (flags.persistent == 1)
+			o->flags.persistent = 1;
 		o->flags.updatable = config.dynamic_dlupdate;
 
 		if (load && !o->prepare()) {
@@ -246,15 +294,125 @@ ObjectIdentity * Loader::dlopen(const char * file, ObjectIdentity::Flags flags,
 		}
 	}
 
+	// Initialize TLS blocks placed in static surplus in existing threads (after relocation)
+	if (load && o != nullptr)
+		tls.init_static();
+
+	// Flags (like global binding) might have changed
+	changed();
+
 	if (load && o != nullptr && !o->initialize()) {
 		LOG_WARNING << "Initialization of " << o << " failed!" << endl;
 		o = nullptr;
 	}
 
+	if (o != nullptr)
+		o->handles++;
+
 	return o;
 }
 
 
+bool Loader::dlclose(ObjectIdentity * object) {
+	assert(object != nullptr);
+	if (object->handles == 0) {
+		LOG_WARNING << "No open handle for " << *object << endl;
+		return false;
+	}
+	if (--object->handles > 0 || !object->unloadable || object->flags.persistent == 1 || unloading)
+		return true;
+
+	// Mark all objects still in use (loaded at startup, persistent or with open handle) and their dependencies
+	auto contains = [](const Vector<const ObjectIdentity *> & list, const ObjectIdentity * object) {
+		for (const auto * o : list)
+			if (o == object)
+				return true;
+		return false;
+	};
+	Vector<const ObjectIdentity *> used;
+	Vector<const ObjectIdentity *> worklist;
+	for (const auto & object_file : lookup)
+		if (!object_file.unloadable || object_file.flags.persistent == 1 || object_file.handles > 0)
+			worklist.push_back(&object_file);
+	while (!worklist.empty()) {
+		const ObjectIdentity * o = worklist.back();
+		worklist.pop_back();
+		if (contains(used, o))
+			continue;
+		used.push_back(o);
+		for (Object * c = o->current; c != nullptr; c = c->file_previous)
+			for (const auto * dep : c->dependencies)
+				worklist.push_back(dep);
+		for (const auto * dep : o->symbol_dependencies)
+			worklist.push_back(dep);
+	}
+
+	// Remaining objects (in lookup order: objects before their dependencies)
+	Vector<ObjectIdentity *> unused;
+	for (auto & object_file : lookup)
+		if (!contains(used, &object_file))
+			unused.push_back(&object_file);
+	if (!unused.empty())
+		unload(unused);
+
+	return true;
+}
+
+
+void Loader::unload(const Vector<ObjectIdentity *> & objects) {
+	// Run destructors while all objects are still mapped
+	unloading = true;
+	for (auto * o : objects)
+		if (!o->deinitialize())
+			LOG_WARNING << "Deinitialization of " << *o << " failed!" << endl;
+	unloading = false;
+
+	GDB::Batch debugger{*this, GDB::RT_DELETE};
+	for (auto * o : objects) {
+		LOG_INFO << "Unloading " << *o << endl;
+		if (size_t trampolines = symbol_trampoline.release(*o); trampolines > 0)
+			LOG_DEBUG << "Released " << trampolines << " trampolines to " << *o << endl;
+
+		// Shared memory files of writable segments are used by all versions (relro ones are closed on unmap)
+		Vector<int> fds;
+		for (Object * c = o->current; c != nullptr; c = c->file_previous) {
+			if (size_t redirections = Redirect::release(*c); redirections > 0)
+				LOG_DEBUG << "Released " << redirections << " redirections in " << *c << endl;
+			for (const auto & mem : c->memory_map)
+				if (mem.target.fd != -1 && !mem.target.relro) {
+					bool known = false;
+					for (const auto fd : fds)
+						known |= fd == mem.target.fd;
+					if (!known)
+						fds.push_back(mem.target.fd);
+				}
+		}
+
+		if (o->tls_module_id != 0)
+			tls.remove_module(o->tls_module_id);
+
+		// Destructor will remove watch, unmap all versions and update the lookup caches
+		object_index.remove(*o);
+		for (auto i = lookup.begin(); i != lookup.end(); ++i)
+			if (i.operator->() == o) {
+				bool first_dependency = dependencies == i;
+				i = lookup.erase(i);
+				if (first_dependency)
+					dependencies = i;
+				break;
+			}
+
+		for (const auto fd : fds)
+			Syscall::close(fd);
+
+		load_subs++;
+	}
+	// Objects with same name (previously hidden by an unloaded one) will be indexed now
+	for (auto & o : lookup)
+		object_index.add(o);
+}
+
+
 bool Loader::relocate(bool update) {
 	// Pre-Prepare
 	for (auto & o : reverse(lookup))
@@ -285,16 +443,29 @@ bool Loader::relocate(bool update) {
 }
 
 
-void Loader::update() {
+bool Loader::update() {
 	// Perform relocation
-	GDB::notify(GDB::RT_ADD);
-	if (!relocate(true)) {
+	GDB::Batch debugger{*this};
+	bool success = relocate(true);
+	if (!success)
 		LOG_ERROR << "Updating relocations failed!" << endl;
-		assert(false);
-	}
 	update_pending = false;
-	GDB::refresh(*this);
-	GDB::notify(GDB::RT_CONSISTENT);
+
+	// Report deferred transaction members and protect outdated versions of deferred updates
+	for (auto & object : update_deferred.members)
+		if (is_loaded(object))
+			object->status(success ? ObjectIdentity::INFO_SUCCESS_UPDATE : ObjectIdentity::INFO_UPDATE_TRANSACTION, StatusInfo::now() - update_deferred.start);
+	if (success && config.detect_outdated != Loader::Config::DETECT_OUTDATED_DISABLED && !update_deferred.updated.empty()) {
+		for (auto & object : update_deferred.updated)
+			if (is_loaded(object) && object->current != nullptr && object->current->file_previous != nullptr)
+				update_deferred.protect.push_back(object->current->file_previous);
+		__atomic_store_n(&update_deferred.protect_ready, true, __ATOMIC_RELAXED);
+	}
+	update_deferred.members.clear();
+	update_deferred.updated.clear();
+	changed();
+	profiler.summary("update");
+	return success;
 }
 
 
@@ -315,8 +486,7 @@ extern "C" __attribute__((visibility("default"))) int __luci_update() {
 				}
 			}
 		}
-		loader->update();
-		return 1;
+		return loader->update() ? 1 : -1;
 	} else {
 		return 0;
 	}
@@ -363,6 +533,9 @@ bool Loader::prepare(Object * start) {
 		LOG_WARNING << "No AT_RANDOM!" << endl;
 	}
 	tls.dtv_setup(main_thread);
+	if (main_thread->tid == 0)
+		main_thread->tid = Syscall::gettid();
+	ThreadRegistry::add(main_thread);
 	GLIBC::RTLD::init_globals_tls(tls, main_thread->dtv);
 	GLIBC::init(*this);
 
@@ -379,6 +552,9 @@ bool Loader::prepare(Object * start) {
 
 	start->finalize();
 
+	// Time spent until start of program
+	profiler.summary("startup");
+
 	// Mark start of program
 	GLIBC::RTLD::starting();
 
@@ -699,6 +875,27 @@ Optional<VersionedSymbol> Loader::resolve_symbol(uintptr_t addr, namespace_t ns)
 
 
 Object * Loader::resolve_object(uintptr_t addr, namespace_t ns) const {
+	if (const auto * index = get_address_index()) {
+		// Binary search for last range starting at or before the address
+		size_t l = 0;
+		size_t r = index->size();
+		while (l < r) {
+			size_t m = l + (r - l) / 2;
+			if ((*index)[m].start <= addr)
+				l = m + 1;
+			else
+				r = m;
+		}
+		// Ranges are disjoint, but the (inclusive) end might touch the start of the next one
+		for (size_t i = l; i > 0 && l - i < 2; i--) {
+			const auto & range = (*index)[i - 1];
+			if (addr <= range.end && range.object->file.ns == ns)
+				return range.object;
+		}
+		return nullptr;
+	}
+
+	// Fallback: Linear search
 	for (const auto & object_file : lookup) {
 		if (object_file.ns != ns)
 			continue;
@@ -713,6 +910,48 @@ Object * Loader::resolve_object(uintptr_t addr, namespace_t ns) const {
 }
 
 
+const Vector<Loader::AddressRange> * Loader::get_address_index() const {
+	auto * index = __atomic_load_n(&address_index, __ATOMIC_ACQUIRE);
+	if (index != nullptr)
+		return index;
+
+	Guarded _{address_index_lock};
+	// Another reader might have been faster
+	if ((index = __atomic_load_n(&address_index, __ATOMIC_ACQUIRE)) != nullptr)
+		return index;
+
+	index = new Vector<AddressRange>();
+	if (index == nullptr)
+		return nullptr;
+
+	for (const auto & object_file : lookup)
+		for (Object * o = object_file.current; o != nullptr; o = o->file_previous)
+			for (const auto & mem : o->memory_map) {
+				if (mem.target.size == 0)
+					continue;
+				// Insertion sort (ranges of an object are usually already ordered)
+				AddressRange range{ mem.target.address(), mem.target.address() + mem.target.size, o };
+				index->push_back(range);
+				for (size_t i = index->size() - 1; i > 0 && (*index)[i - 1].start > range.start; i--) {
+					(*index)[i] = (*index)[i - 1];
+					(*index)[i - 1] = range;
+				}
+			}
+
+	__atomic_store_n(&address_index, index, __ATOMIC_RELEASE);
+	return index;
+}
+
+
+void Loader::changed() {
+	__atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+
+	// Readers are excluded, hence the index can be released immediately
+	auto * index = __atomic_exchange_n(&address_index, nullptr, __ATOMIC_ACQ_REL);
+	delete index;
+}
+
+
 uintptr_t Loader::next_address(size_t size) const {
 	uintptr_t start = 0;
 	uintptr_t end = 0;
@@ -721,6 +960,9 @@ uintptr_t Loader::next_address(size_t size) const {
 		for (Object * obj = object_file.current; obj != nullptr; obj = obj->file_previous)
 			if (obj->memory_range(start, end) && end > next && (BASEADDRESS < LIBADDRESS || end < BASEADDRESS))
 				next = end;
+	// Memory for common symbols
+	if (end = common_symbols.end(); end > next && (BASEADDRESS < LIBADDRESS || end < BASEADDRESS))
+		next = end;
 
 	// Default address
 	if (next == 0)
@@ -736,9 +978,15 @@ void Loader::reset_address(uintptr_t addr) const {
 }
 
 bool Loader::is_loaded(const ObjectIdentity * ptr) const {
+	return object_index.contains(ptr);
+}
+
+
+bool Loader::is_loaded(const Object * ptr) const {
 	for (const auto & object_file : lookup)
-		if (ptr == &object_file)
-			return true;
+		for (const Object * o = object_file.current; o != nullptr; o = o->file_previous)
+			if (ptr == o)
+				return true;
 	return false;
 }
 
@@ -764,6 +1012,10 @@ bool Loader::start_handler_threads() {
 		userfaultfd = -1;
 	}
 	if (config.dynamic_update) {
+		// Cross modifying code without stopping the process
+		if (!CodePatch::setup() && config.stop_on_update)
+			LOG_INFO << "Core serialization not available -- process will be stopped during updates" << endl;
+
 		if (config.detect_outdated == Loader::Config::DETECT_OUTDATED_VIA_USERFAULTFD) {
 			if (auto userfault = Syscall::userfaultfd(O_CLOEXEC | O_NONBLOCK)) {
 				userfaultfd = userfault.value();
@@ -784,6 +1036,9 @@ bool Loader::start_handler_threads() {
 			for (auto & object_file : lookup)
 				object_file.watch(true, false);
 
+			if (config.update_transaction != nullptr && !filemodification_transaction_watch())
+				success = false;
+
 			if ((handler_thread = Thread::create(&kickoff_helper_loop, this, true, true, !config.debugger)) == nullptr) {
 				LOG_ERROR << "Creating (file modification) handler thread failed" << endl;
 				success = false;
@@ -798,5 +1053,8 @@ bool Loader::start_handler_threads() {
 		LOG_INFO << "Not starting file modification handler thread since there are no dynamic updates" << endl;
 	}
 
+	// Without helper thread the status info has to be written immediately
+	status_info.synchronous = handler_thread == nullptr;
+
 	return success;
 }
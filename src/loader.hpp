@@ -12,14 +12,21 @@
 #include <dlh/container/tree.hpp>
 #include <dlh/socket_client.hpp>
 #include <dlh/mutex_rec.hpp>
+#include <dlh/mutex.hpp>
 #include <dlh/rwlock.hpp>
 #include <dlh/thread.hpp>
 
 #include "object/identity.hpp"
+#include "common_symbols.hpp"
+#include "object/index.hpp"
+#include "prefetch.hpp"
+#include "profiler.hpp"
 #include "trampoline.hpp"
 #include "redirect.hpp"
+#include "status_info.hpp"
 #include "symbol.hpp"
 #include "tls.hpp"
+#include "update_coordinator.hpp"
 
 extern "C" int __luci_update();
 
@@ -53,9 +60,12 @@ struct Loader {
 		/*! \brief support dynamic weak definitions? */
 		bool dynamic_weak = false;
 
-		/*! \brief Stop process during update (required for cross processor code modification according to intel)? */
+		/*! \brief Synchronize cross processor code modification during update (according to intel)? Uses membarrier if available and all code modifications are performed using it, otherwise the process is stopped */
 		bool stop_on_update = false;
 
+		/*! \brief Marker file for update transactions: while it exists, modifications are collected and applied together on its removal (nullptr to disable) */
+		const char * update_transaction = nullptr;
+
 		/*! \brief use modification time to detect changes? */
 		bool use_mtime = false;
 
@@ -65,6 +75,14 @@ struct Loader {
 		/*! \brief update relocations in outdated (old) versions as well? */
 		bool update_outdated_relocations = false;
 
+		/*! \brief fork with copy-on-write data (shared memory is privatized and only shared again on the next update) instead of duplicating it
+		 * \note not available as option, since its benefit has not been shown (see `test/bench/fork`)
+		 */
+		bool fork_copy_on_write = false;
+
+		/*! \brief let the first forking process analyse updates for all processes of the tree (sharing the update plan) */
+		bool fork_coordinator = false;
+
 		/*! \brief mode for updates */
 		enum UpdateMode {
 			UPDATE_MODE_GOT,                // just update global offset table
@@ -84,15 +102,39 @@ struct Loader {
 		/*! \brief delay (in seconds) after an update before enabling detection of access of outdated libs */
 		unsigned detect_outdated_delay = 1;
 
+		/*! \brief delay (in seconds) without access of a protected outdated version before its memory is reclaimed (0 to keep all versions) */
+		unsigned reclaim_outdated = 0;
+
 		/*! \brief Trap for code redirection */
 		enum Redirect::Mode trap_mode = Redirect::MODE_BREAKPOINT_TRAP;
 
+		/*! \brief number of hits after which a trap is promoted to a static jump, even if not all threads have passed it (0 to disable) */
+		unsigned trap_promote_hits = 0;
+
+		/*! \brief delay (in milliseconds) after which a trap is promoted to a static jump, even if not all threads have passed it (0 to disable) */
+		unsigned trap_promote_delay = 0;
+
+		/*! \brief number of worker threads for concurrent prefetching of dependencies (0 to load sequentially) */
+		unsigned load_threads = 0;
+
+		/*! \brief size (in bytes) of static TLS surplus for dynamically loaded modules (glibc tunable `glibc.rtld.optional_static_tls`) */
+		size_t tls_optional_static = 512;
+
 		/*! \brief set comparison mode to relax patchability checks */
 		int relax_comparison = 0;
 
 		/*! \brief output status info during initialization */
 		bool early_statusinfo = false;
 
+		/*! \brief use binary format for status info (instead of text) */
+		bool statusinfo_binary = false;
+
+		/*! \brief print time spent in each loader phase (per object) after startup and each update */
+		bool profile = false;
+
+		/*! \brief path for Chrome trace event file of the loader phases (or nullptr) */
+		const char * profile_trace = nullptr;
+
 		/*! \brief look for external debug symbols (for bean hashing)? */
 		bool find_debug_symbols = false;
 
@@ -144,12 +186,25 @@ struct Loader {
 	/*! \brief synchronize lookup access */
 	mutable RWLock<MutexRecursive> lookup_sync;
 
+	/*! \brief Generation of the loaded objects (incremented on each change, invalidates lookup caches) */
+	unsigned long generation = 0;
+
+	/*! \brief Number of objects loaded / unloaded (`dlpi_adds` / `dlpi_subs` of `dl_iterate_phdr`) */
+	unsigned long long load_adds = 0;
+	unsigned long long load_subs = 0;
+
 	/*! \brief thread local storage */
 	TLS tls;
 
 	/*! \brief Trampoline used for dynamically loaded symbols (using dlsym) - for dynamic_dlupdate */
 	Trampoline symbol_trampoline;
 
+	/*! \brief Tentative definitions of relocatable objects */
+	CommonSymbols common_symbols;
+
+	/*! \brief Shared update analysis of forked processes */
+	UpdateCoordinator update_coordinator;
+
 	/*! \brief socket to receive elf hash */
 	Socket::Client debug_hash_socket;
 
@@ -162,8 +217,11 @@ struct Loader {
 	/*! \brief Process PID */
 	pid_t pid;
 
-	/*! \brief Descriptor for status info output */
-	int statusinfofd = -1;
+	/*! \brief Status info output */
+	StatusInfo status_info;
+
+	/*! \brief Timing of loader phases */
+	Profiler profiler;
 
 	/*! \brief Descriptor for inotify */
 	int filemodification_inotifyfd = -1;
@@ -182,6 +240,9 @@ struct Loader {
 	/*! \brief are updates currently pending? */
 	bool update_pending = false;
 
+	/*! \brief Active prefetch of dependencies (innermost) */
+	Prefetch * prefetch = nullptr;
+
 	/*! \brief Default flags for objects */
 	ObjectIdentity::Flags default_flags;
 
@@ -208,6 +269,11 @@ struct Loader {
 	/*! \brief Search, load & initizalize libary (during runtime) */
 	ObjectIdentity * dlopen(const char * file, ObjectIdentity::Flags flags, namespace_t ns = NAMESPACE_BASE, bool load = true);
 
+	/*! \brief Close handle of libary, unload it (and its dependencies) if no longer used
+	 * \return `false` if there was no open handle
+	 */
+	bool dlclose(ObjectIdentity * object);
+
 	/*! \brief Run */
 	bool run(ObjectIdentity * file, const Vector<const char *> & args, uintptr_t stack_pointer = 0, size_t stack_size = 0, const char * entry_point = nullptr);
 	bool run(ObjectIdentity * file, uintptr_t stack_pointer, const char * entry_point = nullptr);
@@ -241,6 +307,13 @@ struct Loader {
 
 	/*! \brief check if object is already loaded */
 	bool is_loaded(const ObjectIdentity * ptr) const;
+	/*! \brief check if object version is (still) loaded */
+	bool is_loaded(const Object * ptr) const;
+
+	/*! \brief Objects have been added, updated or removed: invalidate address index and symbol caches
+	 * \note requires exclusive access to lookup (or no concurrent readers)
+	 */
+	void changed();
 
 	/*! \brief get instance for current process */
 	static Loader * instance();
@@ -255,12 +328,74 @@ struct Loader {
 	/*! \brief Iterator to first pure dependency library in lookup list */
 	ObjectIdentityList::Iterator dependencies;
 
+	/*! \brief Index of objects in lookup list (by name, path and inode) */
+	ObjectIndex object_index;
+
+	/*! \brief Objects are currently unloaded (prevent nested unloading by destructors) */
+	bool unloading = false;
+
 	/*! \brief Next Namespace */
 	mutable namespace_t next_namespace;
 
 	/*! \brief next unused address for object */
 	mutable uintptr_t next_library_address = 0;
 
+	/*! \brief Memory range of an object (sorted by start in the address index) */
+	struct AddressRange {
+		uintptr_t start;
+		uintptr_t end;  // inclusive
+		Object * object;
+	};
+
+	/*! \brief Address index of all mapped object versions (built on demand, discarded on change) */
+	mutable Vector<AddressRange> * address_index = nullptr;
+
+	/*! \brief Synchronize concurrent build of address index by readers */
+	mutable Mutex address_index_lock;
+
+	/*! \brief Get (and build if required) the address index */
+	const Vector<AddressRange> * get_address_index() const;
+
+	/*! \brief state of multi-object update transaction */
+	struct {
+		/*! \brief inotify descriptor for directory containing the marker file */
+		int wd = -1;
+
+		/*! \brief file name of the marker (in the directory) */
+		const char * name = nullptr;
+
+		/*! \brief marker exists, collect modified objects */
+		bool active = false;
+
+		/*! \brief marker was removed, load all collected objects at once */
+		bool commit = false;
+	} update_transaction;
+
+	/*! \brief loaded updates waiting for the custom update point */
+	struct {
+		/*! \brief members of an update transaction (status is reported when the update is applied) */
+		Vector<ObjectIdentity*> members;
+
+		/*! \brief start time of the update transaction */
+		uint64_t start = 0;
+
+		/*! \brief all updated objects (their outdated version is protected when the update is applied) */
+		Vector<ObjectIdentity*> updated;
+
+		/*! \brief outdated versions of applied updates (moved to the protection worklist by the helper loop) */
+		Vector<Object*> protect;
+
+		/*! \brief `protect` is not empty (checked without lock by the helper loop) */
+		bool protect_ready = false;
+	} update_deferred;
+
+	/*! \brief Result of applying loaded updates */
+	enum UpdateResult {
+		UPDATE_FAILED,
+		UPDATE_APPLIED,
+		UPDATE_DEFERRED  // waiting for custom update point
+	};
+
 	/*! \brief helper loop for file modification detection and userfault handling (executed in new thread) */
 	void helper_loop();
 
@@ -269,10 +404,34 @@ struct Loader {
 
 	/*! \brief Delayed object loading after file modifiaction (called in helper loop) */
 	void filemodification_load(unsigned long now, TreeSet<Pair<unsigned long, ObjectIdentity*>> & worklist_load, TreeSet<Pair<unsigned long, Object*>> & worklist_protect);
-	bool filemodification_load_helper(ObjectIdentity* object, uintptr_t addr = 0);
+	ObjectIdentity::Info filemodification_load_helper(ObjectIdentity* object, uintptr_t addr = 0, bool transaction = false);
+
+	/*! \brief Wait for update plans of the coordinator (before loading, since no lock is held while waiting)
+	 * \param now current time
+	 * \param worklist_load objects to be loaded
+	 * \param transaction all objects will be loaded (without delay)
+	 */
+	void filemodification_await(unsigned long now, const TreeSet<Pair<unsigned long, ObjectIdentity*>> & worklist_load, bool transaction = false);
+
+	/*! \brief Watch for marker of update transactions */
+	bool filemodification_transaction_watch();
+
+	/*! \brief Load all collected objects of an update transaction (called in helper loop) */
+	void filemodification_transaction(unsigned long now, TreeSet<Pair<unsigned long, ObjectIdentity*>> & worklist_load, TreeSet<Pair<unsigned long, Object*>> & worklist_protect);
+
+	/*! \brief Discard new versions of a rejected update transaction and unload dependencies loaded for them */
+	void filemodification_transaction_rollback(const Vector<ObjectIdentity*> & members, const HashSet<const ObjectIdentity *> & existing, uint64_t start);
+
+	/*! \brief Apply loaded updates (or wait for custom update point)
+	 * \return result (the caller has to register deferred updates in `update_deferred`)
+	 */
+	UpdateResult filemodification_update();
 
 	/*! \brief Delayed object protection after file modifiaction (called in helper loop) */
-	void filemodification_protect(unsigned long now, TreeSet<Pair<unsigned long, Object*>> & worklist_protect);
+	void filemodification_protect(unsigned long now, TreeSet<Pair<unsigned long, Object*>> & worklist_protect, TreeSet<Pair<unsigned long, Object*>> & worklist_reclaim);
+
+	/*! \brief Release quiescent outdated versions (called in helper loop) */
+	void filemodification_reclaim(unsigned long now, TreeSet<Pair<unsigned long, Object*>> & worklist_reclaim);
 
 	/*! \brief userfault handler (called in helper loop) */
 	void userfault_handle();
@@ -280,8 +439,13 @@ struct Loader {
 	/*! \brief relocate all loaded files for execution */
 	bool relocate(bool update = false);
 
-	/*! \brief Perform update */
-	void update();
+	/*! \brief Perform update
+	 * \return `false` if relocation failed
+	 */
+	bool update();
+
+	/*! \brief Unload objects (without open handles), including all their versions */
+	void unload(const Vector<ObjectIdentity *> & objects);
 
 	/*! \brief resolve address of entry point */
 	uintptr_t get_entry_point(Object * start, const char * custom_entry_point = nullptr);
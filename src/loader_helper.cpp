@@ -5,15 +5,40 @@
 #include "loader.hpp"
 
 #include <dlh/parser/ar.hpp>
+#include <dlh/parser/string.hpp>
 #include <dlh/syscall.hpp>
+#include <dlh/dir.hpp>
+#include <dlh/math.hpp>
+#include <dlh/utility.hpp>
+#include <dlh/stream/string.hpp>
 #include <dlh/error.hpp>
 #include <dlh/file.hpp>
+#include <dlh/string.hpp>
 #include <dlh/log.hpp>
 
 #include "comp/gdb.hpp"
+#include "code_patch.hpp"
+#include "thread_scan.hpp"
+#include "update_plan.hpp"
 
 const unsigned long SECOND_NS = 1'000'000'000UL;
 
+/*! \brief Will an update modify live code with plain stores (instead of the cross modifying code protocol)?
+ *  This is the case for relocations in machine code and for relocatable objects which are affected by the update
+ *  (their relocations in text, e.g. `rel32` fields, referencing an updated object
+ *  and in sections of previous versions reused by the new version).
+ */
+static bool update_writes_code(const Loader & loader) {
+	if (loader.config.update_mode >= Loader::Config::UPDATE_MODE_CODEREL)
+		return true;
+	// Only versions updated by `ObjectIdentity::update`
+	for (const auto & o : loader.lookup)
+		for (const Object * c = o.current; c != nullptr; c = o.flags.update_outdated ? c->file_previous : nullptr)
+			if (c->update_writes_code())
+				return true;
+	return false;
+}
+
 static void helper_signal(int signum) {
 	if (signum == SIGTERM) {
 		LOG_INFO << "helper loop handler ends (Signal " << signum << ")" << endl;
@@ -47,7 +72,23 @@ void Loader::filemodification_detect(unsigned long now, TreeSet<Pair<unsigned lo
 			LOG_WARNING << "Notification event queue overflow -- will check all objects!" << endl;
 			check_all = true;
 		}
-		if (event->wd != -1) {
+		if (event->wd != -1 && event->wd == update_transaction.wd) {
+			// Marker for update transaction
+			if ((event->mask & IN_IGNORED) != 0) {
+				update_transaction.wd = -1;
+				if (!filemodification_transaction_watch())
+					LOG_WARNING << "Unable to reinstall watch for update transaction marker " << config.update_transaction << endl;
+			} else if (event->len > 0 && String::compare(event->name, update_transaction.name) == 0) {
+				if ((event->mask & (IN_CREATE | IN_MOVED_TO)) != 0) {
+					LOG_INFO << "Begin of update transaction (marker " << config.update_transaction << " created)" << endl;
+					update_transaction.active = true;
+				} else if ((event->mask & (IN_DELETE | IN_MOVED_FROM)) != 0 && update_transaction.active) {
+					LOG_INFO << "Commit of update transaction (marker " << config.update_transaction << " removed)" << endl;
+					update_transaction.active = false;
+					update_transaction.commit = true;
+				}
+			}
+		} else if (event->wd != -1) {
 			// Get Object
 			GuardedWriter _{lookup_sync};
 			for (auto & object_file : lookup) {
@@ -84,7 +125,7 @@ void Loader::filemodification_detect(unsigned long now, TreeSet<Pair<unsigned lo
 	}
 }
 
-bool Loader::filemodification_load_helper(ObjectIdentity* object, uintptr_t addr) {  // NOLINT
+ObjectIdentity::Info Loader::filemodification_load_helper(ObjectIdentity* object, uintptr_t addr, bool transaction) {  // NOLINT
 	auto format = addr != 0 ? File::contents::format(reinterpret_cast<const char *>(addr), 6) : File::contents::format(object->path.c_str());
 	switch (format) {
 		case File::contents::FORMAT_AR:
@@ -97,72 +138,283 @@ bool Loader::filemodification_load_helper(ObjectIdentity* object, uintptr_t addr
 						auto size = entry.size();
 						if (auto anon = Syscall::mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0))
 							addr = Memory::copy(anon.value(), addr, size);
-						return filemodification_load_helper(object, addr);
+						return filemodification_load_helper(object, addr, transaction);
 					}
-			break;
+			return ObjectIdentity::INFO_ERROR_OPEN;
 		}
 		case File::contents::FORMAT_ELF:
-			if (object->load(addr) != nullptr)
-				return true;
-			break;
+		 {
+			// Transactions postpone preparation (relocations might depend on other members of the transaction)
+			Object * o = nullptr;
+			uint64_t start = StatusInfo::now();
+			auto info = object->load_version(o, addr, Elf::ET_NONE, !transaction);
+			// Status of transaction members is reported on commit
+			if (!transaction)
+				object->status(info, StatusInfo::now() - start);
+			return info;
+		}
 		default:
 			LOG_ERROR << "Invalid file format (" << format_description(format) << ") for updated " << *object << endl;
+			return ObjectIdentity::INFO_ERROR_ELF;
 	}
-	return false;
+}
+
+void Loader::filemodification_await(unsigned long now, const TreeSet<Pair<unsigned long, ObjectIdentity*>> & worklist_load, bool transaction) {
+	if (!update_coordinator.is_member())
+		return;
+
+	for (const auto & i : worklist_load)
+		if (transaction || i.first <= now) {
+			uint64_t previous_hash, new_hash;
+			{
+				// Object might be unloaded in the meantime
+				GuardedReader _{lookup_sync};
+				if (!is_loaded(i.second) || !UpdatePlan::coordinated(*(i.second), previous_hash, new_hash))
+					continue;
+			}
+			update_coordinator.wait(previous_hash, new_hash);
+		}
 }
 
 void Loader::filemodification_load(unsigned long now, TreeSet<Pair<unsigned long, ObjectIdentity*>> & worklist_load, TreeSet<Pair<unsigned long, Object*>> & worklist_protect) {
+	// Collect modifications until transaction is committed
+	if (update_transaction.active) {
+		return;
+	} else if (update_transaction.commit) {
+		filemodification_await(now, worklist_load, true);
+		filemodification_transaction(now, worklist_load, worklist_protect);
+		return;
+	}
+
+	// Waiting for the coordinator must not block other threads
+	filemodification_await(now, worklist_load);
+
 	GuardedWriter _{lookup_sync};
-	bool updated = false;
+	Vector<ObjectIdentity*> updated;
 	while (!worklist_load.empty()) {
 		auto i = worklist_load.lowest();
 		if (i->first <= now) {
 			assert(i->second != nullptr);
-			LOG_INFO << "Loading " << *(i->second) << endl;
-			if (filemodification_load_helper(i->second)) {
-				updated = true;
-				if (config.detect_outdated != Loader::Config::DETECT_OUTDATED_DISABLED) {
-					assert(i->second->current != nullptr && i->second->current->file_previous != nullptr);
-					worklist_protect.emplace(now + config.detect_outdated_delay * SECOND_NS, i->second->current->file_previous);
-				}
+			// Object might have been unloaded in the meantime
+			if (!is_loaded(i->second)) {
+				worklist_load.erase(i);
+				continue;
 			}
+			LOG_INFO << "Loading " << *(i->second) << endl;
+			if (auto info = filemodification_load_helper(i->second); info == ObjectIdentity::INFO_SUCCESS_LOAD || info == ObjectIdentity::INFO_SUCCESS_UPDATE)
+				updated.push_back(i->second);
 			worklist_load.erase(i);
 		} else {
 			break;
 		}
 	}
-	if (updated) {
-		// Check for update hooks
-		for (const auto & o : lookup) {
-			if (o.hook.update_point) {
-				update_pending = true;
-				LOG_INFO << "Waiting for reaching custom update point to apply changes" << endl;
-				return;
+	if (!updated.empty())
+		switch (filemodification_update()) {
+			case UPDATE_APPLIED:
+				if (config.detect_outdated != Loader::Config::DETECT_OUTDATED_DISABLED)
+					for (auto & object : updated) {
+						assert(object->current != nullptr && object->current->file_previous != nullptr);
+						worklist_protect.emplace(now + config.detect_outdated_delay * SECOND_NS, object->current->file_previous);
+					}
+				break;
+
+			case UPDATE_DEFERRED:
+				for (auto & object : updated)
+					update_deferred.updated.push_back(object);
+				break;
+
+			case UPDATE_FAILED:
+				break;
+		}
+}
+
+bool Loader::filemodification_transaction_watch() {
+	assert(config.update_transaction != nullptr);
+	// Watch the directory, since the marker file does not exist most of the time
+	auto len = String::len(config.update_transaction);
+	char dir[len + 2];  // NOLINT
+	String::copy(dir, config.update_transaction, len + 1);
+	char * name = const_cast<char*>(String::find_last(dir, '/'));
+	if (name == nullptr) {
+		update_transaction.name = config.update_transaction;
+		String::copy(dir, ".", 2);
+	} else {
+		update_transaction.name = config.update_transaction + (name - dir) + 1;
+		if (name == dir)
+			name++;
+		*name = '\0';
+	}
+
+	if (auto inotify = Syscall::inotify_add_watch(filemodification_inotifyfd, dir, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)) {
+		LOG_DEBUG << "Watching for update transaction marker " << update_transaction.name << " in " << dir << endl;
+		update_transaction.wd = inotify.value();
+		update_transaction.active = File::exists(config.update_transaction);
+		if (update_transaction.active)
+			LOG_INFO << "Update transaction marker " << config.update_transaction << " exists -- collecting modifications" << endl;
+		return true;
+	} else {
+		LOG_ERROR << "Cannot watch for update transaction marker in " << dir << ": " << inotify.error_message() << endl;
+		update_transaction.wd = -1;
+		return false;
+	}
+}
+
+void Loader::filemodification_transaction(unsigned long now, TreeSet<Pair<unsigned long, ObjectIdentity*>> & worklist_load, TreeSet<Pair<unsigned long, Object*>> & worklist_protect) {
+	GuardedWriter _{lookup_sync};
+	update_transaction.commit = false;
+	uint64_t start = StatusInfo::now();
+
+	// Objects loaded before the transaction (new dependencies of members are unloaded on rollback)
+	HashSet<const ObjectIdentity *> existing;
+	for (const auto & o : lookup)
+		existing.insert(&o);
+
+	// Load new versions of all modified objects (without delay), but do not prepare them yet
+	Vector<ObjectIdentity*> members;
+	ObjectIdentity * rejected = nullptr;
+	while (!worklist_load.empty()) {
+		auto i = worklist_load.lowest();
+		ObjectIdentity * object = i->second;
+		assert(object != nullptr);
+		worklist_load.erase(i);
+		if (rejected != nullptr || !is_loaded(object))
+			continue;
+
+		LOG_INFO << "Loading " << *object << " (update transaction)" << endl;
+		switch (auto info = filemodification_load_helper(object, 0, true)) {
+			case ObjectIdentity::INFO_SUCCESS_LOAD:
+			case ObjectIdentity::INFO_SUCCESS_UPDATE:
+				members.push_back(object);
+				break;
+
+			case ObjectIdentity::INFO_IDENTICAL_TIME:
+			case ObjectIdentity::INFO_IDENTICAL_HASH:
+				// Unchanged objects are not part of the transaction
+				object->status(info);
+				break;
+
+			default:
+				// Incompatible (not patchable) or broken member
+				object->status(info);
+				rejected = object;
+		}
+	}
+
+	// Prepare all members (in dependency order) before the first change to the running code,
+	// so that a failing relocation still allows to roll back the whole transaction
+	if (rejected == nullptr && !members.empty()) {
+		for (auto & o : reverse(lookup))
+			o.preprepare();
+		for (auto & o : reverse(lookup))
+			if (!o.prepare()) {
+				LOG_WARNING << "Preparing " << o << " failed" << endl;
+				rejected = &o;
+				break;
+			}
+	}
+
+	if (rejected != nullptr) {
+		LOG_WARNING << "Rejecting update transaction with " << members.size() << " objects since " << *rejected << " cannot be updated" << endl;
+		filemodification_transaction_rollback(members, existing, start);
+	} else if (!members.empty()) {
+		LOG_INFO << "Applying update transaction with " << members.size() << " objects" << endl;
+		// All members are already prepared, relocate them in a single pass
+		auto result = filemodification_update();
+		if (result == UPDATE_DEFERRED) {
+			// Status and protection when the update point is reached
+			for (auto & object : members) {
+				update_deferred.members.push_back(object);
+				update_deferred.updated.push_back(object);
 			}
+			update_deferred.start = start;
+			return;
 		}
+		bool success = result == UPDATE_APPLIED;
+		if (!success)
+			LOG_ERROR << "Update transaction with " << members.size() << " objects failed during commit!" << endl;
+		for (auto & object : members) {
+			object->status(success ? ObjectIdentity::INFO_SUCCESS_UPDATE : ObjectIdentity::INFO_UPDATE_TRANSACTION, StatusInfo::now() - start);
+			if (success && config.detect_outdated != Loader::Config::DETECT_OUTDATED_DISABLED) {
+				assert(object->current != nullptr && object->current->file_previous != nullptr);
+				worklist_protect.emplace(now + config.detect_outdated_delay * SECOND_NS, object->current->file_previous);
+			}
+		}
+	} else {
+		LOG_INFO << "Update transaction without modifications" << endl;
+	}
+}
 
-		// Stop main process
-		if (config.stop_on_update)
-			Syscall::kill(pid, SIGSTOP);
+void Loader::filemodification_transaction_rollback(const Vector<ObjectIdentity*> & members, const HashSet<const ObjectIdentity *> & existing, uint64_t start) {
+	// Discard new versions of members (in reverse load order)
+	for (size_t m = members.size(); m > 0; m--) {
+		ObjectIdentity * object = members[m - 1];
+		if (!object->discard())
+			LOG_ERROR << "Discarding new version of " << *object << " failed!" << endl;
+		object->status(ObjectIdentity::INFO_UPDATE_TRANSACTION, StatusInfo::now() - start);
+	}
 
-		// Perform update routine
-		update();
+	// Unload dependencies which were only loaded for the new versions
+	Vector<ObjectIdentity *> added;
+	for (auto & o : lookup)
+		if (!existing.contains(&o) && o.handles == 0)
+			added.push_back(&o);
+	if (!added.empty()) {
+		LOG_INFO << "Unloading " << added.size() << " dependencies of rejected update transaction" << endl;
+		unload(added);
+	}
+}
 
-		// Continue main process
-		if (config.stop_on_update)
-			Syscall::kill(pid, SIGCONT);
+Loader::UpdateResult Loader::filemodification_update() {
+	// Check for update hooks
+	for (const auto & o : lookup) {
+		if (o.hook.update_point) {
+			update_pending = true;
+			LOG_INFO << "Waiting for reaching custom update point to apply changes" << endl;
+			return UPDATE_DEFERRED;
+		}
 	}
+
+	// Stop main process (unless all code modifications use core serialization)
+	bool stop = config.stop_on_update && (!CodePatch::available() || update_writes_code(*this));
+	if (stop)
+		Syscall::kill(pid, SIGSTOP);
+
+	// Perform update routine
+	bool success = update();
+
+	// Continue main process
+	if (stop)
+		Syscall::kill(pid, SIGCONT);
+	// or ensure that all threads will not execute stale (prefetched) instructions
+	else if (config.stop_on_update && !CodePatch::sync_core())
+		LOG_WARNING << "Core serialization after update failed" << endl;
+
+	return success ? UPDATE_APPLIED : UPDATE_FAILED;
 }
 
-void Loader::filemodification_protect(unsigned long now, TreeSet<Pair<unsigned long, Object*>> & worklist_protect) {
+void Loader::filemodification_protect(unsigned long now, TreeSet<Pair<unsigned long, Object*>> & worklist_protect, TreeSet<Pair<unsigned long, Object*>> & worklist_reclaim) {
 	GuardedWriter _{lookup_sync};
+	// Updates applied at the custom update point
+	if (update_deferred.protect_ready) {
+		for (auto & object : update_deferred.protect)
+			worklist_protect.emplace(now + config.detect_outdated_delay * SECOND_NS, object);
+		update_deferred.protect.clear();
+		__atomic_store_n(&update_deferred.protect_ready, false, __ATOMIC_RELAXED);
+	}
 	bool updated = false;
 	while (!worklist_protect.empty()) {
 		auto i = worklist_protect.lowest();
 		if (i->first <= now) {
 			assert(i->second != nullptr);
+			// Object might have been unloaded in the meantime
+			if (!is_loaded(i->second)) {
+				worklist_protect.erase(i);
+				continue;
+			}
 			LOG_INFO << "Protecting " << *(i->second) << endl;
-			i->second->disable();
+			// Access detection installed: reclaim if no access within delay
+			if (i->second->disable() && config.reclaim_outdated > 0)
+				worklist_reclaim.emplace(now + config.reclaim_outdated * SECOND_NS, i->second);
 			worklist_protect.erase(i);
 		} else {
 			break;
@@ -170,6 +422,84 @@ void Loader::filemodification_protect(unsigned long now, TreeSet<Pair<unsigned l
 	}
 }
 
+/*! \brief Upper limit for the exponential backoff of postponed reclaiming (as factor of the reclaim interval) */
+static const unsigned reclaim_backoff_limit = 6;
+
+void Loader::filemodification_reclaim(unsigned long now, TreeSet<Pair<unsigned long, Object*>> & worklist_reclaim) {
+	GuardedWriter _{lookup_sync};
+	bool reclaimed = false;
+	Vector<Object*> postponed;
+	while (!worklist_reclaim.empty()) {
+		auto i = worklist_reclaim.lowest();
+		if (i->first > now)
+			break;
+		Object * object = i->second;
+		assert(object != nullptr);
+		worklist_reclaim.erase(i);
+		// Object might have been unloaded in the meantime
+		if (!is_loaded(object))
+			continue;
+		auto & file = object->file;
+
+		if (object->outdated_access()) {
+			// Outdated version is still in use (e.g. via function pointer) -- keep it
+			LOG_WARNING << "Outdated " << *object << " was accessed -- will not be reclaimed" << endl;
+			continue;
+		} else if (file.flags.premapped && file.reclaimed.versions == 0 && object->file_previous == nullptr) {
+			// Memory was not allocated by us
+			LOG_DEBUG << "Initial version " << *object << " is premapped -- will not be reclaimed" << endl;
+			continue;
+		} else if (object->borrowed > 0) {
+			// Memory is used by newer versions (e.g. reused data of relocatable objects)
+			LOG_DEBUG << "Memory of outdated " << *object << " is used by " << object->borrowed << " newer version(s) -- will not be reclaimed" << endl;
+			continue;
+		} else if (object->file_previous != nullptr || file.hook.object == object) {
+			// Release versions in their order (older first)
+			postponed.push_back(object);
+			continue;
+		}
+
+		// Memory ranges (code and data) of outdated version
+		Vector<Pair<uintptr_t, uintptr_t>> ranges;
+		for (const auto & seg : object->memory_map)
+			ranges.emplace_back(seg.target.page_start(), seg.target.page_end());
+		if (ThreadScan::referenced(ranges)) {
+			// Exponential backoff (bounded), since threads might keep referencing it for a long time
+			object->reclaim_attempts++;
+			unsigned long delay = (config.reclaim_outdated * SECOND_NS) << Math::min(object->reclaim_attempts, reclaim_backoff_limit);
+			LOG_INFO << "Outdated " << *object << " might be referenced by a thread -- postpone reclaiming (attempt " << object->reclaim_attempts << ")" << endl;
+			worklist_reclaim.emplace(now + delay, object);
+			continue;
+		}
+
+		// Determine size
+		size_t bytes = object->data.size + object->debug_size;
+		for (const auto & seg : object->memory_map)
+			bytes += seg.target.page_size();
+
+		LOG_INFO << "Reclaiming " << bytes << " bytes of outdated " << *object << endl;
+		if (size_t redirections = Redirect::release(*object); redirections > 0)
+			LOG_DEBUG << "Released " << redirections << " redirections in " << *object << endl;
+
+		if (!reclaimed)
+			GDB::begin(GDB::RT_DELETE);
+		reclaimed = true;
+
+		// Destructor will remove the version from the list and unmap memory
+		delete object;
+		file.reclaimed.versions++;
+		file.reclaimed.bytes += bytes;
+		file.status(ObjectIdentity::INFO_SUCCESS_RECLAIM);
+	}
+
+	// Retry later
+	for (auto & object : postponed)
+		worklist_reclaim.emplace(now + config.reclaim_outdated * SECOND_NS, object);
+
+	if (reclaimed)
+		GDB::end(*this);
+}
+
 void Loader::userfault_handle() {
 	struct uffd_msg msg;
 
@@ -304,6 +634,7 @@ void Loader::helper_loop() {
 
 	TreeSet<Pair<unsigned long, ObjectIdentity*>> worklist_load;
  	TreeSet<Pair<unsigned long, Object*>> worklist_protect;
+ 	TreeSet<Pair<unsigned long, Object*>> worklist_reclaim;
 
 	while (true) {
 		if (auto poll = Syscall::poll(fds, nfds, 1000)) {
@@ -317,10 +648,15 @@ void Loader::helper_loop() {
 				filemodification_detect(now, worklist_load);
 			if (poll.value() > 0 && nfds > 1 && (fds[1].revents & POLLIN) != 0)
 				userfault_handle();
-			if (!worklist_load.empty())
+			if (!worklist_load.empty() || update_transaction.commit)
 				filemodification_load(now, worklist_load, worklist_protect);
-			if (!worklist_protect.empty())
-				filemodification_protect(now, worklist_protect);
+			if (!worklist_protect.empty() || __atomic_load_n(&update_deferred.protect_ready, __ATOMIC_RELAXED))
+				filemodification_protect(now, worklist_protect, worklist_reclaim);
+			if (!worklist_reclaim.empty())
+				filemodification_reclaim(now, worklist_reclaim);
+			if (size_t promoted = Redirect::promote(); promoted > 0)
+				LOG_DEBUG << "Promoted " << promoted << " traps to static jumps" << endl;
+			status_info.drain();
 		} else {
 			LOG_ERROR << "Poll of helper loop failed: " << poll.error_message() << endl;
 			break;
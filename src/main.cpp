@@ -11,11 +11,13 @@
 #include <dlh/macro.hpp>
 #include <dlh/file.hpp>
 #include <dlh/log.hpp>
+#include <dlh/mem.hpp>
 
 #include <elfo/elf.hpp>
 
 #include "object/base.hpp"
 #include "build_info.hpp"
+#include "update_plan.hpp"
 #include "loader.hpp"
 
 #ifndef LUCIDIR
@@ -54,7 +56,14 @@ struct Opts {
 	const char * statusinfo{ nullptr };
 	const char * detectOutdated{ nullptr };
 	const char * debugSymbolsRoot{ nullptr };
+	const char * updateTransaction{ nullptr };
+	const char * profileTrace{ nullptr };
+	const char * updatePlan{ nullptr };
 	unsigned delayOutdated{1};
+	unsigned reclaimOutdated{0};
+	unsigned trapPromoteHits{0};
+	unsigned trapPromoteDelay{0};
+	unsigned loadThreads{0};
 	bool pie{};
 	bool noPie{};
 	bool logtimeAbs{};
@@ -70,7 +79,10 @@ struct Opts {
 	bool dynamicWeak{};
 	bool relocateCheck{};
 	bool relocateOutdated{};
+	bool forkCoordinator{};
 	bool earlyStatusInfo{};
+	bool statusInfoBinary{};
+	bool profile{};
 	bool bindNow{};
 	bool bindNot{};
 	bool tracing{};
@@ -192,6 +204,12 @@ static Loader * setup(uintptr_t luci_base, const char * luci_path, struct Opts &
 	// Stop process during relocation at updates
 	if (config_loader.dynamic_update)
 		config_loader.stop_on_update = opts.stopOnUpdate || config_file.value_or_default<bool>("LD_STOP_ON_UPDATE", false);
+	// Collect modifications during transaction
+	if (config_loader.dynamic_update) {
+		config_loader.update_transaction = opts.updateTransaction != nullptr && String::len(opts.updateTransaction) > 0 ? opts.updateTransaction : config_file.value_or_default<const char *>("LD_UPDATE_TRANSACTION", nullptr);
+		if (config_loader.update_transaction != nullptr && String::len(config_loader.update_transaction) == 0)
+			config_loader.update_transaction = nullptr;
+	}
 	// Ignore identical updates
 	if (config_loader.skip_identical)
 		config_loader.skip_identical = opts.skipIdentical || config_file.value_or_default<bool>("LD_SKIP_IDENTICAL", false);
@@ -205,8 +223,17 @@ static Loader * setup(uintptr_t luci_base, const char * luci_path, struct Opts &
 	// Fix relocations in outdated varsions
 	if (config_loader.dynamic_update)
 		config_loader.update_outdated_relocations = (opts.relocateOutdated || config_file.value_or_default<bool>("LD_RELOCATE_OUTDATED", false));
+	// Shared update analysis of forked processes
+	if (config_loader.dynamic_update)
+		config_loader.fork_coordinator = opts.forkCoordinator || config_file.value_or_default<bool>("LD_FORK_COORDINATOR", false);
 	// Early Status Info output
 	config_loader.early_statusinfo = opts.earlyStatusInfo ||  config_file.value_or_default<bool>("LD_EARLY_STATUS_INFO", false);
+	config_loader.statusinfo_binary = opts.statusInfoBinary ||  config_file.value_or_default<bool>("LD_STATUS_INFO_BINARY", false);
+	// Profiling of loader phases
+	config_loader.profile = opts.profile || config_file.value_or_default<bool>("LD_PROFILE", false);
+	config_loader.profile_trace = opts.profileTrace != nullptr && String::len(opts.profileTrace) > 0 ? opts.profileTrace : config_file.value_or_default<const char *>("LD_PROFILE_TRACE", nullptr);
+	if (config_loader.profile_trace != nullptr && String::len(config_loader.profile_trace) == 0)
+		config_loader.profile_trace = nullptr;
 	// Process init debug output
 	config_loader.show_args = opts.showArgs || config_file.value_or_default<bool>("LD_SHOW_ARGS", false);
 	config_loader.show_auxv = opts.showAuxv || config_file.value_or_default<bool>("LD_SHOW_AUXV", false);
@@ -248,6 +275,12 @@ static Loader * setup(uintptr_t luci_base, const char * luci_path, struct Opts &
 	if (config_loader.detect_outdated != Loader::Config::DETECT_OUTDATED_DISABLED) {
 		config_loader.detect_outdated_delay = Math::max(opts.delayOutdated, config_file.value_or_default<unsigned>("LD_DETECT_OUTDATED_DELAY", config_loader.detect_outdated_delay));
 		LOG_DEBUG << "Delay for detecting outdated access is " << config_loader.detect_outdated_delay << "s" << endl;
+		// Reclaim memory of quiescent outdated versions
+		config_loader.reclaim_outdated = Math::max(opts.reclaimOutdated, config_file.value_or_default<unsigned>("LD_RECLAIM_OUTDATED", config_loader.reclaim_outdated));
+		if (config_loader.reclaim_outdated > 0)
+			LOG_DEBUG << "Reclaim outdated versions after " << config_loader.reclaim_outdated << "s without access" << endl;
+	} else if (opts.reclaimOutdated > 0) {
+		LOG_WARNING << "Reclaiming outdated versions requires detection of outdated access -- ignoring" << endl;
 	}
 
 	// Set update mode for patchability
@@ -258,6 +291,37 @@ static Loader * setup(uintptr_t luci_base, const char * luci_path, struct Opts &
 	config_loader.trap_mode = static_cast<Redirect::Mode>(Math::max(opts.trapMode, config_file.value_or_default<int>("LD_TRAP_MODE", config_loader.trap_mode)));
 	if (config_loader.dynamic_update)
 		LOG_DEBUG << "Using trap mode " << config_loader.trap_mode << endl;
+	// Promote hot traps to static jumps
+	if (config_loader.dynamic_update) {
+		config_loader.trap_promote_hits = Math::max(opts.trapPromoteHits, config_file.value_or_default<unsigned>("LD_TRAP_PROMOTE_HITS", config_loader.trap_promote_hits));
+		config_loader.trap_promote_delay = Math::max(opts.trapPromoteDelay, config_file.value_or_default<unsigned>("LD_TRAP_PROMOTE_DELAY", config_loader.trap_promote_delay));
+	}
+
+	// Size of static TLS surplus for dynamically loaded modules (using the glibc tunable)
+	if (const char * tunables = config_file.value("GLIBC_TUNABLES")) {
+		const char * optional_static_tls = "glibc.rtld.optional_static_tls=";
+		const size_t optional_static_tls_len = String::len(optional_static_tls);
+		for (const char * tunable = tunables; *tunable != '\0'; ) {
+			const char * end = String::find(tunable, ':');
+			size_t len = end == nullptr ? String::len(tunable) : static_cast<size_t>(end - tunable);
+			if (len > optional_static_tls_len && len - optional_static_tls_len < 24 && String::compare(tunable, optional_static_tls, optional_static_tls_len) == 0) {
+				char value[24] = {};
+				Memory::copy(value, tunable + optional_static_tls_len, len - optional_static_tls_len);
+				if (Parser::string(config_loader.tls_optional_static, value))
+					LOG_DEBUG << "Using " << config_loader.tls_optional_static << " bytes of optional static TLS" << endl;
+				else
+					LOG_WARNING << "Invalid value for optional static TLS: " << value << endl;
+			}
+			if (end == nullptr)
+				break;
+			tunable = end + 1;
+		}
+	}
+
+	// Concurrent prefetching of dependencies
+	config_loader.load_threads = Math::max(opts.loadThreads, config_file.value_or_default<unsigned>("LD_LOAD_THREADS", config_loader.load_threads));
+	if (config_loader.load_threads > 0)
+		LOG_DEBUG << "Prefetching dependencies using up to " << config_loader.load_threads << " threads" << endl;
 
 	// Set comparison mode for patchability checks
 	config_loader.relax_comparison = Math::max(opts.relaxPatchCheck, config_file.value_or_default<int>("LD_RELAX_CHECK", config_loader.relax_comparison));
@@ -299,14 +363,8 @@ static Loader * setup(uintptr_t luci_base, const char * luci_path, struct Opts &
 		if (statusinfo == nullptr) {
 			statusinfo = config_file.value("LD_STATUS_INFO");
 		}
-		if (statusinfo != nullptr) {
-			if (auto open = Syscall::open(statusinfo, O_WRONLY | O_CREAT | O_TRUNC | O_SYNC, 0644)) {
-				LOG_DEBUG << "Writing status info to " << statusinfo << endl;
-				loader->statusinfofd = open.value();
-			} else {
-				LOG_INFO << "Opening '" << statusinfo << "' for status info failed: " << open.error_message() << endl;
-			}
-		}
+		if (statusinfo != nullptr && loader->status_info.open(statusinfo, loader->config.statusinfo_binary))
+			LOG_DEBUG << "Writing status info " << (loader->config.statusinfo_binary ? "(binary) " : "") << "to " << statusinfo << endl;
 
 		// Flags
 		loader->default_flags.bind_now = opts.bindNow || (config_file.value("LD_BIND_NOW") != nullptr);
@@ -418,6 +476,7 @@ int main(int argc, char* argv[]) {
 				{'L',  "library-path",     "DIR",    &Opts::libpath,          false, "Add library search path (this parameter may be used multiple times to specify additional directories). This can also be specified with the environment variable LD_LIBRARY_PATH - separate mutliple directories by semicolon." },
 				{'c',  "library-conf",     "FILE",   &Opts::libpathconf,      false, "Library path configuration" },
 				{'C',  "luci-conf",        "FILE",   &Opts::luciconf,         false, "Luci loader configuration file" },
+				{'\0', "load-threads",     "NUM",    &Opts::loadThreads,      false, "Open, map and validate the needed libraries of an object concurrently using up to the given number of worker threads (objects are still created in the usual order) -- default is 0 (sequential loading). This option can also be set using the environment variable LD_LOAD_THREADS" },
 				{'P',  "preload",          "FILE",   &Opts::preload,          false, "Library to be loaded first (this parameter may be used multiple times to specify addtional libraries). This can also be specified with the environment variable LD_PRELOAD - separate mutliple files by semicolon." },
 				{'S',  "statusinfo",       "FILE",   &Opts::statusinfo,       false, "File (named pipe) for logging successful and failed updates (latter would require a restart). Disabled if empty. This option can also be activated by setting the environment variable LD_STATUS_INFO" },
 				{'d',  "debughash",        "SOCKET", &Opts::debughash,        false, "Socket URI (unix / tcp / udp) for retrieving debug data hashes. Disabled if empty. This option can also be activated by setting the environment variable LD_DEBUG_HASH" },
@@ -427,6 +486,8 @@ int main(int argc, char* argv[]) {
 				{'D',  "func-dep-check",   nullptr,  &Opts::dependencyCheck,  false, "Check (recursively) all dependencies of each function for patchability -- only available if dynamic updates are enabled. This option can also be enabled by setting the environment variable LD_DEPENDENCY_CHECK to 1" },
 				{'i',  "relax-check",      "MODE",   &Opts::relaxPatchCheck,  false, "Relax binary comparison check (0 will use an extended ID check [default], 1 will releax check for writeable sections, 2 for all sections except executable, 3 will only use internal ID for comparison. This can also be done using the environment variable LD_RELAX_CHECK." },
 				{'t',  "trap",             "MODE",   &Opts::trapMode,         false, "Set redirection trap mode. This option can also be enabled by setting the environment variable LD_TRAP_MODE" },
+				{'\0', "trap-promote-hits", "HITS", &Opts::trapPromoteHits,  false, "Promote a trap to a static jump after the given number of hits, even if not all threads have passed it (requires core serialization via membarrier) -- default is 0 (disabled). This option can also be set using the environment variable LD_TRAP_PROMOTE_HITS" },
+				{'\0', "trap-promote-delay", "MS",  &Opts::trapPromoteDelay, false, "Promote a trap to a static jump after the given time in milliseconds, even if not all threads have passed it (requires core serialization via membarrier) -- default is 0 (disabled). This option can also be set using the environment variable LD_TRAP_PROMOTE_DELAY" },
 				{'F',  "force",            nullptr,  &Opts::forceUpdate,      false, "Force dynamic update of changed files, even if they seem to be incompatible -- only available if dynamic updates are enabled. This option can also be enabled by setting the environment variable LD_FORCE_UPDATE to 1" },
 				{'I',  "skip-identical",   nullptr,  &Opts::skipIdentical,    false, "Do not apply updates if they are identical to a previously loaded version -- only available if dynamic updates are enabled. This option can also be enabled by setting the environment variable LD_SKIP_IDENTICAL to 1" },
 				{'m',  "mtime",            nullptr,  &Opts::modificationTime, false, "Consider modification time when detecting identical updates libraries -- only available if identical updates are skipped. This option can also be enabled by setting the delay in environment variable LD_USE_MTIME."},
@@ -435,13 +496,20 @@ int main(int argc, char* argv[]) {
 				{'R',  "reloc-outdated",   nullptr,  &Opts::relocateOutdated, false, "Fix relocations of outdated versions as well. This option can also be enabled by setting the environment variable LD_RELOCATE_OUTDATED to 1"},
 				{'o',  "detect-outdated",  "MODE",   &Opts::detectOutdated,   false, "Detect access in old versions, allowed values are 'disabled' (default), 'userfaultfd', 'uprobes', 'uprobes_deps' and 'ptrace'. This option can also be enabled by setting the in environment variable LD_DETECT_OUTDATED."},
 				{'O',  "delay-outdated",   "DELAY",  &Opts::delayOutdated,    false, "Delay the installation for outdated access -- default is 1 second. This option can also be set using the environment variable LD_DETECT_OUTDATED_DELAY."},
+				{'\0', "reclaim-outdated", "DELAY",  &Opts::reclaimOutdated,  false, "Unmap and release outdated versions which were not accessed for the given seconds (and are not referenced by any thread stack) after the detection of outdated access was installed -- default is 0 (disabled). This option can also be set using the environment variable LD_RECLAIM_OUTDATED."},
 				{'w',  "weak",             nullptr,  &Opts::dynamicWeak,      false, "Enable weak symbol references in dynamic files (nonstandard!). This option can also be enabled by setting the environment variable LD_DYNAMIC_WEAK to 1" },
 				{'n',  "bind-now",         nullptr,  &Opts::bindNow,          false, "Resolve all symbols at program start (instead of lazy resolution). This option can also be enabled by setting the environment variable LD_BIND_NOW to 1" },
 				{'N',  "bind-not",         nullptr,  &Opts::bindNot,          false, "Do not update GOT after resolving a symbol. This option cannot be used in conjunction with bind-now. It can be enabled by setting the environment variable LD_BIND_NOT to 1" },
 				{'V',  "version",          nullptr,  &Opts::showVersion,      false, "Show version information" },
 				{'s',  "static",           nullptr,  &Opts::linkstatic,       false, "Act as static linker as well - this mode allows binding and loading relocatable object files (.o)." },
-				{'\0', "stop-on-update",   nullptr,  &Opts::stopOnUpdate,     false, "Stop the process during update according to Intels requirements for cross processor code modification. Make sure to disable job control. This option can also be enabled by setting the environment variable LD_STOP_ON_UPDATE to 1" },
+				{'\0', "fork-coordinator", nullptr,  &Opts::forkCoordinator,  false, "Let the first forking process act as update coordinator: It analyses new versions of libraries once and publishes the update plan in a memory file, the forked processes only load the new version and apply the plan -- only available if dynamic updates are enabled. This option can also be enabled by setting the environment variable LD_FORK_COORDINATOR to 1" },
+				{'\0', "stop-on-update",   nullptr,  &Opts::stopOnUpdate,     false, "Synchronize the process during update according to Intels requirements for cross processor code modification: Uses membarrier to serialize all cores if available and the update modifies code only via static redirections, otherwise (relocatable objects or code relocation update mode) the process is stopped (make sure to disable job control). This option can also be enabled by setting the environment variable LD_STOP_ON_UPDATE to 1" },
+				{'\0', "update-transaction", "FILE", &Opts::updateTransaction, false, "Marker file for update transactions: As long as the file exists, modified libraries are collected and, after its removal, either all of them are applied in a single update or none. This option can also be set using the environment variable LD_UPDATE_TRANSACTION" },
+				{'\0', "update-plan",      "FILE",   &Opts::updatePlan,       false, "Do not run the given files, but create an update plan (sidecar file with suffix '.luciplan') for each of them by comparing it with the previous version FILE. The plan is only used during runtime if both files and the comparison settings are unchanged, avoiding the expensive binary comparison during dynamic updates." },
 				{'\0', "early-statusinfo", nullptr,  &Opts::earlyStatusInfo,  false, "Output status info during loading the binary, so that it will also contain details about the initial libraries. This option can also be enabled by setting the environment variable LD_EARLY_STATUS_INFO to 1" },
+				{'\0', "statusinfo-binary", nullptr, &Opts::statusInfoBinary, false, "Write status info in a compact binary format (see tools/statusinfo.c) instead of text lines. This option can also be enabled by setting the environment variable LD_STATUS_INFO_BINARY to 1" },
+				{'\0', "profile",          nullptr,  &Opts::profile,          false, "Measure the time spent in each loader phase (path search, open, hashing, mapping, relocation, initialization, ...) per object and print a summary table on standard error after startup and each update. This option can also be enabled by setting the environment variable LD_PROFILE to 1" },
+				{'\0', "profile-trace",    "FILE",   &Opts::profileTrace,     false, "Write the measured loader phases as Chrome trace events (JSON, viewable in about:tracing or Perfetto) to FILE. This option can also be set using the environment variable LD_PROFILE_TRACE" },
 				{'\0', "dbgsym",           nullptr,  &Opts::debugSymbols,     false, "Search for external debug symbols to improve detection of binary updatability. This option can also be enabled by setting the environment variable LD_DEBUG_SYMBOLS to 1" },
 				{'\0', "dbgsym-root",      nullptr,  &Opts::debugSymbolsRoot, false, "Set root directory for external debug symbols. This option can also be configured using the environment variable LD_DEBUG_SYMBOLS_ROOT" },
 				{'\0', "argv0",            nullptr,  &Opts::argv0,            false, "Explicitly specify program name (argv[0])" },
@@ -472,7 +540,18 @@ int main(int argc, char* argv[]) {
 		Loader * loader = setup(base, argv[0], args, preload);
 
 		// Binary Arguments
-		if (args.has_positional()) {
+		if (args.updatePlan != nullptr) {
+			if (!args.has_positional()) {
+				LOG_ERROR << "No new versions for update plan" << endl;
+				return EXIT_FAILURE;
+			}
+			for (auto & bin : args.get_positional())
+				if (!UpdatePlan::create(loader->config, args.updatePlan, bin)) {
+					LOG_ERROR << "Creating update plan for " << bin << " failed" << endl;
+					return EXIT_FAILURE;
+				}
+			return EXIT_SUCCESS;
+		} else if (args.has_positional()) {
 			Vector<const char *> start_args;
 			ObjectIdentity * start = nullptr;
 			for (auto & bin : args.get_positional()) {
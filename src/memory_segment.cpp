@@ -5,8 +5,10 @@
 #include "memory_segment.hpp"
 
 #include <dlh/log.hpp>
+#include <dlh/math.hpp>
 
 #include "object/base.hpp"
+#include "thread_scan.hpp"
 #include "loader.hpp"
 
 
@@ -26,6 +28,12 @@ MemorySegment::MemorySegment(const Object & object, size_t target_offset, size_t
   : source{object, 0, 0 },
 	target{base, target_offset, target_size, PROT_READ | PROT_WRITE, PROT_NONE, -1, 0, false, MEMSEG_NOT_MAPPED} {}
 
+MemorySegment::MemorySegment(const Object & object, size_t target_offset, size_t target_size, int protection, uintptr_t base)
+  : source{object, 0, 0 },
+	target{base, target_offset, target_size, protection, PROT_NONE, -1, 0, false, object.file.flags.premapped ? MEMSEG_MAPPED : MEMSEG_NOT_MAPPED} {
+		assert((target.address() % Page::SIZE) == 0);
+	}
+
 
 MemorySegment::~MemorySegment() {
 	unmap();
@@ -36,6 +44,7 @@ bool MemorySegment::map() {
 	auto & identity = source.object.file;
 	const bool writable = (target.protection & PROT_WRITE) != 0;
 	bool copy = source.object.data.fd < 0
+	         || !fragments.empty()
 	         || (source.size > 0 && (source.offset % Page::SIZE) != (target.address() % Page::SIZE))
 	         || writable
 	         || target.relro;
@@ -45,11 +54,12 @@ bool MemorySegment::map() {
 	off_t offset = 0;
 	int protection = target.protection | (copy || writable || target.relro ? PROT_WRITE : 0);
 
-	if (writable && source.object.use_data_alias()) {
+	if ((writable || target.relro) && source.object.use_data_alias()) {
 		// Shared memory for updatable writable sections (if set, it is already initialized)
+		// and relocation read-only sections (version specific, allowing updates using a writable alias)
 		if ((copy = (target.fd == -1))) {
-			// Only first version
-			assert(source.object.file_previous == nullptr);
+			// Only first version (for writable sections)
+			assert(target.relro || source.object.file_previous == nullptr);
 			// Create new shared memory
 			if ((target.fd = shmemfd()) == -1)
 				return false;
@@ -95,14 +105,24 @@ bool MemorySegment::map() {
 		LOG_DEBUG << "Copy " << source.size << " Bytes from " << reinterpret_cast<void*>(source.offset) << " to "  << reinterpret_cast<void*>(target.address()) << endl;
 		Memory::copy(target.address(), source.object.data.addr + source.offset, source.size);
 	}
+	if (copy) {
+		for (const auto & fragment : fragments) {
+			assert(fragment.target_offset >= target.offset && fragment.target_offset + fragment.size <= target.offset + target.size);
+			Memory::copy(target.base + fragment.target_offset, source.object.data.addr + fragment.source_offset, fragment.size);
+		}
+		if (!fragments.empty())
+			LOG_DEBUG << "Copied " << fragments.size() << " packed sections to " << reinterpret_cast<void*>(target.address()) << endl;
+	}
 
 	target.status = MEMSEG_MAPPED;
 	return true;
 }
 
 static const int flags_privanon = MAP_ANONYMOUS | MAP_PRIVATE;
-uintptr_t MemorySegment::compose() {
-	if (buffer == 0) {
+uintptr_t MemorySegment::compose(uintptr_t address, size_t size) {
+	if (alias != 0) {
+		return alias + (target.offset % Page::SIZE);
+	} else if (buffer == 0) {
 		// Memory segment must be mapped
 		if (target.status != MEMSEG_MAPPED) {
 			if (!map())
@@ -116,41 +136,118 @@ uintptr_t MemorySegment::compose() {
 		if (!source.object.file.loader.process_started && Syscall::mprotect(target.page_start(), target.page_size(), target.effective_protection | PROT_WRITE).success()) {
 			target.effective_protection |= PROT_WRITE;
 			return target.address();
-		// Create anonymous writable mapping with same size as source
-		} else if (auto mmap = Syscall::mmap(target.page_start() & (~0x400000000000), target.page_size(), PROT_READ | PROT_WRITE, flags_privanon, -1, 0)) {
-			// Duplicate full pages (just for debugging)
-			buffer = Memory::copy(mmap.value(), target.page_start(), target.page_size());
+		// Shared memory: Create writable alias, changes are directly visible in target
+		} else if (target.fd != -1) {
+			if (auto mmap = Syscall::mmap(0, target.page_size(), PROT_READ | PROT_WRITE, MAP_SHARED, target.fd, 0)) {
+				alias = mmap.value();
+				LOG_DEBUG << "Created writable alias at " << reinterpret_cast<void*>(alias) << " for " << reinterpret_cast<void*>(target.page_start()) << " (" << target.page_size() << " Bytes, fd " << target.fd << ")" << endl;
+				return alias + (target.offset % Page::SIZE);
+			} else {
+				LOG_WARNING << "Mapping writable alias for " << reinterpret_cast<void*>(target.page_start()) << " (fd " << target.fd << ") failed: " << mmap.error_message() << " -- using back buffer" << endl;
+			}
+		}
+		// Reserve anonymous writable mapping with same size as source (pages will be copied on demand)
+		if (auto mmap = Syscall::mmap(target.page_start() & (~0x400000000000), target.page_size(), PROT_READ | PROT_WRITE, flags_privanon | MAP_NORESERVE, -1, 0)) {
+			buffer = mmap.value();
+			buffer_pages.clear();
+			for (size_t p = 0; p < target.page_size() / Page::SIZE; p++)
+				buffer_pages.push_back(false);
 			LOG_DEBUG << "Created compose back buffer at " << reinterpret_cast<void*>(buffer) << " for " << reinterpret_cast<void*>(target.page_start()) << " (" << target.page_size() << " Bytes)" << endl;
 		} else {
 			LOG_ERROR << "Mapping back buffer for " << reinterpret_cast<void*>(target.page_start()) << " (" << target.page_size() << " Bytes) failed: " << mmap.error_message() << endl;
+			return 0;
 		}
 	}
+	compose_pages(address, size);
 	return buffer + (target.offset % Page::SIZE);
 }
 
+void MemorySegment::compose_pages(uintptr_t address, size_t size) {
+	assert(buffer != 0);
+	// Determine page range (whole segment if no address is given)
+	size_t first = 0;
+	size_t last = buffer_pages.size();
+	if (address != 0) {
+		assert(address >= target.page_start() && address < target.page_end());
+		first = (address - target.page_start()) / Page::SIZE;
+		last = Math::min(last, (Math::align_up(address + Math::max(size, static_cast<size_t>(1)), Page::SIZE) - target.page_start()) / Page::SIZE);
+	}
+	// Copy target contents of pages not composed yet
+	for (size_t p = first; p < last; p++)
+		if (!buffer_pages[p]) {
+			Memory::copy(buffer + p * Page::SIZE, target.page_start() + p * Page::SIZE, Page::SIZE);
+			buffer_pages[p] = true;
+		}
+}
+
 bool MemorySegment::finalize(bool force) {
+	if (alias != 0) {
+		// Changes are already visible, remove alias
+		if (auto munmap = Syscall::munmap(alias, target.page_size()); munmap.failed())
+			LOG_WARNING << "Unmapping writable alias " << reinterpret_cast<void*>(alias) << " (" << target.page_size() << " Bytes) failed: " << munmap.error_message() << endl;
+		else
+			LOG_INFO << "Updated " << reinterpret_cast<void*>(target.page_start()) << " (" << target.page_size() << " Bytes) of " << source.object << " using writable alias (shared mapping)" << endl;
+		alias = 0;
+	}
+
 	if (!force && target.status == MEMSEG_INACTIVE) {
 		LOG_WARNING << "Memory segment " << reinterpret_cast<void*>(target.page_start()) << " (" << target.page_size() << " Bytes) is currently disabled, hence ignoring finalize request" << endl;
 		return true;
 	} else if (buffer != 0) {
 		bool result = true;
-		// Adjust permissions
-		if (auto mprotect = Syscall::mprotect(buffer, target.page_size(), target.protection)) {
-			target.effective_protection = target.protection;
-		} else {
-			LOG_WARNING << "Unable to adjust protection for " << reinterpret_cast<void*>(target.page_start()) << " (" << target.page_size() << " Bytes) of " << source.object << ": " << mprotect.error_message() << endl;
-			result = false;
+		size_t pages = target.page_size() / Page::SIZE;
+		// Disabled segments have a full copy in the buffer
+		if (target.status == MEMSEG_INACTIVE) {
+			buffer_pages.clear();
+			for (size_t p = 0; p < pages; p++)
+				buffer_pages.push_back(true);
 		}
 
-		// Remap
-		if (auto mremap = Syscall::mremap(buffer, target.page_size(), target.page_size(), MREMAP_MAYMOVE | MREMAP_FIXED, target.page_start())) {
-			target.flags = flags_privanon;
-			buffer = 0;
-			LOG_INFO << "Updated " << reinterpret_cast<void*>(target.page_start()) << " (" << target.page_size() << " Bytes) of " << source.object << " with composite back buffer (private mapping)" << endl;
+		// Replace only composed pages (in consecutive ranges)
+		size_t replaced = 0;
+		for (size_t p = 0; p < pages;) {
+			if (p >= buffer_pages.size() || !buffer_pages[p]) {
+				p++;
+				continue;
+			}
+			size_t n = 1;
+			while (p + n < pages && buffer_pages[p + n])
+				n++;
+
+			uintptr_t from = buffer + p * Page::SIZE;
+			uintptr_t to = target.page_start() + p * Page::SIZE;
+			size_t len = n * Page::SIZE;
+			// Adjust permissions
+			if (auto mprotect = Syscall::mprotect(from, len, target.protection); mprotect.failed()) {
+				LOG_WARNING << "Unable to adjust protection for " << reinterpret_cast<void*>(to) << " (" << len << " Bytes) of " << source.object << ": " << mprotect.error_message() << endl;
+				result = false;
+			}
+			// Remap
+			if (auto mremap = Syscall::mremap(from, len, len, MREMAP_MAYMOVE | MREMAP_FIXED, to); mremap.failed()) {
+				LOG_ERROR << "Remapping " << len << " Bytes at " << reinterpret_cast<void*>(to) << " failed: " << mremap.error_message() << endl;
+				result = false;
+			}
+			replaced += n;
+			p += n;
+		}
+
+		// Release remaining (untouched) buffer pages
+		if (replaced < pages) {
+			if (auto munmap = Syscall::munmap(buffer, target.page_size()); munmap.failed())
+				LOG_WARNING << "Unmapping back buffer " << reinterpret_cast<void*>(buffer) << " failed: " << munmap.error_message() << endl;
+			// Unmodified pages need to be protected as well
+			if (target.effective_protection != target.protection)
+				for (size_t p = 0; p < pages; p++)
+					if (!buffer_pages[p])
+						Syscall::mprotect(target.page_start() + p * Page::SIZE, Page::SIZE, target.protection);
 		} else {
-			LOG_ERROR << "Protecting " << target.page_size() << " Bytes at " << reinterpret_cast<void*>(target.page_start()) << " failed: " << mremap.error_message() << endl;
-			result = false;
+			// All pages are private anonymous memory now
+			target.flags = flags_privanon;
 		}
+		target.effective_protection = target.protection;
+		buffer = 0;
+		buffer_pages.clear();
+		LOG_INFO << "Updated " << replaced << " of " << pages << " pages at " << reinterpret_cast<void*>(target.page_start()) << " of " << source.object << " with composite back buffer (private mapping)" << endl;
 		return result;
 	} else if (target.status == MEMSEG_NOT_MAPPED) {
 		LOG_WARNING << "Cannot protect " << reinterpret_cast<void*>(target.page_start()) << " (" << target.page_size() << " Bytes) of " << source.object << " since it is not mapped!" << endl;
@@ -194,6 +291,12 @@ bool MemorySegment::disable() {
 				// Create private mapping
 				if (compose() == 0)
 					return false;
+				// Shared memory segments are composed via alias (without back buffer)
+				if (buffer == 0) {
+					LOG_ERROR << "Memory segment " << reinterpret_cast<void*>(target.page_start()) << " (" << target.page_size() << " Bytes) is shared memory and cannot be disabled!" << endl;
+					finalize();
+					return false;
+				}
 				// save old memory address
 				page_start = buffer;
 				// Set private mapping
@@ -266,6 +369,16 @@ bool MemorySegment::unmap() {
 			if (buffer != 0) {
 				Syscall::munmap(buffer, target.page_size());
 				buffer = 0;
+				buffer_pages.clear();
+			}
+			if (alias != 0) {
+				Syscall::munmap(alias, target.page_size());
+				alias = 0;
+			}
+			// Shared memory of relocation read-only sections is version specific
+			if (target.relro && target.fd != -1) {
+				Syscall::close(target.fd);
+				target.fd = -1;
 			}
 			target.status = MEMSEG_NOT_MAPPED;
 			target.effective_protection = PROT_NONE;
@@ -334,6 +447,116 @@ int MemorySegment::shmemdup() {
 }
 
 
+bool MemorySegment::privatize() {
+	if (target.snapshot) {
+		return true;
+	} else if (target.status != MEMSEG_MAPPED || target.fd == -1 || target.relro) {
+		LOG_WARNING << "Cannot privatize memory at " << reinterpret_cast<void*>(target.page_start()) << " since it is not mapped shared data!" << endl;
+		return false;
+	}
+
+	// Replace shared by private mapping of the same file -- contents stay the same
+	if (auto mmap = Syscall::mmap(target.page_start(), target.page_size(), target.effective_protection, MAP_PRIVATE | MAP_FIXED, target.fd, 0)) {
+		target.snapshot = true;
+		LOG_DEBUG << "Privatized shared memory at " << reinterpret_cast<void*>(target.page_start()) << " (" << target.page_size() << " Bytes, fd " << target.fd << ")" << endl;
+		return true;
+	} else {
+		LOG_ERROR << "Privatizing shared memory at " << reinterpret_cast<void*>(target.page_start()) << " (" << target.page_size() << " Bytes) failed: " << mmap.error_message() << endl;
+		return false;
+	}
+}
+
+bool MemorySegment::detach() {
+	if (target.fd == -1) {
+		return true;
+	} else if (target.status != MEMSEG_MAPPED || !target.relro) {
+		LOG_WARNING << "Cannot detach memory at " << reinterpret_cast<void*>(target.page_start()) << " since it is not mapped relocation read-only data!" << endl;
+		return false;
+	}
+
+	// Private anonymous copy of the current contents (the segment is read-only, hence no concurrent writes)
+	if (auto mmap = Syscall::mmap(NULL, target.page_size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0); mmap.failed()) {
+		LOG_ERROR << "Mapping " << target.page_size() << " Bytes for private copy failed: " << mmap.error_message() << endl;
+	} else {
+		Memory::copy(mmap.value(), target.page_start(), target.page_size());
+		if (auto mprotect = Syscall::mprotect(mmap.value(), target.page_size(), target.effective_protection); mprotect.failed()) {
+			LOG_ERROR << "Protecting private copy at " << reinterpret_cast<void*>(mmap.value()) << " failed: " << mprotect.error_message() << endl;
+		} else if (auto mremap = Syscall::mremap(mmap.value(), target.page_size(), target.page_size(), MREMAP_MAYMOVE | MREMAP_FIXED, target.page_start()); mremap.failed()) {
+			LOG_ERROR << "Replacing shared memory at " << reinterpret_cast<void*>(target.page_start()) << " failed: " << mremap.error_message() << endl;
+		} else {
+			LOG_DEBUG << "Detached relocation read-only memory at " << reinterpret_cast<void*>(target.page_start()) << " from shared memory (fd " << target.fd << ")" << endl;
+			// Further updates will be composed in a back buffer
+			Syscall::close(target.fd);
+			target.fd = -1;
+			return true;
+		}
+		Syscall::munmap(mmap.value(), target.page_size());
+	}
+	return false;
+}
+
+int MemorySegment::share() {
+	if (!target.snapshot)
+		return target.fd;
+
+	// Create new shared memory with the current (private) contents
+	int tmpfd = shmemfd();
+	if (tmpfd == -1)
+		return -1;
+	if (auto ftruncate = Syscall::ftruncate(tmpfd, static_cast<off_t>(target.page_size())); ftruncate.failed()) {
+		LOG_ERROR << "Setting memfd size failed: " << ftruncate.error_message() << endl;
+		Syscall::close(tmpfd);
+		return -1;
+	}
+
+	// Writes to the private memory between copy and replacement would get lost, hence the main process is stopped
+	// (unless called from the main process itself, i.e. without a helper thread)
+	pid_t pid = source.object.file.loader.pid;
+	bool stop = Syscall::getpid() != pid;
+	if (stop) {
+		Syscall::kill(pid, SIGSTOP);
+		if (!ThreadScan::stopped(pid)) {
+			LOG_ERROR << "Unable to stop process " << pid << " for sharing memory at " << reinterpret_cast<void*>(target.page_start()) << endl;
+			Syscall::kill(pid, SIGCONT);
+			Syscall::close(tmpfd);
+			return -1;
+		}
+	}
+
+	bool success = false;
+	if (auto mmap = Syscall::mmap(NULL, target.page_size(), PROT_WRITE, MAP_SHARED, tmpfd, 0); mmap.failed()) {
+		LOG_ERROR << "Mapping of memfd failed: " << mmap.error_message() << endl;
+	} else {
+		Memory::copy(mmap.value(), target.page_start(), target.page_size());
+		if (auto munmap = Syscall::munmap(mmap.value(), target.page_size()); munmap.failed())
+			LOG_WARNING << "Unmapping " << reinterpret_cast<void*>(mmap.value()) << " (" << target.page_size() << " Bytes) failed: " << munmap.error_message() << endl;
+		if (auto fcntl = Syscall::fcntl(tmpfd, F_ADD_SEALS, F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL); fcntl.failed())
+			LOG_WARNING << "Sealing shared memory failed: " << fcntl.error_message() << endl;
+
+		// Replace private mapping
+		if (auto remap = Syscall::mmap(target.page_start(), target.page_size(), target.effective_protection, MAP_SHARED | MAP_FIXED, tmpfd, 0); remap.failed())
+			LOG_ERROR << "Sharing memory at " << reinterpret_cast<void*>(target.page_start()) << " (" << target.page_size() << " Bytes) failed: " << remap.error_message() << endl;
+		else
+			success = true;
+	}
+
+	// Continue main process
+	if (stop)
+		Syscall::kill(pid, SIGCONT);
+
+	if (success) {
+		LOG_DEBUG << "Replaced snapshot (fd " << target.fd << ") of private memory at " << reinterpret_cast<void*>(target.page_start()) << " by shared memory (fd " << tmpfd << ")" << endl;
+		Syscall::close(target.fd);
+		target.fd = tmpfd;
+		target.snapshot = false;
+		return tmpfd;
+	}
+
+	Syscall::close(tmpfd);
+	return -1;
+}
+
+
 int MemorySegment::shmemfd() const {
 	// Create shared memory for data
 	StringStream<NAME_MAX + 1> shdatastr;
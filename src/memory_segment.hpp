@@ -5,6 +5,7 @@
 #pragma once
 
 #include <dlh/assert.hpp>
+#include <dlh/container/vector.hpp>
 #include <dlh/string.hpp>
 #include <dlh/syscall.hpp>
 #include <dlh/page.hpp>
@@ -65,6 +66,9 @@ struct MemorySegment {
 		/*! \brief Current mapping status */
 		enum Status status;
 
+		/*! \brief Shared memory is mapped private (copy-on-write), file contains only a snapshot */
+		bool snapshot = false;
+
 		/*! \brief get memory address */
 		uintptr_t address() const {
 			return base + offset;
@@ -100,6 +104,27 @@ struct MemorySegment {
 	/* Back buffer */
 	uintptr_t buffer = 0;
 
+	/*! \brief Pages of back buffer containing a copy of the target (only these pages will be replaced on finalize) */
+	Vector<bool> buffer_pages;
+
+	/*! \brief Writable alias of shared memory (for non-writable segments with memory file descriptor) */
+	uintptr_t alias = 0;
+
+	/*! \brief Part of the source copied into the target (for packed sections) */
+	struct Fragment {
+		/*! \brief start offset in file */
+		uintptr_t source_offset;
+
+		/*! \brief length */
+		size_t size;
+
+		/*! \brief target offset */
+		uintptr_t target_offset;
+	};
+
+	/*! \brief Contents of packed sections (copied on mapping) */
+	Vector<Fragment> fragments;
+
 	/*! \brief Constructor for Segments */
 	MemorySegment(const Object & object, const Elf::Segment & segment, uintptr_t base = 0, uintptr_t offset_delta = 0);
 
@@ -109,11 +134,18 @@ struct MemorySegment {
 	/*! \brief Constructor for pure BSS */
 	MemorySegment(const Object & object, size_t target_offset, size_t target_size, uintptr_t base = 0);
 
+	/*! \brief Constructor for packed sections (contents are assigned as fragments) */
+	MemorySegment(const Object & object, size_t target_offset, size_t target_size, int protection, uintptr_t base);
+
 	/*! \brief Destructor (clean up) */
 	~MemorySegment();
 
-	/*! \brief Allocate/get address of temporary (back) buffer to modify contents offline */
-	uintptr_t compose();
+	/*! \brief Allocate/get address of temporary (back) buffer to modify contents offline
+	 * \param address start address (in target) of the area to be modified (0 for the whole segment)
+	 * \param size size of the area to be modified
+	 * \return buffer address corresponding to the (unaligned) target start address
+	 */
+	uintptr_t compose(uintptr_t address = 0, size_t size = 0);
 
 	/*! \brief Helper to get pointer in compose buffer corresponding to an active address */
 	template<typename T>
@@ -139,10 +171,29 @@ struct MemorySegment {
 	/*! \brief duplicate memory fd for this segment */
 	int shmemdup();
 
+	/*! \brief map shared memory private (copy-on-write, e.g. for forking) -- the file is kept as snapshot
+	 * \note only valid if no other segment maps the same memory file
+	 */
+	bool privatize();
+
+	/*! \brief replace shared memory of a relocation read-only segment by a private anonymous copy (e.g. in a forked child)
+	 * \note the memory file is closed, further updates of the segment use the compose back buffer
+	 */
+	bool detach();
+
+	/*! \brief get memory fd for this segment, replacing a snapshot by a new shared memory with the current contents
+	 * \note the main process is stopped while replacing the snapshot (to prevent lost writes)
+	 * \return memory file descriptor or -1 on error
+	 */
+	int share();
+
 	/*! \brief dump memory to log */
 	void dump(Log::Level level = Log::TRACE) const;
 
  private:
 	/*! \brief create shared memory fd for this segment */
 	int shmemfd() const;
+
+	/*! \brief copy target pages of the given range into the back buffer (if not already done) */
+	void compose_pages(uintptr_t address, size_t size);
 };
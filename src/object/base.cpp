@@ -15,6 +15,8 @@
 #include "object/executable.hpp"
 #include "object/relocatable.hpp"
 
+#include "bean_interface.hpp"
+#include "update_plan.hpp"
 #include "loader.hpp"
 
 
@@ -37,6 +39,9 @@ Object::~Object() {
 	if (debug_hash != nullptr)
 		Memory::free(debug_hash);
 
+	if (update_plan != nullptr)
+		delete update_plan;
+
 	// Remove this version from list
 	if (file.current == this) {
 		file.current = file_previous;
@@ -56,6 +61,9 @@ Object::~Object() {
 	// Reset adress checker
 	file.loader.reset_address(base);
 
+	// Drop references in lookup caches
+	file.loader.changed();
+
 	if (auto unmap = Syscall::munmap(data.addr, data.size); unmap.failed()) {
 		LOG_ERROR << "Unmapping data from " << *this << " failed: " << unmap.error_message() << endl;
 	}
@@ -67,6 +75,15 @@ Object::~Object() {
 	// TODO: unmap file.data?
 }
 
+bool Object::calculate_binary_hash() {
+	if (!binary_hash) {
+		LOG_INFO << "Calculate Binary hash of " << *this << endl;
+		Profiler::Scope profile{file.loader.profiler, Profiler::PHASE_BEAN, file.name.str, version()};
+		binary_hash.emplace(*this, debug_symbols, BeanInterface::flags(file.loader.config.update_mode >= Loader::Config::UPDATE_MODE_CODEREL));
+	}
+	return binary_hash.has_value();
+}
+
 const char * Object::query_debug_hash() {
 	// Query for DWARF hash, if corresponding socket is connected)
 	if (debug_hash == nullptr) {
@@ -142,7 +159,25 @@ bool Object::finalize() const {
 	return success;
 }
 
+/*! \brief sanitize uprobe event name (only alphanumeric characters and underscore allowed)
+ * \param name event name (will be modified)
+ * \param size maximum length
+ */
+static void uprobe_name(char * name, size_t size) {
+	for (size_t i = 0; i < size ; i++)
+		if (name[i] == '\0')
+			break;
+		else if ((name[i] < 'a' || name[i] > 'z') && (name[i] < 'A' || name[i] > 'Z') && (name[i] < '0' || name[i] > '9'))
+			name[i] = '_';
+}
+
 bool Object::disable() const {
+	// Sections borrowed by a newer version are still live code (no outdated access)
+	if (borrowed > 0 && file.loader.config.detect_outdated != Loader::Config::DETECT_OUTDATED_DISABLED) {
+		LOG_INFO << "Memory of outdated " << *this << " is used by " << borrowed << " newer version(s) -- no access detection" << endl;
+		return false;
+	}
+
 	switch (file.loader.config.detect_outdated) {
 		case Loader::Config::DETECT_OUTDATED_DISABLED:
 			return false;
@@ -159,10 +194,12 @@ bool Object::disable() const {
 		case Loader::Config::DETECT_OUTDATED_VIA_UPROBES:
 		case Loader::Config::DETECT_OUTDATED_WITH_DEPS_VIA_UPROBES:
 		 {
-			if (!file.current->binary_hash) {
+			// Changed symbols are either taken from the update plan or by comparing the binary hashes
+			const UpdatePlan * plan = file.current->file_previous == this ? file.current->update_plan : nullptr;
+			if (plan == nullptr && !file.current->calculate_binary_hash()) {
 				LOG_WARNING << *(file.current) << " has no binary hash, hence no uprobe detection possible!" << endl;
 				return false;
-			} else if (!this->binary_hash) {
+			} else if (plan == nullptr && !this->binary_hash) {
 				LOG_WARNING << *this << " has no binary hash, hence no uprobe detection possible!" << endl;
 				return false;
 			} else if (data.fd < 0) {
@@ -184,31 +221,33 @@ bool Object::disable() const {
 				OutputStream<1024> uprobe_events(fd.value());
 				char name[65];
 				BufferStream name_stream(name, 65);
-				const auto diff = binary_hash->diff(*(file.current->binary_hash), file.loader.config.detect_outdated == Loader::Config::DETECT_OUTDATED_WITH_DEPS_VIA_UPROBES, static_cast<Bean::ComparisonMode>(file.loader.config.relax_comparison));
 				size_t uprobes = 0;
-				for (const auto & d : diff) {
-					if (d.section.executable) {
-						name_stream.clear();
-						// set name
-						name_stream << file.name << "_v" << dec << version() << '_';
-						if (d.name != nullptr)
-							name_stream << d.name;
-						else
-							continue;  // name_stream << "0x" << hex << d.address; -- but results to Error 524
-						name_stream.str();
-						// sanitize name
-						for (size_t i = 0; i < 65 ; i++)
-							if (name[i] == '\0')
-								break;
-							else if ((name[i] < 'a' || name[i] > 'z') && (name[i] < 'A' || name[i] > 'Z') && (name[i] < '0' || name[i] > '9'))
-								name[i] = '_';
-
-						// write to uprove
-						uprobe_events << "p:" << name << ' ' << path << ":0x" << hex << d.address << endl;
-						uprobe_events.flush();
-						uprobes++;
-						LOG_DEBUG << "adding uprobe 'p:" << name << ' ' << path << ":0x" << hex << d.address << '\'' << endl;
-					}
+				auto add_uprobe = [&](const char * sym_name, uintptr_t address) {
+					name_stream.clear();
+					// set name
+					name_stream << file.name << "_v" << dec << version() << '_';
+					if (sym_name != nullptr)
+						name_stream << sym_name;
+					else
+						return;  // name_stream << "0x" << hex << address; -- but results to Error 524
+					name_stream.str();
+					uprobe_name(name, 65);
+
+					// write to uprove
+					uprobe_events << "p:" << name << ' ' << path << ":0x" << hex << address << endl;
+					uprobe_events.flush();
+					uprobes++;
+					LOG_DEBUG << "adding uprobe 'p:" << name << ' ' << path << ":0x" << hex << address << '\'' << endl;
+				};
+				if (plan != nullptr) {
+					for (auto * d = plan->outdated_begin(); d != plan->outdated_end(); ++d)
+						if (d->executable != 0)
+							add_uprobe(plan->name(*d), d->address);
+				} else {
+					const auto diff = binary_hash->diff(*(file.current->binary_hash), file.loader.config.detect_outdated == Loader::Config::DETECT_OUTDATED_WITH_DEPS_VIA_UPROBES, static_cast<Bean::ComparisonMode>(file.loader.config.relax_comparison));
+					for (const auto & d : diff)
+						if (d.section.executable)
+							add_uprobe(d.name, d.address);
 				}
 
 				Syscall::close(fd.value());
@@ -234,8 +273,75 @@ bool Object::disable() const {
 	}
 }
 
+bool Object::outdated_access() const {
+	switch (file.loader.config.detect_outdated) {
+		case Loader::Config::DETECT_OUTDATED_VIA_USERFAULTFD:
+			// Userfault handler reactivates accessed segments
+			for (auto & seg : memory_map)
+				if (seg.target.status == MemorySegment::MEMSEG_REACTIVATED)
+					return true;
+			return false;
+
+		case Loader::Config::DETECT_OUTDATED_VIA_UPROBES:
+		case Loader::Config::DETECT_OUTDATED_WITH_DEPS_VIA_UPROBES:
+		 {
+			// Event name prefix of uprobes installed by disable()
+			char prefix[65];
+			BufferStream prefix_stream(prefix, 65);
+			prefix_stream << file.name << "_v" << dec << version() << '_';
+			prefix_stream.str();
+			uprobe_name(prefix, 65);
+			size_t prefix_len = String::len(prefix);
+
+			auto fd = Syscall::open("/sys/kernel/debug/tracing/uprobe_profile", O_RDONLY);
+			if (fd.failed()) {
+				LOG_WARNING << "Opening /sys/kernel/debug/tracing/uprobe_profile for " << *this << " failed: " << fd.error_message() << endl;
+				return true;
+			}
+
+			// Each line contains path, event name and number of hits
+			bool accessed = false;
+			char buf[4096];
+			size_t len = 0;
+			while (!accessed) {
+				auto read = Syscall::read(fd.value(), buf + len, sizeof(buf) - len - 1);
+				if (read.failed() || read.value() <= 0)
+					break;
+				len += read.value();
+				buf[len] = '\0';
+				char * line = buf;
+				for (char * end; !accessed && (end = const_cast<char*>(String::find(line, '\n'))) != nullptr; line = end + 1) {
+					*end = '\0';
+					const char * token[3] = {};
+					size_t tokens = 0;
+					for (char * c = line; *c != '\0' && tokens < 3; c++)
+						if (*c == ' ' || *c == '\t')
+							*c = '\0';
+						else if (c == line || *(c - 1) == '\0')
+							token[tokens++] = c;
+					if (tokens == 3 && String::compare(token[1], prefix, prefix_len) == 0 && String::compare(token[2], "0") != 0) {
+						LOG_INFO << "Uprobe " << token[1] << " of " << *this << " was hit " << token[2] << " times" << endl;
+						accessed = true;
+					}
+				}
+				// Keep incomplete line
+				len = buf + len - line;
+				Memory::move(buf, line, len);
+				if (len >= sizeof(buf) - 1)
+					len = 0;
+			}
+			Syscall::close(fd.value());
+			return accessed;
+		 }
+
+		default:
+			// No evidence available
+			return true;
+	}
+}
+
 size_t Object::version() const {
-	size_t v = 0;
+	size_t v = file.reclaimed.versions;
 	for (Object * p = file_previous; p != nullptr; p = p->file_previous)
 		v++;
 	return v;
@@ -246,7 +352,7 @@ uintptr_t Object::tls_address(uintptr_t value) const {
 	Thread * thread = Thread::self();
 	assert(thread != nullptr);
 
-	return file.loader.tls.get_addr(thread, file.tls_module_id) + file.tls_offset + value;
+	return file.loader.tls.get_addr(thread, file.tls_module_id) + value;
 }
 
 
@@ -23,6 +23,7 @@
 #include "memory_segment.hpp"
 
 struct ObjectIdentity;
+struct UpdatePlan;
 
 struct Object : public Elf {
 	/*! \brief Information about the object file (shared by all versions) */
@@ -84,6 +85,9 @@ struct Object : public Elf {
 	/*! \brief Binary symbol hashes */
 	Optional<Bean> binary_hash;
 
+	/*! \brief Precomputed update plan from previous version (if available) */
+	UpdatePlan * update_plan = nullptr;
+
 	/*! \brief DWARF hash contents (if enabled) */
 	const char * debug_hash = nullptr;
 
@@ -93,6 +97,12 @@ struct Object : public Elf {
 	/*! \brief Pointer to previous version */
 	Object * file_previous = nullptr;
 
+	/*! \brief Number of newer versions using memory (sections or data) of this version -- must not be reclaimed */
+	unsigned borrowed = 0;
+
+	/*! \brief Number of postponed attempts to reclaim this (outdated) version */
+	unsigned reclaim_attempts = 0;
+
 	/*! \brief create new object */
 	Object(ObjectIdentity & file, const Data & data);
 
@@ -102,6 +112,9 @@ struct Object : public Elf {
 	/*! \brief destroy object */
 	virtual ~Object();
 
+	/*! \brief Calculate binary hash (if not done yet) */
+	bool calculate_binary_hash();
+
 	/*! \brief query debug hash */
 	const char * query_debug_hash();
 
@@ -135,21 +148,25 @@ struct Object : public Elf {
 	/*! \brief Update relocations */
 	virtual bool update() { return true; }
 
+	/*! \brief Will `update` modify machine code (with plain stores)? */
+	virtual bool update_writes_code() const { return false; }
+
 	/*! \brief Does this object use memory aliasing for data? */
 	virtual bool use_data_alias() const { return false; }
 
 	/*! \brief Helper to get pointer in compose buffer corresponding to an active address
 	 * \param pointer the address in object which should be modified (redirected)
 	 * \param mem_seg if pointer is set, the memory segment will be stored in it
+	 * \param size number of bytes to be modified (only the affected pages are composed)
 	 * \note memory_map must not be modified as long as `seg` is used!
 	 * \return pointer to the address in compositing buffer
 	 */
 	template<typename T>
-	T compose_pointer(T pointer, MemorySegment ** mem_seg = nullptr) {
+	T compose_pointer(T pointer, MemorySegment ** mem_seg = nullptr, size_t size = sizeof(uintptr_t)) {
 		auto ptr = reinterpret_cast<uintptr_t>(pointer);
 		for (auto & seg : memory_map)
 			if (seg.target.contains(ptr)) {
-				uintptr_t buffer = seg.compose();
+				uintptr_t buffer = seg.compose(ptr, size);
 				if (buffer == 0)
 					break;
 				if (mem_seg != nullptr)
@@ -168,12 +185,24 @@ struct Object : public Elf {
 		return true;
 	}
 
+	/*! \brief Finalisation method (run destructors) */
+	virtual bool deinitialize() {
+		return true;
+	}
+
 	/*! \brief Check if current object can patch a previous version */
 	virtual bool patchable() const { return false; }
 
-	/*! \brief Make this (old) object inactive */
+	/*! \brief Make this (old) object inactive
+	 * \note skipped while a newer version borrows its memory
+	 */
 	virtual bool disable() const;
 
+	/*! \brief Check if this (disabled) outdated version was accessed
+	 * \return `false` if the detection of outdated access has no evidence of execution
+	 */
+	bool outdated_access() const;
+
 	/*! \brief Get (internal) version = number of updates */
 	size_t version() const;
 
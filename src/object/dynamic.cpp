@@ -19,6 +19,8 @@
 #include "dynamic_resolve.hpp"
 #include "loader.hpp"
 #include "redirect.hpp"
+#include "tls_descriptor.hpp"
+#include "update_plan.hpp"
 
 ObjectDynamic::ObjectDynamic(ObjectIdentity & file, const Object::Data & data, bool position_independent)
   : ObjectExecutable{file, data},
@@ -150,6 +152,8 @@ bool ObjectDynamic::preload_libraries() {
 
 			case Elf::DT_SONAME:
 				soname = dyn.string();
+				if (file_previous == nullptr && file.soname == nullptr)
+					file.soname = String::duplicate(soname);
 				break;
 
 			case Elf::DT_RPATH:
@@ -169,10 +173,10 @@ bool ObjectDynamic::preload_libraries() {
 				 * 		It indicates that the shared object or executable contains code using a static thread-local storage scheme.
 				 * 		Implementations need not support any form of thread-local storage.
 				 *
-				 * However, it seems like glibc ignores it...
+				 * However, glibc ignores it and uses the surplus of the static TLS -- and so do we (if the block fits).
 				 */
-				if ((dyn.value() & Elf::DF_STATIC_TLS) != 0 && file_previous == nullptr && this->file.tls_module_id != 0 && file.loader.tls.gen > 0) {
-					LOG_WARNING << *this << " has a static TLS block which cannot be initialized dynamically (according to standard) - use preloading instead... However, we will initialize & load it anyway!" << endl;
+				if ((dyn.value() & Elf::DF_STATIC_TLS) != 0 && file_previous == nullptr && this->file.tls_module_id != 0 && this->file.tls_offset == 0 && file.loader.tls.gen > 0) {
+					LOG_WARNING << *this << " has a static TLS block which does not fit into the remaining static TLS surplus (increase glibc.rtld.optional_static_tls) - use preloading instead... However, we will initialize & load it anyway!" << endl;
 					// return false;
 				}
 				break;
@@ -196,6 +200,9 @@ bool ObjectDynamic::preload_libraries() {
 	flags.premapped = 0;
 	flags.updatable = file.loader.config.dynamic_update ? 1 : 0;
 
+	// Open the files of the needed libraries concurrently (creation remains in order)
+	Prefetch prefetch(file.loader, libs, this->rpath, this->runpath, file.ns, flags.updatable == 1 && file.loader.config.skip_identical);
+
 	for (auto & lib : libs) {
 		// Is lib excluded? TODO: Should be done with resolved path
 		if (file.loader.library_exclude.contains(lib)) {
@@ -253,8 +260,9 @@ bool ObjectDynamic::prepare() {
 		got[2] = reinterpret_cast<uintptr_t>(_dlresolve);
 
 		// Remainder for relocations
+		// (TLS descriptors are always resolved immediately)
 		for (const auto & reloc : dynamic_relocations_plt)
-			if (file.flags.bind_now == 1) {
+			if (file.flags.bind_now == 1 || reloc.type() == Elf::R_X86_64_TLSDESC) {
 				if (relocate(reloc, true, error) == nullptr && error)
 					break;
 			} else {
@@ -288,10 +296,8 @@ static bool update_redirect(uintptr_t from, uintptr_t to, size_t size, ObjectDat
 	}
 }
 
-static bool update_relocate(const Bean::SymbolRelocation & rel, uintptr_t to, const Bean::Symbol & target, ObjectData * objs) {
-	(void)to;
-	BeanInterface::Symbol bean_sym(target);
-	BeanInterface::Relocation bean_rel(objs->to, rel);
+template<typename S, typename R>
+static bool update_relocate(const S & bean_sym, const R & bean_rel, ObjectData * objs) {
 	const Relocator relocator{bean_rel, objs->from.global_offset_table};
 
 	MemorySegment * seg = nullptr;
@@ -306,13 +312,18 @@ static bool update_relocate(const Bean::SymbolRelocation & rel, uintptr_t to, co
 		LOG_INFO << "Relocating " << bean_sym.name() << " in " << objs->from << " at " << reinterpret_cast<void*>(relocator.address(objs->from.base)) << " with " << reinterpret_cast<void*>(value) <<  endl;
 
 		// if (relocator.is_copy() || relocator.read_value(this->base) != value)
-		auto r = relocator.fix_value_external(objs->from.base + (seg != nullptr ? seg->compose() - seg->target.address() : 0), bean_sym, value);
+		auto r = relocator.fix_value_external(objs->from.base + (seg != nullptr ? seg->compose(relocator.address(objs->from.base), sizeof(uintptr_t)) - seg->target.address() : 0), bean_sym, value);
 		return r != 0;
 	} else {
 		return false;
 	}
 }
 
+static bool update_relocate(const Bean::SymbolRelocation & rel, uintptr_t to, const Bean::Symbol & target, ObjectData * objs) {
+	(void)to;
+	return update_relocate(BeanInterface::Symbol(target), BeanInterface::Relocation(objs->to, rel), objs);
+}
+
 static void update_skip(uintptr_t from, uintptr_t to, const char * reason, ObjectData * objs) {
 	LOG_DEBUG << "Skipping " << objs->from << " at " << reinterpret_cast<void*>(from) << " (to " << objs->from  << " at " << reinterpret_cast<void*>(to) << ")";
 	if (reason != nullptr)
@@ -339,9 +350,16 @@ bool ObjectDynamic::update() {
 			flags |= BeanUpdate::FLAG_IGNORE_LOCAL_RELS;
 		BeanUpdate updater(flags);
 		for (auto * prev = file_previous; prev != nullptr; prev = prev->file_previous) {
-			assert(this->binary_hash && prev->binary_hash);
 			ObjectData data{*prev, *this};
-			updater.process<ObjectData, update_redirect, update_relocate, update_skip>(*(prev->binary_hash), *(this->binary_hash), prev->base, this->base, &data);
+			if (prev == file_previous && update_plan != nullptr) {
+				// Apply precomputed changes
+				for (auto * r = update_plan->redirects_begin(); r != update_plan->redirects_end(); ++r)
+					update_redirect(prev->base + r->from, this->base + r->to, r->size, &data);
+				for (auto * r = update_plan->relocations_begin(); r != update_plan->relocations_end(); ++r)
+					update_relocate(UpdatePlan::SymbolInterface(*update_plan, update_plan->target(*r)), UpdatePlan::RelocationInterface(*this, *r), &data);
+			} else if (this->calculate_binary_hash() && prev->calculate_binary_hash()) {
+				updater.process<ObjectData, update_redirect, update_relocate, update_skip>(*(prev->binary_hash), *(this->binary_hash), prev->base, this->base, &data);
+			}
 		}
 	}
 	return true;
@@ -359,6 +377,10 @@ void* ObjectDynamic::relocate(const Elf::Relocation & reloc, bool fix, bool & fa
 			break;
 		}
 
+	// TLS descriptors are not handled by the relocator
+	if (reloc.type() == Elf::R_X86_64_TLSDESC)
+		return relocate_tlsdesc(reloc, relocator.address(this->base + (seg != nullptr ? seg->compose(relocator.address(this->base), sizeof(TLSDescriptor::Descriptor)) - seg->target.address() : 0)), fatal);
+
 	// Detect changes in data relocation
 	Pair<int, uintptr_t> datarel_key{-1, 0};
 	if (seg != nullptr && file.loader.config.check_relocation_content && is_latest_version()) {
@@ -383,8 +405,10 @@ void* ObjectDynamic::relocate(const Elf::Relocation & reloc, bool fix, bool & fa
 	if (need_symbol_index == 0) {
 		// Local symbol
 		auto value = relocator.value_internal(this->base, 0, this->file.tls_module_id, this->file.tls_offset);
+		if (reloc.type() == Elf::R_X86_64_TPOFF64 && this->file.tls_offset == 0)
+			LOG_ERROR << "Initial-exec TLS access in " << *this << " requires static TLS, but its block is dynamic!" << endl;
 		if (relocator.is_copy() || (fix && relocator.read_value(this->base) != value)) {
-			auto r = relocator.fix_value_internal(this->base + (seg != nullptr ? seg->compose() - seg->target.address() : 0), value);
+			auto r = relocator.fix_value_internal(this->base + (seg != nullptr ? seg->compose(relocator.address(this->base), sizeof(uintptr_t)) - seg->target.address() : 0), value);
 			assert(r == value);
 			if (datarel_key.first != -1)
 				file.datarel_content[datarel_key] = r;
@@ -400,11 +424,14 @@ void* ObjectDynamic::relocate(const Elf::Relocation & reloc, bool fix, bool & fa
 			// Update / add symbol to cache
 			relocations.insert(reloc, symbol.value());
 			const auto & symobj = symbol->object();
+			file.add_symbol_dependency(symobj.file);
 
 			auto value = relocator.value_external(this->base, symbol.value(), symobj.base, 0, symobj.file.tls_module_id, symobj.file.tls_offset);
+			if (reloc.type() == Elf::R_X86_64_TPOFF64 && symobj.file.tls_offset == 0)
+				LOG_ERROR << "Initial-exec TLS access to " << need_symbol << " in " << *this << " requires static TLS, but the block of " << symobj << " is dynamic!" << endl;
 			LOG_TRACE << "Relocating " << need_symbol << " in " << *this << " with " << symbol->name() << " from " << symobj << " to " << reinterpret_cast<void*>(value) <<  endl;
 			if (relocator.is_copy() || (fix && relocator.read_value(this->base) != value)) {
-				auto r = relocator.fix_value_external(this->base + (seg != nullptr ? seg->compose() - seg->target.address() : 0), symbol.value(), value);
+				auto r = relocator.fix_value_external(this->base + (seg != nullptr ? seg->compose(relocator.address(this->base), sizeof(uintptr_t)) - seg->target.address() : 0), symbol.value(), value);
 				assert(r == value);
 				if (datarel_key.first != -1)
 					file.datarel_content[datarel_key] = r;
@@ -421,6 +448,37 @@ void* ObjectDynamic::relocate(const Elf::Relocation & reloc, bool fix, bool & fa
 	return nullptr;
 }
 
+void* ObjectDynamic::relocate_tlsdesc(const Elf::Relocation & reloc, uintptr_t target, bool & fatal) const {
+	auto & descriptor = *reinterpret_cast<TLSDescriptor::Descriptor *>(target);
+	auto need_symbol_index = reloc.symbol_index();
+	if (need_symbol_index == 0) {
+		// Local TLS block
+		if (!TLSDescriptor::set(descriptor, this->file, reloc.addend())) {
+			fatal = true;
+			return nullptr;
+		}
+	} else {
+		VersionedSymbol need_symbol(dynamic_symbols[need_symbol_index], get_version(dynamic_symbols.version(need_symbol_index)));
+		if (auto symbol = file.loader.resolve_symbol(need_symbol, file.ns, &file, file.flags.bind_deep == 1 ? Loader::RESOLVE_OBJECT_FIRST : Loader::RESOLVE_DEFAULT)) {
+			relocations.insert(reloc, symbol.value());
+			file.add_symbol_dependency(symbol->object().file);
+			LOG_TRACE << "Relocating TLS descriptor for " << need_symbol << " in " << *this << " with " << symbol->name() << " from " << symbol->object() << endl;
+			if (!TLSDescriptor::set(descriptor, symbol->object().file, symbol->value() + reloc.addend())) {
+				fatal = true;
+				return nullptr;
+			}
+		} else if (need_symbol.bind() == STB_WEAK) {
+			LOG_DEBUG << "Unable to resolve weak TLS symbol " << need_symbol << "..." << endl;
+			TLSDescriptor::set_undefined_weak(descriptor, reloc.addend());
+		} else {
+			LOG_ERROR << "Unable to resolve TLS symbol " << need_symbol << " for descriptor..." << file << endl;
+			fatal = true;
+			return nullptr;
+		}
+	}
+	return &descriptor;
+}
+
 bool ObjectDynamic::patchable() const {
 	if (file_previous == nullptr
 	 || file_previous->header.identification != this->header.identification
@@ -428,17 +486,23 @@ bool ObjectDynamic::patchable() const {
 	 || file_previous->header.version()      != this->header.version())
 		return false;
 
-	assert(file_previous->binary_hash && this->binary_hash);
 	LOG_INFO << "Checking if " << this->file << " can patch previous version..." << endl;
 
 	assert(file_previous == file.current);
 
 	// TODO: Check if TLS data size has changed
-	auto diff = binary_hash->diff(*(file_previous->binary_hash), file.loader.config.dependency_check, static_cast<Bean::ComparisonMode>(file.loader.config.relax_comparison));
-	LOG_DEBUG << "Found " << diff.size() << " differences in " << this->file << " (compared to the current version)" << endl;
-	uint16_t ignore = Bean::Symbol::Section::SECTION_RELRO | Bean::Symbol::Section::SECTION_EH_FRAME | Bean::Symbol::Section::SECTION_DYNAMIC;
+	bool patchable;
+	if (update_plan != nullptr) {
+		patchable = update_plan->patchable();
+		LOG_DEBUG << "Update plan lists " << (update_plan->changed_end() - update_plan->changed_begin()) << " differences in " << this->file << " (compared to the current version)" << endl;
+	} else {
+		assert(file_previous->binary_hash && this->binary_hash);
+		auto diff = binary_hash->diff(*(file_previous->binary_hash), file.loader.config.dependency_check, static_cast<Bean::ComparisonMode>(file.loader.config.relax_comparison));
+		LOG_DEBUG << "Found " << diff.size() << " differences in " << this->file << " (compared to the current version)" << endl;
+		patchable = Bean::patchable(diff);
+	}
 
-	if (!Bean::patchable(diff)) {
+	if (!patchable) {
 		LOG_WARNING << "New version of " << this->file << " has non-trivial changes in the data section..." << endl;
 		if (!file.loader.config.force_update)
 			return false;
@@ -512,3 +576,41 @@ bool ObjectDynamic::initialize(bool preinit) {
 	}
 	return true;
 }
+
+bool ObjectDynamic::deinitialize() {
+	LOG_DEBUG << "Deinitialize " << *this << endl;
+	uintptr_t fini = 0;
+	uintptr_t fini_array = 0;
+	size_t fini_array_size = 0;
+	for (const auto &dyn : dynamic_table) {
+		switch (dyn.tag()) {
+			case Elf::DT_FINI:
+				fini = dyn.value();
+				break;
+
+			case Elf::DT_FINI_ARRAY:
+				fini_array = dyn.value();
+				break;
+
+			case Elf::DT_FINI_ARRAYSZ:
+				fini_array_size = dyn.value();
+				break;
+
+			default:
+				continue;
+		}
+	}
+
+	// fini array (in reverse order)
+	if (fini_array != 0) {
+		auto * f = reinterpret_cast<void (**)()>(base + fini_array);
+		for (size_t i = fini_array_size / sizeof(void*); i > 0; i--)
+			f[i - 1]();
+	}
+
+	// fini func
+	if (fini != 0)
+		reinterpret_cast<void (*)()>(base + fini)();
+
+	return true;
+}
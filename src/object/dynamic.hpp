@@ -54,8 +54,18 @@ struct ObjectDynamic : public ObjectExecutable {
 		return relocate(reloc, fix, fatal);
 	}
 
+	/*! \brief Assign TLS descriptor (`R_X86_64_TLSDESC`)
+	 * \param reloc relocation
+	 * \param target (writable) address of descriptor
+	 * \param fatal set on unrecoverable error
+	 * \return address of descriptor or `nullptr` on error
+	 */
+	void* relocate_tlsdesc(const Elf::Relocation & reloc, uintptr_t target, bool & fatal) const;
+
 	bool initialize(bool preinit = false) override;
 
+	bool deinitialize() override;
+
  private:
 	Elf::DynamicTable dynamic_table;
 	Elf::SymbolTable dynamic_symbols;
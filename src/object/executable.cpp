@@ -65,10 +65,14 @@ bool ObjectExecutable::preload_segments(bool setup_relro) {
 			LOG_WARNING << "Load segements differ in " << file << " (" << this->memory_map.size() << " compared to " << prev_memory_map.size() <<  " in the current version) - unable to handle this yet" << endl;
 			return false;
 		} else {
-			// Copy Memory FD (for shared data)
+			// Copy Memory FD (for shared data, but not for version specific relocation read-only sections)
 			for (size_t m = 0; m < memory_map.size(); m++)
-				if (prev_memory_map[m].target.fd != -1)
+				if (prev_memory_map[m].target.fd != -1 && !prev_memory_map[m].target.relro) {
+					// Data privatized by fork has to be shared again
+					if (prev_memory_map[m].share() == -1)
+						return false;
 					memory_map[m].target.fd = prev_memory_map[m].target.fd;
+				}
 		}
 	}
 
@@ -10,8 +10,6 @@
 #include <dlh/xxhash.hpp>
 #include <dlh/utility.hpp>
 #include <dlh/syscall.hpp>
-#include <dlh/datetime.hpp>
-#include <dlh/stream/output.hpp>
 
 #include <bean/helper/debug_sym.hpp>
 
@@ -22,6 +20,7 @@
 #include "comp/glibc/patch.hpp"
 
 #include "loader.hpp"
+#include "update_plan.hpp"
 
 static bool supported(const Elf::Header * header) {
 	if (!header->valid()) {
@@ -80,14 +79,32 @@ void ObjectIdentity::hook_refresh() const {
 }
 
 
-Object * ObjectIdentity::load(uintptr_t addr, Elf::ehdr_type type) {
-	Object::Data data;
+Object * ObjectIdentity::load(uintptr_t addr, Elf::ehdr_type type, const Object::Data * prefetched) {
 	Object * object = nullptr;
+	uint64_t start = StatusInfo::now();
+	auto info = load_version(object, addr, type, true, prefetched);
+	status(info, StatusInfo::now() - start);
+
+	// Initial hook
+	if (hook.object == nullptr)
+		hook_refresh();
+
+	return object;
+}
+
+ObjectIdentity::Info ObjectIdentity::load_version(Object * & object, uintptr_t addr, Elf::ehdr_type type, bool prepare, const Object::Data * prefetched) {
+	Object::Data data;
+	if (prefetched != nullptr)
+		data = *prefetched;
 	// Open...
-	enum Info info = open(addr, data, type);
+	enum Info info;
+	{
+		Profiler::Scope profile{loader.profiler, Profiler::PHASE_OPEN, name.str};
+		info = open(addr, data, type);
+	}
 	if (info == INFO_CONTINUE_LOAD) {
 		// ... and create object
-		create(data, type).assign(object, info);
+		create(data, type, prepare).assign(object, info);
 		// Clean up on failure
 		if (object == nullptr && data.fd != -1) {
 			if (flags.premapped == 0)
@@ -97,14 +114,25 @@ Object * ObjectIdentity::load(uintptr_t addr, Elf::ehdr_type type) {
 			info = INFO_ERROR_INOTIFY;
 		}
 	}
+	return info;
+}
 
-	status(info);
 
-	// Initial hook
-	if (hook.object == nullptr)
-		hook_refresh();
+bool ObjectIdentity::discard() {
+	Object * o = current;
+	if (o == nullptr || o->file_previous == nullptr)
+		return false;
 
-	return object;
+	LOG_INFO << "Discarding " << *o << endl;
+	// Destructor will remove the version from the list
+	delete o;
+	assert(current != nullptr);
+
+	// Restore GLIBC specific stuff
+	base = current->base;
+	dynamic = current->dynamic_address();
+
+	return true;
 }
 
 static unsigned debug_counter = 0;
@@ -122,22 +150,28 @@ ObjectIdentity::Info ObjectIdentity::open(uintptr_t addr, Object::Data & data, E
 		assert(!path.empty());
 		assert(flags.premapped == 0);
 
-		// Open file
-		if (auto open = Syscall::open(path.str, O_RDONLY)) {
-			data.fd = open.value();
-		} else {
-			LOG_VERBOSE << "Opening " << *this << " failed: " << open.error_message() << endl;
-			return INFO_ERROR_OPEN;
-		}
+		// File already opened and mapped by prefetch worker?
+		uintptr_t mapped = data.addr;
+		if (mapped == 0) {
+			// Open file
+			if (auto open = Syscall::open(path.str, O_RDONLY)) {
+				data.fd = open.value();
+			} else {
+				LOG_VERBOSE << "Opening " << *this << " failed: " << open.error_message() << endl;
+				return INFO_ERROR_OPEN;
+			}
 
-		// Determine file size and inode
-		if (struct stat sb; auto fstat = Syscall::fstat(data.fd, &sb)) {
-			data.modification_time = sb.st_mtim;
-			data.size = sb.st_size;
+			// Determine file size and inode
+			if (struct stat sb; auto fstat = Syscall::fstat(data.fd, &sb)) {
+				data.modification_time = sb.st_mtim;
+				data.size = sb.st_size;
+			} else {
+				LOG_ERROR << "Stat file " << *this << " failed: " << fstat.error_message() << endl;
+				Syscall::close(data.fd);
+				return INFO_ERROR_STAT;
+			}
 		} else {
-			LOG_ERROR << "Stat file " << *this << " failed: " << fstat.error_message() << endl;
-			Syscall::close(data.fd);
-			return INFO_ERROR_STAT;
+			LOG_DEBUG << "Using prefetched " << *this << endl;
 		}
 
 		// Check if already loaded (using modification time)
@@ -145,6 +179,8 @@ ObjectIdentity::Info ObjectIdentity::open(uintptr_t addr, Object::Data & data, E
 			for (Object * obj = current; obj != nullptr; obj = obj->file_previous) {
 				if (obj->data.modification_time.tv_sec == data.modification_time.tv_sec && obj->data.modification_time.tv_nsec == data.modification_time.tv_nsec && obj->data.size == data.size) {
 					LOG_INFO << "Already loaded " << *this << " with same modification time -- abort loading..." << endl;
+					if (mapped != 0)
+						Syscall::munmap(mapped, data.size);
 					Syscall::close(data.fd);
 					return INFO_IDENTICAL_TIME;
 				}
@@ -152,50 +188,55 @@ ObjectIdentity::Info ObjectIdentity::open(uintptr_t addr, Object::Data & data, E
 		}
 
 		// Map file
-		if (auto mmap = Syscall::mmap(NULL, data.size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, data.fd, 0)) {
-			if (flags.immutable_source) {
-				data.addr = mmap.value();
+		if (mapped == 0) {
+			if (auto mmap = Syscall::mmap(NULL, data.size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, data.fd, 0)) {
+				mapped = mmap.value();
 			} else {
-				int new_data_fd = -1;
-				// In case a debugger is supported, we make our memory copy of the ELF accessible by gdb using procfs.
-				// For relocatable objects, this also provides a section table containing addresses and a fixed symbol table.
-				if (loader.config.debugger) {
-					StringStream<NAME_MAX + 9> dbgmemfd;
-					dbgmemfd << name << " (v" << (current != nullptr ? current->version() + 1 : 0) << ')';
-					const char * dbgmemfdstr = dbgmemfd.str();
-					if (auto memfd = Syscall::memfd_create(dbgmemfdstr, MFD_CLOEXEC)) {
-						new_data_fd = memfd.value();
-						if (auto ftruncate = Syscall::ftruncate(new_data_fd, static_cast<off_t>(data.size))) {
-							LOG_DEBUG << "Creating memory file for " << dbgmemfdstr << " at memfd " << new_data_fd << endl;
-						} else {
-							LOG_ERROR << "Allocating space for memory copy of " << dbgmemfdstr << " failed: " << ftruncate.error_message() << endl;
-							Syscall::close(new_data_fd);
-							new_data_fd = -1;
-						}
+				LOG_ERROR << "Mapping " << *this << " failed: " << mmap.error_message() << endl;
+				Syscall::close(data.fd);
+				return INFO_ERROR_MAP;
+			}
+		}
+
+		if (flags.immutable_source) {
+			data.addr = mapped;
+		} else {
+			int new_data_fd = -1;
+			// In case a debugger is supported, we make our memory copy of the ELF accessible by gdb using procfs.
+			// For relocatable objects, this also provides a section table containing addresses and a fixed symbol table.
+			if (loader.config.debugger) {
+				StringStream<NAME_MAX + 9> dbgmemfd;
+				dbgmemfd << name << " (v" << (current != nullptr ? current->version() + 1 : 0) << ')';
+				const char * dbgmemfdstr = dbgmemfd.str();
+				if (auto memfd = Syscall::memfd_create(dbgmemfdstr, MFD_CLOEXEC)) {
+					new_data_fd = memfd.value();
+					if (auto ftruncate = Syscall::ftruncate(new_data_fd, static_cast<off_t>(data.size))) {
+						LOG_DEBUG << "Creating memory file for " << dbgmemfdstr << " at memfd " << new_data_fd << endl;
 					} else {
-						LOG_ERROR << "Creating memory file " << dbgmemfdstr << " failed: " << memfd.error_message() << endl;
+						LOG_ERROR << "Allocating space for memory copy of " << dbgmemfdstr << " failed: " << ftruncate.error_message() << endl;
 						Syscall::close(new_data_fd);
 						new_data_fd = -1;
 					}
-				}
-
-				if (auto anon = Syscall::mmap(NULL, data.size, PROT_READ | PROT_WRITE, new_data_fd == -1 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_SHARED, new_data_fd, 0)) {
-					LOG_INFO << "Creating a full in-memory copy of " << *this << endl;
-					data.addr = Memory::copy(anon.value(), mmap.value(), data.size);
-					// cleaning up
-					Syscall::munmap(mmap.value(), data.size);
-					Syscall::close(data.fd);
-					data.fd = new_data_fd;
 				} else {
-					LOG_ERROR << "Mapping anonymous memory for " << *this << " failed: " << anon.error_message() << endl;
-					Syscall::close(data.fd);
-					return INFO_ERROR_MAP;
+					LOG_ERROR << "Creating memory file " << dbgmemfdstr << " failed: " << memfd.error_message() << endl;
+					Syscall::close(new_data_fd);
+					new_data_fd = -1;
 				}
 			}
-		} else {
-			LOG_ERROR << "Mapping " << *this << " failed: " << mmap.error_message() << endl;
-			Syscall::close(data.fd);
-			return INFO_ERROR_MAP;
+
+			if (auto anon = Syscall::mmap(NULL, data.size, PROT_READ | PROT_WRITE, new_data_fd == -1 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_SHARED, new_data_fd, 0)) {
+				LOG_INFO << "Creating a full in-memory copy of " << *this << endl;
+				data.addr = Memory::copy(anon.value(), mapped, data.size);
+				// cleaning up
+				Syscall::munmap(mapped, data.size);
+				Syscall::close(data.fd);
+				data.fd = new_data_fd;
+			} else {
+				LOG_ERROR << "Mapping anonymous memory for " << *this << " failed: " << anon.error_message() << endl;
+				Syscall::munmap(mapped, data.size);
+				Syscall::close(data.fd);
+				return INFO_ERROR_MAP;
+			}
 		}
 	} else {
 		data.addr = addr;
@@ -330,15 +371,22 @@ ObjectIdentity::~ObjectIdentity() {
 		delete current;
 		current = prev;
 	}
+
+	if (soname != nullptr)
+		Memory::free(const_cast<char *>(soname));
 }
 
 
-Pair<Object *, ObjectIdentity::Info> ObjectIdentity::create(Object::Data & data, Elf::ehdr_type type) {
+Pair<Object *, ObjectIdentity::Info> ObjectIdentity::create(Object::Data & data, Elf::ehdr_type type, bool prepare) {
 	// Hash file contents
 	if (flags.updatable && flags.skip_identical) {
-		XXHash64 datahash(name.hash);  // Name hash as seed
-		datahash.add(data.addr, data.size);
-		data.hash = datahash.hash();
+		// (unless already calculated by prefetch worker)
+		if (data.hash == 0) {
+			Profiler::Scope profile{loader.profiler, Profiler::PHASE_HASH, name.str};
+			XXHash64 datahash(name.hash);  // Name hash as seed
+			datahash.add(data.addr, data.size);
+			data.hash = datahash.hash();
+		}
 		LOG_DEBUG << "Elf " << *this << " has hash " << hex << data.hash << dec << endl;
 
 		// Check if already loaded (using hash)
@@ -407,6 +455,7 @@ Pair<Object *, ObjectIdentity::Info> ObjectIdentity::create(Object::Data & data,
 	if (flags.updatable == 1 && type != Elf::ET_REL) {
 		// Debug symbols
 		if (loader.config.find_debug_symbols) {
+			Profiler::Scope profile{loader.profiler, Profiler::PHASE_DEBUG_SYMBOLS, name.str, o->version()};
 			DebugSymbol dbgsym{path.c_str(), loader.config.debug_symbols_root};
 			const char * debug_link = DebugSymbol::link(*o);
 			const char * debug_symbol_path = dbgsym.find(debug_link, o->build_id);
@@ -433,19 +482,21 @@ Pair<Object *, ObjectIdentity::Info> ObjectIdentity::create(Object::Data & data,
 				o->debug_size = 0;
 			}
 		}
-		LOG_INFO << "Calculate Binary hash of " << *o << endl;
-		uint32_t bean_flags = Bean::FLAG_NONE;
-		// Resolve internal relocations to improve patchable detection
-		bean_flags |= Bean::FLAG_RESOLVE_INTERNAL_RELOCATIONS;
-		if (loader.config.update_mode >= Loader::Config::UPDATE_MODE_CODEREL) {
-			bean_flags |= Bean::FLAG_RECONSTRUCT_RELOCATIONS;
-			bean_flags |= Bean::FLAG_HASH_ATTRIBUTES_FOR_ID;
+		// Use precomputed update plan (if available) instead of comparing the binary hashes
+		if (current != nullptr && !loader.config.find_debug_symbols) {
+			o->update_plan = UpdatePlan::load(*current, *o);
+			// Share analysis with forked processes
+			if (o->update_plan == nullptr && loader.update_coordinator.is_coordinator())
+				o->update_plan = UpdatePlan::publish(*current, *o);
+		}
+		if (o->update_plan == nullptr) {
+			o->calculate_binary_hash();
+			if (current != nullptr)
+				current->calculate_binary_hash();
 		}
-
-		o->binary_hash.emplace(*o, o->debug_symbols, bean_flags);
 		// if previous version exist, check if we can patch it
 		if (current != nullptr) {
-			assert(current->binary_hash && o->binary_hash);
+			assert(o->update_plan != nullptr || (current->binary_hash && o->binary_hash));
 			if (!o->patchable()) {
 				LOG_WARNING << "Got new version of " << path << ", however, it is incompatible with current version and hence cannot be employed..." << endl;
 				delete o;
@@ -469,7 +520,12 @@ Pair<Object *, ObjectIdentity::Info> ObjectIdentity::create(Object::Data & data,
 	current = o;
 
 	// perform preload
-	if (!o->preload()) {
+	bool preloaded;
+	{
+		Profiler::Scope profile{loader.profiler, Profiler::PHASE_PRELOAD, name.str, o->version()};
+		preloaded = o->preload();
+	}
+	if (!preloaded) {
 		LOG_ERROR << "Loading of " << path << " failed (while preloading)..." << endl;
 		current = o->file_previous;
 		delete o;
@@ -477,13 +533,21 @@ Pair<Object *, ObjectIdentity::Info> ObjectIdentity::create(Object::Data & data,
 	}
 
 	// Map memory
-	if (flags.premapped == 0 && !o->map()) {
+	bool mapped = true;
+	if (flags.premapped == 0) {
+		Profiler::Scope profile{loader.profiler, Profiler::PHASE_MAP, name.str, o->version()};
+		mapped = o->map();
+	}
+	if (!mapped) {
 		LOG_ERROR << "Loading of " << path << " failed (while mapping into memory)..." << endl;
 		current = o->file_previous;
 		delete o;
 		return { nullptr, INFO_FAILED_MAPPING };
 	}
 
+	// New memory ranges (and symbols) invalidate the lookup caches
+	loader.changed();
+
 	// Apply (Luci specific) fixes
 	if (!o->fix()) {
 		LOG_ERROR << "Applying fixes at " << *this << " failed!" << endl;
@@ -492,19 +556,25 @@ Pair<Object *, ObjectIdentity::Info> ObjectIdentity::create(Object::Data & data,
 	// Prepare
 	if (flags.initialized == 1) {
 		if (o->file_previous != nullptr) {
-			LOG_INFO << "Prepare new version of " << path << endl;
 			// Lazy evaluation is not possible for updated files!
 			flags.bind_now = 1;
-			// Do preprepare
-			o->preprepare();
-			// Fix relocations in dynamic objects
-			if (!o->prepare()) {
-				LOG_WARNING << "Preparing updated object " << path << " failed!" << endl;
+			if (prepare) {
+				LOG_INFO << "Prepare new version of " << path << endl;
+				Profiler::Scope profile{loader.profiler, Profiler::PHASE_PREPARE, name.str, o->version()};
+				// Do preprepare
+				o->preprepare();
+				// Fix relocations in dynamic objects
+				if (!o->prepare()) {
+					LOG_WARNING << "Preparing updated object " << path << " failed!" << endl;
+				}
+				o->status = Object::STATUS_PREPARED;
+			} else {
+				LOG_INFO << "Postponing preparation of new version of " << path << endl;
 			}
 		} else {
 			assert(type == Elf::ET_EXEC || o->base == data.addr);
+			o->status = Object::STATUS_PREPARED;
 		}
-		o->status = Object::STATUS_PREPARED;
 	}
 
 	LOG_INFO << "Successfully loaded " << path << " v" << o->version();
@@ -551,10 +621,12 @@ bool ObjectIdentity::prepare() const {  // NOLINT
 					return false;
 
 			LOG_DEBUG << "Preparing " << *current << endl;
-			if (current->prepare())
-				current->status = Object::STATUS_PREPARED;
-			else
-				return false;
+			{
+				Profiler::Scope profile{loader.profiler, Profiler::PHASE_PREPARE, name.str, current->version()};
+				if (!current->prepare())
+					return false;
+			}
+			current->status = Object::STATUS_PREPARED;
 			break;
 
 		case Object::STATUS_PREPARING:
@@ -578,13 +650,20 @@ bool ObjectIdentity::update() const {
 		hook.payload_data = hook.serialize(current == hook.object ? 0 : 1);
 	}
 
-	// Perform updates
+	// Perform updates -- oldest version first, since newer (relocatable) versions might reuse its code
+	// and have to apply their relocations last
+	Vector<Object *> versions;
 	for (Object * c = current; c != nullptr; c = c->file_previous) {
-		LOG_DEBUG << "Updating relocations at " << *c << endl;
-		success &= c->update();
+		versions.push_back(c);
 		if (!flags.update_outdated)
 			break;
 	}
+	for (size_t v = versions.size(); v > 0; v--) {
+		Object * c = versions[v - 1];
+		LOG_DEBUG << "Updating relocations at " << *c << endl;
+		Profiler::Scope profile{loader.profiler, Profiler::PHASE_UPDATE, name.str, c->version()};
+		success &= c->update();
+	}
 
 	// Update hooks to latest object
 	hook_refresh();
@@ -603,6 +682,7 @@ bool ObjectIdentity::finalize() const {
 	bool success = true;
 	for (Object * c = current; c != nullptr; c = c->file_previous) {
 		LOG_DEBUG << "Finalizing " << *c << endl;
+		Profiler::Scope profile{loader.profiler, Profiler::PHASE_FINALIZE, name.str, c->version()};
 		success &= c->finalize();
 	}
 	return success;
@@ -620,36 +700,43 @@ bool ObjectIdentity::initialize() {  // NOLINT
 				return false;
 
 		LOG_DEBUG << "Initializing " << *current << endl;
+		Profiler::Scope profile{loader.profiler, Profiler::PHASE_INIT, name.str, current->version()};
 		if (!current->initialize())
 			return false;
 	}
 	return true;
 }
 
+bool ObjectIdentity::deinitialize() {
+	assert(current != nullptr);
+	if (flags.initialized == 1) {
+		flags.initialized = 0;
 
-void ObjectIdentity::status(ObjectIdentity::Info msg) const {
-	if (loader.statusinfofd >= 0 && (loader.config.early_statusinfo || loader.target != nullptr)) {
-		OutputStream<512> out(loader.statusinfofd);
-		switch (msg) {
-			case INFO_ERROR_OPEN:          out << "ERROR (opening file failed)"; break;
-			case INFO_ERROR_STAT:          out << "ERROR (retrieving file status failed)"; break;
-			case INFO_ERROR_MAP:           out << "ERROR (mapping whole file into memory failed)"; break;
-			case INFO_ERROR_CREATE:        out << "ERROR (not able to create object)"; break;
-			case INFO_ERROR_ELF:           out << "ERROR (unsupported format)"; break;
-			case INFO_ERROR_INOTIFY:       out << "ERROR (not able to watch for file modifications)"; break;
-			case INFO_IDENTICAL_TIME:      out << "IGNORED (new version has same modification time)"; break;
-			case INFO_IDENTICAL_HASH:      out << "IGNORED (new version has same hash)"; break;
-			case INFO_UPDATE_DISABLED:     out << "FAILED (dynamic updates are disabled)"; break;
-			case INFO_UPDATE_INCOMPATIBLE: out << "FAILED (new version is incompatible)"; break;
-			case INFO_UPDATE_MODIFIED:     out << "FAILED (relocated data was altered)"; break;
-			case INFO_FAILED_PRELOADING:   out << "FAILED (preload was unsuccessful)"; break;
-			case INFO_FAILED_MAPPING:      out << "FAILED (mapping of segments was unsuccessful)"; break;
-			case INFO_FAILED_REUSE:        out << "FAILED (reusing outdated code)"; break;
-			case INFO_CONTINUE_LOAD:       out << "ERROR (open was successful, but not continued load)"; break;
-			case INFO_SUCCESS_LOAD:        out << "SUCCESS (loaded initial version)"; break;
-			case INFO_SUCCESS_UPDATE:      out << "SUCCESS (updated to new version)"; break;
-			default:                       out << "ERROR (invalid info type)"; break;
-		}
-		out << " for " << name << " [" << path << "] in PID " << Syscall::getpid() << " at " << DateTime::now() << endl;
+		LOG_DEBUG << "Deinitializing " << *current << endl;
+		if (!current->deinitialize())
+			return false;
+
+		// Handlers registered by `__cxa_atexit` (usually already called by the destructor of crtbegin)
+		if (auto dso_handle = current->resolve_internal_symbol(SymbolHelper{"__dso_handle"}))
+			if (auto cxa_finalize = loader.resolve_symbol("__cxa_finalize", nullptr, ns))
+				reinterpret_cast<void (*)(void *)>(cxa_finalize->pointer())(reinterpret_cast<void *>(current->base + dso_handle->value()));
 	}
+	return true;
+}
+
+
+void ObjectIdentity::add_symbol_dependency(const ObjectIdentity & provider) const {
+	// Only required to prevent unloading of the provider
+	if (&provider == this || !provider.unloadable)
+		return;
+	for (const auto * dep : symbol_dependencies)
+		if (dep == &provider)
+			return;
+	symbol_dependencies.push_back(&provider);
+}
+
+
+void ObjectIdentity::status(ObjectIdentity::Info msg, uint64_t duration) const {
+	if (loader.status_info.enabled() && (loader.config.early_statusinfo || loader.target != nullptr))
+		loader.status_info.event(status_id, name.str, path.str, msg, current != nullptr ? current->version() : 0, duration, msg == INFO_SUCCESS_RECLAIM ? reclaimed.bytes : 0);
 }
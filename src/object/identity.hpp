@@ -12,6 +12,7 @@
 
 #include "comp/glibc/libdl/interface.hpp"
 #include "object/base.hpp"
+#include "symbol_cache.hpp"
 
 struct Loader;
 
@@ -59,6 +60,13 @@ struct ObjectIdentity {
 	/*! \brief path to file */
 	StrPtr path;
 
+	/*! \brief Shared object name (`DT_SONAME` of first version, if available) */
+	const char * soname = nullptr;
+
+	/*! \brief Device & inode of file (0 if not file based) */
+	uint64_t device = 0;
+	uint64_t inode = 0;
+
 	/*! \brief Object specific flags*/
 	union Flags {
 		struct {
@@ -90,6 +98,27 @@ struct ObjectIdentity {
 	/*! \brief Current (latest) version of the object */
 	Object * current = nullptr;
 
+	/*! \brief Number of handles returned by `dlopen` (and not closed yet) */
+	size_t handles = 0;
+
+	/*! \brief Object was loaded during runtime (and can therefore be unloaded) */
+	bool unloadable = false;
+
+	/*! \brief Objects providing symbols for relocations (besides dependencies) */
+	mutable Vector<const ObjectIdentity *> symbol_dependencies;
+
+	/*! \brief Outdated versions which have been released */
+	struct {
+		/*! \brief number of versions (required for consistent version numbers) */
+		size_t versions = 0;
+
+		/*! \brief total size of unmapped memory */
+		size_t bytes = 0;
+	} reclaimed;
+
+	/*! \brief Cached results of `dlsym` using this object as handle (or caller for `RTLD_DEFAULT` / `RTLD_NEXT`) */
+	mutable SymbolCache dlsym_cache;
+
 	/*! \brief Storage for comparing relocated values in data section to detect changes by the user [program] */
 	HashMap<Pair<int, uintptr_t>, uintptr_t> datarel_content;
 
@@ -109,11 +138,13 @@ private:
 		INFO_UPDATE_DISABLED,
 		INFO_UPDATE_INCOMPATIBLE,
 		INFO_UPDATE_MODIFIED,
+		INFO_UPDATE_TRANSACTION,
 		INFO_FAILED_PRELOADING,
 		INFO_FAILED_MAPPING,
 		INFO_FAILED_REUSE,
 		INFO_SUCCESS_LOAD,
-		INFO_SUCCESS_UPDATE
+		INFO_SUCCESS_UPDATE,
+		INFO_SUCCESS_RECLAIM
 	};
 
 	/*! \brief inotify descriptor for file modifications */
@@ -129,8 +160,23 @@ private:
 	/*! \brief Open file (map into memory) */
 	Info open(uintptr_t addr, Object::Data & data, Elf::ehdr_type & type) const;
 
+	/*! \brief Open & create new version (without reporting status)
+	 * \param object pointer to newly opened object (or nullptr on failure)
+	 * \param addr use memory mapped Elf instead of file located at path
+	 * \param type ELF type (`ET_NONE` to auto determine)
+	 * \param prepare prepare updated version immediately (otherwise postponed to next relocation)
+	 * \param prefetched file data already opened and mapped (by a prefetch worker)
+	 * \return info about loading result
+	 */
+	Info load_version(Object * & object, uintptr_t addr = 0, Elf::ehdr_type type = Elf::ET_NONE, bool prepare = true, const Object::Data * prefetched = nullptr);
+
+	/*! \brief Remove latest version (not yet applied by an update), restoring the previous one
+	 * \return `true` if version was discarded
+	 */
+	bool discard();
+
 	/*! \brief create new object instance */
-	Pair<Object *, enum Info> create(Object::Data & data, Elf::ehdr_type type);
+	Pair<Object *, enum Info> create(Object::Data & data, Elf::ehdr_type type, bool prepare = true);
 
 	/*! \brief Make memory copy of ELF */
 	bool memdup(Object::Data & data);
@@ -150,8 +196,37 @@ private:
 	/*! \brief call initializer */
 	bool initialize();
 
-	/*! \brief send status info message */
-	void status(Info msg) const;
+	/*! \brief call finalizer (destructors) */
+	bool deinitialize();
+
+	/*! \brief send status info message
+	 * \param msg status
+	 * \param duration duration of the operation in nanoseconds (if measured)
+	 */
+	void status(Info msg, uint64_t duration = 0) const;
+
+	/*! \brief Identifier in status info (assigned on first message) */
+	mutable uint32_t status_id = 0;
+
+	/*! \brief Hashes of the modified file determined while waiting for the update coordinator
+	 * \see UpdatePlan::coordinated
+	 */
+	mutable struct {
+		/*! \brief version the previous hash belongs to (`nullptr` if not set) */
+		const Object * previous = nullptr;
+
+		/*! \brief hash of the previous version */
+		uint64_t previous_hash = 0;
+
+		/*! \brief hash of the modified file */
+		uint64_t new_hash = 0;
+
+		/*! \brief size of the modified file */
+		size_t size = 0;
+
+		/*! \brief last modification time of the modified file */
+		struct timespec modification_time = { 0, 0 };
+	} update_plan_hash;
 
 	/*! \brief custom update hooks */
 	void hook_refresh() const;
@@ -176,9 +251,15 @@ private:
 	/*! \brief Load/get current version
 	 * \param addr use memory mapped Elf instead of file located at path
 	 * \param type ELF type (`ET_NONE` to auto determine)
+	 * \param prefetched file data already opened and mapped (by a prefetch worker)
 	 * \return pointer to newly opened object (or nullptr on failure / if already loaded)
 	 */
-	Object * load(uintptr_t addr = 0, Elf::ehdr_type type = Elf::ET_NONE);
+	Object * load(uintptr_t addr = 0, Elf::ehdr_type type = Elf::ET_NONE, const Object::Data * prefetched = nullptr);
+
+	/*! \brief Note that a relocation of this object was resolved using a symbol of another object
+	 * \param provider object containing the symbol
+	 */
+	void add_symbol_dependency(const ObjectIdentity & provider) const;
 
 	/*! \brief constructor */
 	ObjectIdentity(Loader & loader, const Flags flags, const char * path = nullptr, namespace_t ns = NAMESPACE_BASE, const char * altname = nullptr);
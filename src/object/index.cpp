@@ -0,0 +1,68 @@
+// Luci - a dynamic linker/loader with DSU capabilities
+// Copyright 2021-2023 by Bernhard Heinloth <heinloth@cs.fau.de>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include "object/index.hpp"
+
+void ObjectIndex::insert(const Key & key, ObjectIdentity & object) {
+	if (objects.find(key) == objects.end())
+		objects.insert(key, &object);
+}
+
+void ObjectIndex::erase(const Key & key, const ObjectIdentity & object) {
+	auto i = objects.find(key);
+	if (i != objects.end() && i->value == &object)
+		objects.erase(key);
+}
+
+ObjectIdentity * ObjectIndex::find(const Key & key) const {
+	auto i = objects.find(key);
+	return i != objects.end() ? i->value : nullptr;
+}
+
+void ObjectIndex::add(ObjectIdentity & object) {
+	identities.insert(&object);
+	if (!object.name.empty())
+		insert(Key{Key::NAME, object.ns, object.name, 0, 0}, object);
+	if (object.soname != nullptr)
+		insert(Key{Key::SONAME, object.ns, StrPtr(object.soname), 0, 0}, object);
+	if (!object.path.empty())
+		insert(Key{Key::PATH, object.ns, object.path, 0, 0}, object);
+	if (object.inode != 0)
+		insert(Key{Key::FILE, object.ns, StrPtr(), object.device, object.inode}, object);
+}
+
+void ObjectIndex::remove(const ObjectIdentity & object) {
+	identities.erase(&object);
+	if (!object.name.empty())
+		erase(Key{Key::NAME, object.ns, object.name, 0, 0}, object);
+	if (object.soname != nullptr)
+		erase(Key{Key::SONAME, object.ns, StrPtr(object.soname), 0, 0}, object);
+	if (!object.path.empty())
+		erase(Key{Key::PATH, object.ns, object.path, 0, 0}, object);
+	if (object.inode != 0)
+		erase(Key{Key::FILE, object.ns, StrPtr(), object.device, object.inode}, object);
+}
+
+void ObjectIndex::clear() {
+	objects.clear();
+	identities.clear();
+}
+
+bool ObjectIndex::contains(const ObjectIdentity * object) const {
+	return identities.contains(object);
+}
+
+ObjectIdentity * ObjectIndex::by_name(namespace_t ns, const StrPtr & name) const {
+	if (auto object = find(Key{Key::NAME, ns, name, 0, 0}))
+		return object;
+	return find(Key{Key::SONAME, ns, name, 0, 0});
+}
+
+ObjectIdentity * ObjectIndex::by_path(namespace_t ns, const StrPtr & path) const {
+	return find(Key{Key::PATH, ns, path, 0, 0});
+}
+
+ObjectIdentity * ObjectIndex::by_file(namespace_t ns, uint64_t device, uint64_t inode) const {
+	return find(Key{Key::FILE, ns, StrPtr(), device, inode});
+}
@@ -0,0 +1,90 @@
+// Luci - a dynamic linker/loader with DSU capabilities
+// Copyright 2021-2023 by Bernhard Heinloth <heinloth@cs.fau.de>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#pragma once
+
+#include <dlh/types.hpp>
+#include <dlh/strptr.hpp>
+#include <dlh/container/hash.hpp>
+
+#include "object/identity.hpp"
+
+/*! \brief Index of loaded objects (per namespace)
+ *  Objects can be found by their (file or archive entry) name, their shared object name (`DT_SONAME`),
+ *  their absolute path and the device & inode of their file (to detect loading via different links).
+ *  In case of collisions the object added first is kept (same as the first match in the lookup list).
+ */
+class ObjectIndex {
+	struct Key {
+		enum Type {
+			NAME,
+			SONAME,
+			PATH,
+			FILE
+		} type;
+		namespace_t ns;
+		StrPtr str;
+		uint64_t device;
+		uint64_t inode;
+
+		bool operator==(const Key & other) const {
+			return type == other.type && ns == other.ns && (type == FILE ? (device == other.device && inode == other.inode) : str == other.str);
+		}
+	};
+
+	struct KeyComparison {
+		static inline bool equal(const Key & a, const Key & b) {
+			return a == b;
+		}
+
+		static inline uint32_t hash(const Key & v) {
+			uint32_t h = static_cast<uint32_t>(v.type) * 0x9e3779b1U ^ static_cast<uint32_t>(v.ns) * 0x85ebca6bU;
+			if (v.type == Key::FILE)
+				return h ^ static_cast<uint32_t>(v.inode * 0xc2b2ae35U) ^ static_cast<uint32_t>(v.device);
+			else
+				return h ^ static_cast<uint32_t>(v.str.hash);
+		}
+	};
+
+	/*! \brief Objects by key */
+	HashMap<Key, ObjectIdentity *, KeyComparison> objects;
+
+	/*! \brief All objects in index */
+	HashSet<const ObjectIdentity *> identities;
+
+	/*! \brief Insert key (unless it already exists) */
+	void insert(const Key & key, ObjectIdentity & object);
+
+	/*! \brief Remove key (if it refers to the object) */
+	void erase(const Key & key, const ObjectIdentity & object);
+
+	/*! \brief Find object by key */
+	ObjectIdentity * find(const Key & key) const;
+
+ public:
+	/*! \brief Add object (with all available keys) */
+	void add(ObjectIdentity & object);
+
+	/*! \brief Remove object */
+	void remove(const ObjectIdentity & object);
+
+	/*! \brief Remove all objects */
+	void clear();
+
+	/*! \brief Check if object is in index */
+	bool contains(const ObjectIdentity * object) const;
+
+	/*! \brief Find object by (file or archive entry) name or shared object name
+	 * \param ns namespace
+	 * \param name file name (without directory)
+	 * \return object or `nullptr` if not found
+	 */
+	ObjectIdentity * by_name(namespace_t ns, const StrPtr & name) const;
+
+	/*! \brief Find object by absolute path */
+	ObjectIdentity * by_path(namespace_t ns, const StrPtr & path) const;
+
+	/*! \brief Find object by device & inode of its file */
+	ObjectIdentity * by_file(namespace_t ns, uint64_t device, uint64_t inode) const;
+};
@@ -7,12 +7,14 @@
 #include <dlh/log.hpp>
 #include <dlh/is_in.hpp>
 #include <dlh/string.hpp>
+#include <dlh/mem.hpp>
 #include <dlh/auxiliary.hpp>
 
 #include <elfo/elf_rel.hpp>
 
 #include "comp/glibc/start.hpp"
 #include "loader.hpp"
+#include "tls_descriptor.hpp"
 
 /* Files will be modified in memory!
  * Create GOT/PLT (with custom on-the-fly relocations for resolving) unless static -- (perhaps!) additional relocs
@@ -50,20 +52,202 @@ ObjectRelocatable::ObjectRelocatable(ObjectIdentity & file, const Object::Data &
 	}
 }
 
+ObjectRelocatable::~ObjectRelocatable() {
+	if (borrows && file_previous != nullptr) {
+		assert(file_previous->borrowed > 0);
+		file_previous->borrowed--;
+	}
+}
+
 // Custom header is required for the supplied Error Handling Frame
 // https://refspecs.linuxfoundation.org/LSB_1.3.0/gLSB/gLSB/ehframehdr.html
 struct ErrorHandlingFrameHeader {
 	uint8_t version = 1;              // mnust be 1
 	uint8_t eh_frame_ptr_enc = 0x04;  // DW_EH_PE_udata8 (8 bit signed pointer)
-	uint8_t eh_fde_count_enc = 0xff;  // DW_EH_PE_omit (= no binary binary search table)
-	uint8_t table_enc = 0xff;         // DW_EH_PE_omit (= no binary binary search table)
+	uint8_t eh_fde_count_enc = 0x03;  // DW_EH_PE_udata4 (or DW_EH_PE_omit = no binary search table)
+	uint8_t table_enc = 0x3b;         // DW_EH_PE_datarel | DW_EH_PE_sdata4 (or DW_EH_PE_omit = no binary search table)
 	uintptr_t eh_frame_ptr;           // Pointer to the actual error handling frame
-	uintptr_t fde_count = 0;          // 0 entries in binary search table;
-	/* binary search table would follow */
+	uint32_t fde_count = 0;           // number of entries in binary search table;
+
+	// Binary search table (sorted by initial location), addresses relative to this header
+	struct Entry {
+		int32_t initial_location;
+		int32_t address;
+	} table[];
 
 	explicit ErrorHandlingFrameHeader(uintptr_t eh_frame_ptr) : eh_frame_ptr(eh_frame_ptr) {}
+
+	/*! \brief Disable binary search table (unwinder will parse the error handling frame linearly) */
+	void omit_table() {
+		eh_fde_count_enc = 0xff;
+		table_enc = 0xff;
+		fde_count = 0;
+	}
 } __attribute__((packed));
 
+/*! \brief Helper for parsing the error handling frame (call frame information) */
+namespace ErrorHandlingFrame {
+
+/*! \brief Iterate over records (CIE / FDE)
+ * \param start begin of error handling frame
+ * \param size size of error handling frame
+ * \param func callback with address of record, its content (after the length field) and the content size
+ * \return `false` if callback aborted
+ */
+template<typename F>
+static bool foreach(uintptr_t start, size_t size, F func) {
+	const uintptr_t end = start + size;
+	for (uintptr_t record = start; record + 4 <= end; ) {
+		uint64_t length = *reinterpret_cast<const uint32_t *>(record);
+		uintptr_t content = record + 4;
+		if (length == 0) {
+			// Terminator
+			break;
+		} else if (length == 0xffffffff) {
+			length = *reinterpret_cast<const uint64_t *>(content);
+			content += 8;
+		}
+		if (length < 4 || content + length > end)
+			break;
+		if (!func(record, content, length))
+			return false;
+		record = content + length;
+	}
+	return true;
+}
+
+/*! \brief Number of frame description entries */
+static size_t entries(uintptr_t start, size_t size) {
+	size_t n = 0;
+	foreach(start, size, [&n](uintptr_t, uintptr_t content, uint64_t) -> bool {
+		// CIE ID is zero, FDEs contain a pointer to their CIE
+		if (*reinterpret_cast<const uint32_t *>(content) != 0)
+			n++;
+		return true;
+	});
+	return n;
+}
+
+static uint64_t uleb128(uintptr_t & p) {
+	uint64_t r = 0;
+	uint8_t byte;
+	unsigned shift = 0;
+	do {
+		byte = *reinterpret_cast<const uint8_t *>(p++);
+		r |= static_cast<uint64_t>(byte & 0x7f) << shift;
+		shift += 7;
+	} while ((byte & 0x80) != 0 && shift < 64);
+	return r;
+}
+
+/*! \brief Read encoded pointer (only absolute and PC relative encodings are supported)
+ * \param p address of encoded pointer, will be advanced
+ * \param encoding pointer encoding (`DW_EH_PE_*`)
+ * \param value decoded value
+ * \return `false` if encoding is not supported
+ */
+static bool pointer(uintptr_t & p, uint8_t encoding, uintptr_t & value) {
+	const uintptr_t field = p;
+	intptr_t v;
+	switch (encoding & 0x0f) {
+		case 0x00:  // DW_EH_PE_absptr
+		case 0x04:  // DW_EH_PE_udata8
+		case 0x0c:  // DW_EH_PE_sdata8
+			v = *reinterpret_cast<const int64_t *>(p);
+			p += 8;
+			break;
+		case 0x01:  // DW_EH_PE_uleb128
+			v = static_cast<intptr_t>(uleb128(p));
+			break;
+		case 0x02:  // DW_EH_PE_udata2
+			v = *reinterpret_cast<const uint16_t *>(p);
+			p += 2;
+			break;
+		case 0x03:  // DW_EH_PE_udata4
+			v = *reinterpret_cast<const uint32_t *>(p);
+			p += 4;
+			break;
+		case 0x0a:  // DW_EH_PE_sdata2
+			v = *reinterpret_cast<const int16_t *>(p);
+			p += 2;
+			break;
+		case 0x0b:  // DW_EH_PE_sdata4
+			v = *reinterpret_cast<const int32_t *>(p);
+			p += 4;
+			break;
+		default:
+			return false;
+	}
+	switch (encoding & 0xf0) {
+		case 0x00:  // DW_EH_PE_absptr
+			break;
+		case 0x10:  // DW_EH_PE_pcrel
+			v += static_cast<intptr_t>(field);
+			break;
+		default:
+			return false;
+	}
+	value = static_cast<uintptr_t>(v);
+	return true;
+}
+
+/*! \brief Get pointer encoding of FDEs from their common information entry
+ * \param cie address of CIE record
+ * \param encoding pointer encoding (`DW_EH_PE_*`)
+ * \return `false` if augmentation is not supported
+ */
+static bool fde_encoding(uintptr_t cie, uint8_t & encoding) {
+	uintptr_t p = cie + 4;
+	if (*reinterpret_cast<const uint32_t *>(cie) == 0xffffffff)
+		p += 8;
+	// Skip CIE ID
+	p += 4;
+	uint8_t version = *reinterpret_cast<const uint8_t *>(p++);
+	const char * augmentation = reinterpret_cast<const char *>(p);
+	p += String::len(augmentation) + 1;
+	if (augmentation[0] == 'e' && augmentation[1] == 'h')
+		p += sizeof(uintptr_t);
+	// Code & data alignment factor
+	uleb128(p);
+	uleb128(p);
+	// Return address register
+	if (version == 1)
+		p++;
+	else
+		uleb128(p);
+
+	encoding = 0x00;  // DW_EH_PE_absptr
+	if (augmentation[0] == 'z') {
+		// Augmentation data length
+		uleb128(p);
+		for (const char * a = augmentation + 1; *a != '\0'; a++)
+			switch (*a) {
+				case 'R':  // FDE pointer encoding
+					encoding = *reinterpret_cast<const uint8_t *>(p++);
+					return true;
+				case 'P':  // Personality routine
+				{
+					uint8_t personality_encoding = *reinterpret_cast<const uint8_t *>(p++);
+					uintptr_t personality;
+					if (!pointer(p, personality_encoding & 0x7f, personality))
+						return false;
+					break;
+				}
+				case 'L':  // LSDA encoding
+					p++;
+					break;
+				case 'S':
+				case 'B':
+					break;
+				default:
+					return false;
+			}
+	}
+	return true;
+}
+
+}  // namespace ErrorHandlingFrame
+
 bool ObjectRelocatable::preload() {
 	// TODO flags.immutable_source  (should always be set, right?)
 	Optional<Elf::Section> tdata;
@@ -88,71 +272,158 @@ bool ObjectRelocatable::preload() {
 	}
 
 
-	for (const auto & section : this->sections) {
-		offset_sections.push_back(offset);
+	// Allocated sections are packed (according to their alignment) into groups with the same permissions,
+	// similar to a linker. Each group is mapped contiguously, starting at a new page.
+	enum Group {
+		GROUP_READ,
+		GROUP_EXEC,
+		GROUP_RELRO,
+		GROUP_WRITE,
+		GROUPS
+	};
+	auto group = [](const Elf::Section & section) -> Group {
+		if (section.executable())
+			return GROUP_EXEC;
+		else if (!section.writeable())
+			return GROUP_READ;
+		else if (String::compare(section.name(), ".data.rel.ro", 12) == 0)
+			return GROUP_RELRO;
+		else
+			return GROUP_WRITE;
+	};
+	auto packable = [](const Elf::Section & section) -> bool {
+		return section.size() > 0 && section.allocate() && !section.tls() && is(section.type()).in(SHT_NOBITS, SHT_PROGBITS, SHT_X86_64_UNWIND, SHT_INIT_ARRAY, SHT_FINI_ARRAY, SHT_PREINIT_ARRAY);
+	};
 
-		if (section.size() == 0)
-			continue;
-		if (section.tls() && section.allocate()) {
+	// First pass: Map TLS data, collect relocation tables and determine (maximum) size of groups
+	Vector<size_t> additional_sizes;
+	size_t group_size[GROUPS] = {};
+	uintptr_t tdata_offset = 0;
+	for ([[maybe_unused]] const auto & section : this->sections) {
+		section_relocations.push_back(0);
+		section_reused.push_back(false);
+	}
+	for (const auto & section : this->sections) {
+		size_t additional_size = 0;
+		if (section.size() > 0 && section.tls() && section.allocate()) {
 			if (section.type() == SHT_NOBITS) {
 				tbss = section;
 			} else {
 				tdata = section;
+				tdata_offset = offset;
 				// Mapping
 				auto mem = memory_map.emplace_back(*this, section, offset, 0, base);
 				// increase offset to next free page
 				offset += mem->target.page_size();
 			}
-			continue;
-		}
-
-		switch (section.type()) {
-			case SHT_NOBITS:
-			case SHT_PROGBITS:
-			case SHT_X86_64_UNWIND:  // EH_FRAME
-			case SHT_INIT_ARRAY:
-			case SHT_FINI_ARRAY:
-			case SHT_PREINIT_ARRAY:
-				if (section.allocate()) {
-					size_t additional_size = 0;
-					if (this->file_previous == nullptr && section.type() == SHT_PROGBITS && (String::compare(section.name(), ".init", 5) == 0 || String::compare(section.name(), ".fini", 5) == 0)) {
-						// The init/fini section consists only of calls.
-						// They need to be fixed after mapping
-						init_sections.push_back(section);
-						// We need an additional byte for the return instruction
-						additional_size = 1;
-					}
+		} else if (packable(section)) {
+			if (this->file_previous == nullptr && section.type() == SHT_PROGBITS && (String::compare(section.name(), ".init", 5) == 0 || String::compare(section.name(), ".fini", 5) == 0)) {
+				// The init/fini section consists only of calls.
+				// They need to be fixed after mapping
+				init_sections.push_back(section);
+				// We need an additional byte for the return instruction
+				additional_size = 1;
+			}
 
-					if (section.type() == SHT_PROGBITS && String::compare(section.name(), ".eh_frame") == 0) {
-						eh_section.emplace(section);
-						// We will add an aligned error handling frame header at the end of the section.
-						additional_size += 16 + sizeof(ErrorHandlingFrameHeader) * 8;
-					}
+			if (section.type() == SHT_PROGBITS && String::compare(section.name(), ".eh_frame") == 0) {
+				if (eh_sections.empty()) {
+					// Count the entries of all error handling frames for the binary search table
+					for (const auto & eh : this->sections)
+						if (eh.type() == SHT_PROGBITS && String::compare(eh.name(), ".eh_frame") == 0)
+							eh_frame_entries += ErrorHandlingFrame::entries(data.addr + eh.offset(), eh.size());
+					// We will add an aligned error handling frame header (with search table) at the end of the first section.
+					additional_size += 16 + sizeof(ErrorHandlingFrameHeader) + eh_frame_entries * sizeof(ErrorHandlingFrameHeader::Entry);
+				}
+				eh_sections.push_back(section);
+			}
 
-					// Fixup symbols & relocations
-					bool changed = adjust_offsets(offset, section);
+			auto & size = group_size[group(section)];
+			size = Math::align_up(size, Math::max(section.alignment(), static_cast<size_t>(1))) + section.size() + additional_size;
+		} else if (section.size() > 0 && is(section.type()).in(SHT_REL, SHT_RELA)) {
+			// Only relocations for allocated sections (linked in the info attribute)
+			if (section.info() != 0 && this->sections[section.info()].allocate())
+				section_relocations[section.info()] = this->sections.index(section);
+		}
+		additional_sizes.push_back(additional_size);
+	}
 
-					// If the whole writeable data/bss can be used from previous sections,
-					// there is no need to allocate it
-					if (this->file_previous == nullptr || changed || !section.writeable()) {
-						// Create mapping
-						auto mem = memory_map.emplace_back(*this, section, offset, additional_size, base);
+	// Reserve address space for groups
+	uintptr_t group_start[GROUPS];
+	uintptr_t group_end[GROUPS];
+	for (size_t g = 0; g < GROUPS; g++) {
+		group_start[g] = group_end[g] = offset;
+		offset += Math::align_up(group_size[g], Page::SIZE);
+	}
 
-						// increase offset to next free page
-						offset += mem->target.page_size();
-					}
-				}
+	// For updated versions, check previous writable data sections
+	Vector<bool> changed;
+	Vector<Optional<uintptr_t>> reused;
+	if (this->file_previous != nullptr) {
+		reuse_symbols(changed, reused);
+		// Reused symbols are accessed at their address in the previous version
+		for (const auto & r : reused)
+			if (r.has_value()) {
+				borrow();
 				break;
+			}
+	}
 
-			case SHT_REL:
-			case SHT_RELA:
-				// Only relocations for allocated sections (linked in the info attribute)
-				if (section.info() != 0 && this->sections[section.info()].allocate())
-					relocation_tables.push_back(section.get_relocations());
-				break;
+	// Second pass: Assign offsets to sections
+	Vector<MemorySegment::Fragment> fragments[GROUPS];
+	Vector<Optional<uintptr_t>> rebase;
+	size_t reused_sections = 0;
+	for (const auto & section : this->sections) {
+		size_t index = offset_sections.size();
+		if (tdata.has_value() && index == this->sections.index(tdata.value())) {
+			offset_sections.push_back(tdata_offset);
+			rebase.push_back(Optional<uintptr_t>());
+		} else if (!packable(section)) {
+			offset_sections.push_back(offset);
+			rebase.push_back(Optional<uintptr_t>());
+		} else {
+			Group g = group(section);
+			uintptr_t section_offset = Math::align_up(group_end[g], Math::max(section.alignment(), static_cast<size_t>(1)));
+			// Unchanged code & read-only data can be used from previous version
+			if (this->file_previous != nullptr && reusable(section, section_offset)) {
+				section_reused[index] = true;
+				reused_sections++;
+				offset_sections.push_back(section_offset);
+				rebase.push_back(Optional<uintptr_t>(section_offset));
+				continue;
+			}
+			offset_sections.push_back(section_offset);
+			rebase.push_back(Optional<uintptr_t>(section_offset));
+
+			// If the whole writeable data/bss can be used from previous sections,
+			// there is no need to allocate it
+			if (this->file_previous == nullptr || changed[index] || !section.writeable()) {
+				group_end[g] = section_offset + section.size() + additional_sizes[index];
+				if (section.type() != SHT_NOBITS)
+					fragments[g].push_back(MemorySegment::Fragment{section.offset(), section.size(), section_offset});
+			}
 		}
 	}
 
+	if (reused_sections > 0) {
+		LOG_INFO << "Using " << reused_sections << " unchanged sections of " << *this->file_previous << " in " << *this << endl;
+		// Previous version must not be reclaimed while its sections are in use
+		borrow();
+	}
+
+	// Relocation tables (of reused sections only relocations to changed sections are required)
+	for (size_t i = 0; i < section_relocations.size(); i++)
+		if (section_relocations[i] != 0)
+			(section_reused[i] ? relocation_tables_reused : relocation_tables).push_back(RelocationTable{this->sections[section_relocations[i]].get_relocations(), rebase[i].has_value() ? rebase[i].value() : 0, this->sections[i].executable()});
+
+	// Create mappings for groups
+	for (size_t g = 0; g < GROUPS; g++)
+		if (group_end[g] > group_start[g]) {
+			auto mem = memory_map.emplace_back(*this, group_start[g], group_end[g] - group_start[g], PROT_READ | PROT_WRITE | (g == GROUP_EXEC ? PROT_EXEC : 0), base);
+			for (const auto & fragment : fragments[g])
+				mem->fragments.push_back(fragment);
+			LOG_DEBUG << "Packed " << fragments[g].size() << " sections of " << *this << " into " << mem->target.page_size() << " bytes at " << reinterpret_cast<void*>(mem->target.address()) << endl;
+		}
+
 	// Setup TLS
 	if ((tdata.has_value() || tbss.has_value()) && this->file.tls_module_id == 0) {
 		size_t tls_size = 0;
@@ -171,8 +442,8 @@ bool ObjectRelocatable::preload() {
 			if (tls_size != 0) {
 				Elf::Shdr * data = const_cast<Elf::Shdr *>(tdata->ptr());
 				data->sh_addr = tls_size;
-				// Fixup BSS symbols & relocations
-				adjust_offsets(tls_size, tbss.value());
+				// BSS symbols & relocations are relative to TLS image
+				rebase[this->sections.index(tbss.value())] = Optional<uintptr_t>(tls_size);
 			}
 			tls_size += tbss->size();
 			// Adjust BSS
@@ -182,84 +453,155 @@ bool ObjectRelocatable::preload() {
 		this->file.tls_module_id = this->file.loader.tls.add_module(this->file, tls_size, tls_alignment, tls_image, tls_image_size, this->file.tls_offset);
 	}
 
+	// Symbol values (relocations are relative to their section)
+	adjust_offsets(rebase, reused);
+
+	// Declare tentative definitions (allocated in preprepare, after all relocatable objects have been preloaded)
+	for (const auto & sym : symbol_table())
+		if (sym.size() != 0 && sym.section_index() == Elf::SHN_COMMON)
+			file.loader.common_symbols.declare(file.ns, sym.name(), sym.size(), sym.value());
+
 	return !memory_map.empty();
 }
 
+void ObjectRelocatable::borrow() {
+	assert(this->file_previous != nullptr);
+	if (!borrows) {
+		borrows = true;
+		this->file_previous->borrowed++;
+	}
+}
+
 bool ObjectRelocatable::fix() {
 	// TODO: add _start routine etc
 	return true;
 }
 
 
-bool ObjectRelocatable::adjust_offsets(uintptr_t offset, const Elf::Section & section) {
-	int64_t index = static_cast<int64_t>(this->sections.index(section));
-	bool changed = false;
+bool ObjectRelocatable::reusable(const Elf::Section & section, uintptr_t & offset) const {
+	assert(this->file_previous != nullptr);
+	if (section.type() != SHT_PROGBITS || section.writeable() || String::compare(section.name(), ".eh_frame") == 0)
+		return false;
+
+	// Find section with same name in previous version (usually at the same index)
+	auto previous = reinterpret_cast<const ObjectRelocatable *>(this->file_previous);
+	size_t index = this->sections.index(section);
+	size_t previous_index = 0;
+	if (index < previous->section_reused.size() && String::compare(previous->sections[index].name(), section.name()) == 0) {
+		previous_index = index;
+	} else {
+		for (const auto & candidate : previous->sections)
+			if (String::compare(candidate.name(), section.name()) == 0) {
+				previous_index = previous->sections.index(candidate);
+				break;
+			}
+		if (previous_index == 0)
+			return false;
+	}
+
+	// Compare section header and contents
+	const auto previous_section = previous->sections[previous_index];
+	if (previous_section.type() != section.type() || previous_section.flags() != section.flags() || previous_section.size() != section.size() || previous_section.alignment() != section.alignment()
+	 || Memory::compare(reinterpret_cast<const void *>(previous->data.addr + previous_section.offset()), reinterpret_cast<const void *>(data.addr + section.offset()), section.size()) != 0)
+		return false;
+
+	// Compare relocations (by symbol name, since the symbol table might have changed)
+	size_t relocation_index = section_relocations[index];
+	size_t previous_relocation_index = previous->section_relocations[previous_index];
+	if ((relocation_index == 0) != (previous_relocation_index == 0))
+		return false;
+	if (relocation_index != 0) {
+		const auto relocation_section = this->sections[relocation_index];
+		const auto previous_relocation_section = previous->sections[previous_relocation_index];
+		if (relocation_section.type() != previous_relocation_section.type() || relocation_section.size() != previous_relocation_section.size())
+			return false;
+
+		auto previous_relocations = previous_relocation_section.get_relocations();
+		auto previous_reloc = previous_relocations.begin();
+		for (const auto & reloc : relocation_section.get_relocations()) {
+			if (reloc.type() != (*previous_reloc).type() || reloc.addend() != (*previous_reloc).addend() || reloc.offset() != (*previous_reloc).offset())
+				return false;
+			if ((reloc.symbol_index() == 0) != ((*previous_reloc).symbol_index() == 0))
+				return false;
+			if (reloc.symbol_index() != 0) {
+				const auto sym = reloc.symbol();
+				const auto previous_sym = (*previous_reloc).symbol();
+				if (sym.type() != previous_sym.type())
+					return false;
+				else if (sym.type() == STT_SECTION ? String::compare(this->sections[sym.section_index()].name(), previous->sections[previous_sym.section_index()].name()) != 0 : String::compare(sym.name(), previous_sym.name()) != 0)
+					return false;
+			}
+			++previous_reloc;
+		}
+	}
+
+	// Identical: Use address of previous version (relative to this base)
+	offset = previous->base + previous->offset_sections[previous_index] - base;
+	return true;
+}
+
+
+void ObjectRelocatable::reuse_symbols(Vector<bool> & changed, Vector<Optional<uintptr_t>> & reused) {
+	assert(this->file_previous != nullptr);
+	for ([[maybe_unused]] const auto & section : this->sections)
+		changed.push_back(false);
 
-	// Relocations
 	for (const auto & linked : this->sections) {
 		if (linked.size() == 0)
 			continue;
 
 		switch (linked.type()) {
 			case SHT_SYMTAB:
-				// fix symbols
-				for (auto sym : linked.get_symbol_table())
-					if (sym.section_index() == index) {
-						// For updated versions, check previous writable data sections
-						if (this->file_previous != nullptr && section.writeable()) {
+				for (auto sym : linked.get_symbol_table()) {
+					Optional<uintptr_t> reuse;
+					auto index = sym.section_index();
+					if (index != Elf::SHN_UNDEF && index < changed.size()) {
+						const auto & section = this->sections[index];
+						if (section.writeable() && section.allocate() && !section.tls()) {
 							auto prev_sym = this->file_previous->resolve_internal_symbol(sym.name());
 							// if we have an old matching symbol, use its address
 							if (prev_sym.has_value() && prev_sym->type() == sym.type() && prev_sym->size() == sym.size()) {
-								Elf::Sym * new_data = const_cast<Elf::Sym *>(sym.ptr());
-								// Fixup value (= offset)
-								new_data->st_value = prev_sym->value();
+								reuse = Optional<uintptr_t>(prev_sym->value());
 								// Insert into lookup list
 								symbols.insert(prev_sym.value());
-								continue;
 							}
 						}
-						// For general symbols adjust entry
-						if (is(sym.type()).in(STT_NOTYPE, STT_OBJECT, STT_FUNC, STT_SECTION, STT_GNU_IFUNC, STT_TLS)) {
-							// This is only allowed since we have a COW mapping
-							Elf::Sym * data = const_cast<Elf::Sym *>(sym.ptr());
-							// Fixup value (= offset)
-							data->st_value += offset;
-							// Add to symbol list
-							symbols.insert(sym);
-							// Store change of symbol table
-							changed = true;
-						}
+						if (!reuse.has_value() && is(sym.type()).in(STT_NOTYPE, STT_OBJECT, STT_FUNC, STT_SECTION, STT_GNU_IFUNC, STT_TLS))
+							changed[index] = true;
 					}
+					reused.push_back(reuse);
+				}
 				break;
 
 			case SHT_REL:
-				// Fixup relocations to this section
-				if (static_cast<int16_t>(linked.info()) == index)
-					for (auto rel : linked.get_array<RelocationWithoutAddend>()) {
-						// This is only allowed since we have a COW mapping
-						Elf::Rel * data = const_cast<Elf::Rel *>(rel.ptr());
-						// Fixup offset
-						data->r_offset += offset;
-						// Store change of relocation table
-						changed = true;
-					}
-				break;
-
 			case SHT_RELA:
-				// Fixup relocations to this section
-				if (static_cast<int16_t>(linked.info()) == index)
-					for (auto rel : linked.get_array<RelocationWithAddend>()) {
-						// This is only allowed since we have a COW mapping
-						Elf::Rela * data = const_cast<Elf::Rela *>(rel.ptr());
-						// Fixup offset
-						data->r_offset += offset;
-						// Store change of relocation table
-						changed = true;
-					}
+				// Relocations to this section
+				if (linked.info() != 0 && linked.info() < changed.size())
+					changed[linked.info()] = true;
 				break;
 		}
 	}
-	return changed;
+}
+
+
+void ObjectRelocatable::adjust_offsets(const Vector<Optional<uintptr_t>> & rebase, const Vector<Optional<uintptr_t>> & reused) {
+	for (const auto & linked : this->sections)
+		if (linked.size() > 0 && linked.type() == SHT_SYMTAB)
+			for (auto sym : linked.get_symbol_table()) {
+				size_t s = symbol_values.size();
+				uintptr_t value = sym.value();
+				auto index = sym.section_index();
+				if (s < reused.size() && reused[s].has_value()) {
+					// Symbol taken from the previous version (already in symbol list)
+					value = reused[s].value();
+				} else if (index != Elf::SHN_UNDEF && index < rebase.size() && rebase[index].has_value() && is(sym.type()).in(STT_NOTYPE, STT_OBJECT, STT_FUNC, STT_SECTION, STT_GNU_IFUNC, STT_TLS)) {
+					// For general symbols the value is relative to the section
+					value += rebase[index].value();
+					// Add to symbol list
+					symbols.insert(ElfSymbolHelper(sym, value));
+				}
+				symbol_values.push_back(value);
+			}
 }
 
 
@@ -269,50 +611,40 @@ void ObjectRelocatable::preprepare() {
 
 	// Allocate bss space for tentative definitions
 	// this has to be done after all other relocatable objects have been preloaded
-	size_t global_bss = 0;
-	size_t common_base = 0;
-	// Check symbol table for tentative definitions
-	for (const auto & sym : symbol_table())
+	auto & common = file.loader.common_symbols;
+	if (common.has_pending()) {
+		// Use (non-tentative) definitions of relocatable objects if available (single pass over their symbols)
+		for (const auto & object_file : file.loader.lookup)
+			if (object_file.flags.bind_global == 1 && object_file.current != nullptr && object_file.current->header.type() == Elf::ET_REL)
+				for (const auto & sym : static_cast<const ObjectRelocatable *>(object_file.current)->symbols)
+					// Skip merged tentative definitions (of this or previous allocations)
+					if (!sym.undefined() && sym.section_index() != Elf::SHN_COMMON && sym.bind() != Elf::STB_LOCAL && sym.visibility() == Elf::STV_DEFAULT && is(sym.type()).in(STT_NOTYPE, STT_OBJECT))
+						common.define(object_file.ns, sym.name(), object_file.current->base + sym.value(), sym.size());
+
+		// Merge all others into a single mapping (owned by the loader, since this object might be unloaded)
+		if (size_t global_bss = common.layout(); global_bss > 0) {
+			uintptr_t common_base = file.loader.next_address(global_bss);
+			assert(common_base > base);
+			LOG_INFO << "Common section with " << global_bss << " bytes at " << reinterpret_cast<void*>(common_base) << " (declared by " << *this << ")" << endl;
+			if (!common.allocate(common_base, global_bss))
+				LOG_ERROR << "Unable to allocate common section for " << *this << endl;
+		} else {
+			common.allocate(0, 0);
+		}
+	}
+
+	// Assign tentative definitions
+	size_t index = 0;
+	for (const auto & sym : symbol_table()) {
 		if (sym.size() != 0 && sym.section_index() == Elf::SHN_COMMON) {
-			bool found = false;
-			for (const auto & object_file : file.loader.lookup) {
-				auto init_sym = object_file.current->resolve_internal_symbol(sym.name());
-				if (init_sym.has_value() && init_sym->type() == sym.type() && init_sym->size() == sym.size()) {
-					Elf::Sym * data = const_cast<Elf::Sym *>(sym.ptr());
-					// Fixup value (= offset)
-					data->st_value = object_file.base + init_sym->value() - base;
-					// Insert into lookup list
-					symbols.insert(init_sym.value());
-					// Mark found
-					found = true;
-					break;
-				}
-			}
-			if (!found) {
-				// Check if such a symbol was already defined within
-				// Value is alignment
-				auto start = Math::align_up(global_bss, sym.value());
-				// Add to global bss size
-				global_bss = start + sym.size();
-				// This is only allowed since we have a COW mapping
-				Elf::Sym * data = const_cast<Elf::Sym *>(sym.ptr());
-				// Get free address
-				if (common_base == 0) {
-					common_base = file.loader.next_address();
-					assert(common_base > base);
-				}
-				// Fixup value (= offset)
-				data->st_value = (common_base - base) + start;
-				// Add to symbol list
-				symbols.insert(sym);
-			}
+			auto merged = common.find(file.ns, sym.name());
+			assert(merged != nullptr && merged->address != 0);
+			assert(index < symbol_values.size());
+			symbol_values[index] = merged->address - base;
+			// Add to symbol list
+			symbols.insert(ElfSymbolHelper(sym, symbol_values[index]));
 		}
-	// Allocate
-	if (global_bss > 0) {
-		LOG_INFO << "Common section of " << *this << " at " << reinterpret_cast<void*>(common_base) << endl;
-		auto mem = memory_map.emplace_back(*this, common_base - base, global_bss, base);
-		// And map target
-		mem->map();
+		index++;
 	}
 
 	preprepared = true;
@@ -321,11 +653,11 @@ void ObjectRelocatable::preprepare() {
 bool ObjectRelocatable::prepare() {
 	bool success = true;
 	// Perform initial relocations
-	Vector<Elf::Relocation> postpone;
+	Vector<Pair<Elf::Relocation, uintptr_t>> postpone;
 	size_t postpone_count = 0;
-	for (auto & relocations : relocation_tables)
-		for (const auto & reloc : relocations)
-			if (relocate(reloc, &postpone) == nullptr) {
+	for (const auto & table : relocation_tables)
+		for (const auto & reloc : table.relocations)
+			if (relocate(reloc, table.section_offset, &postpone) == nullptr) {
 				if (postpone.size() > postpone_count) {
 					LOG_TRACE << "Postpone relocation of offset " << reinterpret_cast<void*>(reloc.offset()) << endl;
 					postpone_count = postpone.size();
@@ -334,9 +666,11 @@ bool ObjectRelocatable::prepare() {
 					success = false;
 				}
 			}
+	// Reused sections are live code of the previous version, hence their relocations are performed in `update`
 	// Postponed relocations: indirect function symbols have to be resolved after all other relocations.
-	for (const auto & reloc : postpone) {
-		void * x = relocate(reloc);
+	for (const auto & p : postpone) {
+		const auto & reloc = p.first;
+		void * x = relocate(reloc, p.second);
 		if (x == nullptr) {
 			LOG_WARNING << "Failed postponed relocation of offset " << reinterpret_cast<void*>(reloc.offset()) << " with " << reinterpret_cast<void*>(reloc.symbol().address()) << endl;
 			success = false;
@@ -345,10 +679,13 @@ bool ObjectRelocatable::prepare() {
 
 
 	// Add error handling frame header
-	if (eh_section.has_value()) {
-		uintptr_t eh_start = base + offset_sections[this->sections.index(eh_section.value())];
-		eh_frame = reinterpret_cast<uintptr_t>(new (reinterpret_cast<void*>((eh_start + eh_section->size() + 16) & ~0xf)) ErrorHandlingFrameHeader(eh_start));
+	if (!eh_sections.empty()) {
+		uintptr_t eh_start = base + offset_sections[this->sections.index(eh_sections[0])];
+		auto header = new (reinterpret_cast<void*>((eh_start + eh_sections[0].size() + 16) & ~0xf)) ErrorHandlingFrameHeader(eh_start);
+		eh_frame = reinterpret_cast<uintptr_t>(header);
 		LOG_DEBUG << "Error handling frame at " << reinterpret_cast<void*>(eh_start) << " has header at " << reinterpret_cast<void*>(eh_frame) << endl;
+		if (!eh_frame_table(header))
+			header->omit_table();
 	}
 
 	// Add ret statement to section which need fixing
@@ -366,19 +703,109 @@ bool ObjectRelocatable::prepare() {
 }
 
 
-bool ObjectRelocatable::update() {
-	for (const auto & r : relocations) {
-		// Update only if target has changed (relocation does not point to latest version).
-		// And if this is not the latest version, then omit (shared) data section relocations
-		// since they are performed in the latest version of this object
-		if (!r.value.object().is_latest_version() && is(r.value.type()).in(STT_FUNC, STT_GNU_IFUNC, STT_SECTION))
-			relocate(r.key);
+bool ObjectRelocatable::eh_frame_table(ErrorHandlingFrameHeader * header) const {
+	const uintptr_t header_address = reinterpret_cast<uintptr_t>(header);
+	auto relative = [header_address](uintptr_t address, int32_t & value) -> bool {
+		intptr_t diff = static_cast<intptr_t>(address - header_address);
+		value = static_cast<int32_t>(diff);
+		return value == diff;
+	};
+
+	// Collect entries of all (relocated) error handling frames
+	uint32_t n = 0;
+	for (const auto & section : eh_sections) {
+		uintptr_t start = base + offset_sections[this->sections.index(section)];
+		bool valid = ErrorHandlingFrame::foreach(start, section.size(), [&](uintptr_t record, uintptr_t content, uint64_t) -> bool {
+			uint32_t cie_pointer = *reinterpret_cast<const uint32_t *>(content);
+			if (cie_pointer == 0)
+				return true;
+			uint8_t encoding;
+			uintptr_t initial_location;
+			uintptr_t p = content + 4;
+			if (n >= eh_frame_entries || !ErrorHandlingFrame::fde_encoding(content - cie_pointer, encoding) || !ErrorHandlingFrame::pointer(p, encoding, initial_location))
+				return false;
+			auto & entry = header->table[n++];
+			return relative(initial_location, entry.initial_location) && relative(record, entry.address);
+		});
+		if (!valid) {
+			LOG_WARNING << "Unable to create binary search table for error handling frame of " << *this << endl;
+			return false;
+		}
 	}
 
+	// Insertion sort (entries are usually already ordered)
+	for (uint32_t i = 1; i < n; i++) {
+		auto entry = header->table[i];
+		uint32_t j = i;
+		for (; j > 0 && header->table[j - 1].initial_location > entry.initial_location; j--)
+			header->table[j] = header->table[j - 1];
+		header->table[j] = entry;
+	}
+	header->fde_count = n;
+	LOG_DEBUG << "Binary search table for error handling frame of " << *this << " has " << n << " entries" << endl;
 	return true;
 }
 
 
+bool ObjectRelocatable::update() {
+	bool success = true;
+	// Reused sections (of previous version) only require relocations pointing to changed sections.
+	// Since they modify code which might be executed, this is done during the update
+	// (with the process stopped, see `Loader::filemodification_update`)
+	if (!reused_relocated) {
+		for (const auto & table : relocation_tables_reused)
+			for (const auto & reloc : table.relocations) {
+				if (reloc.symbol_index() == 0)
+					continue;
+				const auto sym = reloc.symbol();
+				const auto index = sym.section_index();
+				if (sym.undefined() || sym.type() == STT_TLS || index >= section_reused.size() || section_reused[index] || !this->sections[index].allocate())
+					continue;
+				if (relocate(reloc, table.section_offset) == nullptr) {
+					LOG_WARNING << "Failed relocation of offset " << reinterpret_cast<void*>(reloc.offset()) << " in reused section with " << reinterpret_cast<void*>(sym.address()) << endl;
+					success = false;
+				}
+			}
+		reused_relocated = true;
+	}
+
+	for (const auto * tables : { &relocation_tables, &relocation_tables_reused })
+		for (const auto & table : *tables)
+			for (const auto & reloc : table.relocations) {
+				// Update only if target has changed (relocation does not point to latest version).
+				// And if this is not the latest version, then omit (shared) data section relocations
+				// since they are performed in the latest version of this object
+				auto r = relocations.find(reloc);
+				if (r != relocations.end() && !r->value.object().is_latest_version() && is(r->value.type()).in(STT_FUNC, STT_GNU_IFUNC, STT_SECTION))
+					relocate(reloc, table.section_offset);
+			}
+
+	return success;
+}
+
+
+bool ObjectRelocatable::update_writes_code() const {
+	// Relocations in reused code sections (see `update`)
+	if (!reused_relocated)
+		for (const auto & table : relocation_tables_reused)
+			if (table.code)
+				for ([[maybe_unused]] const auto & reloc : table.relocations)
+					return true;
+
+	// Relocations in code pointing to a version which is not the latest one anymore
+	for (const auto * tables : { &relocation_tables, &relocation_tables_reused })
+		for (const auto & table : *tables)
+			if (table.code)
+				for (const auto & reloc : table.relocations) {
+					auto r = relocations.find(reloc);
+					if (r != relocations.end() && !r->value.object().is_latest_version() && is(r->value.type()).in(STT_FUNC, STT_GNU_IFUNC, STT_SECTION))
+						return true;
+				}
+
+	return false;
+}
+
+
 bool ObjectRelocatable::patchable() const {
 	// check if updateable
 	return file_previous != nullptr
@@ -435,14 +862,16 @@ static uintptr_t ifunc(uintptr_t ptr) {
 	return r;
 }
 
-void* ObjectRelocatable::relocate(const Elf::Relocation & reloc, Vector<Elf::Relocation> * postpone) const {
+void* ObjectRelocatable::relocate(const Elf::Relocation & reloc, uintptr_t section_offset, Vector<Pair<Elf::Relocation, uintptr_t>> * postpone) const {
 	// Initialize relocator object
 	Relocator relocator(reloc, 0);
+	// Relocation offsets are relative to their section
+	const uintptr_t target = this->base + section_offset;
 
 	// Since we have only a few segments, iterating is just fine
 	MemorySegment * seg = nullptr;
 	/*for (auto &mem : memory_map)
-		if (mem.target.contains(relocator.address(this->base))) {
+		if (mem.target.contains(relocator.address(target))) {
 			seg = &mem;
 			break;
 		}
@@ -450,7 +879,7 @@ void* ObjectRelocatable::relocate(const Elf::Relocation & reloc, Vector<Elf::Rel
 	// Special case: reading address of GOTPCRELX
 	// TODO: This should only applied to locally defined symbols (but would require a GOT otherwise)
 	if (is(reloc.type()).in(Elf::R_X86_64_REX_GOTPCRELX, Elf::R_X86_64_GOTPCRELX)) {
-		auto * instruction = reinterpret_cast<uint8_t*>(this->base + (seg != nullptr ? seg->compose() - seg->target.address() : 0) + reloc.offset() - 2);
+		auto * instruction = reinterpret_cast<uint8_t*>(target + (seg != nullptr ? seg->compose() - seg->target.address() : 0) + reloc.offset() - 2);
 		if (instruction[0] == 0x8b) {
 			// instruction is MOV (+ register)
 			LOG_TRACE << "Rewriting MOV with GOTPCRELX relocation to LEA at " << reinterpret_cast<void*>(instruction) << endl;
@@ -476,19 +905,24 @@ void* ObjectRelocatable::relocate(const Elf::Relocation & reloc, Vector<Elf::Rel
 			instruction[1] = 0xe9;
 		}
 	}
+	// TLS descriptors
+	if (is(reloc.type()).in(Elf::R_X86_64_GOTPC32_TLSDESC, Elf::R_X86_64_TLSDESC_CALL))
+		return relocate_tlsdesc(reloc, section_offset);
+
 	// find symbol
 	if (reloc.symbol_index() == 0) {
 		// Local relocation (without symbol) -- not sure if can occure at all
 		LOG_INFO << "Relocating local in " << *this <<  endl;
-		return reinterpret_cast<void*>(relocator.fix_internal(this->base, 0, this->file.tls_module_id, this->file.tls_offset));
+		return reinterpret_cast<void*>(relocator.fix_internal(target, 0, this->file.tls_module_id, this->file.tls_offset));
 	} else {
 		const auto needed_symbol = reloc.symbol();
 		// We omit the PLT and directly link the target, hence replacing `plt_entry` with `base + symbol.value()``
-		auto plt_entry = base + needed_symbol.value();
+		const auto needed_value = symbol_value(reloc.symbol_index(), needed_symbol);
+		auto plt_entry = base + needed_value;
 		if (!needed_symbol.undefined()) {
 			if (needed_symbol.type() == STT_GNU_IFUNC) {
 				if (postpone != nullptr) {
-					postpone->push_back(reloc);
+					postpone->emplace_back(reloc, section_offset);
 					return nullptr;
 				} else {
 					plt_entry = ifunc(plt_entry);
@@ -499,16 +933,16 @@ void* ObjectRelocatable::relocate(const Elf::Relocation & reloc, Vector<Elf::Rel
 				auto latest_symbol = this->file.current->resolve_internal_symbol(needed_symbol.name());
 				if (latest_symbol.has_value() && needed_symbol.type() == latest_symbol->type()) {
 					relocations.insert(reloc, latest_symbol.value());
-					auto value = relocator.value_external(this->base, latest_symbol.value(), file.current->base, file.current->base + latest_symbol->value(), this->file.tls_module_id, this->file.tls_offset);
+					auto value = relocator.value_external(target, latest_symbol.value(), file.current->base, file.current->base + latest_symbol->value(), this->file.tls_module_id, this->file.tls_offset);
 					LOG_TRACE << "Updating symbol " << needed_symbol.name() << " in " << *this << " with " << latest_symbol->name() << " from " << *file.current << " to " << reinterpret_cast<void*>(value) << endl;
-					return reinterpret_cast<void*>(relocator.fix_value_external(this->base + (seg != nullptr ? seg->compose() - seg->target.address() : 0), latest_symbol.value(), value));
+					return reinterpret_cast<void*>(relocator.fix_value_external(target + (seg != nullptr ? seg->compose() - seg->target.address() : 0), latest_symbol.value(), value));
 				}
 			}
 			// Local symbol
-			relocations.insert(reloc, needed_symbol);
-			auto value = relocator.value_internal(this->base, plt_entry, this->file.tls_module_id, this->file.tls_offset);
-			LOG_TRACE << "Relocating local symbol " << needed_symbol.name() << " @ " << reinterpret_cast<void*>(base + needed_symbol.value()) << " in " << *this << " to " << reinterpret_cast<void*>(value) << " @ " << reinterpret_cast<void*>(relocator.address(this->base)) << endl;
-			return reinterpret_cast<void*>(relocator.fix_value_internal(this->base + (seg != nullptr ? seg->compose() - seg->target.address() : 0), value));
+			relocations.insert(reloc, ElfSymbolHelper(needed_symbol, needed_value));
+			auto value = relocator.value_internal(target, plt_entry, this->file.tls_module_id, this->file.tls_offset);
+			LOG_TRACE << "Relocating local symbol " << needed_symbol.name() << " @ " << reinterpret_cast<void*>(base + needed_value) << " in " << *this << " to " << reinterpret_cast<void*>(value) << " @ " << reinterpret_cast<void*>(relocator.address(target)) << endl;
+			return reinterpret_cast<void*>(relocator.fix_value_internal(target + (seg != nullptr ? seg->compose() - seg->target.address() : 0), value));
 		} else {
 			// external symbol
 			// COPY Relocations have a defined symbol with the same name
@@ -516,24 +950,25 @@ void* ObjectRelocatable::relocate(const Elf::Relocation & reloc, Vector<Elf::Rel
 			if (auto external_symbol = file.loader.resolve_symbol(needed_symbol.name(), nullptr, file.ns, &file, mode)) {
 				relocations.insert(reloc, external_symbol.value());
 				const auto & external_symobj = external_symbol->object();
+				file.add_symbol_dependency(external_symobj.file);
 				if (postpone != nullptr && external_symbol.value().type() == STT_GNU_IFUNC) {
-					postpone->push_back(reloc);
+					postpone->emplace_back(reloc, section_offset);
 					return nullptr;
 				}
 
-				auto value = relocator.value_external(this->base, external_symbol.value(), external_symobj.base, external_symobj.base + external_symbol->value(), file.tls_module_id, file.tls_offset);
+				auto value = relocator.value_external(target, external_symbol.value(), external_symobj.base, external_symobj.base + external_symbol->value(), file.tls_module_id, file.tls_offset);
 				// Special case for PLT: Trampoline in case a function is unreachable
 				if (!relocator.valid_value(value) && is(external_symbol.value().type()).in(Elf::STT_FUNC, Elf::STT_GNU_IFUNC) && is(reloc.type()).in(Elf::R_X86_64_PLT32, Elf::R_X86_64_PC32)) {
-					auto trampoline_address = reinterpret_cast<uintptr_t>(file.loader.symbol_trampoline.set(external_symbol.value()));
+					auto trampoline_address = reinterpret_cast<uintptr_t>(file.loader.symbol_trampoline.set(external_symbol.value(), relocator.address(target)));
 					if (reloc.type() == Elf::R_X86_64_PLT32) {
-						value = relocator.value(this->base, external_symbol.value(), external_symobj.base, trampoline_address, file.tls_module_id, file.tls_offset);
+						value = relocator.value(target, external_symbol.value(), external_symobj.base, trampoline_address, file.tls_module_id, file.tls_offset);
 					} else if (reloc.type() == Elf::R_X86_64_PC32) {
-						value = relocator.value(this->base, external_symbol.value(), trampoline_address - external_symbol.value().value(), 0, file.tls_module_id, file.tls_offset);
+						value = relocator.value(target, external_symbol.value(), trampoline_address - external_symbol.value().value(), 0, file.tls_module_id, file.tls_offset);
 					}
 					LOG_TRACE << "Using trampoline at " << reinterpret_cast<void*>(trampoline_address) << " (-> new offset " << reinterpret_cast<void*>(value) << ") for " << needed_symbol.name() << " at " << reinterpret_cast<void*>(external_symobj.base + external_symbol->value()) << endl;
 				}
 				LOG_TRACE << "Relocating symbol " << needed_symbol.name() << " in " << *this << " with " << external_symbol->name() << " from " << external_symobj << " to " << reinterpret_cast<void*>(value) << endl;
-				return reinterpret_cast<void*>(relocator.fix_value_external(this->base + (seg != nullptr ? seg->compose() - seg->target.address() : 0), external_symbol.value(), value));
+				return reinterpret_cast<void*>(relocator.fix_value_external(target + (seg != nullptr ? seg->compose() - seg->target.address() : 0), external_symbol.value(), value));
 			} else if (needed_symbol.bind() == STB_WEAK) {
 				LOG_DEBUG << "Unable to resolve weak symbol " << needed_symbol.name() << "..." << endl;
 			} else {
@@ -546,6 +981,62 @@ void* ObjectRelocatable::relocate(const Elf::Relocation & reloc, Vector<Elf::Rel
 	return nullptr;
 }
 
+void* ObjectRelocatable::relocate_tlsdesc(const Elf::Relocation & reloc, uintptr_t section_offset) const {
+	// Object with TLS block and offset of variable
+	const auto needed_symbol = reloc.symbol();
+	const ObjectIdentity * tls_object = &this->file;
+	uintptr_t tls_value = symbol_value(reloc.symbol_index(), needed_symbol);
+	if (needed_symbol.undefined()) {
+		if (auto external_symbol = file.loader.resolve_symbol(needed_symbol.name(), nullptr, file.ns, &file, file.flags.bind_deep == 1 ? Loader::RESOLVE_OBJECT_FIRST : Loader::RESOLVE_DEFAULT)) {
+			relocations.insert(reloc, external_symbol.value());
+			tls_object = &external_symbol->object().file;
+			file.add_symbol_dependency(*tls_object);
+			tls_value = external_symbol->value();
+		} else {
+			LOG_ERROR << "Unable to resolve TLS symbol " << needed_symbol.name() << " for descriptor..." << file << endl;
+			return nullptr;
+		}
+	} else {
+		relocations.insert(reloc, ElfSymbolHelper(needed_symbol, tls_value));
+	}
+
+	auto * instruction = reinterpret_cast<uint8_t*>(this->base + section_offset + reloc.offset());
+	if (reloc.type() == Elf::R_X86_64_TLSDESC_CALL) {
+		// `call *(%rax)` is only required for dynamic TLS, otherwise replace it by a two byte NOP
+		if (tls_object->tls_offset != 0 && instruction[0] == 0xff && instruction[1] == 0x10) {
+			LOG_TRACE << "Rewriting TLS descriptor CALL to NOP at " << reinterpret_cast<void*>(instruction) << endl;
+			instruction[0] = 0x66;
+			instruction[1] = 0x90;
+		}
+		return instruction;
+	}
+
+	// `lea x@tlsdesc(%rip), %rax` will be replaced by `mov $imm32, %rax` (same length) -- or has already been replaced (update)
+	instruction -= 3;
+	if (instruction[0] != 0x48 || !((instruction[1] == 0x8d && instruction[2] == 0x05) || (instruction[1] == 0xc7 && instruction[2] == 0xc0))) {
+		LOG_ERROR << "Unsupported instruction for TLS descriptor of " << needed_symbol.name() << " at " << reinterpret_cast<void*>(instruction) << " in " << *this << endl;
+		return nullptr;
+	}
+
+	intptr_t value;
+	if (tls_object->tls_offset != 0) {
+		// Static TLS: offset to thread pointer
+		value = static_cast<intptr_t>(tls_value) - tls_object->tls_offset;
+	} else if (auto * descriptor = TLSDescriptor::get(*tls_object, tls_value)) {
+		// Dynamic TLS: address of descriptor (in the lower 2 GiB)
+		value = reinterpret_cast<intptr_t>(descriptor);
+	} else {
+		return nullptr;
+	}
+	assert(value >= INT32_MIN && value <= INT32_MAX);
+
+	LOG_TRACE << "Rewriting LEA of TLS descriptor for " << needed_symbol.name() << " to MOV " << reinterpret_cast<void*>(value) << " at " << reinterpret_cast<void*>(instruction) << endl;
+	instruction[1] = 0xc7;
+	instruction[2] = 0xc0;
+	*reinterpret_cast<int32_t*>(instruction + 3) = static_cast<int32_t>(value);
+	return instruction;
+}
+
 bool ObjectRelocatable::initialize(bool preinit) {
 	if (preinit) {
 		LOG_DEBUG << "Preinitialize " << *this << endl;
@@ -583,3 +1074,28 @@ bool ObjectRelocatable::initialize(bool preinit) {
 	}
 	return true;
 }
+
+bool ObjectRelocatable::deinitialize() {
+	LOG_DEBUG << "Deinitialize " << *this << endl;
+	// fini array (in reverse order)
+	for (const auto & section : this->sections)
+		if (section.size() > 0 && section.type() == SHT_FINI_ARRAY) {
+			auto * f = reinterpret_cast<void (**)()>(base + offset_sections[this->sections.index(section)]);
+			for (size_t i = section.size() / sizeof(void*); i > 0; i--)
+				f[i - 1]();
+		}
+
+	// fini func
+	auto fini = symbols.find(SymbolHelper{"_fini"});
+	if (fini != symbols.end() && fini->type() == Elf::STT_FUNC) {
+		reinterpret_cast<void (*)()>(base + fini->value())();
+	} else {
+		// In case there is no _fini function, we have to use the .fini function
+		for (auto & section : this->init_sections)
+			if (strcmp(section.name(), ".fini") == 0) {
+				assert(section.size() > 0 && section.type() == SHT_PROGBITS);
+				reinterpret_cast<void (*)()>(base + offset_sections[this->sections.index(section)])();
+			}
+	}
+	return true;
+}
@@ -5,6 +5,7 @@
 #pragma once
 
 #include <dlh/container/vector.hpp>
+#include <dlh/container/pair.hpp>
 #include <dlh/string.hpp>
 #include <elfo/elf.hpp>
 
@@ -12,9 +13,14 @@
 #include "object/base.hpp"
 #include "symbol.hpp"
 
+struct ErrorHandlingFrameHeader;
+
 struct ObjectRelocatable : public Object {
 	ObjectRelocatable(ObjectIdentity & file, const Object::Data & data);
 
+	/*! \brief Release memory borrowed from previous version */
+	~ObjectRelocatable();
+
  protected:
 	using Object::resolve_symbol;
 
@@ -32,27 +38,99 @@ struct ObjectRelocatable : public Object {
 
 	bool update() override;
 
+	bool update_writes_code() const override;
+
 	bool patchable() const override;
 
 	Optional<VersionedSymbol> resolve_symbol(const char * name, uint32_t hash, uint32_t gnu_hash, const VersionedSymbol::Version & version) const override;
 	Optional<VersionedSymbol> resolve_symbol(uintptr_t addr) const override;
 	Optional<ElfSymbolHelper> resolve_internal_symbol(const SymbolHelper & needle) const override;
 
-	void* relocate(const Elf::Relocation & reloc, Vector<Elf::Relocation> * postpone = nullptr) const;
+	/*! \brief Perform relocation
+	 * \param reloc relocation entry (with offset relative to its section)
+	 * \param section_offset offset of the relocated section (relative to base)
+	 * \param postpone collect relocations to indirect functions (performed after all others) instead of relocating
+	 * \return address of relocation or `nullptr` on error (or if postponed)
+	 */
+	void* relocate(const Elf::Relocation & reloc, uintptr_t section_offset, Vector<Pair<Elf::Relocation, uintptr_t>> * postpone = nullptr) const;
+
+	/*! \brief Relax code sequence of TLS descriptor access (there is no GOT for descriptors)
+	 * \param reloc relocation of type `R_X86_64_GOTPC32_TLSDESC` or `R_X86_64_TLSDESC_CALL`
+	 * \param section_offset offset of the relocated section (relative to base)
+	 * \return address of modified instruction or `nullptr` on error
+	 */
+	void* relocate_tlsdesc(const Elf::Relocation & reloc, uintptr_t section_offset) const;
 
 	bool initialize(bool preinit = false) override;
 
+	bool deinitialize() override;
+
  private:
 	uintptr_t offset = 0;
 	bool preprepared = false;
 
-	Vector<Elf::Array<Elf::Relocation>> relocation_tables;
+	/*! \brief Memory of the previous version is used (increased its `borrowed` counter) */
+	bool borrows = false;
+
+	/*! \brief Relocations in reused sections (of previous version) have been performed */
+	bool reused_relocated = false;
+
+	/*! \brief Relocation table with the offset (relative to base) of the section it applies to */
+	struct RelocationTable {
+		Elf::Array<Elf::Relocation> relocations;
+		uintptr_t section_offset;
+		bool code;  // relocated section contains machine code
+	};
+	Vector<RelocationTable> relocation_tables;
+	Vector<RelocationTable> relocation_tables_reused;
+	Vector<size_t> section_relocations;
+	Vector<bool> section_reused;
 	Vector<Elf::Section> init_sections;
-	Optional<Elf::Section> eh_section;
+	Vector<Elf::Section> eh_sections;
+	size_t eh_frame_entries = 0;
 	Vector<uintptr_t> offset_sections;
 
+	/*! \brief Value (relative to base) of each entry in the symbol table
+	 *  The file-backed symbol table is not modified (to keep its pages clean)
+	 */
+	Vector<uintptr_t> symbol_values;
+
 	HashSet<ElfSymbolHelper, SymbolComparison> symbols;
 
-	/*! \brief Fixup symbols & relocations after assigning an offset to a section */
-	bool adjust_offsets(uintptr_t offset, const Elf::Section & section);
+	/*! \brief Fill binary search table of error handling frame header (after relocation)
+	 * \param header header (with sufficient space for all entries) at end of first error handling frame
+	 * \return `false` if table could not be created
+	 */
+	bool eh_frame_table(ErrorHandlingFrameHeader * header) const;
+
+	/*! \brief Check if section is identical (including its relocations) to a section of the previous version
+	 * \param section code or read-only data section
+	 * \param offset will contain the offset (relative to base) of the section in the previous version
+	 * \return `true` if the section of the previous version can be used
+	 */
+	bool reusable(const Elf::Section & section, uintptr_t & offset) const;
+
+	/*! \brief Mark memory of the previous version as used by this version (prevents its reclaiming) */
+	void borrow();
+
+	/*! \brief Use matching symbols of writable sections from previous version
+	 * \param changed will contain for each section whether it requires new memory
+	 * \param reused will contain for each symbol (of all symbol tables) its value in the previous version (if taken from it)
+	 */
+	void reuse_symbols(Vector<bool> & changed, Vector<Optional<uintptr_t>> & reused);
+
+	/*! \brief Calculate symbol values after assigning offsets to sections (single pass)
+	 * \param rebase offset for each section (if it has to be adjusted)
+	 * \param reused values of symbols which are taken from the previous version
+	 */
+	void adjust_offsets(const Vector<Optional<uintptr_t>> & rebase, const Vector<Optional<uintptr_t>> & reused);
+
+	/*! \brief Value (relative to base) of a symbol
+	 * \param index index in symbol table
+	 * \param sym symbol table entry
+	 * \return value from side table (or of the entry, if not available)
+	 */
+	uintptr_t symbol_value(size_t index, const Elf::Symbol & sym) const {
+		return index < symbol_values.size() ? symbol_values[index] : sym.value();
+	}
 };
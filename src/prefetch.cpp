@@ -0,0 +1,254 @@
+// Luci - a dynamic linker/loader with DSU capabilities
+// Copyright 2021-2023 by Bernhard Heinloth <heinloth@cs.fau.de>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include "prefetch.hpp"
+
+#include <dlh/log.hpp>
+#include <dlh/file.hpp>
+#include <dlh/math.hpp>
+#include <dlh/assert.hpp>
+#include <dlh/mutex.hpp>
+#include <dlh/string.hpp>
+#include <dlh/strptr.hpp>
+#include <dlh/thread.hpp>
+#include <dlh/xxhash.hpp>
+#include <dlh/syscall.hpp>
+
+#include <elfo/elf.hpp>
+
+#include "loader.hpp"
+
+struct Prefetch::Batch {
+	struct Job {
+		/*! \brief Progress (changed by compare & exchange, the one leaving `PENDING` does the work) */
+		enum State {
+			PENDING,  // not started yet
+			RUNNING,  // worker is processing (and holds the lock)
+			DONE,     // worker has finished (data valid if `success` is set)
+			TAKEN     // result consumed (or job withdrawn) by the loader
+		} state = PENDING;
+
+		/*! \brief held by the worker during processing */
+		Mutex lock;
+
+		/*! \brief Full path to file (as it will be used by the loader) */
+		char path[PATH_MAX + 1];
+
+		/*! \brief File opened, mapped and valid */
+		bool success = false;
+
+		/*! \brief Prepared file data */
+		Object::Data data;
+
+		/*! \brief Open, map (populated), validate and (optionally) hash file */
+		void process(bool hash) {
+			const char * name = StrPtr(path).find_last('/').str;
+			Profiler::Scope profile{Loader::instance()->profiler, Profiler::PHASE_OPEN, name};
+			if (auto open = Syscall::open(path, O_RDONLY)) {
+				data.fd = open.value();
+			} else {
+				return;
+			}
+
+			if (struct stat sb; auto fstat = Syscall::fstat(data.fd, &sb)) {
+				data.modification_time = sb.st_mtim;
+				data.size = sb.st_size;
+			} else {
+				Syscall::close(data.fd);
+				return;
+			}
+
+			if (auto mmap = Syscall::mmap(NULL, data.size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, data.fd, 0)) {
+				data.addr = mmap.value();
+			} else {
+				Syscall::close(data.fd);
+				return;
+			}
+
+			// Check ELF identification (further checks are done by the loader)
+			if (data.size < sizeof(Elf::Header) || !reinterpret_cast<const Elf::Header *>(data.addr)->valid()) {
+				Syscall::munmap(data.addr, data.size);
+				Syscall::close(data.fd);
+				return;
+			}
+
+			if (hash) {
+				Profiler::Scope profile_hash{Loader::instance()->profiler, Profiler::PHASE_HASH, name};
+				XXHash64 datahash(StrPtr(path).find_last('/').hash);  // Name hash as seed (same as loader)
+				datahash.add(data.addr, data.size);
+				data.hash = datahash.hash();
+			}
+
+			success = true;
+		}
+
+		/*! \brief Claim job (by loader), waiting for a running worker
+		 * \return `true` if the worker finished the job and the data is valid
+		 */
+		bool claim() {
+			State expected = PENDING;
+			if (__atomic_compare_exchange_n(&state, &expected, TAKEN, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+				return false;
+
+			if (expected == RUNNING) {
+				// Worker holds the lock until it is done
+				Guarded _{lock};
+			}
+
+			expected = DONE;
+			return __atomic_compare_exchange_n(&state, &expected, TAKEN, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE) && success;
+		}
+	};
+
+	/*! \brief Files to prefetch (in load order) */
+	Vector<Job *> jobs;
+
+	/*! \brief Index of next job for workers */
+	size_t next = 0;
+
+	/*! \brief Number of users (workers and prefetch instance) */
+	unsigned references = 1;
+
+	/*! \brief Calculate file hash */
+	bool hash = false;
+
+	~Batch() {
+		for (auto job : jobs)
+			delete job;
+	}
+};
+
+
+void * Prefetch::worker(void * ptr) {
+	Batch * batch = reinterpret_cast<Batch *>(ptr);
+	assert(batch != nullptr);
+
+	for (size_t j; (j = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->jobs.size(); ) {
+		auto job = batch->jobs[j];
+		Guarded _{job->lock};
+		// Lock is acquired before leaving `PENDING` -- the loader will wait for it
+		auto expected = Batch::Job::PENDING;
+		if (__atomic_compare_exchange_n(&job->state, &expected, Batch::Job::RUNNING, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			job->process(batch->hash);
+			__atomic_store_n(&job->state, Batch::Job::DONE, __ATOMIC_RELEASE);
+		}
+	}
+
+	release(batch);
+	return nullptr;
+}
+
+
+void Prefetch::release(Batch * batch) {
+	if (__atomic_sub_fetch(&batch->references, 1, __ATOMIC_ACQ_REL) == 0)
+		delete batch;
+}
+
+
+Prefetch::Prefetch(Loader & loader, const Vector<const char *> & libs, const Vector<const char *> & rpath, const Vector<const char *> & runpath, namespace_t ns, bool hash) : loader(loader), ns(ns), outer(loader.prefetch) {
+	loader.prefetch = this;
+
+	if (loader.config.load_threads == 0 || ns == NAMESPACE_NEW)
+		return;
+
+	batch = new Batch;
+	assert(batch != nullptr);
+	batch->hash = hash;
+
+	for (const auto & lib : libs) {
+		if (loader.library_exclude.contains(lib))
+			continue;
+
+		// Already loaded?
+		if (loader.library(lib, ObjectIdentity::Flags(), false, rpath, runpath, ns, false) != nullptr)
+			continue;
+
+		// Already in batch?
+		StrPtr path(lib);
+		auto name = path.find_last('/');
+		bool duplicate = false;
+		for (auto job : batch->jobs)
+			if (name == StrPtr(job->path).find_last('/')) {
+				duplicate = true;
+				break;
+			}
+		if (duplicate)
+			continue;
+
+		// Find file (same search order as the loader)
+		auto job = new Batch::Job;
+		assert(job != nullptr);
+		bool found = false;
+		if (path == name) {
+			size_t lib_len = String::len(lib);
+			for (const auto & search : { rpath, loader.library_path_runtime, runpath, loader.library_path_config, loader.library_path_default }) {
+				for (const auto & dir : search) {
+					size_t dir_len = String::len(dir);
+					if (dir_len + lib_len + 1 < PATH_MAX) {
+						String::copy(job->path, dir, dir_len);
+						job->path[dir_len] = '/';
+						String::copy(job->path + dir_len + 1, lib, lib_len + 1);
+						if ((found = File::exists(job->path)))
+							break;
+					}
+				}
+				if (found)
+					break;
+			}
+		} else if (String::len(lib) < PATH_MAX) {
+			String::copy(job->path, lib, PATH_MAX);
+			found = File::exists(job->path);
+		}
+
+		if (found)
+			batch->jobs.push_back(job);
+		else
+			delete job;
+	}
+
+	if (batch->jobs.empty())
+		return;
+
+	// Start workers
+	size_t threads = Math::min(static_cast<size_t>(loader.config.load_threads), batch->jobs.size());
+	LOG_DEBUG << "Prefetching " << batch->jobs.size() << " dependencies using " << threads << " threads" << endl;
+	for (size_t t = 0; t < threads; t++) {
+		__atomic_add_fetch(&batch->references, 1, __ATOMIC_RELAXED);
+		if (Thread::create(&worker, batch, true, true, !loader.config.debugger) == nullptr) {
+			LOG_WARNING << "Creating prefetch worker thread failed -- continue sequentially" << endl;
+			release(batch);
+			break;
+		}
+	}
+}
+
+
+Prefetch::~Prefetch() {
+	assert(loader.prefetch == this);
+	loader.prefetch = outer;
+
+	if (batch != nullptr) {
+		// Withdraw remaining jobs and release unused data
+		for (auto job : batch->jobs)
+			if (job->claim()) {
+				Syscall::munmap(job->data.addr, job->data.size);
+				Syscall::close(job->data.fd);
+			}
+		release(batch);
+	}
+}
+
+
+bool Prefetch::take(const char * path, namespace_t ns, Object::Data & data) {
+	if (batch != nullptr && ns == this->ns)
+		for (auto job : batch->jobs)
+			if (String::compare(job->path, path) == 0) {
+				if (!job->claim())
+					break;
+				data = job->data;
+				return true;
+			}
+
+	return outer != nullptr && outer->take(path, ns, data);
+}
@@ -0,0 +1,64 @@
+// Luci - a dynamic linker/loader with DSU capabilities
+// Copyright 2021-2023 by Bernhard Heinloth <heinloth@cs.fau.de>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#pragma once
+
+#include <dlh/types.hpp>
+#include <dlh/container/vector.hpp>
+
+#include "comp/glibc/libdl/interface.hpp"
+#include "object/base.hpp"
+
+struct Loader;
+
+/*! \brief Concurrent prefetching of the dependencies of an object
+ *  The files of the (not yet loaded) needed libraries are opened, mapped (populated), validated
+ *  and hashed by worker threads while the loader continues with the first dependency.
+ *  The objects are still created and inserted into the lookup list sequentially (in the same order
+ *  as without prefetching), the loader just takes the prepared file data -- or does the work on its own
+ *  if no worker has started with the file yet.
+ *  Active instances are chained (nested dependencies) and consulted by `Loader::open`.
+ */
+class Prefetch {
+	/*! \brief Shared state of jobs and workers (released by the last user) */
+	struct Batch;
+	Batch * batch = nullptr;
+
+	/*! \brief Loader */
+	Loader & loader;
+
+	/*! \brief Namespace of the dependencies */
+	namespace_t ns;
+
+	/*! \brief Enclosing prefetch (of the dependent object) */
+	Prefetch * outer;
+
+	/*! \brief Worker thread entry */
+	static void * worker(void * ptr);
+
+	/*! \brief Drop reference to batch (and release it if it was the last one) */
+	static void release(Batch * batch);
+
+ public:
+	/*! \brief Prefetch needed libraries
+	 * \param loader Loader
+	 * \param libs names of needed libraries (in load order)
+	 * \param rpath library search path of the dependent object (`DT_RPATH`)
+	 * \param runpath library search path of the dependent object (`DT_RUNPATH`)
+	 * \param ns namespace
+	 * \param hash calculate the file hash as well (for skipping identical versions)
+	 */
+	Prefetch(Loader & loader, const Vector<const char *> & libs, const Vector<const char *> & rpath, const Vector<const char *> & runpath, namespace_t ns, bool hash);
+
+	/*! \brief Release all file data which was not taken */
+	~Prefetch();
+
+	/*! \brief Take the prepared data of a file (from this or an enclosing prefetch)
+	 * \param path full path to file (as used by the loader)
+	 * \param ns namespace
+	 * \param data file data (fd, size, modification time, mapping and hash) will be assigned if prefetched
+	 * \return `true` if `data` was assigned
+	 */
+	bool take(const char * path, namespace_t ns, Object::Data & data);
+};
@@ -0,0 +1,226 @@
+// Luci - a dynamic linker/loader with DSU capabilities
+// Copyright 2021-2023 by Bernhard Heinloth <heinloth@cs.fau.de>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include "profiler.hpp"
+
+#include <dlh/stream/output.hpp>
+#include <dlh/stream/buffer.hpp>
+#include <dlh/syscall.hpp>
+#include <dlh/string.hpp>
+#include <dlh/log.hpp>
+
+/*! \brief Width of a column in the summary table */
+static const size_t column_width = 10;
+
+static uint64_t now() {
+	struct timespec time = { 0, 0 };
+	Syscall::clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.nanotimestamp();
+}
+
+static size_t digits(uint64_t value) {
+	size_t d = 1;
+	while (value >= 10) {
+		value /= 10;
+		d++;
+	}
+	return d;
+}
+
+static void pad(size_t len, size_t width) {
+	for (; len < width; len++)
+		cerr << ' ';
+}
+
+static void escape(BufferStream & out, const char * str) {
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\')
+			out << '\\' << *str;
+		else if (static_cast<unsigned char>(*str) >= 0x20)
+			out << *str;
+	}
+}
+
+
+Profiler::Scope::Scope(Profiler & profiler, Phase phase, const char * object, unsigned long version) : profiler(profiler), object(object), version(version), phase(phase) {
+	if (profiler.enabled()) {
+		tid = Syscall::gettid();
+		{
+			Guarded _{profiler.lock};
+			// Nesting is only tracked in a single thread at a time
+			if (profiler.active == nullptr || profiler.active->tid == tid) {
+				parent = profiler.active;
+				profiler.active = this;
+				linked = true;
+			}
+		}
+		start = now();
+	}
+}
+
+
+Profiler::Scope::~Scope() {
+	if (start != 0) {
+		uint64_t duration = now() - start;
+
+		Event event;
+		event.phase = phase;
+		event.tid = tid;
+		event.version = version;
+		event.start = start;
+		event.duration = duration;
+		event.self = duration > children ? duration - children : 0;
+		String::copy(event.object, object == nullptr ? "" : object, sizeof(event.object) - 1);
+		event.object[sizeof(event.object) - 1] = '\0';
+
+		Guarded _{profiler.lock};
+		if (linked) {
+			profiler.active = parent;
+			if (parent != nullptr)
+				parent->children += duration;
+		}
+		profiler.events.push_back(event);
+	}
+}
+
+
+Profiler::~Profiler() {
+	if (!events.empty())
+		summary("runtime");
+	// The closing bracket is optional in the trace event format (and omitted, since forked processes share the file)
+	if (trace_fd >= 0)
+		Syscall::close(trace_fd);
+}
+
+
+bool Profiler::setup(bool table, const char * trace_path) {
+	this->table = table;
+	if (trace_path != nullptr) {
+		if (auto open = Syscall::open(trace_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) {
+			trace_fd = open.value();
+			Syscall::write(trace_fd, "[\n", 2);
+		} else {
+			LOG_WARNING << "Opening '" << trace_path << "' for profile trace failed: " << open.error_message() << endl;
+		}
+	}
+	origin = now();
+	return enabled();
+}
+
+
+const char * Profiler::name(Phase phase) {
+	switch (phase) {
+		case PHASE_SEARCH:        return "search";
+		case PHASE_OPEN:          return "open";
+		case PHASE_HASH:          return "hash";
+		case PHASE_BEAN:          return "bean";
+		case PHASE_DEBUG_SYMBOLS: return "debugsym";
+		case PHASE_PRELOAD:       return "preload";
+		case PHASE_MAP:           return "map";
+		case PHASE_PREPARE:       return "prepare";
+		case PHASE_UPDATE:        return "update";
+		case PHASE_FINALIZE:      return "finalize";
+		case PHASE_INIT:          return "init";
+		default:                  return "unknown";
+	}
+}
+
+
+void Profiler::print_table(const char * title) const {
+	struct Row {
+		const char * object;
+		uint64_t self[PHASES];
+		uint64_t total;
+	};
+	Vector<Row> rows;
+	Row sum = {};
+	sum.object = "(total)";
+	size_t object_width = String::len(sum.object);
+
+	// Accumulate self time per object
+	for (const auto & event : events) {
+		Row * row = nullptr;
+		for (auto & r : rows)
+			if (String::compare(r.object, event.object) == 0) {
+				row = &r;
+				break;
+			}
+		if (row == nullptr) {
+			Row r = {};
+			r.object = event.object;
+			rows.push_back(r);
+			row = &rows.back();
+			size_t len = String::len(event.object);
+			if (len > object_width)
+				object_width = len;
+		}
+		row->self[event.phase] += event.self;
+		row->total += event.self;
+		sum.self[event.phase] += event.self;
+		sum.total += event.self;
+	}
+	rows.push_back(sum);
+
+	// Print (in microseconds)
+	cerr << "Luci profile (" << title << "), self time in us:" << endl;
+	cerr << "  object";
+	pad(6, object_width);
+	for (size_t p = 0; p < PHASES; p++) {
+		const char * n = name(static_cast<Phase>(p));
+		pad(String::len(n), column_width);
+		cerr << n;
+	}
+	pad(5, column_width);
+	cerr << "total" << endl;
+
+	for (const auto & row : rows) {
+		cerr << "  " << row.object;
+		pad(String::len(row.object), object_width);
+		for (size_t p = 0; p < PHASES; p++) {
+			uint64_t us = row.self[p] / 1000;
+			pad(digits(us), column_width);
+			cerr << us;
+		}
+		uint64_t us = row.total / 1000;
+		pad(digits(us), column_width);
+		cerr << us << endl;
+	}
+}
+
+
+void Profiler::write_trace() {
+	char buffer[512];
+	pid_t pid = Syscall::getpid();
+	for (const auto & event : events) {
+		BufferStream out(buffer, sizeof(buffer));
+		if (traced++ > 0)
+			out << ",\n";
+		out << "{\"name\":\"" << name(event.phase) << "\",\"cat\":\"";
+		escape(out, event.object);
+		out << "\",\"ph\":\"X\",\"ts\":" << ((event.start - origin) / 1000) << '.' << ((event.start - origin) % 1000 / 100)
+		    << ",\"dur\":" << (event.duration / 1000) << '.' << (event.duration % 1000 / 100)
+		    << ",\"pid\":" << pid << ",\"tid\":" << event.tid
+		    << ",\"args\":{\"object\":\"";
+		escape(out, event.object);
+		out << "\",\"version\":" << event.version << ",\"self_us\":" << (event.self / 1000) << "}}";
+		const char * line = out.str();
+		Syscall::write(trace_fd, line, String::len(line));
+	}
+}
+
+
+void Profiler::summary(const char * title) {
+	if (!enabled())
+		return;
+
+	Guarded _{lock};
+	if (events.empty())
+		return;
+
+	if (table)
+		print_table(title);
+	if (trace_fd >= 0)
+		write_trace();
+	events.clear();
+}
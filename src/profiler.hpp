@@ -0,0 +1,119 @@
+// Luci - a dynamic linker/loader with DSU capabilities
+// Copyright 2021-2023 by Bernhard Heinloth <heinloth@cs.fau.de>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#pragma once
+
+#include <dlh/types.hpp>
+#include <dlh/mutex.hpp>
+#include <dlh/container/vector.hpp>
+
+/*! \brief Timing of the loader phases (per object)
+ *  Each phase is measured by a `Scope` (nested scopes of the same thread are subtracted from the self time).
+ *  At the end of the startup and of each update the collected events are summarized in a table (on standard error)
+ *  and/or appended as complete events (`"ph":"X"`) to a Chrome trace event file (JSON array format).
+ */
+class Profiler {
+ public:
+	/*! \brief Measured phases */
+	enum Phase : uint8_t {
+		PHASE_SEARCH,         // probing library search paths
+		PHASE_OPEN,           // open, stat and map file
+		PHASE_HASH,           // file content hash (XXHash)
+		PHASE_BEAN,           // binary hash (Bean)
+		PHASE_DEBUG_SYMBOLS,  // external debug symbol lookup
+		PHASE_PRELOAD,        // parse dynamic section & load dependencies
+		PHASE_MAP,            // map segments into memory
+		PHASE_PREPARE,        // relocations
+		PHASE_UPDATE,         // update relocations (of previous versions)
+		PHASE_FINALIZE,       // memory protection
+		PHASE_INIT,           // init functions
+		PHASES
+	};
+
+	/*! \brief Measure a phase (until end of scope) */
+	class Scope {
+		Profiler & profiler;
+		Scope * parent = nullptr;
+		const char * object;
+		unsigned long version;
+		uint64_t start = 0;
+		uint64_t children = 0;
+		pid_t tid = 0;
+		Phase phase;
+		bool linked = false;
+
+	 public:
+		/*! \brief Start measurement
+		 * \param profiler profiler instance (nothing will be measured if disabled)
+		 * \param phase measured phase
+		 * \param object name of object
+		 * \param version version of object
+		 */
+		Scope(Profiler & profiler, Phase phase, const char * object, unsigned long version = 0);
+
+		/*! \brief Stop measurement & record event */
+		~Scope();
+	};
+
+ private:
+	/*! \brief Recorded phase */
+	struct Event {
+		Phase phase;
+		pid_t tid;
+		unsigned long version;
+		uint64_t start;
+		uint64_t duration;
+		uint64_t self;
+		char object[48];
+	};
+	Vector<Event> events;
+
+	/*! \brief Innermost scope (for self time) */
+	Scope * active = nullptr;
+
+	/*! \brief Protects `events` and `active` */
+	Mutex lock;
+
+	/*! \brief Print summary table */
+	bool table = false;
+
+	/*! \brief Trace event file descriptor */
+	int trace_fd = -1;
+
+	/*! \brief Time of setup (origin of trace) */
+	uint64_t origin = 0;
+
+	/*! \brief Number of trace events written */
+	unsigned long traced = 0;
+
+	/*! \brief Print self time per object and phase */
+	void print_table(const char * title) const;
+
+	/*! \brief Append recorded events to trace file */
+	void write_trace();
+
+ public:
+	Profiler() {}
+	~Profiler();
+
+	/*! \brief Enable profiling
+	 * \param table print summary table on standard error
+	 * \param trace_path path for Chrome trace event file (or `nullptr`)
+	 * \return `true` if profiling is enabled
+	 */
+	bool setup(bool table, const char * trace_path);
+
+	/*! \brief Is profiling enabled? */
+	bool enabled() const {
+		return table || trace_fd >= 0;
+	}
+
+	/*! \brief Output and reset recorded events
+	 * \param title name of the summarized interval (e.g. `startup`)
+	 */
+	void summary(const char * title);
+
+	/*! \brief Name of phase */
+	static const char * name(Phase phase);
+};
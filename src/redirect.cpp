@@ -8,11 +8,16 @@
 #include <dlh/parser/string.hpp>
 #include <dlh/log.hpp>
 #include <dlh/syscall.hpp>
+#include <dlh/string.hpp>
 #include <dlh/mem.hpp>
+#include <dlh/math.hpp>
 #include <dlh/utility.hpp>
 
+#include "code_patch.hpp"
 #include "loader.hpp"
 #include "memory_segment.hpp"
+#include "thread_registry.hpp"
+#include "thread_scan.hpp"
 
 namespace Redirect {
 
@@ -34,6 +39,15 @@ const struct {
 	/* [MODE_GENERAL_PROTECTION_FAULT] = */  { { 0xf4, 0x00 }, 1, 0, SIGSEGV, "HLT instruction (general protection fault in user mode)" }
 };
 
+/*! \brief Promote redirections to static jumps after this number of trap hits (0 to disable) */
+static size_t promote_hits = 0;
+
+/*! \brief Promote redirections to static jumps after this time in milliseconds (0 to disable) */
+static unsigned long promote_delay = 0;
+
+/*! \brief Minimum time (in milliseconds) a trap has to be in place before (and between) attempts to promote it */
+static const unsigned long promote_grace = 10;
+
 /*! \brief alternative stack for trap signal handler */
 static char trap_handler_stack[4096 * 4];
 static_assert(count(trap_handler_stack) >= SIGSTKSZ);
@@ -57,9 +71,24 @@ struct RedirectionEntry {
 	/*! \brief Opcode replaced by trap */
 	uint8_t previous_opcode[16] = {};
 
-	/*! \brief Trapped threads */
+	/*! \brief Trapped threads (registered in thread registry) */
+	ThreadRegistry::Bitmap trapped{};
+
+	/*! \brief Trapped threads (by ID, only used if thread registry is incomplete) */
 	TreeSet<pid_t> tids{};
 
+	/*! \brief Number of trap hits */
+	size_t hits = 0;
+
+	/*! \brief Installation time of the trap (monotonic, in milliseconds) */
+	unsigned long installed = 0;
+
+	/*! \brief Earliest time for next attempt to promote the trap to a static redirection */
+	unsigned long promote_after = 0;
+
+	/*! \brief Promotion requested by trap handler (performed by helper thread) */
+	bool promote_requested = false;
+
 	/*! \brief Comparator */
 	bool operator==(const RedirectionEntry & other) const {
 		return this->from_object == other.from_object && this->to_address == other.to_address && this->type == other.type;
@@ -70,6 +99,8 @@ struct RedirectionEntry {
 static HashMap<uintptr_t, RedirectionEntry> redirection_entries;
 /*! \brief Helper to synchronize concurrent collection access */
 static RWLock<Mutex> redirection_sync;
+/*! \brief Are there any requested promotions? */
+static bool promotion_requested = false;
 
 /*! \brief Check if a string contains (only) numeric characters
  *  \param str string to be checked
@@ -87,6 +118,7 @@ static bool is_numeric(const char * str) {
 }
 
 /*! \brief Check if collection contains IDs of all currently active tasks
+ *  \note Fallback if there are threads not tracked by the thread registry
  *  \param tids collection of Thread IDs
  *  \return `true` if the Thread IDs of all currently active tasks are listed in the collection
  */
@@ -100,6 +132,15 @@ static bool all_tasks(TreeSet<pid_t> & tids) {
 	return true;
 }
 
+/*! \brief Current monotonic time
+ *  \return time in milliseconds (using coarse clock, hence usually no system call)
+ */
+static unsigned long timestamp() {
+	struct timespec time = { 0, 0 };
+	Syscall::clock_gettime(CLOCK_MONOTONIC_COARSE, &time);
+	return static_cast<unsigned long>(time.tv_sec) * 1000UL + static_cast<unsigned long>(time.tv_nsec) / 1000000UL;
+}
+
 /*! \brief check if a relative jump is possible
  *  \param from address to be redirected
  *  \param to target address
@@ -113,50 +154,103 @@ static bool check_relative_jump(uintptr_t from, uintptr_t to) {
 /*! \brief Create a static (permanent) redirection
  *  This will create a relative jump if target is within 2 GB (5 byte opcode)
  *  or a 16 byte opcode for an absolute jump.
+ *  If possible, the live code is modified using the cross modifying code protocol,
+ *  otherwise a compose buffer is used to replace the code.
  *  \param object the object containing the address
  *  \param from the address in object which should be modified (redirected)
  *  \param to the target address to redirect to
+ *  \param live_only only modify the live code using the cross modifying code protocol (no compose buffer)
  */
-static bool static_redirect(Object & object, uintptr_t from, uintptr_t to) {
-	MemorySegment * seg = nullptr;
-	uint8_t * m = reinterpret_cast<uint8_t*>(object.compose_pointer(from, &seg));
-	if (m == nullptr)
-		return false;
+static bool static_redirect(Object & object, uintptr_t from, uintptr_t to, bool live_only = false) {
+	uint8_t code[16];
+	size_t size = 0;
 
 	// Check if we could do a relative jmp
 	if (check_relative_jump(from, to)) {
 		uint32_t rel = static_cast<uint32_t>(to - from - 5);
 		// jmp $rel
-		*(m++) = 0xe9;
-		*(m++) = (rel >> 0) & 0xff;
-		*(m++) = (rel >> 8) & 0xff;
-		*(m++) = (rel >> 16) & 0xff;
-		*(m++) = (rel >> 24) & 0xff;
+		code[size++] = 0xe9;
+		code[size++] = (rel >> 0) & 0xff;
+		code[size++] = (rel >> 8) & 0xff;
+		code[size++] = (rel >> 16) & 0xff;
+		code[size++] = (rel >> 24) & 0xff;
 	} else {
 		uint64_t abs = static_cast<uint64_t>(to);
 		// Hacky 64 bit absolute jmp
 		// jmp [rip + 0]
-		*(m++) = 0xff;
-		*(m++) = 0x25;
-		*(m++) = 0x00;
-		*(m++) = 0x00;
-		*(m++) = 0x00;
-		*(m++) = 0x00;
+		code[size++] = 0xff;
+		code[size++] = 0x25;
+		code[size++] = 0x00;
+		code[size++] = 0x00;
+		code[size++] = 0x00;
+		code[size++] = 0x00;
 		// at rip: the 64 bit address
-		*(m++) = (abs >> 0) & 0xff;
-		*(m++) = (abs >> 8) & 0xff;
-		*(m++) = (abs >> 16) & 0xff;
-		*(m++) = (abs >> 24) & 0xff;
-		*(m++) = (abs >> 32) & 0xff;
-		*(m++) = (abs >> 40) & 0xff;
-		*(m++) = (abs >> 48) & 0xff;
-		*(m++) = (abs >> 56) & 0xff;
+		code[size++] = (abs >> 0) & 0xff;
+		code[size++] = (abs >> 8) & 0xff;
+		code[size++] = (abs >> 16) & 0xff;
+		code[size++] = (abs >> 24) & 0xff;
+		code[size++] = (abs >> 32) & 0xff;
+		code[size++] = (abs >> 40) & 0xff;
+		code[size++] = (abs >> 48) & 0xff;
+		code[size++] = (abs >> 56) & 0xff;
 	}
+
+	// Modify live code (if there are no pending changes in the compose buffer)
+	if (CodePatch::available())
+		for (auto & seg : object.memory_map)
+			if (seg.target.contains(from)) {
+				if (seg.buffer == 0 && seg.target.status == MemorySegment::MEMSEG_MAPPED && CodePatch::write(from, code, size, traps[mode].instructions, traps[mode].size, seg.target.effective_protection))
+					return true;
+				break;
+			}
+
+	if (live_only)
+		return false;
+
+	MemorySegment * seg = nullptr;
+	uint8_t * m = reinterpret_cast<uint8_t*>(object.compose_pointer(from, &seg, size));
+	if (m == nullptr)
+		return false;
+	for (size_t i = 0; i < size; i++)
+		m[i] = code[i];
+
 	// Apply changes
 	return seg->finalize();
 }
 
 
+/*! \brief Check if a hot or long lasting trap should be promoted to a static redirection,
+ *  although not all threads have passed it yet
+ *  \param entry redirection entry
+ *  \param hits current number of hits
+ *  \return `true` if policy requests a promotion
+ */
+static bool promotable(const RedirectionEntry & entry, size_t hits) {
+	if ((promote_hits == 0 || hits < promote_hits) && promote_delay == 0)
+		return false;
+	auto now = timestamp();
+	if (now < entry.promote_after)
+		return false;
+	return (promote_hits != 0 && hits >= promote_hits) || (promote_delay != 0 && now >= entry.installed + promote_delay);
+}
+
+/*! \brief Request promotion of a trap to a static redirection
+ *  Inspecting the other threads is too expensive for the trap handler (and would block them while holding the lock),
+ *  hence it is performed by the helper thread.
+ *  \param entry redirection entry (requires write lock)
+ *  \param from address of trap
+ */
+static void request_promotion(RedirectionEntry & entry, uintptr_t from) {
+	entry.promote_after = timestamp() + Math::max(promote_grace, promote_delay);
+	if (!CodePatch::available()) {
+		LOG_DEBUG << "Unable to promote trap at " << reinterpret_cast<void*>(from) << " without core serialization" << endl;
+		entry.promote_after = ~0UL;
+	} else if (!entry.promote_requested) {
+		entry.promote_requested = true;
+		__atomic_store_n(&promotion_requested, true, __ATOMIC_RELEASE);
+	}
+}
+
 /*! \brief Trap signal handler
  *  \brief signal the signal number
  *  \brief si pointer to signal info structure
@@ -173,6 +267,9 @@ static void trap_handler(int signal, siginfo *si, ucontext *context) {
 	for (size_t i = 0; i <  traps[mode].size; i++) {
 		auto instruction = reinterpret_cast<uint8_t*>(rip - trap.offset)[i];
 		if (instruction != trap.instructions[i]) {
+			// Trap might have been replaced by static redirection in the meantime
+			if (is_set(rip - trap.offset))
+				break;
 			LOG_WARNING << "Got signal " << si->si_signo << ':' << si->si_code << " at " << reinterpret_cast<void*>(rip) << " -" << trap.offset
 			            << " but trap instructions don't match: " << hex << setw(2) << setfill(0) << static_cast<int>(instruction) << " vs " << static_cast<int>(trap.instructions[i]) << endl;
 			return;
@@ -191,17 +288,34 @@ static void trap_handler(int signal, siginfo *si, ucontext *context) {
 		rip = entry.to_address;
 		// In case this should be replaced by an jmp at some point...
 		if (entry.type == RedirectionEntry::MAKE_STATIC) {
+			size_t hits = __atomic_add_fetch(&entry.hits, 1, __ATOMIC_RELAXED);
 			// ... we have to wait until every task has reached this point, to ensure that we don't change code currently executed
-			auto tid = Syscall::gettid();
-			if (!entry.tids.contains(tid)) {
+			size_t slot = 0;
+			bool registered = ThreadRegistry::complete() && ThreadRegistry::slot(Thread::self(), slot);
+			pid_t tid = registered ? 0 : Syscall::gettid();
+			bool first = registered ? !entry.trapped.test(slot) : !entry.tids.contains(tid);
+			// ... or the policy allows an earlier promotion
+			bool hot = promotable(entry, hits);
+			if (first || hot) {
 				// We will change the set, hence needing write lock
 				redirection_sync.read_unlock();
 				redirection_sync.write_lock();
-				entry.tids.insert(tid);
-				// Check if all tasks of the thread have hit the trap and try to install the static redirect
-				if (all_tasks(entry.tids) && static_redirect(entry.from_object, trap_address, entry.to_address)) {
-					LOG_DEBUG << "Installed a static redirection from " << reinterpret_cast<void*>(trap_address) << " (" << entry.from_object << ") to " << reinterpret_cast<void*>(entry.to_address) << endl;
-					entry.type = RedirectionEntry::MADE_STATIC;
+				if (entry.type == RedirectionEntry::MAKE_STATIC) {
+					bool all = false;
+					if (first && registered) {
+						entry.trapped.set(slot);
+						all = ThreadRegistry::covered(entry.trapped);
+					} else if (first) {
+						entry.tids.insert(tid);
+						all = all_tasks(entry.tids);
+					}
+					// Check if all tasks of the thread have hit the trap and try to install the static redirect
+					if (all && static_redirect(entry.from_object, trap_address, entry.to_address)) {
+						LOG_DEBUG << "Installed a static redirection from " << reinterpret_cast<void*>(trap_address) << " (" << entry.from_object << ") to " << reinterpret_cast<void*>(entry.to_address) << " after " << hits << " hits" << endl;
+						entry.type = RedirectionEntry::MADE_STATIC;
+					} else if (hot) {
+						request_promotion(entry, trap_address);
+					}
 				}
 				redirection_sync.write_unlock();
 				return;
@@ -213,7 +327,7 @@ static void trap_handler(int signal, siginfo *si, ucontext *context) {
 	redirection_sync.read_unlock();
 }
 
-bool setup(Mode mode) {
+bool setup(Mode mode, size_t promote_hits, unsigned long promote_delay) {
 	if (mode >= MODE_NOT_CONFIGURED) {
 		LOG_ERROR << "Invalid mode " << static_cast<int>(mode) << endl;
 		return false;
@@ -230,6 +344,11 @@ bool setup(Mode mode) {
 	const auto & trap = traps[mode];
 	LOG_INFO << "Setting up redirections using " << trap.desc << endl;
 
+	Redirect::promote_hits = promote_hits;
+	Redirect::promote_delay = promote_delay;
+	if (promote_hits > 0 || promote_delay > 0)
+		LOG_INFO << "Promoting traps to static jumps after " << promote_hits << " hits or " << promote_delay << " ms (0 = disabled)" << endl;
+
 	sigstack stack;
 	stack.ss_sp = reinterpret_cast<void*>(trap_handler_stack);
 	stack.ss_size = count(trap_handler_stack);
@@ -244,7 +363,7 @@ bool setup(Mode mode) {
 	sigaction action;
 	action.sa_flags = SA_ONSTACK | SA_SIGINFO;
 	action.sa_sigaction = trap_handler;      /* Address of a signal handler */
-	// TODO: Benchmark performance between trap and illegal opcode signal
+	// Performance of the different traps can be compared using test/bench/trap
 	if (auto sigaction = Syscall::sigaction(trap.signal, &action, nullptr)) {
 		LOG_DEBUG << "Installed trap signal handler" << endl;
 		return true;
@@ -300,12 +419,16 @@ bool add(Object & from_object, uintptr_t from_address, uintptr_t to_address, siz
 	}
 
 	MemorySegment *seg = nullptr;
-	uint8_t * ptr = reinterpret_cast<uint8_t*>(from_object.compose_pointer(from_address + from_object.base, &seg));
+	uint8_t * ptr = reinterpret_cast<uint8_t*>(from_object.compose_pointer(from_address + from_object.base, &seg, 16));
 	if (ptr == nullptr)
 		return false;
 	assert(seg != nullptr);
 
 	RedirectionEntry entry{from_object, to_address, type};
+	if (type == RedirectionEntry::MAKE_STATIC && (promote_hits > 0 || promote_delay > 0)) {
+		entry.installed = timestamp();
+		entry.promote_after = entry.installed + promote_grace;
+	}
 
 	// store previous opcode (in case this should be made removed at some point)
 	for (size_t i = 0; i < bytes_to_preserve; i++)
@@ -341,13 +464,15 @@ bool remove(uintptr_t address, bool finalize) {
 		auto & val = e->value;
 		// Recover old opcode
 		MemorySegment *seg = nullptr;
-		uint8_t * ptr = reinterpret_cast<uint8_t*>(val.from_object.compose_pointer(address + val.from_object.base, &seg));
+		uint8_t * ptr = reinterpret_cast<uint8_t*>(val.from_object.compose_pointer(address + val.from_object.base, &seg, 16));
 		if (ptr != nullptr) {
 			size_t bytes_to_be_recovered = val.type == RedirectionEntry::MADE_STATIC ? (check_relative_jump(address, val.to_address) ? 5 : 16) : 1;
 			for (size_t i = 0; i < bytes_to_be_recovered; i++)
 				ptr[i] = val.previous_opcode[i];
 		}
 
+		LOG_DEBUG << "Removing redirection at " << reinterpret_cast<void*>(address) << " after " << val.hits << " hits" << endl;
+
 		// delete entry
 		redirection_entries.erase(e);
 
@@ -361,6 +486,59 @@ bool remove(uintptr_t address, bool finalize) {
 	}
 }
 
+size_t promote() {
+	if (mode == MODE_NONE || !__atomic_exchange_n(&promotion_requested, false, __ATOMIC_ACQ_REL))
+		return 0;
+
+	// Collect requests (the threads are inspected without holding the lock)
+	Vector<Pair<uintptr_t, uintptr_t>> requests;
+	{
+		GuardedReader _(redirection_sync);
+		for (const auto & e : redirection_entries)
+			if (e.value.type == RedirectionEntry::MAKE_STATIC && e.value.promote_requested)
+				requests.emplace_back(e.key, e.value.to_address);
+	}
+
+	size_t promoted = 0;
+	for (const auto & request : requests) {
+		uintptr_t from = request.first;
+		uintptr_t to = request.second;
+		// No thread may execute or return into the code to be replaced (except at its start, which is the trap)
+		Vector<Pair<uintptr_t, uintptr_t>> code;
+		code.emplace_back(from + 1, from + (check_relative_jump(from, to) ? 5 : 16));
+		bool referenced = ThreadScan::referenced(code);
+
+		GuardedWriter _(redirection_sync);
+		auto e = redirection_entries.find(from);
+		if (!e || e->value.type != RedirectionEntry::MAKE_STATIC || e->value.to_address != to)
+			continue;
+		auto & entry = e->value;
+		entry.promote_requested = false;
+		if (referenced) {
+			LOG_DEBUG << "Trap at " << reinterpret_cast<void*>(from) << " is not quiescent -- postpone promotion" << endl;
+			entry.promote_after = timestamp() + Math::max(promote_grace, promote_delay);
+		} else if (static_redirect(entry.from_object, from, to, true)) {
+			LOG_DEBUG << "Promoted redirection from " << reinterpret_cast<void*>(from) << " (" << entry.from_object << ") to " << reinterpret_cast<void*>(to) << " to a static jump after " << entry.hits << " hits" << endl;
+			entry.type = RedirectionEntry::MADE_STATIC;
+			promoted++;
+		}
+	}
+	return promoted;
+}
+
+size_t release(const Object & object) {
+	if (mode == MODE_NONE)
+		return 0;
+	GuardedWriter _(redirection_sync);
+	Vector<uintptr_t> addresses;
+	for (const auto & e : redirection_entries)
+		if (&(e.value.from_object) == &object)
+			addresses.push_back(e.key);
+	for (const auto & address : addresses)
+		redirection_entries.erase(address);
+	return addresses.size();
+}
+
 bool is_set(uintptr_t from, uintptr_t * to) {
 	if (mode == MODE_NONE)
 		return false;
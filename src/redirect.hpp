@@ -25,9 +25,11 @@ enum Mode {
 /*! \brief Setup redirection
  *  installs the trap signal handler
  *  \param mode set the instructions should be used for interruption
+ *  \param promote_hits promote trap to static jump after this number of hits, even if not all threads have passed it (0 to disable)
+ *  \param promote_delay promote trap to static jump after this time in milliseconds, even if not all threads have passed it (0 to disable)
  *  \return `true` if signal handler was installed
  */
-bool setup(Mode mode = MODE_BREAKPOINT_TRAP);
+bool setup(Mode mode = MODE_BREAKPOINT_TRAP, size_t promote_hits = 0, unsigned long promote_delay = 0);
 
 /*! \brief Add redirection
  *  \param from_object Object containing the address to be redirected
@@ -92,6 +94,20 @@ bool remove(Symbol & from, bool finalize = false) {
 	return from.valid() ? remove(reinterpret_cast<uintptr_t>(from.pointer()), finalize) : false;
 }
 
+/*! \brief Promote traps to static jumps (as requested by the promotion policy)
+ *  Only traps without any thread executing (or returning into) the replaced code are promoted.
+ *  \note Called periodically by the helper thread
+ *  \return number of promoted redirections
+ */
+size_t promote();
+
+/*! \brief Remove all redirections in an object
+ *  The original code will not be restored (since the object is about to be unmapped)
+ *  \param object Object containing the redirected addresses
+ *  \return number of removed redirections
+ */
+size_t release(const Object & object);
+
 /*! \brief check if there is a redirection set
  *  \param from memory address to check
  *  \param to pointer to variable to store the target address (or nullptr to ignore)
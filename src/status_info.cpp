@@ -0,0 +1,257 @@
+// Luci - a dynamic linker/loader with DSU capabilities
+// Copyright 2021-2023 by Bernhard Heinloth <heinloth@cs.fau.de>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include "status_info.hpp"
+
+#include <dlh/log.hpp>
+#include <dlh/mem.hpp>
+#include <dlh/assert.hpp>
+#include <dlh/string.hpp>
+#include <dlh/syscall.hpp>
+
+#include "object/identity.hpp"
+
+static const char magic[8] = { 'L', 'U', 'C', 'I', 'S', 'T', 'A', 'T' };
+static const uint32_t format_version = 1;
+
+StatusInfo::StatusInfo() {
+	for (size_t s = 0; s < slots; s++) {
+		ring[s].sequence = s;
+		ring[s].strings = nullptr;
+	}
+}
+
+StatusInfo::~StatusInfo() {
+	close();
+	for (auto & name : names)
+		Memory::free(name.value);
+}
+
+bool StatusInfo::open(const char * path, bool binary) {
+	assert(fd < 0);
+	if (auto open = Syscall::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) {
+		fd = open.value();
+		this->binary = binary;
+		if (binary) {
+			Header header;
+			Memory::copy(reinterpret_cast<uintptr_t>(header.magic), reinterpret_cast<uintptr_t>(magic), sizeof(magic));
+			header.version = format_version;
+			header.record_size = sizeof(Record);
+			if (auto write = Syscall::write(fd, &header, sizeof(Header)); write.failed())
+				LOG_WARNING << "Writing status info header failed: " << write.error_message() << endl;
+		}
+		return true;
+	} else {
+		LOG_INFO << "Opening '" << path << "' for status info failed: " << open.error_message() << endl;
+		return false;
+	}
+}
+
+void StatusInfo::close() {
+	if (fd >= 0) {
+		drain();
+		if (auto close = Syscall::close(fd)) {
+			LOG_INFO << "Destroyed status info handle" << endl;
+		} else {
+			LOG_ERROR << "Closing status info handle failed: " << close.error_message() << endl;
+		}
+		fd = -1;
+	}
+}
+
+uint64_t StatusInfo::now(clockid_t clock) {
+	struct timespec time = { 0, 0 };
+	Syscall::clock_gettime(clock, &time);
+	return time.nanotimestamp();
+}
+
+/*! \brief Print number with leading zeros */
+static void print_padded(BufferStream & out, uint64_t value, unsigned digits) {
+	for (uint64_t limit = 10; digits > 1; digits--, limit *= 10)
+		if (value < limit)
+			out << '0';
+	out << value;
+}
+
+/*! \brief Print realtime timestamp (UTC) as `YYYY-MM-DD HH:MM:SS.uuuuuu` */
+static void print_time(BufferStream & out, uint64_t timestamp) {
+	uint64_t seconds = timestamp / 1'000'000'000;
+	uint64_t days = seconds / 86400;
+	uint64_t time = seconds % 86400;
+
+	// Civil date from days since epoch (proleptic gregorian calendar)
+	uint64_t z = days + 719468;
+	uint64_t era = z / 146097;
+	uint64_t doe = z - era * 146097;
+	uint64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	uint64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	uint64_t mp = (5 * doy + 2) / 153;
+	uint64_t day = doy - (153 * mp + 2) / 5 + 1;
+	uint64_t month = mp < 10 ? mp + 3 : mp - 9;
+	uint64_t year = yoe + era * 400 + (month <= 2 ? 1 : 0);
+
+	print_padded(out, year, 4);
+	out << '-';
+	print_padded(out, month, 2);
+	out << '-';
+	print_padded(out, day, 2);
+	out << ' ';
+	print_padded(out, time / 3600, 2);
+	out << ':';
+	print_padded(out, time / 60 % 60, 2);
+	out << ':';
+	print_padded(out, time % 60, 2);
+	out << '.';
+	print_padded(out, timestamp % 1'000'000'000 / 1000, 6);
+}
+
+bool StatusInfo::push(const Record & record, char * strings) {
+	// Bounded multi-producer queue: each slot carries the position it is ready for
+	unsigned long pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+	Slot * slot;
+	while (true) {
+		slot = ring + (pos % slots);
+		unsigned long sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		if (sequence == pos) {
+			if (__atomic_compare_exchange_n(&head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (static_cast<long>(sequence - pos) < 0) {
+			// Not consumed yet
+			return false;
+		} else {
+			pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+		}
+	}
+	slot->record = record;
+	slot->strings = strings;
+	__atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+void StatusInfo::event(uint32_t & id, const char * name, const char * path, uint16_t info, uint64_t version, uint64_t duration, uint64_t bytes) {
+	if (fd < 0)
+		return;
+
+	Record record;
+	Memory::set(reinterpret_cast<uintptr_t>(&record), 0, sizeof(Record));
+	record.pid = Syscall::getpid();
+	record.timestamp = now(CLOCK_REALTIME);
+
+	// Assign identifier on first event of object
+	uint32_t expected = 0;
+	if (__atomic_load_n(&id, __ATOMIC_RELAXED) == 0 && __atomic_compare_exchange_n(&id, &expected, __atomic_add_fetch(&objects, 1, __ATOMIC_RELAXED), false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		// Copy name and path (owned by the consumer)
+		size_t name_len = name == nullptr ? 0 : String::len(name);
+		size_t path_len = path == nullptr ? 0 : String::len(path);
+		char * strings = Memory::alloc_array<char>(name_len + path_len + 2);
+		if (strings != nullptr) {
+			String::copy(strings, name == nullptr ? "" : name, name_len + 1);
+			String::copy(strings + name_len + 1, path == nullptr ? "" : path, path_len + 1);
+			record.type = Record::RECORD_OBJECT;
+			record.object = id;
+			record.length = static_cast<uint32_t>(name_len + path_len + 2);
+			while (!push(record, strings))
+				drain();
+		}
+	}
+
+	record.type = Record::RECORD_EVENT;
+	record.info = info;
+	record.length = 0;
+	record.object = id;
+	record.version = version;
+	record.duration = duration;
+	record.bytes = bytes;
+	while (!push(record, nullptr))
+		drain();
+
+	if (synchronous)
+		drain();
+}
+
+void StatusInfo::render(BufferStream & out, const Record & record) const {
+	switch (record.info) {
+		case ObjectIdentity::INFO_ERROR_OPEN:          out << "ERROR (opening file failed)"; break;
+		case ObjectIdentity::INFO_ERROR_STAT:          out << "ERROR (retrieving file status failed)"; break;
+		case ObjectIdentity::INFO_ERROR_MAP:           out << "ERROR (mapping whole file into memory failed)"; break;
+		case ObjectIdentity::INFO_ERROR_CREATE:        out << "ERROR (not able to create object)"; break;
+		case ObjectIdentity::INFO_ERROR_ELF:           out << "ERROR (unsupported format)"; break;
+		case ObjectIdentity::INFO_ERROR_INOTIFY:       out << "ERROR (not able to watch for file modifications)"; break;
+		case ObjectIdentity::INFO_IDENTICAL_TIME:      out << "IGNORED (new version has same modification time)"; break;
+		case ObjectIdentity::INFO_IDENTICAL_HASH:      out << "IGNORED (new version has same hash)"; break;
+		case ObjectIdentity::INFO_UPDATE_DISABLED:     out << "FAILED (dynamic updates are disabled)"; break;
+		case ObjectIdentity::INFO_UPDATE_INCOMPATIBLE: out << "FAILED (new version is incompatible)"; break;
+		case ObjectIdentity::INFO_UPDATE_MODIFIED:     out << "FAILED (relocated data was altered)"; break;
+		case ObjectIdentity::INFO_UPDATE_TRANSACTION:  out << "FAILED (update transaction was rejected)"; break;
+		case ObjectIdentity::INFO_FAILED_PRELOADING:   out << "FAILED (preload was unsuccessful)"; break;
+		case ObjectIdentity::INFO_FAILED_MAPPING:      out << "FAILED (mapping of segments was unsuccessful)"; break;
+		case ObjectIdentity::INFO_FAILED_REUSE:        out << "FAILED (reusing outdated code)"; break;
+		case ObjectIdentity::INFO_CONTINUE_LOAD:       out << "ERROR (open was successful, but not continued load)"; break;
+		case ObjectIdentity::INFO_SUCCESS_LOAD:        out << "SUCCESS (loaded initial version)"; break;
+		case ObjectIdentity::INFO_SUCCESS_UPDATE:      out << "SUCCESS (updated to new version)"; break;
+		case ObjectIdentity::INFO_SUCCESS_RECLAIM:     out << "SUCCESS (reclaimed outdated version, " << record.bytes << " bytes released in total)"; break;
+		default:                                       out << "ERROR (invalid info type)"; break;
+	}
+	auto name = names.find(record.object);
+	if (name != names.end()) {
+		const char * path = name->value + String::len(name->value) + 1;
+		out << " for " << name->value << " [" << path << "]";
+	}
+	out << " in PID " << record.pid << " at ";
+	print_time(out, record.timestamp);
+	out << endl;
+}
+
+void StatusInfo::drain() {
+	Guarded _{consumer};
+	char buffer[PATH_MAX * 2 + 256];
+	while (true) {
+		Slot & slot = ring[tail % slots];
+		if (__atomic_load_n(&slot.sequence, __ATOMIC_ACQUIRE) != tail + 1)
+			break;
+
+		const Record record = slot.record;
+		char * strings = slot.strings;
+		__atomic_store_n(&slot.sequence, tail + slots, __ATOMIC_RELEASE);
+		tail++;
+
+		if (fd < 0) {
+			if (strings != nullptr)
+				Memory::free(strings);
+		} else if (binary) {
+			Syscall::write(fd, &record, sizeof(Record));
+			if (strings != nullptr) {
+				Syscall::write(fd, strings, record.length);
+				Memory::free(strings);
+			}
+		} else if (record.type == Record::RECORD_OBJECT) {
+			// Keep for rendering events
+			if (strings != nullptr)
+				names.insert(record.object, strings);
+		} else {
+			BufferStream out(buffer, sizeof(buffer));
+			render(out, record);
+			const char * line = out.str();
+			Syscall::write(fd, line, String::len(line));
+		}
+	}
+}
+
+void StatusInfo::discard() {
+	Guarded _{consumer};
+	while (true) {
+		Slot & slot = ring[tail % slots];
+		if (__atomic_load_n(&slot.sequence, __ATOMIC_ACQUIRE) != tail + 1)
+			break;
+		// Names are still required for rendering subsequent events
+		if (slot.strings != nullptr) {
+			if (!binary && slot.record.type == Record::RECORD_OBJECT)
+				names.insert(slot.record.object, slot.strings);
+			else
+				Memory::free(slot.strings);
+		}
+		__atomic_store_n(&slot.sequence, tail + slots, __ATOMIC_RELEASE);
+		tail++;
+	}
+}
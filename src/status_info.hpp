@@ -0,0 +1,155 @@
+// Luci - a dynamic linker/loader with DSU capabilities
+// Copyright 2021-2023 by Bernhard Heinloth <heinloth@cs.fau.de>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#pragma once
+
+#include <dlh/types.hpp>
+#include <dlh/mutex.hpp>
+#include <dlh/syscall.hpp>
+#include <dlh/stream/buffer.hpp>
+#include <dlh/container/hash.hpp>
+
+/*! \brief Status info output (about loaded, updated and reclaimed objects)
+ *  Events are recorded in a bounded lock-free ring buffer (multiple producers) and written
+ *  in batches by the helper thread (or by the producer itself if there is no helper thread or the ring is full).
+ *  The output is either the human readable text format (one line per event)
+ *  or a compact binary format: A `Header` followed by `Record`s,
+ *  each `RECORD_OBJECT` is followed by the object name and path (both null-terminated, `length` bytes in total).
+ *  See `tools/statusinfo.c` for a reader.
+ */
+class StatusInfo {
+ public:
+	/*! \brief Binary file header */
+	struct Header {
+		/*! \brief Magic identification (`LUCISTAT`) */
+		char magic[8];
+
+		/*! \brief Format version */
+		uint32_t version;
+
+		/*! \brief Size of a record */
+		uint32_t record_size;
+	} __attribute__((packed));
+
+	/*! \brief Binary record */
+	struct Record {
+		enum Type : uint16_t {
+			RECORD_OBJECT = 1,  // First occurrence of an object (name and path follow)
+			RECORD_EVENT = 2    // Status change of an object
+		};
+
+		/*! \brief Type of record */
+		uint16_t type;
+
+		/*! \brief Status (`ObjectIdentity::Info`) */
+		uint16_t info;
+
+		/*! \brief Size of following strings (`RECORD_OBJECT` only) */
+		uint32_t length;
+
+		/*! \brief Process ID */
+		uint32_t pid;
+
+		/*! \brief Object identifier (unique per process) */
+		uint32_t object;
+
+		/*! \brief Version of object */
+		uint64_t version;
+
+		/*! \brief Time of event (realtime clock, nanoseconds since epoch) */
+		uint64_t timestamp;
+
+		/*! \brief Duration of the operation (load, update or transaction) in nanoseconds (0 if not measured) */
+		uint64_t duration;
+
+		/*! \brief Released bytes (in total, for reclaimed versions) */
+		uint64_t bytes;
+	} __attribute__((packed));
+
+ private:
+	/*! \brief Number of slots in ring buffer */
+	static const size_t slots = 256;
+
+	struct Slot {
+		/*! \brief Sequence number (position the slot is ready for) */
+		unsigned long sequence;
+
+		/*! \brief Recorded data */
+		Record record;
+
+		/*! \brief Object name and path (`RECORD_OBJECT` only, owned by slot) */
+		char * strings;
+	} ring[slots];
+
+	/*! \brief Next position to write (producers) */
+	unsigned long head = 0;
+
+	/*! \brief Next position to read (consumer) */
+	unsigned long tail = 0;
+
+	/*! \brief Last assigned object identifier */
+	uint32_t objects = 0;
+
+	/*! \brief Held by the consumer */
+	Mutex consumer;
+
+	/*! \brief Names of objects (text format only) */
+	HashMap<uint32_t, char *> names;
+
+	/*! \brief Output descriptor */
+	int fd = -1;
+
+	/*! \brief Use binary format */
+	bool binary = false;
+
+	/*! \brief Insert record into ring buffer
+	 * \return `false` if full
+	 */
+	bool push(const Record & record, char * strings);
+
+	/*! \brief Write record in text format */
+	void render(BufferStream & out, const Record & record) const;
+
+ public:
+	/*! \brief Has the consumer to be called by the producer? (there is no helper thread) */
+	bool synchronous = true;
+
+	StatusInfo();
+	~StatusInfo();
+
+	/*! \brief Open output file (or named pipe)
+	 * \param path path to output file
+	 * \param binary use binary format (instead of text)
+	 * \return `true` if opened
+	 */
+	bool open(const char * path, bool binary);
+
+	/*! \brief Flush pending events and close output */
+	void close();
+
+	/*! \brief Is output enabled? */
+	bool enabled() const {
+		return fd >= 0;
+	}
+
+	/*! \brief Record status change of an object
+	 * \param id object identifier (will be assigned on first event)
+	 * \param name name of object
+	 * \param path path of object
+	 * \param info status (`ObjectIdentity::Info`)
+	 * \param version version of object
+	 * \param duration duration of the operation in nanoseconds (or 0)
+	 * \param bytes released bytes (or 0)
+	 */
+	void event(uint32_t & id, const char * name, const char * path, uint16_t info, uint64_t version, uint64_t duration = 0, uint64_t bytes = 0);
+
+	/*! \brief Write all pending events (consumer) */
+	void drain();
+
+	/*! \brief Discard pending events (in forked child, they will be written by the parent) */
+	void discard();
+
+	/*! \brief Current time of clock in nanoseconds */
+	static uint64_t now(clockid_t clock = CLOCK_MONOTONIC);
+};
@@ -8,17 +8,22 @@
 #include "object/base.hpp"
 
 VersionedSymbol::VersionedSymbol(const Elf::Symbol & sym, const char * version_name, bool version_weak, const char * version_file)
- : Elf::Symbol(sym), version(version_name, version_weak, version_file) {
+ : Elf::Symbol(sym), version(version_name, version_weak, version_file), _value(sym.value()) {
+	assert(sym.valid());
+}
+
+VersionedSymbol::VersionedSymbol(const ElfSymbolHelper & sym, const char * version_name, bool version_weak, const char * version_file)
+ : Elf::Symbol(sym), version(version_name, version_weak, version_file), _value(sym.value()) {
 	assert(sym.valid());
 }
 
 VersionedSymbol::VersionedSymbol(const Elf::Symbol & sym, const Version & version, uint32_t hash, uint32_t gnu_hash)
- : Elf::Symbol(sym), version(version), _hash_value(hash), _gnu_hash_value(gnu_hash) {
+ : Elf::Symbol(sym), version(version), _hash_value(hash), _gnu_hash_value(gnu_hash), _value(sym.value()) {
 	assert(sym.valid());
 }
 
 VersionedSymbol::VersionedSymbol(const Elf::Symbol & sym, const Version & version)
- : Elf::Symbol(sym), version(version) {
+ : Elf::Symbol(sym), version(version), _value(sym.value()) {
 	assert(sym.valid());
 }
 
@@ -45,17 +45,23 @@ struct SymbolHelper {
 
 struct ElfSymbolHelper : Elf::Symbol {
 	using Elf::Symbol::name;
-	using Elf::Symbol::value;
 	using Elf::Symbol::size;
 	using Elf::Symbol::bind;
 	using Elf::Symbol::type;
 	using Elf::Symbol::visibility;
 	using Elf::Symbol::section_index;
 
-	ElfSymbolHelper(const Elf::Symbol & sym) : Elf::Symbol(sym), _gnu_hash_value(ELF_Def::gnuhash(sym.name())) {}  // NOLINT
+	ElfSymbolHelper(const Elf::Symbol & sym) : ElfSymbolHelper(sym, sym.value()) {}  // NOLINT
+	/*! \brief Symbol with a value differing from its (file-backed) symbol table entry (e.g. in a relocated section) */
+	ElfSymbolHelper(const Elf::Symbol & sym, uintptr_t value) : Elf::Symbol(sym), _value(value), _gnu_hash_value(ELF_Def::gnuhash(sym.name())) {}
 	ElfSymbolHelper(const ElfSymbolHelper & other) = default;
 	ElfSymbolHelper(ElfSymbolHelper && other) = default;
 
+	/*! \brief Symbol value (might differ from the symbol table entry) */
+	uintptr_t value() const {
+		return _value;
+	}
+
 	uint32_t gnu_hash_value() const {
 		return _gnu_hash_value;
 	}
@@ -71,6 +77,7 @@ struct ElfSymbolHelper : Elf::Symbol {
 	}
 
  private:
+	uintptr_t _value;
 	const uint32_t _gnu_hash_value;
 };
 
@@ -78,7 +85,6 @@ struct ElfSymbolHelper : Elf::Symbol {
 struct VersionedSymbol : Elf::Symbol {
 	using Elf::Symbol::valid;
 	using Elf::Symbol::name;
-	using Elf::Symbol::value;
 	using Elf::Symbol::size;
 	using Elf::Symbol::bind;
 	using Elf::Symbol::type;
@@ -105,6 +111,7 @@ struct VersionedSymbol : Elf::Symbol {
 	} version;
 
 	VersionedSymbol(const Elf::Symbol & sym, const char * version_name = nullptr, bool version_weak = false, const char * version_file = nullptr);  // NOLINT
+	VersionedSymbol(const ElfSymbolHelper & sym, const char * version_name = nullptr, bool version_weak = false, const char * version_file = nullptr);  // NOLINT
 	VersionedSymbol(const Elf::Symbol & sym, const Version & version, uint32_t hash, uint32_t gnu_hash);
 	VersionedSymbol(const Elf::Symbol & sym, const Version & version);
 	VersionedSymbol(const VersionedSymbol & other) = default;
@@ -125,6 +132,11 @@ struct VersionedSymbol : Elf::Symbol {
 		return !operator==(o);
 	}
 
+	/*! \brief Symbol value (might differ from the symbol table entry) */
+	uintptr_t value() const {
+		return _value;
+	}
+
 	uint32_t hash_value() const {
 		if (!_hash_value.has_value())
 			_hash_value = ELF_Def::hash(this->name());
@@ -146,6 +158,7 @@ struct VersionedSymbol : Elf::Symbol {
  private:
 	mutable Optional<uint32_t> _hash_value;
 	mutable Optional<uint32_t> _gnu_hash_value;
+	uintptr_t _value;
 };
 
 struct SymbolComparison {
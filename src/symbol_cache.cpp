@@ -0,0 +1,60 @@
+// Luci - a dynamic linker/loader with DSU capabilities
+// Copyright 2021-2023 by Bernhard Heinloth <heinloth@cs.fau.de>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include "symbol_cache.hpp"
+
+#include <dlh/string.hpp>
+
+bool SymbolCache::get(const char * name, uint32_t gnu_hash, const char * version, bool next, unsigned long generation, void * & address) const {
+	const Entry & entry = entries[gnu_hash % slots];
+
+	unsigned long sequence = __atomic_load_n(&entry.sequence, __ATOMIC_ACQUIRE);
+	if ((sequence & 1) != 0)
+		return false;
+
+	// Copy entry...
+	unsigned long entry_generation = entry.generation;
+	uint32_t entry_gnu_hash = entry.gnu_hash;
+	bool entry_next = entry.next;
+	const char * entry_name = entry.name;
+	const char * entry_version = entry.version;
+	void * entry_address = entry.address;
+
+	// ... and check if it is consistent (before dereferencing the strings)
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&entry.sequence, __ATOMIC_RELAXED) != sequence)
+		return false;
+
+	// Strings are valid as long as the generation has not changed
+	if (entry_generation != generation || entry_gnu_hash != gnu_hash || entry_next != next || entry_name == nullptr)
+		return false;
+	if ((entry_version == nullptr) != (version == nullptr))
+		return false;
+	if (version != nullptr && String::compare(entry_version, version) != 0)
+		return false;
+	if (String::compare(entry_name, name) != 0)
+		return false;
+
+	address = entry_address;
+	return true;
+}
+
+void SymbolCache::set(const char * name, uint32_t gnu_hash, const char * version, bool next, unsigned long generation, void * address) {
+	Entry & entry = entries[gnu_hash % slots];
+
+	// Skip if another thread is currently writing this slot
+	unsigned long sequence = __atomic_load_n(&entry.sequence, __ATOMIC_RELAXED);
+	if ((sequence & 1) != 0 || !__atomic_compare_exchange_n(&entry.sequence, &sequence, sequence + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	entry.generation = generation;
+	entry.gnu_hash = gnu_hash;
+	entry.next = next;
+	entry.name = name;
+	entry.version = version;
+	entry.address = address;
+
+	__atomic_store_n(&entry.sequence, sequence + 2, __ATOMIC_RELEASE);
+}
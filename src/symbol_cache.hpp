@@ -0,0 +1,49 @@
+// Luci - a dynamic linker/loader with DSU capabilities
+// Copyright 2021-2023 by Bernhard Heinloth <heinloth@cs.fau.de>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#pragma once
+
+#include <dlh/types.hpp>
+
+/*! \brief Small direct mapped cache for results of `dlsym` / `dlvsym` of a handle
+ *  Readers do not take a lock, each entry is protected by a sequence counter
+ *  (odd while being written, a concurrent writer for the same slot skips the update).
+ *  Entries are only valid for the generation of the loader they were inserted in,
+ *  hence loading, updating or releasing objects implicitly invalidates the whole cache.
+ */
+class SymbolCache {
+	static const size_t slots = 16;
+
+	struct Entry {
+		unsigned long sequence = 0;
+		unsigned long generation = 0;
+		uint32_t gnu_hash = 0;
+		bool next = false;          // lookup after the object (`RTLD_NEXT`)
+		const char * name = nullptr;     // symbol name (in string table of the resolved object)
+		const char * version = nullptr;  // requested version name (in string table of the resolved object)
+		void * address = nullptr;
+	} entries[slots];
+
+ public:
+	/*! \brief Look up cached address
+	 * \param name symbol name
+	 * \param gnu_hash GNU hash of symbol name
+	 * \param version requested version (or nullptr)
+	 * \param next lookup after the object (`RTLD_NEXT`)
+	 * \param generation current generation of the loader
+	 * \param address cached address (if found)
+	 * \return `true` if cached
+	 */
+	bool get(const char * name, uint32_t gnu_hash, const char * version, bool next, unsigned long generation, void * & address) const;
+
+	/*! \brief Store address
+	 * \param name symbol name (must remain valid for the generation)
+	 * \param gnu_hash GNU hash of symbol name
+	 * \param version requested version (or nullptr, must remain valid for the generation)
+	 * \param next lookup after the object (`RTLD_NEXT`)
+	 * \param generation current generation of the loader
+	 * \param address resolved address
+	 */
+	void set(const char * name, uint32_t gnu_hash, const char * version, bool next, unsigned long generation, void * address);
+};
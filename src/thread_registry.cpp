@@ -0,0 +1,114 @@
+// Luci - a dynamic linker/loader with DSU capabilities
+// Copyright 2021-2023 by Bernhard Heinloth <heinloth@cs.fau.de>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include "thread_registry.hpp"
+
+#include <dlh/log.hpp>
+#include <dlh/mutex.hpp>
+
+namespace ThreadRegistry {
+
+/*! \brief Thread structures of the slots */
+static Thread * threads[capacity] = {};
+
+/*! \brief Slots in use */
+static Bitmap used;
+
+/*! \brief Upper bound of slots in use */
+static size_t limit = 0;
+
+/*! \brief Set if there are threads missing in the registry */
+static bool incomplete = false;
+
+/*! \brief Synchronize access */
+static Mutex lock;
+
+bool add(Thread * thread) {
+	if (thread == nullptr)
+		return false;
+
+	Guarded _{lock};
+	size_t free = capacity;
+	for (size_t i = 0; i < limit; i++)
+		if (threads[i] == thread)
+			return true;
+		else if (free == capacity && threads[i] == nullptr)
+			free = i;
+
+	if (free == capacity) {
+		if (limit == capacity) {
+			LOG_WARNING << "Thread registry exhausted (" << capacity << " threads) -- unable to track Thread " << reinterpret_cast<void*>(thread) << endl;
+			incomplete = true;
+			return false;
+		}
+		free = limit++;
+	}
+	threads[free] = thread;
+	used.set(free);
+	LOG_TRACE << "Registered Thread " << reinterpret_cast<void*>(thread) << " in slot " << free << endl;
+	return true;
+}
+
+void remove(Thread * thread) {
+	Guarded _{lock};
+	for (size_t i = 0; i < limit; i++)
+		if (threads[i] == thread) {
+			threads[i] = nullptr;
+			used.clear(i);
+			LOG_TRACE << "Unregistered Thread " << reinterpret_cast<void*>(thread) << " from slot " << i << endl;
+			break;
+		}
+	while (limit > 0 && threads[limit - 1] == nullptr)
+		limit--;
+}
+
+void reset(Thread * thread) {
+	{
+		Guarded _{lock};
+		for (size_t i = 0; i < limit; i++)
+			threads[i] = nullptr;
+		used = Bitmap();
+		limit = 0;
+		incomplete = false;
+	}
+	add(thread);
+}
+
+bool slot(const Thread * thread, size_t & slot) {
+	Guarded _{lock};
+	for (size_t i = 0; i < limit; i++)
+		if (threads[i] == thread) {
+			slot = i;
+			return true;
+		}
+	incomplete = true;
+	return false;
+}
+
+bool complete() {
+	return !incomplete;
+}
+
+void foreach(void (*func)(Thread * thread, void * arg), void * arg) {
+	Guarded _{lock};
+	for (size_t i = 0; i < limit; i++)
+		if (threads[i] != nullptr)
+			func(threads[i], arg);
+}
+
+bool covered(const Bitmap & bitmap) {
+	Guarded _{lock};
+	if (incomplete)
+		return false;
+	for (size_t w = 0; w * 64 < limit; w++)
+		// Slots in use but not in the given set...
+		if (uint64_t missing = used.words[w] & ~bitmap.words[w])
+			for (size_t b = 0; b < 64; b++)
+				// ... are only allowed for terminated threads (thread ID cleared by kernel) or threads not started yet
+				if ((missing & (1UL << b)) != 0 && threads[w * 64 + b]->tid != 0)
+					return false;
+	return true;
+}
+
+}  // namespace ThreadRegistry
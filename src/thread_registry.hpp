@@ -0,0 +1,84 @@
+// Luci - a dynamic linker/loader with DSU capabilities
+// Copyright 2021-2023 by Bernhard Heinloth <heinloth@cs.fau.de>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#pragma once
+
+#include <dlh/types.hpp>
+#include <dlh/thread.hpp>
+
+/*! \brief Registry of the (user) threads of the process
+ *  Threads are added when their thread structure is prepared for `clone` (in the pthread create path)
+ *  and removed when the structure is released. Since the kernel clears the thread ID in the thread
+ *  structure on exit, terminated threads can be detected without any system call.
+ *  Each thread occupies a slot, which allows tracking sets of threads using bitmaps.
+ */
+namespace ThreadRegistry {
+
+/*! \brief Maximum number of tracked threads */
+const size_t capacity = 1024;
+
+/*! \brief Set of threads (one bit per slot) */
+struct Bitmap {
+	uint64_t words[capacity / 64] = {};
+
+	/*! \brief Add slot */
+	void set(size_t slot) {
+		words[slot / 64] |= 1UL << (slot % 64);
+	}
+
+	/*! \brief Remove slot */
+	void clear(size_t slot) {
+		words[slot / 64] &= ~(1UL << (slot % 64));
+	}
+
+	/*! \brief Check if slot is set */
+	bool test(size_t slot) const {
+		return (words[slot / 64] & (1UL << (slot % 64))) != 0;
+	}
+};
+
+/*! \brief Add thread to registry
+ *  \param thread thread structure (will be ignored if already registered)
+ *  \return `true` if thread is registered
+ */
+bool add(Thread * thread);
+
+/*! \brief Remove thread from registry
+ *  \param thread thread structure
+ */
+void remove(Thread * thread);
+
+/*! \brief Reset registry to a single thread
+ *  \note has to be called in a forked child
+ *  \param thread the only remaining thread
+ */
+void reset(Thread * thread);
+
+/*! \brief Get the slot of a thread
+ *  If the thread is not registered, the registry is considered as incomplete
+ *  \param thread thread structure
+ *  \param slot variable to store the slot
+ *  \return `true` if the thread is registered
+ */
+bool slot(const Thread * thread, size_t & slot);
+
+/*! \brief Check if all threads are registered
+ *  \return `false` if a thread could not be registered or an unknown thread has been encountered
+ */
+bool complete();
+
+/*! \brief Call function for each registered thread
+ *  \note the registry is locked during the iteration
+ *  \param func callback with thread structure and custom argument
+ *  \param arg custom argument for callback
+ */
+void foreach(void (*func)(Thread * thread, void * arg), void * arg);
+
+/*! \brief Check if every running registered thread is contained in the given set
+ *  \param threads set of threads
+ *  \return `true` if registry is complete and contains no running thread missing in the set
+ */
+bool covered(const Bitmap & threads);
+
+}  // namespace ThreadRegistry
@@ -0,0 +1,229 @@
+// Luci - a dynamic linker/loader with DSU capabilities
+// Copyright 2021-2023 by Bernhard Heinloth <heinloth@cs.fau.de>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include "thread_scan.hpp"
+
+#include <dlh/parser/string.hpp>
+#include <dlh/stream/string.hpp>
+#include <dlh/syscall.hpp>
+#include <dlh/string.hpp>
+#include <dlh/math.hpp>
+#include <dlh/mem.hpp>
+#include <dlh/dir.hpp>
+#include <dlh/log.hpp>
+
+namespace ThreadScan {
+
+/*! \brief Parse hexadecimal number (with optional `0x` prefix)
+ * \param str pointer to string, will point to the first character after the number
+ * \return parsed value
+ */
+static uintptr_t parse_hex(const char * & str) {
+	uintptr_t value = 0;
+	if (str[0] == '0' && str[1] == 'x')
+		str += 2;
+	for (;; str++)
+		if (*str >= '0' && *str <= '9')
+			value = value * 16 + (*str - '0');
+		else if (*str >= 'a' && *str <= 'f')
+			value = value * 16 + (*str - 'a' + 10);
+		else
+			return value;
+}
+
+/*! \brief Find memory mapping (in `/proc/self/maps`) containing the given address
+ * \param address address inside mapping (e.g. stack pointer)
+ * \param start start address of mapping
+ * \param end end address of mapping
+ * \return `true` if mapping was found
+ */
+static bool memory_mapping(uintptr_t address, uintptr_t & start, uintptr_t & end) {
+	auto fd = Syscall::open("/proc/self/maps", O_RDONLY);
+	if (fd.failed())
+		return false;
+
+	bool found = false;
+	char buf[4096];
+	size_t len = 0;
+	while (!found) {
+		auto read = Syscall::read(fd.value(), buf + len, sizeof(buf) - len - 1);
+		if (read.failed() || read.value() <= 0)
+			break;
+		len += read.value();
+		buf[len] = '\0';
+		const char * line = buf;
+		for (const char * eol; !found && (eol = String::find(line, '\n')) != nullptr; line = eol + 1) {
+			// Format: start-end perms offset dev inode path
+			const char * str = line;
+			start = parse_hex(str);
+			if (*(str++) == '-') {
+				end = parse_hex(str);
+				found = address >= start && address < end;
+			}
+		}
+		// Keep incomplete line
+		len = buf + len - line;
+		Memory::move(buf, line, len);
+		if (len >= sizeof(buf) - 1)
+			len = 0;
+	}
+	Syscall::close(fd.value());
+	return found;
+}
+
+/*! \brief Number of attempts to sample a running thread (waiting 1 ms in between) */
+static const unsigned running_thread_samples = 10;
+
+bool referenced(const Vector<Pair<uintptr_t, uintptr_t>> & ranges) {
+	auto in_range = [&ranges](uintptr_t address) -> bool {
+		for (const auto & r : ranges)
+			if (address >= r.first && address < r.second)
+				return true;
+		return false;
+	};
+
+	// Stacks are read via procfs, since they might vanish during the scan
+	auto mem = Syscall::open("/proc/self/mem", O_RDONLY);
+	if (mem.failed()) {
+		LOG_WARNING << "Opening memory of process failed: " << mem.error_message() << endl;
+		return true;
+	}
+
+	bool referenced = false;
+	pid_t self = Syscall::gettid();
+	pid_t tid;
+	for (auto e : Directory("/proc/self/task")) {
+		if (!Parser::string(tid, e.name()) || tid == self)
+			continue;
+
+		// Get stack & instruction pointer of (blocked) thread
+		StringStream<64> path;
+		path << "/proc/self/task/" << tid << "/syscall";
+		char info[256];
+		size_t info_len = 0;
+		bool ended = false;
+		// Running threads cannot be inspected -- sample again until they are blocked (bounded)
+		for (unsigned sample = 0; sample < running_thread_samples; sample++) {
+			info_len = 0;
+			if (auto fd = Syscall::open(path.str(), O_RDONLY)) {
+				if (auto read = Syscall::read(fd.value(), info, sizeof(info) - 1); read.success() && read.value() > 0)
+					info_len = read.value();
+				else if (read.failed() && read.error() == ESRCH)
+					ended = true;
+				Syscall::close(fd.value());
+			} else if (fd.error() == ENOENT || fd.error() == ESRCH) {
+				ended = true;
+			}
+			if (ended || info_len == 0 || String::compare(info, "running", 7) != 0)
+				break;
+			Syscall::poll(nullptr, 0, 1);
+		}
+		// Thread has already ended
+		if (ended)
+			continue;
+		// State is unknown
+		if (info_len == 0) {
+			LOG_DEBUG << "Unable to get state of thread " << tid << endl;
+			referenced = true;
+			break;
+		}
+		info[info_len] = '\0';
+		if (String::compare(info, "running", 7) == 0) {
+			LOG_DEBUG << "Thread " << tid << " is still running -- unable to scan stack" << endl;
+			referenced = true;
+			break;
+		}
+		// Last two values are stack and instruction pointer
+		const char * values[2] = { nullptr, nullptr };
+		for (const char * c = info; *c != '\0'; c++)
+			if (*c == ' ') {
+				values[0] = values[1];
+				values[1] = c + 1;
+			}
+		if (values[0] == nullptr) {
+			referenced = true;
+			break;
+		}
+		uintptr_t sp = parse_hex(values[0]);
+		uintptr_t pc = parse_hex(values[1]);
+		if (in_range(pc)) {
+			LOG_DEBUG << "Thread " << tid << " executes inspected range at " << reinterpret_cast<void*>(pc) << endl;
+			referenced = true;
+			break;
+		}
+
+		// Scan stack for return addresses
+		uintptr_t stack_start, stack_end;
+		if (!memory_mapping(sp, stack_start, stack_end)) {
+			LOG_WARNING << "Unable to find stack of thread " << tid << " at " << reinterpret_cast<void*>(sp) << endl;
+			referenced = true;
+			break;
+		}
+		uintptr_t buf[512];
+		for (uintptr_t addr = sp & ~(sizeof(uintptr_t) - 1); !referenced && addr < stack_end; addr += sizeof(buf)) {
+			size_t len = Math::min(sizeof(buf), stack_end - addr);
+			if (auto lseek = Syscall::lseek(mem.value(), static_cast<off_t>(addr), SEEK_SET); lseek.failed())
+				break;
+			auto read = Syscall::read(mem.value(), buf, len);
+			if (read.failed() || read.value() <= 0)
+				break;
+			for (size_t w = 0; w < static_cast<size_t>(read.value()) / sizeof(uintptr_t); w++)
+				if (in_range(buf[w])) {
+					LOG_DEBUG << "Stack of thread " << tid << " references inspected range " << reinterpret_cast<void*>(buf[w]) << " at " << reinterpret_cast<void*>(addr + w * sizeof(uintptr_t)) << endl;
+					referenced = true;
+					break;
+				}
+		}
+		if (referenced)
+			break;
+	}
+	Syscall::close(mem.value());
+	return referenced;
+}
+
+/*! \brief Number of attempts to wait for a thread entering the stopped state (waiting 1 ms in between) */
+static const unsigned stop_samples = 100;
+
+bool stopped(pid_t pid) {
+	StringStream<64> task;
+	task << "/proc/" << pid << "/task";
+	pid_t tid;
+	for (auto e : Directory(task.str())) {
+		if (!Parser::string(tid, e.name()))
+			continue;
+
+		StringStream<64> path;
+		path << task.str() << '/' << tid << "/stat";
+		bool is_stopped = false;
+		bool ended = false;
+		for (unsigned sample = 0; !is_stopped && !ended && sample < stop_samples; sample++) {
+			if (sample > 0)
+				Syscall::poll(nullptr, 0, 1);
+			auto fd = Syscall::open(path.str(), O_RDONLY);
+			// Thread has already ended
+			if (fd.failed()) {
+				ended = fd.error() == ENOENT || fd.error() == ESRCH;
+				continue;
+			}
+			// Format: tid (comm) state ... -- comm might contain spaces and parentheses
+			char info[256];
+			auto read = Syscall::read(fd.value(), info, sizeof(info) - 1);
+			Syscall::close(fd.value());
+			if (read.failed() || read.value() <= 0) {
+				ended = read.failed() && read.error() == ESRCH;
+				continue;
+			}
+			info[read.value()] = '\0';
+			const char * comm_end = String::find_last(info, ')');
+			is_stopped = comm_end != nullptr && comm_end[1] == ' ' && (comm_end[2] == 'T' || comm_end[2] == 't');
+		}
+		if (!is_stopped && !ended) {
+			LOG_DEBUG << "Thread " << tid << " of process " << pid << " has not stopped" << endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+}  // namespace ThreadScan
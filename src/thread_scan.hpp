@@ -0,0 +1,29 @@
+// Luci - a dynamic linker/loader with DSU capabilities
+// Copyright 2021-2023 by Bernhard Heinloth <heinloth@cs.fau.de>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#pragma once
+
+#include <dlh/types.hpp>
+#include <dlh/container/vector.hpp>
+#include <dlh/container/pair.hpp>
+
+/*! \brief Inspect the state of other threads (via procfs)
+ *  Only blocked threads can be inspected; running threads are sampled again for a short time
+ *  and considered to reference the memory if they keep running.
+ */
+namespace ThreadScan {
+
+/*! \brief Check if any thread (except the caller) executes or has a reference on its stack into the given ranges
+ * \param ranges memory ranges (e.g. code and data of an outdated version)
+ * \return `true` if the ranges are referenced (or the thread state is unknown)
+ */
+bool referenced(const Vector<Pair<uintptr_t, uintptr_t>> & ranges);
+
+/*! \brief Wait (bounded) until all threads of the given process are stopped (e.g. after `SIGSTOP`)
+ * \param pid process id
+ * \return `true` if every thread is in stopped state
+ */
+bool stopped(pid_t pid);
+
+}  // namespace ThreadScan
@@ -11,13 +11,26 @@
 #include <dlh/container/vector.hpp>
 
 #include "comp/glibc/init.hpp"
+#include "thread_registry.hpp"
 
-/*! \brief Addtional space reserved for DTV (negative offset) */
-static const size_t dtv_magic_offset = 1;
+/*! \brief Addtional space reserved for DTV (negative offset: slab and number of modules) */
+static const size_t dtv_magic_offset = 2;
 
 size_t TLS::add_module(ObjectIdentity & object, size_t size, size_t align, uintptr_t image, size_t image_size, intptr_t & offset) {
 	Guarded _{lock};
 	assert(size > 0);
+
+	// Reuse module ID of an unloaded object (requires all threads to be known, since their DTV entries have been reset)
+	size_t modid = 0;
+	if (gen > 0 && ThreadRegistry::complete())
+		for (size_t mid = initial_count + 1; mid <= modules.size(); mid++)
+			if (modules[mid - 1].released) {
+				modid = mid;
+				break;
+			}
+	const Module * released = modid == 0 ? nullptr : &modules[modid - 1];
+
+	size_t slab_offset = 0;
 	if (gen == 0) {
 		initial_count++;
 		// Alignment of initial TLS is the maximum alignment of its modules
@@ -27,14 +40,46 @@ size_t TLS::add_module(ObjectIdentity & object, size_t size, size_t align, uintp
 		initial_size += Math::align_up(size, initial_align);
 		// Offset to thread pointer
 		offset = static_cast<intptr_t>(initial_size);
+		static_used = initial_size;
+	} else if (released != nullptr && released->offset != 0 && size <= released->size && align <= initial_align && released->offset % align == 0) {
+		// reuse static TLS block of unloaded module
+		offset = released->offset;
+		LOG_DEBUG << "Placing TLS of " << object << " in static surplus at offset -" << offset << " (reusing module ID " << modid << ")" << endl;
+	} else if (auto end = Math::align_up(static_used + size, align); align <= initial_align && end <= initial_size + surplus && ThreadRegistry::complete()) {
+		// dynamic module fits into remaining static TLS surplus (requires all threads to be known for initialization)
+		offset = static_cast<intptr_t>(end);
+		static_used = end;
+		LOG_DEBUG << "Placing TLS of " << object << " in static surplus at offset -" << end << " (" << (initial_size + surplus - static_used) << " bytes left)" << endl;
 	} else {
 		// dynamic modules have no fixed offset
 		offset = 0;
+		if (released != nullptr && released->offset == 0 && size <= released->size && align <= slab_align && released->slab_offset % align == 0) {
+			// Reuse space in slab layout of unloaded module
+			slab_offset = released->slab_offset;
+		} else {
+			// Append to slab layout
+			slab_offset = Math::align_up(slab_size, align);
+			slab_size = slab_offset + size;
+			if (slab_align < align)
+				slab_align = align;
+		}
 	}
+
 	// add to module list
-	modules.emplace_back(object, size, align, image, image_size, offset);
+	Module * module;
+	if (released != nullptr) {
+		module = &modules[modid - 1];
+		module->~Module();
+		new (module) Module(object, size, align, image, image_size, offset);
+	} else {
+		module = modules.emplace_back(object, size, align, image, image_size, offset).operator->();
+		modid = modules.size();
+	}
+	if (gen > 0 && offset != 0)
+		module->pending = true;
+	else if (gen > 0)
+		module->slab_offset = slab_offset;
 
-	auto modid = modules.size();
 	// GLIBC stuff
 	GLIBC::init_tls(object, size, align, image, image_size, offset, modid);
 
@@ -42,6 +87,22 @@ size_t TLS::add_module(ObjectIdentity & object, size_t size, size_t align, uintp
 	return modid;
 }
 
+void TLS::remove_module(size_t module_id) {
+	Guarded _{lock};
+	assert(module_id > initial_count && module_id <= modules.size());
+	auto & module = modules[module_id - 1];
+	assert(!module.released);
+	module.released = true;
+	module.pending = false;
+
+	// Reset DTV entries (the block might be assigned to another module later)
+	ThreadRegistry::foreach([](Thread * thread, void * arg) {
+		size_t module_id = *reinterpret_cast<size_t *>(arg);
+		if (thread->dtv != nullptr && module_id <= dtv_module_size(thread->dtv))
+			thread->dtv[module_id].pointer.val = TLS_UNALLOCATED;
+	}, &module_id);
+}
+
 void TLS::dtv_setup(Thread * thread) {
 	if (gen == 0)
 		gen = 1;
@@ -71,13 +132,54 @@ void TLS::dtv_setup(Thread * thread) {
 		dtv_copy(thread, mid, reinterpret_cast<void*>(addr));
 	}
 
+	// Dynamically loaded modules in static TLS surplus
+	for (size_t mid = initial_count + 1; mid <= modules.size(); mid++) {
+		auto & module = modules[mid - 1];
+		if (module.offset != 0 && !module.released) {
+			static_copy(thread, module);
+			// Otherwise assigned on first access (after increasing DTV capacity)
+			if (mid <= dtv_module_size(thread->dtv))
+				thread->dtv[mid].pointer.val = reinterpret_cast<void*>(start - module.offset);
+		}
+	}
+
 	// Set generation
 	dtv_generation(thread->dtv) = gen;
 }
 
+void TLS::init_static() {
+	Guarded _{lock};
+	for (size_t mid = initial_count + 1; mid <= modules.size(); mid++) {
+		auto & module = modules[mid - 1];
+		if (module.pending) {
+			// Threads will assign the block in their DTV on first access
+			ThreadRegistry::foreach([](Thread * thread, void * arg) {
+				static_copy(thread, *reinterpret_cast<const Module *>(arg));
+			}, &module);
+			module.pending = false;
+		}
+	}
+}
+
 size_t TLS::dtv_allocate(Thread * thread) {
 	Guarded _{lock};
 
+	// Reuse DTV of exited thread
+	if (thread->dtv == nullptr && !dtv_cache.empty()) {
+		auto * dtv = dtv_cache.back();
+		dtv_cache.pop_back();
+		size_t dtv_size = dtv_module_size(dtv);
+		for (size_t i = 1; i <= dtv_size; i++) {
+			dtv[i].pointer.val = TLS_UNALLOCATED;
+			dtv[i].pointer.to_free = nullptr;
+		}
+		dtv_generation(dtv) = 0;
+		dtv_slab(dtv) = nullptr;
+		thread->dtv = dtv;
+		if (dtv_size >= modules.size())
+			return dtv_size;
+	}
+
 	size_t new_size = Math::max(modules.size() * 2, 16U);
 	size_t n = new_size + dtv_magic_offset + 1;
 	void * ptr;
@@ -103,16 +205,51 @@ size_t TLS::dtv_allocate(Thread * thread) {
 void TLS::dtv_free(Thread * thread) {
 	Guarded _{lock};
 
-	auto count = dtv_module_size(thread->dtv);
-	assert(count >= initial_count);
-	for (size_t i = initial_count + 1; i < count; i++)
-		if (thread->dtv[i].allocated())
-			Memory::free(*(reinterpret_cast<uintptr_t*>(thread->dtv[i].pointer.val) - 1));
+	assert(dtv_module_size(thread->dtv) >= initial_count);
+	// Release all dynamic TLS blocks
+	for (Slab * slab = dtv_slab(thread->dtv); slab != nullptr; ) {
+		Slab * next = slab->next;
+		Memory::free(slab);
+		slab = next;
+	}
+	dtv_slab(thread->dtv) = nullptr;
 
-	Memory::free(thread->dtv - dtv_magic_offset);
+	// Keep DTV for reuse
+	if (dtv_cache.size() < dtv_cache_limit)
+		dtv_cache.push_back(thread->dtv);
+	else
+		Memory::free(thread->dtv - dtv_magic_offset);
 	thread->dtv = nullptr;
 }
 
+uintptr_t TLS::slab_block(Thread * thread, const Module & module) {
+	assert(module.offset == 0);
+	// Find slab containing the module
+	Slab * latest = dtv_slab(thread->dtv);
+	for (Slab * slab = latest; slab != nullptr; slab = slab->next)
+		if (module.slab_offset >= slab->start && module.slab_offset < slab->end)
+			return slab->data + (module.slab_offset - slab->start);
+
+	// Allocate a single slab for all dynamic TLS blocks of the current generation not covered yet
+	size_t start = latest == nullptr ? 0 : latest->end;
+	assert(module.slab_offset >= start && slab_size > start);
+	uintptr_t mem = Memory::alloc(sizeof(Slab) + slab_align + slab_size - start);
+	if (mem == 0) {
+		LOG_ERROR << "Allocating TLS slab for Thread " << reinterpret_cast<void*>(thread) << " failed" << endl;
+		return 0;
+	}
+	Slab * slab = reinterpret_cast<Slab *>(mem);
+	slab->next = latest;
+	slab->start = start;
+	slab->end = slab_size;
+	// Align, so that the layout offsets keep their alignment
+	slab->data = Math::align_up(mem + sizeof(Slab) - start, slab_align) + start;
+	dtv_slab(thread->dtv) = slab;
+	LOG_DEBUG << "Allocated TLS slab for Thread " << reinterpret_cast<void*>(thread) << " at " << reinterpret_cast<void*>(slab->data) << " (" << (slab_size - start) << " bytes)" << endl;
+
+	return slab->data + (module.slab_offset - start);
+}
+
 void TLS::dtv_copy(Thread * thread, size_t module_id, void * ptr) const {
 	const Module & module = modules[module_id - 1];
 	assert(!thread->dtv[module_id].allocated());
@@ -130,6 +267,14 @@ void TLS::dtv_copy(Thread * thread, size_t module_id, void * ptr) const {
 	assert(dtv_ptr.to_free == nullptr);  // or glibc will try to free it (but we didn't use its allocator)...
 }
 
+void TLS::static_copy(Thread * thread, const Module & module) {
+	uintptr_t addr = reinterpret_cast<uintptr_t>(thread) - module.offset;
+	LOG_DEBUG << "Initialize static TLS of " << module.object << " in Thread " << reinterpret_cast<void*>(thread) << " at " << reinterpret_cast<void*>(addr) << endl;
+	Memory::copy(addr, module.object.current->base + module.image, module.image_size);
+	if (module.size > module.image_size)
+		Memory::set(addr + module.image_size, 0, module.size - module.image_size);
+}
+
 Thread * TLS::allocate(Thread * thread, bool set_fs) {
 	if (thread == nullptr) {
 		if (initial_align < 64)
@@ -162,7 +307,7 @@ void TLS::free(Thread * thread, bool free_thread_struct) {
 
 	dtv_free(thread);
 	if (free_thread_struct) {
-		assert(thread->map_size == initial_size + sizeof(Thread));
+		assert(thread->map_size == initial_size + sizeof(Thread) + surplus);
 		Memory::free(thread->map_base);
 	}
 }
@@ -16,8 +16,11 @@
 static void * const TLS_UNALLOCATED = nullptr;
 
 struct TLS {
-	/* GLIBC adds extra space */
-	const size_t surplus = 0x680;
+	/*! \brief Part of the surplus reserved by GLIBC (for its own initial-exec TLS) */
+	static const size_t surplus_reserved = 0x480;
+
+	/*! \brief GLIBC adds extra space (reserved part and optional static TLS for dynamically loaded modules) */
+	size_t surplus = surplus_reserved + 512;
 
 	/*! \brief Generation counter */
 	unsigned long gen = 0;
@@ -28,6 +31,18 @@ struct TLS {
 	size_t initial_align = 1;
 	/*! \brief Size of initial TLS */
 	size_t initial_size = 0;
+	/*! \brief Size of static TLS in use (initial TLS and dynamic modules placed in surplus) */
+	size_t static_used = 0;
+
+	/*! \brief Size of the combined layout of all dynamic TLS blocks (for the slab allocation) */
+	size_t slab_size = 0;
+	/*! \brief Maximum alignment of dynamic TLS blocks */
+	size_t slab_align = 1;
+
+	/*! \brief Maximum number of DTVs of exited threads kept for reuse */
+	static const size_t dtv_cache_limit = 64;
+	/*! \brief DTVs of exited threads */
+	Vector<Thread::DynamicThreadVector *> dtv_cache;
 
 	struct Module {
 		/*! \brief Target Object */
@@ -45,9 +60,18 @@ struct TLS {
 		/*! \brief Source data image size */
 		const size_t image_size = 0;
 
-		/*! \brief Offset to thread pointer / %fs (for initial TLS) */
+		/*! \brief Offset to thread pointer / %fs (for static TLS) */
 		const intptr_t offset;
 
+		/*! \brief Static TLS block still has to be initialized in the existing threads */
+		bool pending = false;
+
+		/*! \brief Offset in slab layout (for dynamic TLS) */
+		size_t slab_offset = 0;
+
+		/*! \brief Object has been unloaded, module ID can be reused */
+		bool released = false;
+
 		Module(const ObjectIdentity & object, size_t size, size_t align, uintptr_t image, size_t image_size, intptr_t offset = 0)
 		  : object(object), size(size), align(align), image(image), image_size(image_size), offset(offset) {
 			assert(size >= image_size);
@@ -66,11 +90,27 @@ struct TLS {
 	 * \param align Alignment of TLS block in memory
 	 * \param image Pointer to initialisation image (in memory)
 	 * \param image_size Size of initialisation image
-	 * \param offset For initial TLS this will contain the offset from thread pointer to the TLS block
+	 * \param offset For static TLS this will contain the offset from thread pointer to the TLS block
 	 * \return module ID of TLS block
 	 */
 	size_t add_module(ObjectIdentity & object, size_t size, size_t align, uintptr_t image, size_t image_size, intptr_t & offset);
 
+	/*! \brief Release module of an unloaded object
+	 * The blocks in the threads are not freed (but the module ID and its space might be reused by subsequently loaded modules)
+	 * \param module_id module ID of TLS block
+	 */
+	void remove_module(size_t module_id);
+
+	/*! \brief Initialize static TLS blocks of dynamically loaded modules in all existing threads
+	 * \note has to be called after the relocation of the module (since the image might be relocated)
+	 */
+	void init_static();
+
+	/*! \brief Size of static TLS (including surplus and thread control block) */
+	inline size_t static_size() const {
+		return Math::align_up(initial_size + surplus, initial_align) + sizeof(Thread);
+	}
+
 	/*! \brief Setup initial TLS
 	 * \param thread current Thread
 	 */
@@ -121,17 +161,17 @@ struct TLS {
 			assert(module_id > initial_count && module_id <= modules.size());
 			auto & module = modules[module_id - 1];
 
-			// Allocate memory
-			uintptr_t mem = Memory::alloc(module.size + module.align + sizeof(void*));
-
-			// Align pointer
-			uintptr_t data = Math::align(mem + sizeof(void*), module.align);
+			if (module.offset != 0) {
+				// Block in static TLS surplus (already initialized)
+				dtv_ptr.val = reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(thread) - module.offset);
+			} else {
+				// Get memory from slab of thread
+				uintptr_t data = slab_block(thread, module);
+				assert(data != 0);
 
-			// Store address of pointer for free;
-			*(reinterpret_cast<uintptr_t*>(data) - 1) = mem;
-
-			// Copy contents
-			dtv_copy(thread, module_id, reinterpret_cast<void*>(data));
+				// Copy contents
+				dtv_copy(thread, module_id, reinterpret_cast<void*>(data));
+			}
 		}
 
 		// Return pointer
@@ -158,14 +198,43 @@ struct TLS {
 	}
 
 	/*! \brief get current DTVs number of modules */
-	inline size_t & dtv_module_size(Thread::DynamicThreadVector * dtv) {
+	static inline size_t & dtv_module_size(Thread::DynamicThreadVector * dtv) {
 		return dtv[-1].counter;
 	}
 
+	/*! \brief Memory for dynamic TLS blocks of a thread
+	 * Each slab covers a range of the layout of all dynamic TLS blocks,
+	 * a new slab is only required for modules loaded after the previous slab has been allocated.
+	 */
+	struct Slab {
+		Slab * next;     // previously allocated slab
+		size_t start;    // start offset of covered layout range
+		size_t end;      // end offset of covered layout range
+		uintptr_t data;  // address of offset `start`
+	};
+
+	/*! \brief get latest slab of DTV (stored in front of the number of modules) */
+	inline Slab *& dtv_slab(Thread::DynamicThreadVector * dtv) {
+		return reinterpret_cast<Slab *&>(dtv[-2].pointer.val);
+	}
+
+	/*! \brief Get memory for dynamic TLS block of module
+	 * \param thread thread trying to access TLS
+	 * \param module TLS module
+	 * \return address for TLS block (or 0 on error)
+	 */
+	uintptr_t slab_block(Thread * thread, const Module & module);
+
 	/*! \brief Copy TLS data
 	 * \param thread thread trying to access TLS
 	 * \param module_id TLS module
 	 * \param ptr Pointer to memory allocated for this module of current threads TLS
 	 */
 	void dtv_copy(Thread * thread, size_t module_id, void * ptr) const;
+
+	/*! \brief Initialize static TLS block of module (without assigning it in the DTV)
+	 * \param thread target thread
+	 * \param module TLS module with static offset
+	 */
+	static void static_copy(Thread * thread, const Module & module);
 };
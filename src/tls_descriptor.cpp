@@ -0,0 +1,286 @@
+// Luci - a dynamic linker/loader with DSU capabilities
+// Copyright 2021-2023 by Bernhard Heinloth <heinloth@cs.fau.de>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include "tls_descriptor.hpp"
+
+#include <dlh/container/hash.hpp>
+#include <dlh/assert.hpp>
+#include <dlh/syscall.hpp>
+#include <dlh/thread.hpp>
+#include <dlh/mutex.hpp>
+#include <dlh/log.hpp>
+#include <dlh/mem.hpp>
+
+#include "loader.hpp"
+
+extern "C" uintptr_t _dl_tlsdesc_return(TLSDescriptor::Descriptor *);
+extern "C" uintptr_t _dl_tlsdesc_undefweak(TLSDescriptor::Descriptor *);
+extern "C" uintptr_t _dl_tlsdesc_dynamic(TLSDescriptor::Descriptor *);
+
+// The fast path of the dynamic resolver reads the DTV directly
+static_assert(sizeof(Thread::DynamicThreadVector) == 2 * sizeof(void*), "Unexpected DTV entry size");
+
+extern "C" __attribute__((__used__)) uintptr_t __tlsdesc_resolve(const TLSDescriptor::Index * index) {
+#ifndef NO_FPU
+	alignas(64) uint8_t buf[4096] = {};
+	const uint32_t mask_low = 0xff;
+	const uint32_t mask_high = 0;
+	extern bool _cpu_supports_xsave;
+	if (_cpu_supports_xsave) {
+		asm volatile ("xsave (%0)" : : "r"(buf), "a"(mask_low), "d"(mask_high) : "%mm0", "%ymm0", "memory");
+	} else {
+		asm volatile ("fxsave %0" : : "m"(buf) : "memory");
+	}
+#endif
+	Thread * thread = Thread::self();
+	assert(thread != nullptr);
+
+	Loader * loader = Loader::instance();
+	assert(loader != nullptr);
+
+	// Lazy allocation of the block
+	uintptr_t r = loader->tls.get_addr(thread, index->module_id) + index->offset;
+#ifndef NO_FPU
+	if (_cpu_supports_xsave) {
+		asm volatile ("xrstor (%0)" : : "r"(buf), "a"(mask_low), "d"(mask_high) : "%mm0", "%ymm0", "memory");
+	} else {
+		asm volatile ("fxrstor %0" : : "m"(buf) : "memory");
+	}
+#endif
+	return r;
+}
+
+
+asm(R"(
+.globl _dl_tlsdesc_return
+.hidden _dl_tlsdesc_return
+.type _dl_tlsdesc_return, @function
+.align 16
+_dl_tlsdesc_return:
+	# Static TLS: Argument is the offset to the thread pointer
+	.cfi_startproc
+	endbr64
+	mov 8(%rax), %rax
+	ret
+	.cfi_endproc
+
+.globl _dl_tlsdesc_undefweak
+.hidden _dl_tlsdesc_undefweak
+.type _dl_tlsdesc_undefweak, @function
+.align 16
+_dl_tlsdesc_undefweak:
+	# Unresolved weak symbol: Argument is the addend (absolute address)
+	.cfi_startproc
+	endbr64
+	mov 8(%rax), %rax
+	sub %fs:0, %rax
+	ret
+	.cfi_endproc
+
+.globl _dl_tlsdesc_dynamic
+.hidden _dl_tlsdesc_dynamic
+.type _dl_tlsdesc_dynamic, @function
+.align 16
+_dl_tlsdesc_dynamic:
+	# Dynamic TLS: Argument is pointer to TLS index (module ID & offset)
+	.cfi_startproc
+	endbr64
+	mov 8(%rax), %rax
+
+	# Save registers required for fast path
+	push %rdi
+	.cfi_adjust_cfa_offset 8
+	.cfi_rel_offset rdi, 0
+	push %rsi
+	.cfi_adjust_cfa_offset 8
+	.cfi_rel_offset rsi, 0
+
+	# Load DTV from thread control block
+	mov %fs:8, %rdi
+	# Check if module is within the DTV capacity (stored in entry -1)
+	mov (%rax), %rsi
+	cmp -16(%rdi), %rsi
+	ja 1f
+	# Get pointer of module block (each entry has 16 bytes)
+	shl $4, %rsi
+	mov (%rdi,%rsi), %rsi
+	test %rsi, %rsi
+	jz 1f
+
+	# Block is allocated: return offset of variable to thread pointer
+	add 8(%rax), %rsi
+	mov %rsi, %rax
+	sub %fs:0, %rax
+	pop %rsi
+	.cfi_adjust_cfa_offset -8
+	.cfi_restore rsi
+	pop %rdi
+	.cfi_adjust_cfa_offset -8
+	.cfi_restore rdi
+	ret
+
+1:
+	# Slow path (lazy allocation)
+	.cfi_adjust_cfa_offset 16
+	.cfi_rel_offset rdi, 8
+	.cfi_rel_offset rsi, 0
+	push %rbp
+	.cfi_adjust_cfa_offset 8
+	.cfi_rel_offset rbp, 0
+	mov %rsp, %rbp
+	.cfi_def_cfa_register rbp
+
+	# Save remaining caller-saved registers
+	push %rcx
+	.cfi_rel_offset rcx, -8
+	push %rdx
+	.cfi_rel_offset rdx, -16
+	push %r8
+	.cfi_rel_offset r8, -24
+	push %r9
+	.cfi_rel_offset r9, -32
+	push %r10
+	.cfi_rel_offset r10, -40
+	push %r11
+	.cfi_rel_offset r11, -48
+
+	# Align stack & call high level resolve function with TLS index
+	and $-16, %rsp
+	mov %rax, %rdi
+	call __tlsdesc_resolve
+	sub %fs:0, %rax
+
+	# Restore registers
+	lea -48(%rbp), %rsp
+	pop %r11
+	pop %r10
+	pop %r9
+	pop %r8
+	pop %rdx
+	pop %rcx
+	pop %rbp
+	.cfi_def_cfa rsp, 24
+	pop %rsi
+	.cfi_adjust_cfa_offset -8
+	pop %rdi
+	.cfi_adjust_cfa_offset -8
+
+	.cfi_restore rbp
+	.cfi_restore rcx
+	.cfi_restore rdx
+	.cfi_restore rsi
+	.cfi_restore rdi
+	.cfi_restore r8
+	.cfi_restore r9
+	.cfi_restore r10
+	.cfi_restore r11
+	ret
+	.cfi_endproc
+)");
+
+namespace TLSDescriptor {
+
+/*! \brief Key for deduplication (descriptors are never released) */
+struct Key {
+	size_t module_id;
+	uintptr_t offset;
+
+	bool operator==(const Key & other) const {
+		return module_id == other.module_id && offset == other.offset;
+	}
+};
+
+struct KeyComparison {
+	static inline bool equal(const Key & a, const Key & b) {
+		return a == b;
+	}
+
+	static inline uint32_t hash(const Key & v) {
+		return static_cast<uint32_t>(v.module_id * 0x9e3779b1U) ^ static_cast<uint32_t>(v.offset);
+	}
+};
+
+/*! \brief Arguments of dynamic descriptors */
+static HashMap<Key, Index *, KeyComparison> indices;
+
+/*! \brief Descriptors in lower address space */
+static HashMap<Key, Descriptor *, KeyComparison> descriptors;
+
+/*! \brief Free descriptors in lower address space */
+static Descriptor * pool = nullptr;
+static size_t pool_free = 0;
+
+/*! \brief Synchronize access */
+static Mutex lock;
+
+static Index * index(size_t module_id, uintptr_t offset) {
+	Key key{module_id, offset};
+	auto i = indices.find(key);
+	if (i != indices.end())
+		return i->value;
+
+	auto * r = Memory::alloc_array<Index>(1);
+	if (r != nullptr) {
+		r->module_id = module_id;
+		r->offset = offset;
+		indices.insert(key, r);
+	}
+	return r;
+}
+
+static bool assign(Descriptor & descriptor, const ObjectIdentity & object, uintptr_t offset) {
+	if (object.tls_module_id == 0) {
+		LOG_ERROR << "TLS descriptor for " << object << " without TLS block" << endl;
+		return false;
+	} else if (object.tls_offset != 0) {
+		// static TLS
+		descriptor.argument = offset - object.tls_offset;
+		descriptor.resolver = _dl_tlsdesc_return;
+	} else if (auto * i = index(object.tls_module_id, offset)) {
+		descriptor.argument = reinterpret_cast<uintptr_t>(i);
+		descriptor.resolver = _dl_tlsdesc_dynamic;
+	} else {
+		LOG_ERROR << "Unable to allocate TLS index for " << object << endl;
+		return false;
+	}
+	return true;
+}
+
+bool set(Descriptor & descriptor, const ObjectIdentity & object, uintptr_t offset) {
+	Guarded _{lock};
+	return assign(descriptor, object, offset);
+}
+
+void set_undefined_weak(Descriptor & descriptor, uintptr_t addend) {
+	descriptor.argument = addend;
+	descriptor.resolver = _dl_tlsdesc_undefweak;
+}
+
+Descriptor * get(const ObjectIdentity & object, uintptr_t offset) {
+	Guarded _{lock};
+	Key key{object.tls_module_id, offset};
+	auto d = descriptors.find(key);
+	if (d != descriptors.end())
+		return d->value;
+
+	if (pool_free == 0) {
+		const size_t size = 4096;
+		if (auto mmap = Syscall::mmap(0, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_32BIT)) {
+			pool = reinterpret_cast<Descriptor *>(mmap.value());
+			pool_free = size / sizeof(Descriptor);
+		} else {
+			LOG_ERROR << "Requesting memory for TLS descriptors failed: " << mmap.error_message() << endl;
+			return nullptr;
+		}
+	}
+
+	if (!assign(*pool, object, offset))
+		return nullptr;
+
+	descriptors.insert(key, pool);
+	pool_free--;
+	return pool++;
+}
+
+}  // namespace TLSDescriptor
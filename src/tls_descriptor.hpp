@@ -0,0 +1,52 @@
+// Luci - a dynamic linker/loader with DSU capabilities
+// Copyright 2021-2023 by Bernhard Heinloth <heinloth@cs.fau.de>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#pragma once
+
+#include <dlh/types.hpp>
+
+#include "object/identity.hpp"
+
+/*! \brief TLS descriptors (`-mtls-dialect=gnu2`)
+ *  Instead of calling `__tls_get_addr`, code accesses TLS variables by an indirect call
+ *  to the resolver function stored in the descriptor (with the address of the descriptor in `%rax`).
+ *  The resolver returns the offset of the variable to the thread pointer and preserves all other registers.
+ */
+namespace TLSDescriptor {
+
+/*! \brief Descriptor (usually in the GOT) */
+struct Descriptor {
+	uintptr_t (*resolver)(Descriptor *);
+	uintptr_t argument;
+};
+
+/*! \brief Argument for descriptors of dynamic TLS blocks (same layout as `tls_index`) */
+struct Index {
+	size_t module_id;
+	uintptr_t offset;
+};
+
+/*! \brief Assign resolver for a TLS variable
+ *  Blocks in static TLS use the offset to the thread pointer, others a (lazy allocating) DTV lookup.
+ *  \param descriptor target descriptor
+ *  \param object object containing the TLS block
+ *  \param offset offset of variable in TLS block
+ *  \return `true` if assigned
+ */
+bool set(Descriptor & descriptor, const ObjectIdentity & object, uintptr_t offset);
+
+/*! \brief Assign resolver for an unresolved weak TLS variable (address will be `addend`)
+ *  \param descriptor target descriptor
+ *  \param addend value of relocation addend
+ */
+void set_undefined_weak(Descriptor & descriptor, uintptr_t addend);
+
+/*! \brief Get a descriptor in the lower 2 GiB of the address space (for relaxed code sequences)
+ *  \param object object containing the TLS block
+ *  \param offset offset of variable in TLS block
+ *  \return pointer to descriptor or `nullptr` on error
+ */
+Descriptor * get(const ObjectIdentity & object, uintptr_t offset);
+
+}  // namespace TLSDescriptor
@@ -23,143 +23,180 @@ static void undefined_trampoline() {
 	assert(false);
 }
 
-bool Trampoline::index(const VersionedSymbol & sym, size_t & index) const {
-	if (sym.type() != Elf::STT_FUNC && sym.type() != Elf::STT_GNU_IFUNC) {
-		LOG_WARNING << "Symbol trampoline can only be used for function types!" << endl;
+bool Trampoline::allocate_block(uintptr_t region) {
+	const size_t size = trampolines_block + Page::SIZE;
+	uintptr_t address = 0;
+	if (region == region_any) {
+		uintptr_t mmap_address = 0;
+		if (address_callback != nullptr)
+			mmap_address = address_callback(size);
+		if (auto mmap = Syscall::mmap(mmap_address, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE)) {
+			address = mmap.value();
+		} else {
+			LOG_ERROR << "Requesting memory failed: " << mmap.error_message() << endl;
+			return false;
+		}
 	} else {
-		for (size_t i = 0; i < symbols.size(); i++) {
-			if (symbols[i] == sym) {
-				index = i;
-				return true;
-			}
+		// Try right after and before the region, then moving outwards -- each candidate is in reach of every address in the region
+		const uintptr_t region_size = 1UL << region_bits;
+		const uintptr_t region_start = region << region_bits;
+		const uintptr_t step = 16 * 1024 * 1024;
+		for (uintptr_t distance = 0; address == 0 && distance + size < region_size; distance += step) {
+			uintptr_t candidates[2] = { region_start + region_size + distance, region_start >= size + distance ? region_start - size - distance : 0 };
+			for (auto candidate : candidates)
+				if (candidate != 0) {
+					if (auto mmap = Syscall::mmap(candidate, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED_NOREPLACE)) {
+						// Older kernels treat the address only as hint
+						if (mmap.value() == candidate) {
+							address = candidate;
+							break;
+						}
+						Syscall::munmap(mmap.value(), size);
+					}
+				}
+		}
+		if (address == 0) {
+			LOG_ERROR << "Unable to map trampolines in reach of region " << reinterpret_cast<void*>(region_start) << endl;
+			return false;
 		}
 	}
-	return false;
-}
 
-bool Trampoline::pointer(size_t index, void* & trampoline_function, uintptr_t* & target_address) const {
-	auto block = index / entries_per_block;
-	if (index < symbols.size() && block < blocks.size()) {
-		uintptr_t base = blocks[block];
-		size_t offset = index % entries_per_block;
-		trampoline_function = reinterpret_cast<void*>(base + offset * trampoline_bytes);
-		target_address = reinterpret_cast<uintptr_t*>(base + trampolines_block + offset * sizeof(uintptr_t));
+	uint8_t * addr = reinterpret_cast<uint8_t*>(address);
+	uintptr_t * entry = reinterpret_cast<uintptr_t*>(address + trampolines_block);
+	for (size_t i = 0; i < entries_per_block; i ++) {
+		// Set redirection pointer to undefined
+		entry[i] = reinterpret_cast<uintptr_t>(undefined_trampoline);
+
+		// target is memory
+		uint32_t target = trampolines_block              // size of trampoline code
+			            + (sizeof(uintptr_t) * i)        // offset in redirection pointer memory
+			            - (trampoline_bytes * i + 0xa);  // offset in trampoline code (RIP relative)
+
+		// endbr64
+		*(addr++) = 0xf3;
+		*(addr++) = 0x0f;
+		*(addr++) = 0x1e;
+		*(addr++) = 0xfa;
+
+		// jmp *target(rip)
+		*(addr++) = 0xff;
+		*(addr++) = 0x25;
+		*(addr++) = (target >> 0) & 0xff;
+		*(addr++) = (target >> 8) & 0xff;
+		*(addr++) = (target >> 16) & 0xff;
+		*(addr++) = (target >> 24) & 0xff;
+
+		// [6 byte] nop
+		*(addr++) = 0x66;
+		*(addr++) = 0x0f;
+		*(addr++) = 0x1f;
+		*(addr++) = 0x44;
+		*(addr++) = 0x00;
+		*(addr++) = 0x00;
+	}
+	if (auto mprotect = Syscall::mprotect(address, trampolines_block, PROT_EXEC)) {
+		blocks.push_back(Block{region, address, 0});
+		LOG_TRACE << "Got new pages for trampoline at " << reinterpret_cast<void*>(address) << endl;
 		return true;
+	} else {
+		LOG_ERROR << "Protecting page at " << reinterpret_cast<void*>(address) << " failed: " << mprotect.error_message() << endl;
+		Syscall::munmap(address, size);
+		return false;
 	}
-	return false;
 }
 
-
-bool Trampoline::allocate(const VersionedSymbol & sym, size_t & index) {
-	if ((symbols.size() + 1) / entries_per_block >= blocks.size()) {
-		// allocate new pages
-		uintptr_t mmap_address = 0;
-		uintptr_t mmap_size = trampolines_block + Page::SIZE;
-		if (address_callback != nullptr)
-			mmap_address = address_callback(mmap_size);
-		if (auto mmap = Syscall::mmap(mmap_address, mmap_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE)) {
-			uint8_t * addr = reinterpret_cast<uint8_t*>(mmap.value());
-			uintptr_t * entry = reinterpret_cast<uintptr_t*>(mmap.value() + trampolines_block);
-			for (size_t i = 0; i < entries_per_block; i ++) {
-				// Set redirection pointer to undefined
-				entry[i] = reinterpret_cast<uintptr_t>(undefined_trampoline);
-
-				// target is memory
-				uint32_t target = trampolines_block              // size of trampoline code
-					            + (sizeof(uintptr_t) * i)        // offset in redirection pointer memory
-					            - (trampoline_bytes * i + 0xa);  // offset in trampoline code (RIP relative)
-
-				// endbr64
-				*(addr++) = 0xf3;
-				*(addr++) = 0x0f;
-				*(addr++) = 0x1e;
-				*(addr++) = 0xfa;
-
-				// jmp *target(rip)
-				*(addr++) = 0xff;
-				*(addr++) = 0x25;
-				*(addr++) = (target >> 0) & 0xff;
-				*(addr++) = (target >> 8) & 0xff;
-				*(addr++) = (target >> 16) & 0xff;
-				*(addr++) = (target >> 24) & 0xff;
-
-				// [6 byte] nop
-				*(addr++) = 0x66;
-				*(addr++) = 0x0f;
-				*(addr++) = 0x1f;
-				*(addr++) = 0x44;
-				*(addr++) = 0x00;
-				*(addr++) = 0x00;
-			}
-			if (auto mprotect = Syscall::mprotect(mmap.value(), trampolines_block, PROT_EXEC)) {
-				blocks.push_back(mmap.value());
-				LOG_TRACE << "Got new pages for trampoline at " << reinterpret_cast<void*>(mmap.value()) << endl;
-			} else {
-				LOG_ERROR << "Protecting page at " << reinterpret_cast<void*>(mmap.value()) << " failed: " << mprotect.error_message() << endl;
-				Syscall::munmap(mmap.value(), trampolines_block + Page::SIZE);
-				return false;
-			}
-		} else {
-			LOG_ERROR << "Requesting memory failed: " << mmap.error_message() << endl;
-			return false;
+bool Trampoline::allocate(const VersionedSymbol & sym, uintptr_t region, size_t & idx) {
+	Block * block = nullptr;
+	for (auto & b : blocks)
+		if (b.region == region && b.used < entries_per_block) {
+			block = &b;
+			break;
 		}
+	if (block == nullptr) {
+		if (!allocate_block(region))
+			return false;
+		block = &blocks[blocks.size() - 1];
 	}
-	index = symbols.push_back(sym).index();
+
+	size_t offset = block->used++;
+	Entry entry{sym, nullptr, reinterpret_cast<void*>(block->address + offset * trampoline_bytes), reinterpret_cast<uintptr_t*>(block->address + trampolines_block + offset * sizeof(uintptr_t))};
+	idx = entries.push_back(entry).index();
+	index.insert(Key{sym, region}, idx);
 	return true;
 }
 
-void * Trampoline::get(const VersionedSymbol & sym) const {
-	size_t idx = SIZE_MAX;
-	if (index(sym, idx)) {
-		uintptr_t * address = nullptr;
-		void * trampoline = nullptr;
-		if (pointer(idx, trampoline, address)) {
-			return trampoline;
-		}
+bool Trampoline::resolve(Entry & entry) {
+	const Object * current = entry.symbol.object().file.current;
+	if (entry.target != current) {
+		auto resolved = current->resolve_symbol(entry.symbol);
+		if (!resolved)
+			return false;
+		assert(entry.address != nullptr);
+		*entry.address = reinterpret_cast<uintptr_t>(resolved->pointer());
+		entry.target = current;
 	}
+	return true;
+}
+
+void * Trampoline::get(const VersionedSymbol & sym, uintptr_t near) const {
+	Guarded _{lock};
+	if (auto i = index.find(Key{sym, region(near)}))
+		return entries[i->value].trampoline;
 	return nullptr;
 }
 
-void * Trampoline::set(const VersionedSymbol & sym) {
+void * Trampoline::set(const VersionedSymbol & sym, uintptr_t near) {
+	if (sym.type() != Elf::STT_FUNC && sym.type() != Elf::STT_GNU_IFUNC)
+		LOG_WARNING << "Symbol trampoline can only be used for function types!" << endl;
+
 	// Retrieve latest
-	if (auto resolved = sym.object().file.current->resolve_symbol(sym)) {
-		size_t idx = SIZE_MAX;
-		if (index(sym, idx) || allocate(sym, idx)) {
-			uintptr_t * address = nullptr;
-			void * trampoline = nullptr;
-			if (pointer(idx, trampoline, address)) {
-				assert(address != nullptr);
-				*address = reinterpret_cast<uintptr_t>(resolved->pointer());
-				return reinterpret_cast<void*>(trampoline);
-			} else {
-				LOG_ERROR << "Unable to find trampoline pointer of " << idx << " for " << sym << endl;
-				assert(false);
-			}
-		}
+	Guarded _{lock};
+	size_t idx = SIZE_MAX;
+	uintptr_t r = region(near);
+	if (auto i = index.find(Key{sym, r})) {
+		idx = i->value;
+	} else if (!sym.object().file.current->resolve_symbol(sym)) {
+		LOG_ERROR << "Symbol " << sym << " could not be found in (current) object!" << endl;
+		return nullptr;
+	} else if (!allocate(sym, r, idx)) {
 		LOG_ERROR << "Unable to find/create trampoline index for " << sym << endl;
+		return nullptr;
+	}
+
+	auto & entry = entries[idx];
+	if (resolve(entry)) {
+		return entry.trampoline;
 	} else {
 		LOG_ERROR << "Symbol " << sym << " could not be found in (current) object!" << endl;
+		return nullptr;
 	}
-	return nullptr;
 }
 
 
 void Trampoline::update() {
-	uintptr_t page = 0;
-	for (size_t i = 0; i < symbols.size(); i++) {
-		auto & sym = symbols[i];
-		if (auto resolved = sym.object().file.current->resolve_symbol(sym)) {
-			uintptr_t * address = nullptr;
-			void * trampoline = nullptr;
-			if (pointer(i, trampoline, address)) {
-				assert(address != nullptr);
-				*address = reinterpret_cast<uintptr_t>(resolved->pointer());
-			} else {
-				LOG_ERROR << "Unable to find trampoline pointer of " << i << " for " << sym << endl;
-				assert(false);
-			}
-		} else {
-			LOG_WARNING << "Symbol " << sym << " could not be found in (current) object on update!" << endl;
+	Guarded _{lock};
+	for (auto & entry : entries)
+		if (!entry.released && !resolve(entry))
+			LOG_WARNING << "Symbol " << entry.symbol << " could not be found in (current) object on update!" << endl;
+}
+
+size_t Trampoline::release(const ObjectIdentity & object) {
+	Guarded _{lock};
+	Vector<Key> keys;
+	for (const auto & i : index)
+		if (&(entries[i.value].symbol.object().file) == &object)
+			keys.push_back(i.key);
+	for (const auto & key : keys)
+		index.erase(key);
+
+	size_t released = 0;
+	for (auto & entry : entries)
+		if (!entry.released && &(entry.symbol.object().file) == &object) {
+			// Trampoline code remains, but will jump to the undefined handler (like unassigned entries)
+			*entry.address = reinterpret_cast<uintptr_t>(undefined_trampoline);
+			entry.target = nullptr;
+			entry.released = true;
+			released++;
 		}
-	}
+	return released;
 }
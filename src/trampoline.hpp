@@ -5,33 +5,98 @@
 #pragma once
 
 #include <dlh/container/vector.hpp>
+#include <dlh/container/hash.hpp>
+#include <dlh/mutex.hpp>
 
 #include "symbol.hpp"
 
+struct ObjectIdentity;
+
 class Trampoline {
-	Vector<uintptr_t> blocks;  // a block starts with two code pages (similar to PLT) and an additional redirection table (GOT)
-	Vector<VersionedSymbol> symbols;  // list of assigned symbols, index corresponds to entry
+	/*! \brief Region of the caller (trampolines are placed within 32 bit relative reach) */
+	static const size_t region_bits = 30;
+
+	/*! \brief Region for trampolines without address constraints */
+	static const uintptr_t region_any = SIZE_MAX;
+
+	/*! \brief a block starts with two code pages (similar to PLT) and an additional redirection table (GOT) */
+	struct Block {
+		uintptr_t region;
+		uintptr_t address;
+		size_t used;
+	};
+	Vector<Block> blocks;
+
+	/*! \brief assigned trampoline */
+	struct Entry {
+		VersionedSymbol symbol;
+		const Object * target;  // object the trampoline is currently pointing to
+		void * trampoline;      // trampoline code
+		uintptr_t * address;    // redirection table entry
+		bool released = false;  // target object has been unloaded
+	};
+	Vector<Entry> entries;
+
+	/*! \brief Index of entries by symbol (name and version) and region */
+	struct Key {
+		VersionedSymbol symbol;
+		uintptr_t region;
+
+		bool operator==(const Key & other) const {
+			return region == other.region && symbol == other.symbol;
+		}
+	};
+	struct KeyComparison {
+		static inline bool equal(const Key & a, const Key & b) {
+			return a == b;
+		}
+
+		static inline uint32_t hash(const Key & v) {
+			return v.symbol.gnu_hash_value() ^ v.symbol.version.hash ^ static_cast<uint32_t>(v.region);
+		}
+	};
+	HashMap<Key, size_t, KeyComparison> index;
+
 	uintptr_t (*address_callback)(size_t);  // callback for mmap address
 
-	/*! \brief Get vector index of symbol */
-	bool index(const VersionedSymbol & sym, size_t & index) const;
+	/*! \brief Synchronize access (trampolines are requested by concurrent `dlsym` calls) */
+	mutable Mutex lock;
+
+	/*! \brief Get region of address */
+	static uintptr_t region(uintptr_t near) {
+		return near == 0 ? region_any : near >> region_bits;
+	}
 
-	/*! \brief Retriefe pointer to trampoline code and target address for symbol at index */
-	bool pointer(size_t index, void* & trampoline_function, uintptr_t* & target_address) const;
+	/*! \brief Map new block for region */
+	bool allocate_block(uintptr_t region);
 
-	/*! \brief Allocate trampoline for symbol */
-	bool allocate(const VersionedSymbol & sym, size_t & index);
+	/*! \brief Allocate trampoline for symbol in region */
+	bool allocate(const VersionedSymbol & sym, uintptr_t region, size_t & idx);
+
+	/*! \brief Point trampoline to current version of target */
+	bool resolve(Entry & entry);
 
  public:
 	/*! \brief Constructor with optional callback for the address */
 	explicit Trampoline(uintptr_t (*address_callback)(size_t) = nullptr) : address_callback(address_callback) {}
 
-	/*! \brief Return address of trampoline code for symbol (or nullptr if not found) */
-	void * get(const VersionedSymbol & sym) const;
+	/*! \brief Return address of trampoline code for symbol (or nullptr if not found)
+	 * \param sym symbol
+	 * \param near address of caller (or 0 for any)
+	 */
+	void * get(const VersionedSymbol & sym, uintptr_t near = 0) const;
 
-	/*! \brief Generate trampoline code for symbol and return its address */
-	void * set(const VersionedSymbol & sym);
+	/*! \brief Generate trampoline code for symbol and return its address
+	 * \param sym symbol
+	 * \param near address of caller, trampoline will be within 32 bit relative reach (or 0 for any)
+	 */
+	void * set(const VersionedSymbol & sym, uintptr_t near = 0);
 
-	/*! \brief Update all trampolines to their current objects */
+	/*! \brief Update trampolines with changed target objects to their current objects */
 	void update();
+
+	/*! \brief Release all trampolines pointing to an object (which is going to be unloaded)
+	 * \return number of released trampolines
+	 */
+	size_t release(const ObjectIdentity & object);
 };
@@ -0,0 +1,138 @@
+// Luci - a dynamic linker/loader with DSU capabilities
+// Copyright 2021-2023 by Bernhard Heinloth <heinloth@cs.fau.de>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include "update_coordinator.hpp"
+
+#include <dlh/log.hpp>
+#include <dlh/assert.hpp>
+#include <dlh/syscall.hpp>
+
+/*! \brief Interval for checking the shared table while waiting */
+static const unsigned long poll_interval_ms = 10;
+
+bool UpdateCoordinator::setup() {
+	if (table != nullptr)
+		return true;
+
+	if (auto mmap = Syscall::mmap(NULL, sizeof(Table), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) {
+		table = reinterpret_cast<Table *>(mmap.value());
+		table->coordinator = Syscall::getpid();
+		table->next = 0;
+		for (auto & entry : table->entries) {
+			entry.sequence = 0;
+			entry.fd = STATE_FAILED;
+		}
+		LOG_INFO << "Process " << table->coordinator << " coordinates updates of its forked processes" << endl;
+		return true;
+	} else {
+		LOG_ERROR << "Creating shared update coordination table failed: " << mmap.error_message() << endl;
+		return false;
+	}
+}
+
+bool UpdateCoordinator::is_coordinator() const {
+	return table != nullptr && __atomic_load_n(&table->coordinator, __ATOMIC_RELAXED) == Syscall::getpid();
+}
+
+bool UpdateCoordinator::is_member() const {
+	return table != nullptr && __atomic_load_n(&table->coordinator, __ATOMIC_RELAXED) != Syscall::getpid();
+}
+
+void UpdateCoordinator::set(size_t slot, int fd) {
+	assert(slot < slots);
+	Entry & entry = table->entries[slot];
+	__atomic_store_n(&entry.sequence, entry.sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	entry.fd = fd;
+	__atomic_store_n(&entry.sequence, entry.sequence + 1, __ATOMIC_RELEASE);
+}
+
+ssize_t UpdateCoordinator::announce(uint64_t previous_hash, uint64_t hash) {
+	if (!is_coordinator())
+		return -1;
+
+	size_t slot = __atomic_fetch_add(&table->next, 1, __ATOMIC_RELAXED) % slots;
+	Entry & entry = table->entries[slot];
+	__atomic_store_n(&entry.sequence, entry.sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	// Release plan of the replaced announcement
+	if (entry.fd >= 0)
+		Syscall::close(entry.fd);
+	entry.previous_hash = previous_hash;
+	entry.hash = hash;
+	entry.fd = STATE_PENDING;
+	__atomic_store_n(&entry.sequence, entry.sequence + 1, __ATOMIC_RELEASE);
+
+	LOG_DEBUG << "Announced update analysis " << hex << previous_hash << " -> " << hash << dec << " in slot " << slot << endl;
+	return static_cast<ssize_t>(slot);
+}
+
+void UpdateCoordinator::publish(ssize_t slot, int fd) {
+	assert(fd >= 0);
+	if (slot >= 0)
+		set(static_cast<size_t>(slot), fd);
+}
+
+void UpdateCoordinator::withdraw(ssize_t slot) {
+	if (slot >= 0)
+		set(static_cast<size_t>(slot), STATE_FAILED);
+}
+
+int UpdateCoordinator::find(uint64_t previous_hash, uint64_t hash) const {
+	for (const auto & entry : table->entries) {
+		unsigned long sequence = __atomic_load_n(&entry.sequence, __ATOMIC_ACQUIRE);
+		if ((sequence & 1) != 0)
+			continue;
+
+		// Copy entry and check if it is consistent
+		uint64_t entry_previous_hash = entry.previous_hash;
+		uint64_t entry_hash = entry.hash;
+		int entry_fd = entry.fd;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&entry.sequence, __ATOMIC_RELAXED) != sequence)
+			continue;
+
+		if (entry_previous_hash == previous_hash && entry_hash == hash)
+			return entry_fd;
+	}
+	return STATE_UNKNOWN;
+}
+
+bool UpdateCoordinator::wait(uint64_t previous_hash, uint64_t hash) const {
+	if (!is_member())
+		return false;
+
+	pid_t pid = __atomic_load_n(&table->coordinator, __ATOMIC_RELAXED);
+	bool announced = false;
+	for (unsigned long waited = 0; waited <= (announced ? analysis_timeout_ms : announce_timeout_ms); waited += poll_interval_ms) {
+		int state = find(previous_hash, hash);
+		if (state >= 0)
+			return true;
+		else if (state == STATE_FAILED)
+			return false;
+		else if (state == STATE_PENDING)
+			announced = true;
+
+		// Coordinator is gone
+		if (Syscall::kill(pid, 0).failed())
+			return false;
+
+		Syscall::poll(nullptr, 0, poll_interval_ms);
+	}
+
+	LOG_WARNING << "Coordinator " << pid << " did not " << (announced ? "finish" : "announce") << " the analysis of update " << hex << previous_hash << " -> " << hash << dec << " in time" << endl;
+	return false;
+}
+
+bool UpdateCoordinator::lookup(uint64_t previous_hash, uint64_t hash, pid_t & pid, int & fd) const {
+	if (!is_member())
+		return false;
+
+	pid = __atomic_load_n(&table->coordinator, __ATOMIC_RELAXED);
+	int state = find(previous_hash, hash);
+	if (state < 0)
+		return false;
+	fd = state;
+	return true;
+}
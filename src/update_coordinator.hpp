@@ -0,0 +1,114 @@
+// Luci - a dynamic linker/loader with DSU capabilities
+// Copyright 2021-2023 by Bernhard Heinloth <heinloth@cs.fau.de>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#pragma once
+
+#include <dlh/types.hpp>
+
+/*! \brief Coordination of dynamic updates in a tree of forked processes
+ *  The process forking first becomes the coordinator: It performs the expensive analysis
+ *  (binary hashing, comparison and patchability check) of a new library version and publishes
+ *  the result as update plan in a sealed memory file.
+ *  All processes of the tree share a small table (anonymous shared memory inherited on fork)
+ *  announcing the plans in progress and the descriptors of the published ones, which are opened
+ *  via the coordinators `/proc` entry.
+ *  Each process still loads the new version and commits the update (relocations, redirections)
+ *  on its own, but uses the published plan instead of repeating the analysis.
+ */
+class UpdateCoordinator {
+	/*! \brief Maximum number of announced plans (oldest one will be replaced) */
+	static const size_t slots = 64;
+
+	/*! \brief State of plan (stored instead of descriptor) */
+	enum State : int {
+		STATE_PENDING = -1,  // analysis in progress
+		STATE_FAILED = -2,   // no plan available
+		STATE_UNKNOWN = -3   // not announced (only returned by `find`)
+	};
+
+	/*! \brief Announced plan */
+	struct Entry {
+		/*! \brief Sequence number (odd while being modified by the coordinator) */
+		unsigned long sequence;
+
+		/*! \brief Hashes of the previous and the new version */
+		uint64_t previous_hash, hash;
+
+		/*! \brief Descriptor of memory file in coordinator (or `State`) */
+		int fd;
+	};
+
+	/*! \brief Shared table */
+	struct Table {
+		/*! \brief PID of coordinator */
+		pid_t coordinator;
+
+		/*! \brief Number of announcements */
+		unsigned long next;
+
+		/*! \brief Announcements (ring buffer) */
+		Entry entries[slots];
+	} * table = nullptr;
+
+	/*! \brief Change state of entry */
+	void set(size_t slot, int fd);
+
+	/*! \brief Search the table (once) for an announced plan
+	 * \param previous_hash hash of the previous version
+	 * \param hash hash of the new version
+	 * \return descriptor of memory file in coordinator (or `State`)
+	 */
+	int find(uint64_t previous_hash, uint64_t hash) const;
+
+ public:
+	/*! \brief Time to wait for an announcement of the coordinator (after a modification was detected) */
+	static const unsigned long announce_timeout_ms = 250;
+
+	/*! \brief Maximum time to wait for the coordinator to finish an announced analysis */
+	static const unsigned long analysis_timeout_ms = 30000;
+
+	/*! \brief Create the shared table with the calling process as coordinator (has to be called before the first fork)
+	 * \return `true` if the table is available (created now or inherited earlier)
+	 */
+	bool setup();
+
+	/*! \brief Is the calling process the coordinator? */
+	bool is_coordinator() const;
+
+	/*! \brief Is the calling process a member (but not the coordinator) of a coordinated tree? */
+	bool is_member() const;
+
+	/*! \brief Announce the analysis of an update (coordinator only)
+	 * \param previous_hash hash of the previous version
+	 * \param hash hash of the new version
+	 * \return slot for `publish` or `withdraw` (or `-1` if not coordinator)
+	 */
+	ssize_t announce(uint64_t previous_hash, uint64_t hash);
+
+	/*! \brief Publish plan of an announced update (coordinator only)
+	 * \param slot announced slot
+	 * \param fd (sealed) memory file containing the plan, will be closed by the coordinator when the slot is replaced
+	 */
+	void publish(ssize_t slot, int fd);
+
+	/*! \brief Withdraw an announced update (analysis failed, no plan available) */
+	void withdraw(ssize_t slot);
+
+	/*! \brief Wait for the coordinator to announce and finish the analysis of an update
+	 * \note blocks up to `analysis_timeout_ms` -- must not be called while holding a lock of the loader
+	 * \param previous_hash hash of the previous version
+	 * \param hash hash of the new version
+	 * \return `true` if plan was published
+	 */
+	bool wait(uint64_t previous_hash, uint64_t hash) const;
+
+	/*! \brief Look up the published plan for an update (without waiting)
+	 * \param previous_hash hash of the previous version
+	 * \param hash hash of the new version
+	 * \param pid will be set to the coordinators PID
+	 * \param fd will be set to the memory file descriptor in the coordinator
+	 * \return `true` if plan was published
+	 */
+	bool lookup(uint64_t previous_hash, uint64_t hash, pid_t & pid, int & fd) const;
+};
@@ -0,0 +1,428 @@
+// Luci - a dynamic linker/loader with DSU capabilities
+// Copyright 2021-2023 by Bernhard Heinloth <heinloth@cs.fau.de>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include "update_plan.hpp"
+
+#include <dlh/container/vector.hpp>
+#include <dlh/assert.hpp>
+#include <dlh/stream/string.hpp>
+#include <dlh/syscall.hpp>
+#include <dlh/xxhash.hpp>
+#include <dlh/string.hpp>
+#include <dlh/file.hpp>
+#include <dlh/log.hpp>
+#include <dlh/mem.hpp>
+
+#include <bean/bean.hpp>
+#include <bean/update.hpp>
+
+#include "bean_interface.hpp"
+
+static const char magic[8] = { 'L', 'U', 'C', 'I', 'P', 'L', 'A', 'N' };
+static const uint32_t format_version = 2;
+
+/*! \brief Collected contents during plan creation */
+struct UpdatePlan::Builder {
+	Header header;
+	Vector<Symbol> symbols;
+	Vector<Symbol> targets;
+	Vector<Redirect> redirects;
+	Vector<Relocation> relocations;
+	Vector<char> strings;
+
+	Builder(const Loader::Config & config, uint64_t previous_hash, size_t previous_size, uint64_t hash, size_t size) {
+		Memory::set(reinterpret_cast<uintptr_t>(&header), 0, sizeof(header));
+		Memory::copy(reinterpret_cast<uintptr_t>(header.magic), reinterpret_cast<uintptr_t>(magic), sizeof(magic));
+		header.version = format_version;
+		header.previous_hash = previous_hash;
+		header.previous_size = previous_size;
+		header.hash = hash;
+		header.size = size;
+		header.update_mode = config.update_mode;
+		header.relax_comparison = config.relax_comparison;
+		header.dependency_check = config.dependency_check ? 1 : 0;
+		header.detect_outdated = config.detect_outdated;
+		// Offset 0 is reserved for symbols without name
+		strings.push_back('\0');
+	}
+
+	uint32_t string(const char * str) {
+		if (str == nullptr)
+			return 0;
+		uint32_t offset = static_cast<uint32_t>(strings.size());
+		do {
+			strings.push_back(*str);
+		} while (*(str++) != '\0');
+		return offset;
+	}
+
+	Symbol symbol(const Bean::Symbol & sym) {
+		BeanInterface::Symbol s(sym);
+		Symbol r;
+		r.address = s.value();
+		r.size = s.size();
+		r.name_offset = string(s.name());
+		r.bind = static_cast<uint8_t>(s.bind());
+		r.type = static_cast<uint8_t>(s.type());
+		r.executable = sym.section.executable ? 1 : 0;
+		return r;
+	}
+
+	/*! \brief Compare binary hashes of both versions */
+	void analyse(const Loader::Config & config, const Bean & previous_hash, const Bean & new_hash);
+
+	/*! \brief Serialize plan and write it to file descriptor */
+	bool write(int fd);
+};
+
+static bool plan_redirect(uintptr_t from, uintptr_t to, size_t size, UpdatePlan::Builder * builder) {
+	UpdatePlan::Redirect r;
+	r.from = from;
+	r.to = to;
+	r.size = size;
+	builder->redirects.push_back(r);
+	return true;
+}
+
+static bool plan_relocate(const Bean::SymbolRelocation & rel, uintptr_t to, const Bean::Symbol & target, UpdatePlan::Builder * builder) {
+	(void)to;
+	UpdatePlan::Relocation r;
+	r.offset = rel.offset;
+	r.addend = rel.addend;
+	r.type = rel.type;
+	r.target = builder->targets.size();
+	builder->relocations.push_back(r);
+	builder->targets.push_back(builder->symbol(target));
+	return true;
+}
+
+static void plan_skip(uintptr_t from, uintptr_t to, const char * reason, UpdatePlan::Builder * builder) {
+	(void) builder;
+	LOG_DEBUG << "Skipping " << reinterpret_cast<void*>(from) << " (to " << reinterpret_cast<void*>(to) << ")";
+	if (reason != nullptr)
+		LOG_DEBUG_APPEND << ": " << reason;
+	LOG_DEBUG_APPEND << endl;
+}
+
+void UpdatePlan::Builder::analyse(const Loader::Config & config, const Bean & previous_hash, const Bean & new_hash) {
+	// Changes in new version & patchability
+	const auto changed = new_hash.diff(previous_hash, config.dependency_check, static_cast<Bean::ComparisonMode>(config.relax_comparison));
+	header.patchable = Bean::patchable(changed) ? 1 : 0;
+	for (const auto & d : changed)
+		symbols.push_back(symbol(d));
+	header.changed = symbols.size();
+
+	// Changes in previous version (for detection of outdated access)
+	const auto outdated = previous_hash.diff(new_hash, config.detect_outdated == Loader::Config::DETECT_OUTDATED_WITH_DEPS_VIA_UPROBES, static_cast<Bean::ComparisonMode>(config.relax_comparison));
+	for (const auto & d : outdated)
+		symbols.push_back(symbol(d));
+	header.outdated = symbols.size() - header.changed;
+
+	// Redirections and relocations (using file relative addresses)
+	if (config.update_mode >= Loader::Config::UPDATE_MODE_CODEREL) {
+		uint32_t flags = BeanUpdate::FLAG_USE_SYMBOL_NAMES | BeanUpdate::FLAG_ONLY_EXECUTABLE | BeanUpdate::FLAG_ONLY_BRANCH_RELS;
+		if (config.update_mode == Loader::Config::UPDATE_MODE_CODEREL)
+			flags |= BeanUpdate::FLAG_IGNORE_LOCAL_RELS;
+		BeanUpdate updater(flags);
+		updater.process<Builder, plan_redirect, plan_relocate, plan_skip>(previous_hash, new_hash, 0, 0, this);
+	}
+	header.targets = targets.size();
+	header.redirects = redirects.size();
+	header.relocations = relocations.size();
+	header.strings = strings.size();
+}
+
+bool UpdatePlan::Builder::write(int fd) {
+	size_t payload_size = (symbols.size() + targets.size()) * sizeof(Symbol) + redirects.size() * sizeof(Redirect) + relocations.size() * sizeof(Relocation) + strings.size();
+	if (auto mmap = Syscall::mmap(NULL, payload_size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) {
+		uintptr_t payload = mmap.value();
+		uintptr_t p = payload;
+		for (const auto & s : symbols)
+			p = Memory::copy(p, reinterpret_cast<uintptr_t>(&s), sizeof(Symbol)) + sizeof(Symbol);
+		for (const auto & s : targets)
+			p = Memory::copy(p, reinterpret_cast<uintptr_t>(&s), sizeof(Symbol)) + sizeof(Symbol);
+		for (const auto & r : redirects)
+			p = Memory::copy(p, reinterpret_cast<uintptr_t>(&r), sizeof(Redirect)) + sizeof(Redirect);
+		for (const auto & r : relocations)
+			p = Memory::copy(p, reinterpret_cast<uintptr_t>(&r), sizeof(Relocation)) + sizeof(Relocation);
+		for (const auto & c : strings)
+			*reinterpret_cast<char*>(p++) = c;
+		assert(p == payload + payload_size);
+		header.checksum = checksum(header, payload, payload_size);
+
+		auto header_write = Syscall::write(fd, &header, sizeof(Header));
+		auto payload_write = Syscall::write(fd, reinterpret_cast<void*>(payload), payload_size);
+		Syscall::munmap(payload, payload_size + 1);
+		return header_write.success() && payload_write.success() && header_write.value() == sizeof(Header) && static_cast<size_t>(payload_write.value()) == payload_size;
+	} else {
+		LOG_ERROR << "Allocating " << payload_size << " bytes for update plan failed: " << mmap.error_message() << endl;
+		return false;
+	}
+}
+
+uint64_t UpdatePlan::hash(uintptr_t addr, size_t size) {
+	XXHash64 datahash(0);
+	datahash.add(addr, size);
+	return datahash.hash();
+}
+
+uint64_t UpdatePlan::checksum(const Header & header, uintptr_t payload, size_t payload_size) {
+	Header tmp = header;
+	tmp.checksum = 0;
+	XXHash64 planhash(0);
+	planhash.add(reinterpret_cast<uintptr_t>(&tmp), sizeof(Header));
+	planhash.add(payload, payload_size);
+	return planhash.hash();
+}
+
+bool UpdatePlan::create(const Loader::Config & config, const char * previous_path, const char * path) {
+	size_t previous_size = 0;
+	size_t size = 0;
+	void * previous_data = File::contents::get(previous_path, previous_size);
+	void * data = File::contents::get(path, size);
+	bool success = false;
+	if (previous_data == nullptr || data == nullptr) {
+		LOG_ERROR << "Unable to read " << (previous_data == nullptr ? previous_path : path) << " for update plan" << endl;
+	} else {
+		Elf previous_elf(reinterpret_cast<uintptr_t>(previous_data));
+		Elf elf(reinterpret_cast<uintptr_t>(data));
+		if (!previous_elf.valid(previous_size) || !elf.valid(size)) {
+			LOG_ERROR << "Invalid ELF " << (previous_elf.valid(previous_size) ? path : previous_path) << " for update plan" << endl;
+		} else {
+			Builder builder(config, hash(reinterpret_cast<uintptr_t>(previous_data), previous_size), previous_size, hash(reinterpret_cast<uintptr_t>(data), size), size);
+
+			// Binary hashes (as during runtime)
+			uint32_t bean_flags = BeanInterface::flags(config.update_mode >= Loader::Config::UPDATE_MODE_CODEREL);
+			LOG_INFO << "Calculate Binary hash of " << previous_path << endl;
+			Bean previous_hash(previous_elf, nullptr, bean_flags);
+			LOG_INFO << "Calculate Binary hash of " << path << endl;
+			Bean new_hash(elf, nullptr, bean_flags);
+
+			builder.analyse(config, previous_hash, new_hash);
+
+			// Write to file
+			StringStream<PATH_MAX + 1> plan_path;
+			plan_path << path << suffix;
+			if (auto fd = Syscall::open(plan_path.str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)) {
+				if (!builder.write(fd.value())) {
+					LOG_ERROR << "Writing update plan " << plan_path.str() << " failed" << endl;
+				} else {
+					LOG_INFO << "Update plan " << plan_path.str() << " written (" << builder.header.changed << " changed symbols, " << (builder.header.patchable != 0 ? "patchable" : "not patchable") << ", " << builder.header.redirects << " redirections, " << builder.header.relocations << " relocations)" << endl;
+					success = true;
+				}
+				Syscall::close(fd.value());
+			} else {
+				LOG_ERROR << "Opening update plan " << plan_path.str() << " failed: " << fd.error_message() << endl;
+			}
+		}
+	}
+
+	if (previous_data != nullptr)
+		Syscall::munmap(reinterpret_cast<uintptr_t>(previous_data), previous_size);
+	if (data != nullptr)
+		Syscall::munmap(reinterpret_cast<uintptr_t>(data), size);
+	return success;
+}
+
+// End of the virtual memory used by the loadable segments (relative to base)
+static uintptr_t virt_end(const Object & object) {
+	uintptr_t end = 0;
+	for (const auto & segment : object.segments)
+		if (Elf::PT_LOAD == segment.type() && segment.virt_addr() + segment.virt_size() > end)
+			end = segment.virt_addr() + segment.virt_size();
+	return end;
+}
+
+UpdatePlan::UpdatePlan(uintptr_t addr, size_t size) : addr(addr), size(size), header(reinterpret_cast<const Header *>(addr)) {
+	symbols = reinterpret_cast<const Symbol *>(addr + sizeof(Header));
+	redirects = reinterpret_cast<const Redirect *>(symbols + header->changed + header->outdated + header->targets);
+	relocations = reinterpret_cast<const Relocation *>(redirects + header->redirects);
+	strings = reinterpret_cast<const char *>(relocations + header->relocations);
+}
+
+UpdatePlan::~UpdatePlan() {
+	if (auto unmap = Syscall::munmap(addr, size); unmap.failed())
+		LOG_WARNING << "Unmapping update plan at " << reinterpret_cast<void*>(addr) << " failed: " << unmap.error_message() << endl;
+}
+
+UpdatePlan * UpdatePlan::open(const char * plan_path, const Object & previous, const Object & object, uint64_t previous_hash, uint64_t new_hash) {
+	size_t size = 0;
+	void * data = File::contents::get(plan_path, size);
+	if (data == nullptr) {
+		LOG_WARNING << "Unable to read update plan " << plan_path << endl;
+		return nullptr;
+	}
+	uintptr_t addr = reinterpret_cast<uintptr_t>(data);
+	const Header * header = reinterpret_cast<const Header *>(addr);
+	const auto & config = object.file.loader.config;
+
+	const char * invalid = nullptr;
+	if (size < sizeof(Header) || Memory::compare(header->magic, magic, sizeof(magic)) != 0 || header->version != format_version)
+		invalid = "unsupported format";
+	else if (size != sizeof(Header) + (static_cast<size_t>(header->changed) + header->outdated + header->targets) * sizeof(Symbol) + static_cast<size_t>(header->redirects) * sizeof(Redirect) + static_cast<size_t>(header->relocations) * sizeof(Relocation) + header->strings)
+		invalid = "invalid size";
+	else if (header->strings == 0 || reinterpret_cast<const char *>(addr)[size - 1] != '\0')
+		invalid = "invalid string table";
+	else if (header->checksum != checksum(*header, addr + sizeof(Header), size - sizeof(Header)))
+		invalid = "checksum mismatch";
+	else if (header->update_mode != static_cast<uint32_t>(config.update_mode) || header->relax_comparison != static_cast<uint32_t>(config.relax_comparison) || header->dependency_check != (config.dependency_check ? 1U : 0U) || header->detect_outdated != static_cast<uint32_t>(config.detect_outdated))
+		invalid = "created with different configuration";
+	else if (header->previous_size != previous.data.size || header->previous_hash != previous_hash)
+		invalid = "not created for current version";
+	else if (header->size != object.data.size || header->hash != new_hash)
+		invalid = "not created for new version";
+
+	if (invalid != nullptr) {
+		LOG_WARNING << "Ignoring update plan " << plan_path << " for " << object << ": " << invalid << endl;
+		Syscall::munmap(addr, size);
+		return nullptr;
+	}
+
+	UpdatePlan * plan = new UpdatePlan(addr, size);
+	if (plan == nullptr) {
+		Syscall::munmap(addr, size);
+		return nullptr;
+	}
+	// Check references
+	for (size_t s = 0; s < static_cast<size_t>(header->changed) + header->outdated + header->targets; s++)
+		if (plan->symbols[s].name_offset >= header->strings)
+			invalid = "invalid symbol name";
+	for (auto * rel = plan->relocations_begin(); rel != plan->relocations_end(); ++rel)
+		if (rel->target >= header->targets)
+			invalid = "invalid relocation target";
+	const uintptr_t previous_end = virt_end(previous);
+	const uintptr_t new_end = virt_end(object);
+	for (auto * r = plan->redirects_begin(); r != plan->redirects_end(); ++r)
+		if (r->from >= previous_end || r->size > previous_end - r->from || r->to >= new_end)
+			invalid = "invalid redirection";
+	if (invalid != nullptr) {
+		LOG_WARNING << "Ignoring update plan " << plan_path << " for " << object << ": " << invalid << endl;
+		delete plan;
+		return nullptr;
+	}
+
+	LOG_INFO << "Using update plan " << plan_path << " for " << object << " (" << header->changed << " changed symbols, " << header->redirects << " redirections, " << header->relocations << " relocations)" << endl;
+	return plan;
+}
+
+UpdatePlan * UpdatePlan::load(const Object & previous, const Object & object) {
+	const auto & path = object.file.path;
+	const auto & coordinator = object.file.loader.update_coordinator;
+
+	StringStream<PATH_MAX + 1> plan_path;
+	if (!path.empty())
+		plan_path << path << suffix;
+	const bool sidecar = !path.empty() && File::exists(plan_path.str());
+	if (!sidecar && !coordinator.is_member())
+		return nullptr;
+
+	// Reuse hashes from waiting for the coordinator if the file was not modified since
+	auto & hint = object.file.update_plan_hash;
+	const bool hinted = hint.previous == &previous && hint.size == object.data.size && hint.modification_time.tv_sec == object.data.modification_time.tv_sec && hint.modification_time.tv_nsec == object.data.modification_time.tv_nsec;
+	const uint64_t previous_hash = hinted ? hint.previous_hash : hash(previous.data.addr, previous.data.size);
+	const uint64_t new_hash = hinted ? hint.new_hash : hash(object.data.addr, object.data.size);
+	hint.previous = nullptr;
+
+	// Precomputed sidecar file
+	if (sidecar)
+		if (UpdatePlan * plan = open(plan_path.str(), previous, object, previous_hash, new_hash))
+			return plan;
+
+	// Published by the coordinator of the forked processes
+	pid_t pid;
+	int fd;
+	if (coordinator.lookup(previous_hash, new_hash, pid, fd)) {
+		StringStream<PATH_MAX + 1> fd_path;
+		fd_path << "/proc/" << pid << "/fd/" << fd;
+		return open(fd_path.str(), previous, object, previous_hash, new_hash);
+	}
+
+	return nullptr;
+}
+
+bool UpdatePlan::coordinated(const ObjectIdentity & file, uint64_t & previous_hash, uint64_t & new_hash) {
+	if (!file.loader.update_coordinator.is_member() || file.loader.config.find_debug_symbols || file.current == nullptr || file.path.empty())
+		return false;
+
+	// Precomputed sidecar file will be preferred
+	StringStream<PATH_MAX + 1> plan_path;
+	plan_path << file.path << suffix;
+	if (File::exists(plan_path.str()))
+		return false;
+
+	auto & hint = file.update_plan_hash;
+	hint.previous = nullptr;
+
+	int fd;
+	if (auto open = Syscall::open(file.path.str, O_RDONLY)) {
+		fd = open.value();
+	} else {
+		return false;
+	}
+
+	// Size and modification time allow `load` to check if the hashes are still valid
+	struct stat sb;
+	if (auto fstat = Syscall::fstat(fd, &sb); fstat.failed() || sb.st_size == 0) {
+		Syscall::close(fd);
+		return false;
+	}
+
+	auto mmap = Syscall::mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	Syscall::close(fd);
+	if (mmap.failed())
+		return false;
+
+	previous_hash = hash(file.current->data.addr, file.current->data.size);
+	new_hash = hash(mmap.value(), sb.st_size);
+	Syscall::munmap(mmap.value(), sb.st_size);
+
+	hint.previous = file.current;
+	hint.previous_hash = previous_hash;
+	hint.new_hash = new_hash;
+	hint.size = sb.st_size;
+	hint.modification_time = sb.st_mtim;
+	return true;
+}
+
+UpdatePlan * UpdatePlan::publish(Object & previous, Object & object) {
+	auto & coordinator = object.file.loader.update_coordinator;
+	const uint64_t previous_hash = hash(previous.data.addr, previous.data.size);
+	const uint64_t new_hash = hash(object.data.addr, object.data.size);
+
+	// Let the other processes wait for the analysis
+	ssize_t slot = coordinator.announce(previous_hash, new_hash);
+	if (slot < 0)
+		return nullptr;
+
+	int fd = -1;
+	if (previous.calculate_binary_hash() && object.calculate_binary_hash()) {
+		Builder builder(object.file.loader.config, previous_hash, previous.data.size, new_hash, object.data.size);
+		builder.analyse(object.file.loader.config, *(previous.binary_hash), *(object.binary_hash));
+
+		StringStream<NAME_MAX + 1> name;
+		name << object.file.name.str << '#' << hex << new_hash << suffix;
+		if (auto memfd = Syscall::memfd_create(name.str(), MFD_CLOEXEC | MFD_ALLOW_SEALING)) {
+			fd = memfd.value();
+			if (!builder.write(fd)) {
+				LOG_ERROR << "Writing update plan " << name.str() << " failed" << endl;
+			} else if (auto fcntl = Syscall::fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL); fcntl.failed()) {
+				LOG_ERROR << "Sealing update plan " << name.str() << " failed: " << fcntl.error_message() << endl;
+			} else {
+				LOG_INFO << "Publishing update plan " << name.str() << " for forked processes (" << builder.header.changed << " changed symbols, " << (builder.header.patchable != 0 ? "patchable" : "not patchable") << ", " << builder.header.redirects << " redirections, " << builder.header.relocations << " relocations)" << endl;
+				coordinator.publish(slot, fd);
+
+				// Use the published plan as well
+				StringStream<PATH_MAX + 1> fd_path;
+				fd_path << "/proc/self/fd/" << fd;
+				return open(fd_path.str(), previous, object, previous_hash, new_hash);
+			}
+			Syscall::close(fd);
+		} else {
+			LOG_ERROR << "Creating memory file " << name.str() << " for update plan failed: " << memfd.error_message() << endl;
+		}
+	}
+
+	coordinator.withdraw(slot);
+	return nullptr;
+}
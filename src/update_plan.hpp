@@ -0,0 +1,280 @@
+// Luci - a dynamic linker/loader with DSU capabilities
+// Copyright 2021-2023 by Bernhard Heinloth <heinloth@cs.fau.de>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#pragma once
+
+#include <dlh/types.hpp>
+#include <elfo/elf.hpp>
+
+#include "loader.hpp"
+
+/*! \brief Precomputed (offline) update plan
+ *  Contains the results of the binary comparison between two versions of a shared library,
+ *  stored in a sidecar file next to the new version (with suffix `.luciplan`).
+ *  The plan is bound to the hashes of both ELF files and the loader configuration
+ *  and replaces the expensive binary hashing, comparison and patchability check during runtime.
+ *  In a tree of forked processes, the update coordinator publishes the plans it creates during runtime
+ *  in memory files (see `UpdateCoordinator`).
+ */
+struct UpdatePlan {
+	/*! \brief File suffix of update plan sidecar */
+	static constexpr const char * suffix = ".luciplan";
+
+	/*! \brief File header */
+	struct Header {
+		/*! \brief Magic identification */
+		char magic[8];
+
+		/*! \brief Format version */
+		uint32_t version;
+
+		/*! \brief Result of patchability check */
+		uint32_t patchable;
+
+		/*! \brief Hash and size of the previous version (ELF file) */
+		uint64_t previous_hash, previous_size;
+
+		/*! \brief Hash and size of the new version (ELF file) */
+		uint64_t hash, size;
+
+		/*! \brief Loader configuration used for comparison */
+		uint32_t update_mode, relax_comparison, dependency_check, detect_outdated;
+
+		/*! \brief Number of entries */
+		uint32_t changed, outdated, targets, redirects, relocations;
+
+		/*! \brief Size of string table */
+		uint32_t strings;
+
+		/*! \brief Hash of the whole plan (calculated with this field set to zero) */
+		uint64_t checksum;
+	} __attribute__((packed));
+
+	/*! \brief Symbol entry */
+	struct Symbol {
+		/*! \brief File relative address */
+		uint64_t address;
+
+		/*! \brief Size of symbol */
+		uint64_t size;
+
+		/*! \brief Offset of name in string table (0 for none) */
+		uint32_t name_offset;
+
+		/*! \brief Binding and type (as ELF values) */
+		uint8_t bind, type;
+
+		/*! \brief Symbol is located in an executable section */
+		uint16_t executable;
+	} __attribute__((packed));
+
+	/*! \brief Redirection of code in previous version */
+	struct Redirect {
+		/*! \brief File relative address in previous version */
+		uint64_t from;
+
+		/*! \brief File relative address in new version */
+		uint64_t to;
+
+		/*! \brief Available bytes */
+		uint64_t size;
+	} __attribute__((packed));
+
+	/*! \brief Relocation in code of previous version */
+	struct Relocation {
+		/*! \brief File relative address in previous version */
+		uint64_t offset;
+
+		/*! \brief Addend */
+		int64_t addend;
+
+		/*! \brief Relocation type */
+		uint32_t type;
+
+		/*! \brief Index of target symbol (in new version) */
+		uint32_t target;
+	} __attribute__((packed));
+
+	/*! \brief Symbol (interface for symbol relocator) */
+	struct SymbolInterface {
+		const UpdatePlan & plan;
+		const Symbol & sym;
+
+		SymbolInterface(const UpdatePlan & plan, const Symbol & sym) : plan(plan), sym(sym) {}
+
+		const char * name() const {
+			return plan.name(sym);
+		}
+
+		uintptr_t value() const {
+			return sym.address;
+		}
+
+		size_t size() const {
+			return sym.size;
+		}
+
+		bool valid() const {
+			return value() != 0 || size() != 0;
+		}
+
+		bool undefined() const {
+			return false;
+		}
+
+		Elf::sym_bind bind() const {
+			return static_cast<Elf::sym_bind>(sym.bind);
+		}
+
+		Elf::sym_type type() const {
+			return static_cast<Elf::sym_type>(sym.type);
+		}
+	};
+
+	/*! \brief Relocation (interface for symbol relocator) */
+	struct RelocationInterface {
+		const Elf & _elf;
+		const Relocation & rel;
+
+		RelocationInterface(const Elf & elf, const Relocation & rel) : _elf(elf), rel(rel) {}
+
+		const Elf & elf() const {
+			return _elf;
+		}
+
+		bool valid() const {
+			return true;
+		}
+
+		uintptr_t offset() const {
+			return rel.offset;
+		}
+
+		uint32_t type() const {
+			return rel.type;
+		}
+
+		intptr_t addend() const {
+			return rel.addend;
+		}
+	};
+
+	/*! \brief Collected contents during plan creation */
+	struct Builder;
+
+	/*! \brief Create update plan by comparing two versions
+	 * \param config loader configuration (used for comparison)
+	 * \param previous_path path to previous version
+	 * \param path path to new version (plan will be written to same path with suffix)
+	 * \return `true` if plan was written
+	 */
+	static bool create(const Loader::Config & config, const char * previous_path, const char * path);
+
+	/*! \brief Load and validate update plan for new version of an object
+	 * Uses the sidecar file or -- in a forked process -- the plan already published by the update coordinator (see `coordinated`)
+	 * \param previous current version of the object
+	 * \param object new version of the object
+	 * \return plan (or `nullptr` if not available or invalid)
+	 */
+	static UpdatePlan * load(const Object & previous, const Object & object);
+
+	/*! \brief Check if the new version of an object might use a plan published by the update coordinator
+	 * Waiting for the coordinator (`UpdateCoordinator::wait`) might take a while, hence it has to be done
+	 * before loading the new version and without holding a lock -- `load` will only use already published plans.
+	 * The hashes are stored in the object identity, so `load` does not have to calculate them again.
+	 * \param file object identity with modified file
+	 * \param previous_hash will be set to the hash of the current version
+	 * \param new_hash will be set to the hash of the modified file
+	 * \return `true` if the plan has to be requested from the coordinator
+	 */
+	static bool coordinated(const ObjectIdentity & file, uint64_t & previous_hash, uint64_t & new_hash);
+
+	/*! \brief Create update plan by comparing the binary hashes and publish it for forked processes
+	 * (only available in the update coordinator)
+	 * \param previous current version of the object
+	 * \param object new version of the object
+	 * \return plan (or `nullptr` if not coordinator or on error)
+	 */
+	static UpdatePlan * publish(Object & previous, Object & object);
+
+	/*! \brief Destructor (unmap file) */
+	~UpdatePlan();
+
+	/*! \brief Result of the patchability check */
+	bool patchable() const {
+		return header->patchable != 0;
+	}
+
+	/*! \brief Name of symbol */
+	const char * name(const Symbol & sym) const {
+		return sym.name_offset == 0 ? nullptr : strings + sym.name_offset;
+	}
+
+	/*! \brief Changed symbols in the new version */
+	const Symbol * changed_begin() const {
+		return symbols;
+	}
+	const Symbol * changed_end() const {
+		return symbols + header->changed;
+	}
+
+	/*! \brief Changed symbols in the previous version */
+	const Symbol * outdated_begin() const {
+		return changed_end();
+	}
+	const Symbol * outdated_end() const {
+		return outdated_begin() + header->outdated;
+	}
+
+	/*! \brief Target symbol of relocation */
+	const Symbol & target(const Relocation & rel) const {
+		return symbols[header->changed + header->outdated + rel.target];
+	}
+
+	/*! \brief Redirections in previous version */
+	const Redirect * redirects_begin() const {
+		return redirects;
+	}
+	const Redirect * redirects_end() const {
+		return redirects + header->redirects;
+	}
+
+	/*! \brief Relocations in previous version */
+	const Relocation * relocations_begin() const {
+		return relocations;
+	}
+	const Relocation * relocations_end() const {
+		return relocations + header->relocations;
+	}
+
+ private:
+	/*! \brief Mapped file */
+	uintptr_t addr;
+	size_t size;
+
+	/*! \brief Contents */
+	const Header * header;
+	const Symbol * symbols;
+	const Redirect * redirects;
+	const Relocation * relocations;
+	const char * strings;
+
+	UpdatePlan(uintptr_t addr, size_t size);
+
+	/*! \brief Hash of file contents */
+	static uint64_t hash(uintptr_t addr, size_t size);
+
+	/*! \brief Checksum of plan */
+	static uint64_t checksum(const Header & header, uintptr_t payload, size_t payload_size);
+
+	/*! \brief Read and validate update plan file
+	 * \param plan_path path to plan
+	 * \param previous current version of the object
+	 * \param object new version of the object
+	 * \param previous_hash hash of the file contents of the current version
+	 * \param new_hash hash of the file contents of the new version
+	 * \return plan (or `nullptr` if invalid)
+	 */
+	static UpdatePlan * open(const char * plan_path, const Object & previous, const Object & object, uint64_t previous_hash, uint64_t new_hash);
+};
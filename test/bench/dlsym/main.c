@@ -0,0 +1,68 @@
+// Throughput of dlsym with an increasing number of concurrent threads
+// looking up symbols in a handle and via RTLD_DEFAULT (like a language runtime).
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define SYMBOLS 16
+#define ITERATIONS 200000UL
+#define MAX_THREADS 8
+
+static void * handle = NULL;
+static char names[SYMBOLS][16];
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void * lookup(void * arg) {
+	void * h = arg;
+	unsigned long sum = 0;
+	for (unsigned long i = 0; i < ITERATIONS; i++) {
+		unsigned long (*func)(unsigned long) = dlsym(h, names[i % SYMBOLS]);
+		if (func == NULL) {
+			fprintf(stderr, "dlsym of %s failed: %s\n", names[i % SYMBOLS], dlerror());
+			exit(EXIT_FAILURE);
+		}
+		sum = func(sum);
+	}
+	return (void *) sum;
+}
+
+static void measure(const char * name, void * h) {
+	for (size_t n = 1; n <= MAX_THREADS; n *= 2) {
+		pthread_t threads[MAX_THREADS];
+		double start = now();
+		for (size_t t = 0; t < n; t++)
+			if (pthread_create(&threads[t], NULL, lookup, h) != 0) {
+				perror("pthread_create");
+				exit(EXIT_FAILURE);
+			}
+		for (size_t t = 0; t < n; t++)
+			pthread_join(threads[t], NULL);
+		double duration = now() - start;
+		printf("%-16s %zu thread(s) %12.2f ns/call %12.0f calls/s\n", name, n, duration / ITERATIONS, n * ITERATIONS * 1e9 / duration);
+	}
+}
+
+int main() {
+	for (size_t s = 0; s < SYMBOLS; s++)
+		snprintf(names[s], sizeof(names[s]), "func%zu", s);
+
+	handle = dlopen("libplugin.so", RTLD_NOW | RTLD_GLOBAL);
+	if (handle == NULL) {
+		fprintf(stderr, "Loading libplugin.so failed: %s\n", dlerror());
+		return EXIT_FAILURE;
+	}
+
+	measure("handle", handle);
+	measure("RTLD_DEFAULT", RTLD_DEFAULT);
+
+	dlclose(handle);
+	return EXIT_SUCCESS;
+}
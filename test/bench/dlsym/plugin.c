@@ -0,0 +1,5 @@
+// Plugin exporting several functions (looked up by name like in a plugin host)
+#define FUNC(N) unsigned long func ## N(unsigned long x) { return x + N; }
+
+FUNC(0) FUNC(1) FUNC(2) FUNC(3) FUNC(4) FUNC(5) FUNC(6) FUNC(7)
+FUNC(8) FUNC(9) FUNC(10) FUNC(11) FUNC(12) FUNC(13) FUNC(14) FUNC(15)
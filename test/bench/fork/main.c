@@ -0,0 +1,57 @@
+// Measure the latency of fork (until the child has exited) depending on the
+// size of the writable data of the process -- run with LD_DYNAMIC_UPDATE=1
+// to compare duplicating the shared memory with the system loader (and with
+// `Loader::Config::fork_copy_on_write` enabled in a custom build).
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ITERATIONS 100
+#define MAX_SIZE (64UL * 1024 * 1024)
+
+// Initialized (non-zero) data to have it in the data segment
+static uint8_t data[MAX_SIZE] = { 1 };
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void measure(size_t size, int child_writes) {
+	// Touch data (as a server would have done before forking its workers)
+	memset(data, 0x42, size);
+
+	double start = now();
+	for (int i = 0; i < ITERATIONS; i++) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			if (child_writes)
+				data[(i * 4096 + 1) % size] = (uint8_t) i;
+			_exit(data[0] == 0x42 ? EXIT_SUCCESS : EXIT_FAILURE);
+		} else if (pid < 0) {
+			perror("fork");
+			exit(EXIT_FAILURE);
+		}
+		int status;
+		if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+			fprintf(stderr, "Child %d failed\n", pid);
+			exit(EXIT_FAILURE);
+		}
+	}
+	double duration = now() - start;
+	printf("%8zu KiB data %-14s %12.2f us/fork (%d forks)\n", size / 1024, child_writes ? "(child writes)" : "", duration / ITERATIONS / 1000, ITERATIONS);
+}
+
+int main() {
+	for (size_t size = 64 * 1024; size <= MAX_SIZE; size *= 4) {
+		measure(size, 0);
+		measure(size, 1);
+	}
+	return EXIT_SUCCESS;
+}
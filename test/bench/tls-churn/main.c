@@ -0,0 +1,63 @@
+// Costs of short-lived threads accessing dynamic TLS blocks of several
+// dlopen'ed libraries (like a thread pool churning in a server).
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define PLUGINS 4
+#define THREADS 20000UL
+#define PARALLEL 4
+
+static unsigned long (*plugin[PLUGINS])(unsigned long);
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void * empty(void * arg) {
+	return arg;
+}
+
+static void * work(void * arg) {
+	unsigned long r = (unsigned long) arg;
+	for (size_t p = 0; p < PLUGINS; p++)
+		r += plugin[p](r);
+	return (void *) r;
+}
+
+static void measure(const char * name, void * (*func)(void *)) {
+	pthread_t threads[PARALLEL];
+	double start = now();
+	for (unsigned long i = 0; i < THREADS; i += PARALLEL) {
+		for (size_t t = 0; t < PARALLEL; t++)
+			if (pthread_create(&threads[t], NULL, func, (void *) (i + t)) != 0) {
+				perror("pthread_create");
+				exit(EXIT_FAILURE);
+			}
+		for (size_t t = 0; t < PARALLEL; t++)
+			pthread_join(threads[t], NULL);
+	}
+	double duration = now() - start;
+	printf("%-28s %12.2f ns/thread (%lu threads)\n", name, duration / THREADS, THREADS);
+}
+
+int main() {
+	measure("thread without TLS access", empty);
+
+	for (size_t p = 0; p < PLUGINS; p++) {
+		char lib[32], sym[32];
+		snprintf(lib, sizeof(lib), "libplugin%zu.so", p + 1);
+		snprintf(sym, sizeof(sym), "plugin%zu", p + 1);
+		void * handle = dlopen(lib, RTLD_NOW);
+		if (handle == NULL || (plugin[p] = dlsym(handle, sym)) == NULL) {
+			fprintf(stderr, "Loading %s failed: %s\n", lib, dlerror());
+			return EXIT_FAILURE;
+		}
+	}
+	measure("thread with dynamic TLS", work);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,9 @@
+// Plugin with a dynamic TLS block (too large for the static TLS surplus)
+#define CONCAT(A, B) A ## B
+#define NAME(A, B) CONCAT(A, B)
+
+static __thread unsigned long data[256] = { PLUGIN };
+
+unsigned long NAME(plugin, PLUGIN)(unsigned long x) {
+	return data[x % 256] += x;
+}
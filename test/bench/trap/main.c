@@ -0,0 +1,114 @@
+// Compare the costs of the different trap instructions used for redirections
+// with the steady state of a static jump (and a direct call as baseline).
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <ucontext.h>
+
+#define TRAP_ITERATIONS 200000UL
+#define JUMP_ITERATIONS 100000000UL
+
+static uint8_t * code = NULL;
+static const size_t code_size = 4096;
+
+__attribute__((noinline)) long target(long x) {
+	__asm__ volatile("" ::: "memory");
+	return x + 1;
+}
+
+static void handler(int sig, siginfo_t * si, void * ctx) {
+	(void) si;
+	ucontext_t * context = (ucontext_t *) ctx;
+	uintptr_t rip = context->uc_mcontext.gregs[REG_RIP];
+	if (rip < (uintptr_t) code || rip > (uintptr_t) code + code_size) {
+		fprintf(stderr, "Unexpected signal %d at %p\n", sig, (void*) rip);
+		exit(EXIT_FAILURE);
+	}
+	// Redirect (like Luci's trap handler)
+	context->uc_mcontext.gregs[REG_RIP] = (uintptr_t) target;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void measure(const char * name, long (*func)(long), unsigned long iterations) {
+	long sum = 0;
+	// Warm up
+	for (unsigned long i = 0; i < iterations / 100; i++)
+		sum = func(sum);
+	double start = now();
+	for (unsigned long i = 0; i < iterations; i++)
+		sum = func(sum);
+	double duration = now() - start;
+	if (sum != (long)(iterations + iterations / 100)) {
+		fprintf(stderr, "%s: invalid result %ld\n", name, sum);
+		exit(EXIT_FAILURE);
+	}
+	printf("%-28s %12.2f ns/call (%lu calls)\n", name, duration / iterations, iterations);
+}
+
+static long (*site(const uint8_t * instructions, size_t size))(long) {
+	memset(code, 0xcc, code_size);
+	memcpy(code, instructions, size);
+	__builtin___clear_cache((char*) code, (char*) code + size);
+	return (long (*)(long)) code;
+}
+
+int main() {
+	code = mmap(NULL, code_size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED) {
+		perror("mmap");
+		return EXIT_FAILURE;
+	}
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_flags = SA_SIGINFO;
+	action.sa_sigaction = handler;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(SIGTRAP, &action, NULL) != 0 || sigaction(SIGILL, &action, NULL) != 0 || sigaction(SIGSEGV, &action, NULL) != 0) {
+		perror("sigaction");
+		return EXIT_FAILURE;
+	}
+
+	measure("direct call", target, JUMP_ITERATIONS);
+
+	// Static redirection (relative jump if possible)
+	uint8_t jump[14];
+	intptr_t rel = (intptr_t) target - ((intptr_t) code + 5);
+	if (rel >= INT32_MIN && rel <= INT32_MAX) {
+		int32_t rel32 = (int32_t) rel;
+		jump[0] = 0xe9;
+		memcpy(jump + 1, &rel32, sizeof(rel32));
+		measure("static jump (relative)", site(jump, 5), JUMP_ITERATIONS);
+	} else {
+		uint64_t abs = (uint64_t) target;
+		const uint8_t jmp_rip[] = { 0xff, 0x25, 0x00, 0x00, 0x00, 0x00 };
+		memcpy(jump, jmp_rip, sizeof(jmp_rip));
+		memcpy(jump + sizeof(jmp_rip), &abs, sizeof(abs));
+		measure("static jump (absolute)", site(jump, sizeof(jump)), JUMP_ITERATIONS);
+	}
+
+	// Traps
+	const uint8_t int3[] = { 0xcc };
+	measure("trap: int3 (SIGTRAP)", site(int3, sizeof(int3)), TRAP_ITERATIONS);
+	const uint8_t int1[] = { 0xf1 };
+	measure("trap: int1 (SIGTRAP)", site(int1, sizeof(int1)), TRAP_ITERATIONS);
+	const uint8_t ud2[] = { 0x0f, 0x0b };
+	measure("trap: ud2 (SIGILL)", site(ud2, sizeof(ud2)), TRAP_ITERATIONS);
+	const uint8_t push_es[] = { 0x06 };
+	measure("trap: push es (SIGILL)", site(push_es, sizeof(push_es)), TRAP_ITERATIONS);
+	const uint8_t hlt[] = { 0xf4 };
+	measure("trap: hlt (SIGSEGV)", site(hlt, sizeof(hlt)), TRAP_ITERATIONS);
+
+	munmap(code, code_size);
+	return EXIT_SUCCESS;
+}
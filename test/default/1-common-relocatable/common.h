@@ -0,0 +1,7 @@
+#pragma once
+
+void count(int n);
+void fill_small(long v);
+void fill_large(long v);
+long sum_large(void);
+double scale(double x);
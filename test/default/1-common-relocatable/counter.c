@@ -0,0 +1,7 @@
+#include "common.h"
+
+int counter;
+
+void count(int n) {
+	counter += n;
+}
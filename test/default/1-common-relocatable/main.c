@@ -0,0 +1,26 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#include "common.h"
+
+// Tentative definitions (also declared in other objects)
+int counter;
+long table[4];
+double value;
+char buffer[100] __attribute__((aligned(64)));
+
+int main() {
+	for (int i = 1; i <= 10; i++)
+		count(i);
+	printf("counter: %d\n", counter);
+
+	fill_large(3);
+	fill_small(7);
+	printf("table: %ld %ld %ld\n", table[0], table[3], sum_large());
+
+	printf("value: %.2f\n", value);
+	printf("scaled: %.2f\n", scale(4.0));
+
+	printf("buffer aligned: %s\n", (uintptr_t)buffer % 64 == 0 ? "yes" : "no");
+	return 0;
+}
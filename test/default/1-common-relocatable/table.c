@@ -0,0 +1,21 @@
+#include "common.h"
+
+// Larger than the tentative definition in main
+long table[64];
+
+void fill_small(long v) {
+	for (int i = 0; i < 4; i++)
+		table[i] = v * i;
+}
+
+void fill_large(long v) {
+	for (int i = 0; i < 64; i++)
+		table[i] = v;
+}
+
+long sum_large(void) {
+	long sum = 0;
+	for (int i = 0; i < 64; i++)
+		sum += table[i];
+	return sum;
+}
@@ -0,0 +1,9 @@
+#include "common.h"
+
+// Real definition for the tentative definition in main
+double value = 1.5;
+
+double scale(double x) {
+	value *= x;
+	return value;
+}
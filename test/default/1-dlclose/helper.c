@@ -0,0 +1,15 @@
+#include <stdio.h>
+
+static int counter = 0;
+
+__attribute__((constructor)) static void init(void) {
+	puts("helper: constructor");
+}
+
+__attribute__((destructor)) static void fini(void) {
+	puts("helper: destructor");
+}
+
+int helper(int x) {
+	return x + ++counter;
+}
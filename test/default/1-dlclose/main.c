@@ -0,0 +1,70 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <link.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int count(struct dl_phdr_info *info, size_t size, void *data) {
+	(void) size;
+	if (strstr(info->dlpi_name, "libplugin.so") != NULL || strstr(info->dlpi_name, "libhelper.so") != NULL)
+		(*(int*)data)++;
+	return 0;
+}
+
+static int loaded(void) {
+	int n = 0;
+	dl_iterate_phdr(count, &n);
+	return n;
+}
+
+static void * load(int flags) {
+	void * handle = dlopen("libplugin.so", flags);
+	if (handle == NULL) {
+		fprintf(stderr, "dlopen failed: %s\n", dlerror());
+		exit(EXIT_FAILURE);
+	}
+	return handle;
+}
+
+static void call(void * handle, int x) {
+	int (*plugin)(int) = dlsym(handle, "plugin");
+	if (plugin == NULL) {
+		fprintf(stderr, "dlsym failed: %s\n", dlerror());
+		exit(EXIT_FAILURE);
+	}
+	printf("plugin(%d) = %d\n", x, plugin(x));
+}
+
+int main() {
+	for (int i = 1; i <= 3; i++) {
+		printf("Round %d\n", i);
+		void * handle = load(RTLD_NOW);
+		// second handle for the same object
+		void * again = load(RTLD_LAZY);
+		printf("same handle: %s\n", handle == again ? "yes" : "no");
+		call(handle, i);
+		call(again, i);
+		printf("loaded objects: %d\n", loaded());
+
+		printf("close first handle: %d\n", dlclose(again));
+		printf("still loaded: %s\n", dlopen("libplugin.so", RTLD_NOW | RTLD_NOLOAD) != NULL ? "yes" : "no");
+		// NOLOAD has increased the reference counter as well
+		dlclose(handle);
+		printf("close last handle: %d\n", dlclose(handle));
+		printf("still loaded: %s\n", dlopen("libplugin.so", RTLD_NOW | RTLD_NOLOAD) != NULL ? "yes" : "no");
+		printf("loaded objects: %d\n", loaded());
+	}
+
+	puts("Persistent");
+	void * handle = load(RTLD_NOW | RTLD_NODELETE);
+	call(handle, 42);
+	printf("close handle: %d\n", dlclose(handle));
+	printf("still loaded: %s\n", dlopen("libplugin.so", RTLD_NOW | RTLD_NOLOAD) != NULL ? "yes" : "no");
+	printf("loaded objects: %d\n", loaded());
+
+	// Skip destructors on exit (not part of this test)
+	fflush(stdout);
+	_exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,23 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+extern int helper(int x);
+
+static __thread int calls = 0;
+
+static void handler(void) {
+	puts("plugin: exit handler");
+}
+
+__attribute__((constructor)) static void init(void) {
+	puts("plugin: constructor");
+	atexit(handler);
+}
+
+__attribute__((destructor)) static void fini(void) {
+	puts("plugin: destructor");
+}
+
+int plugin(int x) {
+	return helper(x) * 10 + ++calls;
+}
@@ -0,0 +1,20 @@
+#include "deep.hpp"
+
+unsigned long Guard::alive = 0;
+unsigned long Guard::destroyed = 0;
+
+unsigned long bottom(unsigned depth) {
+	if (depth % 3 == 0)
+		throw DeepError("runtime error", depth);
+	else if (depth % 3 == 1)
+		throw depth;
+	else
+		return depth;
+}
+
+unsigned long descend(unsigned depth, unsigned limit) {
+	Guard guard;
+	if (depth >= limit)
+		return bottom(depth);
+	return ascend(depth + 1, limit) + 1;
+}
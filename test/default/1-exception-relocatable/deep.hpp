@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdexcept>
+
+struct DeepError : public std::runtime_error {
+	unsigned depth;
+
+	DeepError(const char * what, unsigned depth) : std::runtime_error(what), depth(depth) {}
+};
+
+struct Guard {
+	static unsigned long alive;
+	static unsigned long destroyed;
+
+	Guard() { alive++; }
+	~Guard() { alive--; destroyed++; }
+};
+
+unsigned long bottom(unsigned depth);
+unsigned long descend(unsigned depth, unsigned limit);
+unsigned long ascend(unsigned depth, unsigned limit);
@@ -0,0 +1,50 @@
+#include <cstdio>
+
+#include "deep.hpp"
+
+unsigned long ascend(unsigned depth, unsigned limit) {
+	Guard guard;
+	if (depth >= limit)
+		return bottom(depth);
+	unsigned long r;
+	try {
+		r = descend(depth + 1, limit);
+	} catch (const std::logic_error & e) {
+		// never thrown, but forces a landing pad in each frame
+		return 0;
+	}
+	return r + 1;
+}
+
+int main() {
+	unsigned long returned = 0;
+	unsigned long caught_error = 0;
+	unsigned long caught_int = 0;
+	unsigned long sum = 0;
+
+	for (unsigned round = 0; round < 5; round++) {
+		for (unsigned limit = 10; limit < 1000; limit += 7) {
+			try {
+				sum += descend(0, limit);
+				returned++;
+			} catch (const DeepError & e) {
+				sum += e.depth;
+				caught_error++;
+			} catch (unsigned depth) {
+				sum += depth;
+				caught_int++;
+			}
+		}
+		if (Guard::alive != 0) {
+			printf("Round %u: %lu guards still alive!\n", round, Guard::alive);
+			return 1;
+		}
+	}
+
+	printf("returned: %lu\n", returned);
+	printf("caught errors: %lu\n", caught_error);
+	printf("caught integers: %lu\n", caught_int);
+	printf("sum: %lu\n", sum);
+	printf("destroyed guards: %lu\n", Guard::destroyed);
+	return 0;
+}
@@ -0,0 +1,11 @@
+// Loaded with dlopen: TLS block exceeds the static TLS surplus (dynamic TLS)
+#define BIG_SIZE 4096
+__thread unsigned long big_counter = 1337;
+static __thread unsigned long big_data[BIG_SIZE] = { 1, 2, 3 };
+
+unsigned long big(unsigned long inc) {
+	unsigned long r = big_counter += inc;
+	for (unsigned long i = 0; i < BIG_SIZE; i++)
+		r ^= big_data[i] += i * inc;
+	return r;
+}
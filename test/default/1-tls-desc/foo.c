@@ -0,0 +1,8 @@
+// Linked at startup: TLS block in initial (static) TLS
+__thread unsigned long foo_counter = 42;
+static __thread char foo_buffer[64] = "foo";
+
+unsigned long foo(unsigned long inc) {
+	foo_buffer[3] = '0' + (inc % 10);
+	return foo_counter += inc + foo_buffer[3];
+}
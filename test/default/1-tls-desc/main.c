@@ -0,0 +1,64 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <dlfcn.h>
+
+// TLS accesses in all libraries are compiled with -mtls-dialect=gnu2 (TLS descriptors)
+extern unsigned long foo(unsigned long);
+static unsigned long (*small)(unsigned long) = NULL;
+static unsigned long (*big)(unsigned long) = NULL;
+
+static pthread_barrier_t loaded;
+
+static void * load(const char * file, const char * sym) {
+	void * handle = dlopen(file, RTLD_NOW);
+	if (handle == NULL) {
+		fprintf(stderr, "dlopen %s: %s\n", file, dlerror());
+		exit(EXIT_FAILURE);
+	}
+	void * func = dlsym(handle, sym);
+	if (func == NULL) {
+		fprintf(stderr, "dlsym %s: %s\n", sym, dlerror());
+		exit(EXIT_FAILURE);
+	}
+	return func;
+}
+
+static unsigned long work(unsigned long id) {
+	unsigned long r = 0;
+	for (unsigned long i = 1; i <= 1000; i++)
+		r += foo(id + i) ^ small(id * i) ^ big(i);
+	return r;
+}
+
+static void * thread(void * arg) {
+	// Started before the libraries were loaded
+	pthread_barrier_wait(&loaded);
+	return (void *) work((unsigned long) arg);
+}
+
+static void * late_thread(void * arg) {
+	return (void *) work((unsigned long) arg);
+}
+
+int main() {
+	pthread_t threads[4];
+	pthread_barrier_init(&loaded, NULL, 3);
+	for (unsigned long t = 0; t < 2; t++)
+		pthread_create(&threads[t], NULL, thread, (void *) (t + 1));
+
+	small = load("libsmall.so", "small");
+	big = load("libbig.so", "big");
+	pthread_barrier_wait(&loaded);
+
+	for (unsigned long t = 2; t < 4; t++)
+		pthread_create(&threads[t], NULL, late_thread, (void *) (t + 1));
+
+	printf("main: %lx\n", work(0));
+	for (unsigned long t = 0; t < 4; t++) {
+		void * r;
+		pthread_join(threads[t], &r);
+		printf("thread %lu: %lx\n", t + 1, (unsigned long) r);
+	}
+	return 0;
+}
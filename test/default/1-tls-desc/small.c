@@ -0,0 +1,8 @@
+// Loaded with dlopen: small TLS block fits into the static TLS surplus
+__thread unsigned long small_counter = 23;
+static __thread unsigned small_calls;
+
+unsigned long small(unsigned long inc) {
+	small_calls++;
+	return small_counter += inc * small_calls;
+}
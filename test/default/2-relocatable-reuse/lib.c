@@ -0,0 +1,18 @@
+#include "lib.h"
+
+#ifndef ANSWER
+#define ANSWER 0
+#endif
+
+int calls = 0;
+
+// Changed in every version
+int answer(void) {
+	return ANSWER;
+}
+
+// Identical in every version (in its own section with a relocation to `calls`),
+// hence the section of the previous version should be reused on update
+int stable(void) {
+	return ++calls;
+}
@@ -0,0 +1,4 @@
+#pragma once
+
+int answer(void);
+int stable(void);
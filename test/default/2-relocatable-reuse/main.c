@@ -0,0 +1,20 @@
+#include <stdio.h>
+#include <unistd.h>
+
+#include "lib.h"
+
+static int (* volatile initial)(void);
+
+int main() {
+	initial = stable;
+	for (int i = 0; i < 3; i++) {
+		if (i != 0)
+			sleep(4);
+
+		int (* volatile current)(void) = stable;
+		printf("Round %d: answer %d, stable called %d times ", i, answer(), stable());
+		puts(current == initial ? "(same address)" : "(moved)");
+	}
+
+	return 0;
+}
@@ -0,0 +1,5 @@
+#include "lib.h"
+
+int bar(void) {
+	return VERSION;
+}
@@ -0,0 +1,5 @@
+#include "lib.h"
+
+int foo(void) {
+	return VERSION;
+}
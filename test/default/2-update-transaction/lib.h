@@ -0,0 +1,4 @@
+#pragma once
+
+int foo(void);
+int bar(void);
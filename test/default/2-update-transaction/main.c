@@ -0,0 +1,20 @@
+#include <stdio.h>
+#include <unistd.h>
+
+#include "lib.h"
+
+int main() {
+	// Both libraries are modified during the first interval, but the
+	// update transaction is committed during the second one
+	const int delay[] = { 4, 5 };
+	for (int i = 0; i < 3; i++) {
+		if (i != 0)
+			sleep(delay[i - 1]);
+
+		int f = foo();
+		int b = bar();
+		printf("Round %d: foo v%d, bar v%d %s\n", i, f, b, f == b ? "(consistent)" : "(inconsistent)");
+	}
+
+	return 0;
+}
@@ -0,0 +1,189 @@
+// Luci - a dynamic linker/loader with DSU capabilities
+// Copyright 2021-2023 by Bernhard Heinloth <heinloth@cs.fau.de>
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+/* STATUSINFO
+reads the binary status info of Luci (LD_STATUS_INFO_BINARY)
+
+Compile with
+
+	gcc -o statusinfo statusinfo.c
+
+Example usage
+
+	mkfifo /tmp/status
+	./statusinfo /tmp/status &
+	LD_STATUS_INFO=/tmp/status LD_STATUS_INFO_BINARY=1 LD_DYNAMIC_UPDATE=1 ./app
+
+Each event is printed as one line (tab separated):
+
+	time  pid  object  version  state  duration (us)  released bytes  name  path
+
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*** Format (see src/status_info.hpp) ***/
+
+struct Header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+} __attribute__((packed));
+
+enum {
+	RECORD_OBJECT = 1,
+	RECORD_EVENT = 2
+};
+
+struct Record {
+	uint16_t type;
+	uint16_t info;
+	uint32_t length;
+	uint32_t pid;
+	uint32_t object;
+	uint64_t version;
+	uint64_t timestamp;
+	uint64_t duration;
+	uint64_t bytes;
+} __attribute__((packed));
+
+/* in order of ObjectIdentity::Info */
+static const char * states[] = {
+	"ERROR_CONTINUE_LOAD",
+	"ERROR_OPEN",
+	"ERROR_STAT",
+	"ERROR_MAP",
+	"ERROR_CREATE",
+	"ERROR_ELF",
+	"ERROR_INOTIFY",
+	"IGNORED_IDENTICAL_TIME",
+	"IGNORED_IDENTICAL_HASH",
+	"FAILED_UPDATE_DISABLED",
+	"FAILED_UPDATE_INCOMPATIBLE",
+	"FAILED_UPDATE_MODIFIED",
+	"FAILED_UPDATE_TRANSACTION",
+	"FAILED_PRELOADING",
+	"FAILED_MAPPING",
+	"FAILED_REUSE",
+	"SUCCESS_LOAD",
+	"SUCCESS_UPDATE",
+	"SUCCESS_RECLAIM"
+};
+
+/*** Names of objects (by process and identifier, since identifiers are only unique per process) ***/
+
+struct Name {
+	uint32_t pid;
+	uint32_t object;
+	char * name;
+};
+
+static struct Name * names = NULL;
+static size_t names_size = 0;
+static size_t names_used = 0;
+
+static struct Name * find_name(uint32_t pid, uint32_t object) {
+	/* Open addressing with linear probing */
+	size_t i = ((size_t)pid * 31 + object) & (names_size - 1);
+	while (names[i].name != NULL && (names[i].pid != pid || names[i].object != object))
+		i = (i + 1) & (names_size - 1);
+	return names + i;
+}
+
+static void set_name(uint32_t pid, uint32_t object, char * name) {
+	if (2 * (names_used + 1) > names_size) {
+		struct Name * old = names;
+		size_t old_size = names_size;
+		names_size = names_size == 0 ? 64 : 2 * names_size;
+		names = calloc(names_size, sizeof(struct Name));
+		if (names == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		for (size_t i = 0; i < old_size; i++)
+			if (old[i].name != NULL)
+				*find_name(old[i].pid, old[i].object) = old[i];
+		free(old);
+	}
+	struct Name * entry = find_name(pid, object);
+	if (entry->name == NULL)
+		names_used++;
+	free(entry->name);
+	entry->pid = pid;
+	entry->object = object;
+	entry->name = name;
+}
+
+static const char * get_name(uint32_t pid, uint32_t object) {
+	return names_size == 0 ? NULL : find_name(pid, object)->name;
+}
+
+int main(int argc, char * argv[]) {
+	if (argc > 2 || (argc == 2 && strcmp(argv[1], "-h") == 0)) {
+		fprintf(stderr, "Usage: %s [FILE]\nReads binary Luci status info from FILE (or stdin)\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	FILE * in = stdin;
+	if (argc == 2 && strcmp(argv[1], "-") != 0 && (in = fopen(argv[1], "rb")) == NULL) {
+		perror("fopen");
+		return EXIT_FAILURE;
+	}
+
+	struct Header header;
+	if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, "LUCISTAT", 8) != 0) {
+		fprintf(stderr, "Invalid status info format\n");
+		return EXIT_FAILURE;
+	} else if (header.version != 1 || header.record_size < sizeof(struct Record)) {
+		fprintf(stderr, "Unsupported status info version %u (record size %u)\n", header.version, header.record_size);
+		return EXIT_FAILURE;
+	}
+
+	/* Records might be extended in future versions */
+	char * buffer = malloc(header.record_size);
+	if (buffer == NULL) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+
+	while (fread(buffer, header.record_size, 1, in) == 1) {
+		struct Record record;
+		memcpy(&record, buffer, sizeof(record));
+		if (record.type == RECORD_OBJECT) {
+			char * name = malloc(record.length + 1);
+			if (name == NULL || fread(name, record.length, 1, in) != 1) {
+				fprintf(stderr, "Reading name of object %u failed\n", record.object);
+				return EXIT_FAILURE;
+			}
+			name[record.length] = '\0';
+			set_name(record.pid, record.object, name);
+		} else if (record.type == RECORD_EVENT) {
+			char time[32];
+			time_t seconds = record.timestamp / 1000000000;
+			strftime(time, sizeof(time), "%Y-%m-%d %H:%M:%S", localtime(&seconds));
+
+			const char * name = get_name(record.pid, record.object);
+			const char * path = name == NULL ? NULL : name + strlen(name) + 1;
+
+			printf("%s.%06lu\t%u\t%u\tv%lu\t", time, (unsigned long)(record.timestamp % 1000000000) / 1000, record.pid, record.object, (unsigned long)record.version);
+			if (record.info < sizeof(states) / sizeof(states[0]))
+				printf("%s", states[record.info]);
+			else
+				printf("UNKNOWN_%u", record.info);
+			printf("\t%lu\t%lu\t%s\t%s\n", (unsigned long)(record.duration / 1000), (unsigned long)record.bytes, name == NULL ? "?" : name, path == NULL ? "?" : path);
+			fflush(stdout);
+		} else {
+			fprintf(stderr, "Skipping unknown record type %u\n", record.type);
+			if (record.length > 0 && fseek(in, record.length, SEEK_CUR) != 0)
+				return EXIT_FAILURE;
+		}
+	}
+
+	free(buffer);
+	return EXIT_SUCCESS;
+}